@@ -98,6 +98,9 @@
 #    define END_IGNORE_DEPRECATIONS
 #endif
 
+/* flags of taigi_new3() */
+#define CHEWING_NEW_LAZY 1     /* open the symbol table and user phrases on first use */
+
 #define MIN_SELKEY 1
 #define MAX_SELKEY 10
 
@@ -0,0 +1,24 @@
+/**
+ * bigram-private.h
+ *
+ * Copyright (c) 2026
+ *      libchewing Core Team. See ChangeLog for details.
+ *
+ * See the file "COPYING" for information on usage and redistribution
+ * of this file.
+ */
+
+/* *INDENT-OFF* */
+#ifndef _CHEWING_BIGRAM_PRIVATE_H
+#define _CHEWING_BIGRAM_PRIVATE_H
+/* *INDENT-ON* */
+
+#include "taigi-private.h"
+
+int GetBigramBonus(const ChewingData *pgdata, uint32_t prev, uint32_t next);
+int InitBigram(ChewingData *pgdata, const char *prefix);
+void TerminateBigram(ChewingData *pgdata);
+
+/* *INDENT-OFF* */
+#endif
+/* *INDENT-ON* */
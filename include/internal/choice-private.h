@@ -23,6 +23,13 @@ int ChoicePrevAvail(ChewingData *pgdata);
 int ChoiceSelect(ChewingData *, int selectNo);
 int ChoiceEndChoice(ChewingData *);
 
+#define CHOICE_IN_BUF (0x80000000u)
+
+void ChoiceClear(ChewingData *pgdata);
+int ChoiceAppend(ChewingData *pgdata, const char *str, int len);
+int ChoiceAppendDict(ChewingData *pgdata, const char *str);
+const char *ChoiceString(const ChewingData *pgdata, int index);
+
 /* *INDENT-OFF* */
 #endif
 /* *INDENT-ON* */
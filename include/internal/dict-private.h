@@ -21,9 +21,12 @@
 
 #define PHONE_PHRASE_NUM (162244)
 
-int GetCharFirst(ChewingData *, Phrase *, uint32_t);
-int GetPhraseFirst(ChewingData *pgdata, Phrase *phr_ptr, const TreeType *phrase_parent);
-int GetVocabNext(ChewingData *pgdata, Phrase *phr_ptr);
+int GetCharRange(ChewingData *pgdata, DictIterator *iter, uint32_t key);
+const char *GetCharNext(ChewingData *pgdata, DictIterator *iter, int *type);
+int GetPhraseFirst(ChewingData *pgdata, DictIterator *iter, Phrase *phr_ptr, const TreeType *phrase_parent);
+int GetVocabNext(ChewingData *pgdata, DictIterator *iter, Phrase *phr_ptr);
+int GetPhraseMaxFreq(ChewingData *pgdata, const TreeType *phrase_parent);
+const char *GetVocabString(ChewingData *pgdata, const DictIterator *iter);
 int InitDict(ChewingData *pgdata, const char *prefix);
 void TerminateDict(ChewingData *pgdata);
 
@@ -17,6 +17,7 @@
 
 #define PHONE_TREE_FILE     "index_tree.dat"
 #define DICT_FILE           "dictionary.dat"
+#define BIGRAM_FILE         "bigram.dat"
 #define SYMBOL_TABLE_FILE   "symbols.dat"
 #define SOFTKBD_TABLE_FILE  "swkb.dat"
 #define PINYIN_TAB_NAME     "pinyin.tab"
@@ -14,6 +14,7 @@
 /* *INDENT-ON* */
 
 #include "global.h"
+#include "taigi-private.h"
 #include "userphrase-private.h"
 
 #ifdef __MacOSX__
@@ -26,21 +27,72 @@
 #define BIN_HASH_SIG "CBiH"
 #define HASH_FILE  "uhash.dat"
 
+/* uhash.dat as a checkpoint followed by a log of records, see hash.c */
+#define HASH_LOG_SIG "TGuC"
+#define HASH_LOG_HEADER_SIZE (24)
+#define HASH_LOG_V1_SIG "TGuL"          /* the log without a checkpoint */
+#define HASH_LOG_V1_HEADER_SIZE (8)
+#define HASH_RECORD_HEADER_SIZE (28)
+#define HASH_RECORD_MAX_SIZE (512)
+#define HASH_RECORD_REMOVED (0x01)
+
 typedef struct HASH_ITEM {
-    int item_index;
+    int item_index;             /* offset of the last record in the log, -1 if none */
+    int base;                   /* offset of the record in the checkpoint, 0 if none */
+    int removed;                /* kept only to hide the record in the checkpoint */
+    int entry;                  /* index in entries of the table */
+    int dirty;                  /* index in dirty of the table, -1 if the log is up to date */
+    int word_owned;             /* data.wordSeq is allocated, not in the mapped log */
+    struct HASH_ITEM *next;     /* next free item, see AllocHashItem() */
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];      /* data.phoneSeq */
     UserPhraseData data;
-    struct HASH_ITEM *next;
 } HASH_ITEM;
 
+/* a slot of the open addressing table, see hash.c */
+typedef struct HASH_SLOT {
+    uint32_t hash;              /* HashFunc() of the phones */
+    int entry;                  /* index in entries of the table, -1 if the slot is empty */
+} HASH_SLOT;
+
+/* the items read from uhash.dat or changed since, see hash.c */
+typedef struct HASH_TABLE {
+    plat_mmap mmap;             /* uhash.dat as it was opened */
+    const unsigned char *map;
+    size_t map_size;
+    const unsigned char *index; /* of the checkpoint in map, NULL if none */
+    unsigned int index_mask;    /* number of slots of index - 1 */
+    int base_end;               /* where the records of the checkpoint end, 0 if none */
+    int base_count;             /* records in the checkpoint */
+    int log_size;               /* of uhash.dat, up to the last valid record */
+    int phrase_count;           /* phrases, in the checkpoint or not */
+    int record_count;           /* records in uhash.dat, including the replaced ones */
+    int readonly;               /* the log ends with a torn record, see InitUserphrase() */
+
+    struct HASH_BLOCK *blocks;  /* where the items are allocated, see AllocHashItem() */
+    int block_used;             /* items used in the first of blocks */
+    HASH_ITEM *free_items;      /* items removed, to be reused */
+    HASH_ITEM **entries;        /* in insertion order, NULL once removed */
+    int entry_count;            /* used entries, including the removed */
+    int entry_size;             /* allocated entries */
+    int item_count;             /* items in the table */
+    HASH_SLOT *slots;
+    unsigned int slot_mask;     /* number of slots - 1 */
+    HASH_ITEM **dirty;          /* items to be appended by FlushHashLog() */
+    int dirty_count;
+    int dirty_size;
+
+    struct HASH_COMPACTION *compaction; /* see StartHashCompaction() */
+} HASH_TABLE;
+
 HASH_ITEM *HashFindPhone(const uint32_t phoneSeq[]);
-HASH_ITEM **HashFindHead(struct ChewingData *pgdata, const uint32_t phoneSeq[]);
 HASH_ITEM *HashFindEntry(struct ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[]);
-HASH_ITEM *HashInsert(struct ChewingData *pgdata, UserPhraseData *pData);
+HASH_ITEM *HashInsert(struct ChewingData *pgdata, const UserPhraseData *pData);
 HASH_ITEM *HashFindPhonePhrase(struct ChewingData *pgdata, const uint32_t phoneSeq[], HASH_ITEM *pHashLast);
-HASH_ITEM *FindNextHash(const struct ChewingData *pgdata, HASH_ITEM *curr);
+HASH_ITEM *FindNextHash(struct ChewingData *pgdata, HASH_ITEM *curr);
 void HashModify(struct ChewingData *pgdata, HASH_ITEM *pItem);
-void FreeHashItem(HASH_ITEM *pItem);
-int AlcUserPhraseSeq(UserPhraseData *pData, int phonelen, int wordlen);
+int FlushHashLog(struct ChewingData *pgdata);
+void HashRemove(struct ChewingData *pgdata, HASH_ITEM *pItem);
+void FreeHashItem(struct ChewingData *pgdata, HASH_ITEM *pItem);
 int InitUserphrase(struct ChewingData *pgdata, const char *path);
 void TerminateUserphrase(struct ChewingData *pgdata);
 void FreeHashTable(void);
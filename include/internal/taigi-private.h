@@ -47,9 +47,13 @@ typedef SSIZE_T ssize_t;
 #define MAX_CHI_SYMBOL_LEN (MAX_PHONE_SEQ_LEN - MAX_PHRASE_LEN)
 #define MAX_INTERVAL ( ( MAX_PHONE_SEQ_LEN + 1 ) * MAX_PHONE_SEQ_LEN / 2 )
 #define MAX_CHOICE (567)
+#define MAX_CHOICE_STR_BUF (16 * 1024) /* bytes of choice strings not in the dictionary */
 #define MAX_CHOICE_BUF (50)     /* max length of the choise buffer */
-#define N_HASH_BIT (14)
-#define HASH_TABLE_SIZE (1<<N_HASH_BIT)
+#define MAX_CONVERT_THREAD (64)
+#define CONVERT_BATCH_CHUNK (16) /* inputs taken by a worker at a time */
+#define MIN_PHRASING_BEAM (1)
+#define MAX_PHRASING_BEAM (32)
+#define DEFAULT_PHRASING_BEAM (8) /* phrasings kept by Tab, see tree.c */
 #define EASY_SYMBOL_KEY_TAB_LEN (36)
 #define AUX_PREFIX_LEN (3)
 
@@ -118,6 +122,123 @@ typedef struct TreeType {
     unsigned char type[4];
 } TreeType;
 
+/**
+ * @brief A walk over the phrase leaves of one tree node.
+ *
+ * It is owned by the caller, so lookups in the shared dictionary do not
+ * depend on each other. See GetCharFirst() and GetVocabNext().
+ */
+typedef struct DictIterator {
+    const TreeType *cur;
+    const TreeType *end;
+} DictIterator;
+
+#define TREE_INDEX_MAGIC        "TGTI"
+#define TREE_INDEX_VERSION      (2)
+#define TREE_INDEX_BYTE_ORDER   (0x01020304)
+#define TREE_INDEX_ALIGN        (64)
+
+/**
+ * @struct TreeIndexHeader
+ * @brief header of the versioned system index tree
+ *
+ * An index file starting with TREE_INDEX_MAGIC consists of this header and
+ * three sections, each aligned to TREE_INDEX_ALIGN bytes: the TreeType node
+ * array in BFS (level) order, the keys of all nodes as native-endian uint32,
+ * and the [child.begin, child.end) of all nodes as native-endian uint32 pairs.
+ * Both packed arrays are indexed by node position, so children of a node are
+ * searched over a few contiguous cache lines. Header fields are little-endian
+ * like TreeType except byte_order, which is stored in the byte order of the
+ * packed arrays. A file without the magic is a legacy bare TreeType array.
+ *
+ * When char_offset is not 0, it points to the character table: a native-endian
+ * uint32 slot count, a power of 2, followed by that many TreeCharSlot.
+ */
+typedef struct TreeIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_count;
+    uint32_t node_offset;
+    uint32_t key_offset;
+    uint32_t range_offset;
+    uint32_t char_offset;
+} TreeIndexHeader;
+
+/**
+ * @struct TreeCharSlot
+ * @brief a syllable in the character table of the index tree
+ *
+ * The table is open addressing with linear probing from HashCharKey(key), and
+ * key 0 marks an empty slot. [begin, end) are the positions of the character
+ * leaves of the syllable, sorted by frequency and without duplicates, so the
+ * slot also tells whether the syllable has any character.
+ */
+typedef struct TreeCharSlot {
+    uint32_t key;
+    uint32_t begin;
+    uint32_t end;
+} TreeCharSlot;
+
+static inline uint32_t HashCharKey(uint32_t key)
+{
+    uint32_t hash = key * 2654435761u;
+
+    /* the table is indexed by the low bits, so fold the high bits in */
+    return hash ^ (hash >> 15);
+}
+
+#define BIGRAM_MAGIC            "TGBG"
+#define BIGRAM_VERSION          (1)
+
+/**
+ * @struct BigramHeader
+ * @brief header of the optional phrase bigram table
+ *
+ * The header is followed by slot_count BigramSlot, where slot_count is a power
+ * of 2. All fields are in native byte order, and a table with another
+ * byte_order than TREE_INDEX_BYTE_ORDER is not used.
+ */
+typedef struct BigramHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t slot_count;
+} BigramHeader;
+
+/**
+ * @struct BigramSlot
+ * @brief a pair of adjacent phrases in the bigram table
+ *
+ * The table is open addressing with linear probing from HashBigramKey(prev,
+ * next), where prev and next are HashPhraseString() of the two phrases, and
+ * prev 0 marks an empty slot. bonus is added to the score of a phrasing where
+ * next follows prev.
+ */
+typedef struct BigramSlot {
+    uint32_t prev;
+    uint32_t next;
+    int32_t bonus;
+} BigramSlot;
+
+static inline uint32_t HashPhraseString(const char *phrase)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    for (; *phrase; ++phrase) {
+        hash ^= (unsigned char) *phrase;
+        hash *= 16777619u;
+    }
+    /* 0 marks an empty slot */
+    return hash ? hash : 1;
+}
+
+static inline uint32_t HashBigramKey(uint32_t prev, uint32_t next)
+{
+    return HashCharKey(prev ^ (next * 2246822519u));
+}
+
 typedef struct PhrasingOutput {
     IntervalType dispInterval[MAX_INTERVAL];
     int nDispInterval;
@@ -164,11 +285,19 @@ typedef struct ChoiceInfo {
     int pageNo;
         /** @brief number of choices per page. */
     int nChoicePerPage;
-        /** @brief store possible phrases for being chosen. */
-    char totalChoiceStr[MAX_CHOICE][MAX_PHRASE_LEN * MAX_UTF8_SIZE + 1];
+        /**
+         * @brief where possible phrases for being chosen are stored.
+         *
+         * Either an offset into the dictionary, or an offset into choiceBuf
+         * when CHOICE_IN_BUF is set. Use ChoiceString() to read them.
+         */
+    uint32_t totalChoicePos[MAX_CHOICE];
         /** @brief number of phrases to choose. */
     int  totalChoiceType[MAX_CHOICE];
     int nTotalChoice;
+        /** @brief phrases not coming from the dictionary, such as user phrases and symbols. */
+    char choiceBuf[MAX_CHOICE_STR_BUF];
+    int choiceBufLen;
     int oldChiSymbolCursor;
     int isSymbol;
 } ChoiceInfo;
@@ -195,15 +324,54 @@ typedef struct SymbolEntry {
     char symbols[][MAX_UTF8_SIZE + 1];
 } SymbolEntry;
 
-typedef struct ChewingStaticData {
+/**
+ * @brief Read-only data loaded from a system data directory.
+ *
+ * One instance is shared by every context opened on the same directory. It
+ * is reference counted and released with the last context, see
+ * AcquireSharedData() in taigiio.c.
+ */
+typedef struct ChewingSharedData {
+    struct ChewingSharedData *next;
+    unsigned int refcount;
+    char *path;
+    char *symbol_path;          /* set until the symbol table is loaded */
+
     const TreeType *tree;
     size_t tree_size;
     plat_mmap tree_mmap;
-    const TreeType *tree_cur_pos, *tree_end_pos;
+    const uint32_t *tree_key;   /* NULL when reading a legacy index */
+    const uint32_t (*tree_range)[2];
+    const TreeCharSlot *tree_char;      /* NULL when the index has no character table */
+    uint32_t tree_char_mask;
 
     const char *dict;
     plat_mmap dict_mmap;
 
+    const BigramSlot *bigram;   /* NULL when there is no bigram table */
+    uint32_t bigram_mask;
+    plat_mmap bigram_mmap;
+
+    unsigned int n_symbol_entry;
+    SymbolEntry **symbol_table;
+
+    char *g_easy_symbol_value[EASY_SYMBOL_KEY_TAB_LEN];
+    int g_easy_symbol_num[EASY_SYMBOL_KEY_TAB_LEN];
+
+    struct keymap *hanyuInitialsMap;
+    struct keymap *hanyuFinalsMap;
+    int HANYU_INITIALS;
+    int HANYU_FINALS;
+} ChewingSharedData;
+
+/**
+ * @brief Per-context state of the dictionaries and the user phrase storage.
+ */
+typedef struct ChewingStaticData {
+    /* set until the user phrase storage is opened, see LoadUserphrase() */
+    char *userphrase_path;
+    int userphrase_ready;
+
 #if WITH_SQLITE3
     sqlite3 *db;
     sqlite3_stmt *stmt_config[STMT_CONFIG_COUNT];
@@ -212,24 +380,16 @@ typedef struct ChewingStaticData {
 
     unsigned int original_lifetime;
     unsigned int new_lifetime;
+
+    int userphrase_batch;       /* in UserUpdatePhraseBegin() and UserUpdatePhraseEnd() */
 #else
     int taigi_lifetime;
 
     char hashfilename[200];
-    struct HASH_ITEM *hashtable[HASH_TABLE_SIZE];
+    struct HASH_TABLE *hash_table;      /* shared by the copies of the static data, see hash.c */
+    int hash_batch;             /* in UserUpdatePhraseBegin() and UserUpdatePhraseEnd() */
     struct HASH_ITEM *userphrase_enum;  /* FIXME: Shall be in ChewingData? */
 #endif
-
-    unsigned int n_symbol_entry;
-    SymbolEntry **symbol_table;
-
-    char *g_easy_symbol_value[EASY_SYMBOL_KEY_TAB_LEN];
-    int g_easy_symbol_num[EASY_SYMBOL_KEY_TAB_LEN];
-
-    struct keymap *hanyuInitialsMap;
-    struct keymap *hanyuFinalsMap;
-    int HANYU_INITIALS;
-    int HANYU_FINALS;
 } ChewingStaticData;
 
 typedef enum Category {
@@ -279,13 +439,26 @@ typedef struct ChewingData {
     /* Symbol Key buffer */
     char symbolKeyBuf[MAX_PHONE_SEQ_LEN];
 
+    UserPhraseData tailophrase_data;
 #if WITH_SQLITE3
     UserPhraseData userphrase_data;
-    UserPhraseData tailophrase_data;
+    /* phone sequence keyed lookups, see userphrase-sql.c */
+    struct UserPhraseCache *userphraseCache;
 #else
     struct HASH_ITEM *prev_userphrase;
+    struct HASH_ITEM *prev_tailophrase;
 #endif
 
+    /* intervals kept between two Phrasing() calls, see tree.c */
+    struct PhrasingCache *phrasingCache;
+    /* scratch context of taigi_convert_bopomofo() */
+    struct ChewingData *convertData;
+    /* set in the workers of taigi_convert_bopomofo_batch() */
+    plat_mutex *userphraseLock;
+    /* number of phrasings cycled by Tab */
+    int phrasingBeamWidth;
+
+    ChewingSharedData *shared;
     ChewingStaticData static_data;
     void (*logger) (void *data, int level, const char *fmt, ...);
     void *loggerData;
@@ -18,8 +18,25 @@
 #endif
 
 
+#ifdef HAVE_INTTYPES_H
+#    include <inttypes.h>
+#elif defined HAVE_STDINT_H
+#    include <stdint.h>
+#endif
+
 /*
- * userphrase_v1 table
+ * The phone sequence of userphrase_v2 and tailo_v2 is a single BLOB key of
+ * PHONE_BLOB_UNIT bytes per phone in big endian, so that a lookup binds and
+ * compares one value whatever the phrase length is. The v1 tables with one
+ * column per phone are migrated by InitUserphrase().
+ */
+#define PHONE_BLOB_UNIT (4)
+
+int PackPhoneBlob(unsigned char blob[], const uint32_t phoneSeq[], int len);
+int UnpackPhoneBlob(uint32_t phoneSeq[], int max_len, const unsigned char blob[], int size);
+
+/*
+ * userphrase_v2 table
  */
 
 enum {
@@ -30,17 +47,7 @@ enum {
     BIND_USERPHRASE_LENGTH = 5,
     BIND_USERPHRASE_PHRASE = 6,
     BIND_USERPHRASE_TYPE = 7,
-    BIND_USERPHRASE_PHONE_0 = 10,
-    BIND_USERPHRASE_PHONE_1 = 11,
-    BIND_USERPHRASE_PHONE_2 = 12,
-    BIND_USERPHRASE_PHONE_3 = 13,
-    BIND_USERPHRASE_PHONE_4 = 14,
-    BIND_USERPHRASE_PHONE_5 = 15,
-    BIND_USERPHRASE_PHONE_6 = 16,
-    BIND_USERPHRASE_PHONE_7 = 17,
-    BIND_USERPHRASE_PHONE_8 = 18,
-    BIND_USERPHRASE_PHONE_9 = 19,
-    BIND_USERPHRASE_PHONE_10 = 20,
+    BIND_USERPHRASE_PHONE = 8,
 };
 
 enum {
@@ -51,27 +58,24 @@ enum {
     COLUMN_USERPHRASE_LENGTH,
     COLUMN_USERPHRASE_PHRASE,
     COLUMN_USERPHRASE_TYPE,
-    COLUMN_USERPHRASE_PHONE_0,
-    COLUMN_USERPHRASE_PHONE_1,
-    COLUMN_USERPHRASE_PHONE_2,
-    COLUMN_USERPHRASE_PHONE_3,
-    COLUMN_USERPHRASE_PHONE_4,
-    COLUMN_USERPHRASE_PHONE_5,
-    COLUMN_USERPHRASE_PHONE_6,
-    COLUMN_USERPHRASE_PHONE_7,
-    COLUMN_USERPHRASE_PHONE_8,
-    COLUMN_USERPHRASE_PHONE_9,
-    COLUMN_USERPHRASE_PHONE_10,
+    COLUMN_USERPHRASE_PHONE,
+    COLUMN_USERPHRASE_SOURCE,
     COLUMN_USERPHRASE_COUNT,
 };
 
+/* the table of a row of STMT_USERPHRASE_SELECT_BY_PHONE */
+enum {
+    USERPHRASE_SOURCE_USER,     /* userphrase_v2 */
+    USERPHRASE_SOURCE_TAILO,    /* tailo_v2 */
+    USERPHRASE_SOURCE_COUNT,
+};
+
 enum {
     STMT_USERPHRASE_SELECT,
     STMT_USERPHRASE_SELECT_BY_PHONE,
     STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE,
     STMT_USERPHRASE_UPSERT,
     STMT_USERPHRASE_DELETE,
-    STMT_USERPHRASE_GET_MAX_FREQ,
     STMT_USERPHRASE_COUNT,
 };
 
@@ -82,7 +86,7 @@ typedef struct SqlStmtUserphrase_ {
 
 
 /*
- * tailo_v1 table
+ * tailo_v2 table
  */
 
 enum {
@@ -93,17 +97,7 @@ enum {
     BIND_TAILOPHRASE_LENGTH = 5,
     BIND_TAILOPHRASE_PHRASE = 6,
     BIND_TAILOPHRASE_TYPE = 7,
-    BIND_TAILOPHRASE_PHONE_0 = 10,
-    BIND_TAILOPHRASE_PHONE_1 = 11,
-    BIND_TAILOPHRASE_PHONE_2 = 12,
-    BIND_TAILOPHRASE_PHONE_3 = 13,
-    BIND_TAILOPHRASE_PHONE_4 = 14,
-    BIND_TAILOPHRASE_PHONE_5 = 15,
-    BIND_TAILOPHRASE_PHONE_6 = 16,
-    BIND_TAILOPHRASE_PHONE_7 = 17,
-    BIND_TAILOPHRASE_PHONE_8 = 18,
-    BIND_TAILOPHRASE_PHONE_9 = 19,
-    BIND_TAILOPHRASE_PHONE_10 = 20,
+    BIND_TAILOPHRASE_PHONE = 8,
 };
 
 enum {
@@ -114,27 +108,15 @@ enum {
     COLUMN_TAILOPHRASE_LENGTH,
     COLUMN_TAILOPHRASE_PHRASE,
     COLUMN_TAILOPHRASE_TYPE,
-    COLUMN_TAILOPHRASE_PHONE_0,
-    COLUMN_TAILOPHRASE_PHONE_1,
-    COLUMN_TAILOPHRASE_PHONE_2,
-    COLUMN_TAILOPHRASE_PHONE_3,
-    COLUMN_TAILOPHRASE_PHONE_4,
-    COLUMN_TAILOPHRASE_PHONE_5,
-    COLUMN_TAILOPHRASE_PHONE_6,
-    COLUMN_TAILOPHRASE_PHONE_7,
-    COLUMN_TAILOPHRASE_PHONE_8,
-    COLUMN_TAILOPHRASE_PHONE_9,
-    COLUMN_TAILOPHRASE_PHONE_10,
+    COLUMN_TAILOPHRASE_PHONE,
     COLUMN_TAILOPHRASE_COUNT,
 };
 
 enum {
     STMT_TAILOPHRASE_SELECT,
-    STMT_TAILOPHRASE_SELECT_BY_PHONE,
     STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE,
     STMT_TAILOPHRASE_UPSERT,
     STMT_TAILOPHRASE_DELETE,
-    STMT_TAILOPHRASE_GET_MAX_FREQ,
     STMT_TAILOPHRASE_COUNT,
 };
 
@@ -182,6 +164,8 @@ struct ChewingData;
 
 int InitUserphrase(struct ChewingData *pgdata, const char *path);
 void TerminateUserphrase(struct ChewingData *pgdata);
+void TerminateUserPhraseCache(struct ChewingData *pgdata);
+void FlushUserphrase(struct ChewingData *pgdata);
 
 /* *INDENT-OFF* */
 #endif
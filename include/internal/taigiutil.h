@@ -55,6 +55,7 @@ int OpenSymbolChoice(ChewingData *pgdata);
 
 int InitSymbolTable(ChewingData *pgdata, const char *prefix);
 void TerminateSymbolTable(ChewingData *pgdata);
+void LoadSymbolTable(ChewingData *pgdata);
 
 int InitEasySymbolInput(ChewingData *pgdata, const char *prefix);
 void TerminateEasySymbolTable(ChewingData *pgdata);
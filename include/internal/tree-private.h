@@ -17,14 +17,43 @@
 #define IS_USER_PHRASE 1
 #define IS_DICT_PHRASE 0
 
+/* TreeCursorNext() results, PHRASE and CONTINUE may be combined. */
+#define TREE_CURSOR_DEAD_END 0
+#define TREE_CURSOR_CONTINUE 1
+#define TREE_CURSOR_PHRASE 2
+
+/**
+ * @struct TreeCursor
+ * @brief position of a prefix walk in the phrase tree.
+ */
+typedef struct TreeCursor {
+    const TreeType *node;       /* NULL after a dead end */
+} TreeCursor;
+
 int InitTree(ChewingData *pgdata, const char *prefix);
 void TerminateTree(ChewingData *pgdata);
 
 int Phrasing(ChewingData *pgdata, int all_phrasing);
+
+/**
+ * @brief Phrase pgdata->phoneSeq and append the best segmentation to buf.
+ *
+ * Segments are separated by a space, *used is the length of buf so far.
+ * When *end is less than pgdata->nPhoneSeq, more syllables follow, so the
+ * last segment is left out and *end is set to where it starts. The preedit
+ * buffer and the phrasing output of pgdata are not touched.
+ *
+ * @return number of segments, or -1 when buf is too small.
+ */
+int PhrasingText(ChewingData *pgdata, char *buf, size_t buf_len, size_t *used, int *end);
+void InvalidatePhrasingCache(ChewingData *pgdata);
+void TerminatePhrasingCache(ChewingData *pgdata);
 int IsIntersect(IntervalType in1, IntervalType in2);
 
 const TreeType *TreeFindPhrase(ChewingData *pgdata, int begin, int end, const uint32_t *phoneSeq);
-void TreeChildRange(ChewingData *pgdata, const TreeType *parent);
+DictIterator TreeChildRange(ChewingData *pgdata, const TreeType *parent);
+void TreeCursorInit(ChewingData *pgdata, TreeCursor *cursor);
+int TreeCursorNext(ChewingData *pgdata, TreeCursor *cursor, uint32_t phone);
 
 /* *INDENT-OFF* */
 #endif
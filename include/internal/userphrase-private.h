@@ -75,6 +75,10 @@ int UserRemovePhrase(struct ChewingData *pgdata, const uint32_t phoneSeq[], cons
 /**
  * @brief Read the first phrase of the phone in user phrase database.
  *
+ * The returned UserPhraseData, and its wordSeq, are valid until the next
+ * lookup, update or removal of a user phrase, which may drop the cached
+ * lookups they belong to. Copy wordSeq to keep it.
+ *
  * @param phoneSeq[] Phone sequence
  *
  * @return UserPhraseData, if it's not existing then return NULL.
@@ -87,6 +91,8 @@ UserPhraseData *TailoGetPhraseFirst(struct ChewingData *pgdata, const uint32_t p
  *
  * @param phoneSeq[] Phone sequence
  *
+ * The returned UserPhraseData is valid like that of UserGetPhraseFirst().
+ *
  * @return UserPhraseData, if it's not existing then return NULL.
  */
 UserPhraseData *UserGetPhraseNext(struct ChewingData *pgdata, const uint32_t phoneSeq[]);
@@ -95,10 +101,28 @@ UserPhraseData *TailoGetPhraseNext(struct ChewingData *pgdata, const uint32_t ph
 void UserGetPhraseEnd(struct ChewingData *pgdata, const uint32_t phoneSeq[]);
 void TailoGetPhraseEnd(struct ChewingData *pgdata, const uint32_t phoneSeq[]);
 
+/**
+ * @brief Drop the cached lookups when the database was changed elsewhere.
+ *
+ * Lookups of UserGetPhraseFirst() and TailoGetPhraseFirst() are cached until
+ * this context updates or removes a phrase. This catches commits made by
+ * other connections to the same database.
+ *
+ * @return 1 if the cached lookups were dropped, 0 otherwise.
+ */
+int UserSyncPhraseCache(struct ChewingData *pgdata);
+
 void IncreaseLifeTime(struct ChewingData *pgdata);
 
 char *GetDefaultUserPhrasePath(struct ChewingData *pgdata);
 
+/**
+ * @brief Open the user phrase storage if it is not opened yet.
+ *
+ * @return 0 when the storage is usable, -1 otherwise.
+ */
+int LoadUserphrase(struct ChewingData *pgdata);
+
 /* *INDENT-OFF* */
 #endif
 /* *INDENT-ON* */
@@ -343,6 +343,31 @@ CHEWING_API int taigi_get_maxChiSymbolLen(const ChewingContext *ctx);
 /*@}*/
 
 
+/*! \name Number of phrasings cycled by Tab
+ */
+
+/*@{*/
+/**
+ * @brief Set the number of phrasings kept for Tab at the end of buffer
+ *
+ * Only the n best phrasings are searched, so a small n is faster for a long
+ * buffer. The best one does not depend on n.
+ *
+ * @param ctx
+ * @param n number of phrasings, from 1 to 32
+ */
+CHEWING_API void taigi_set_phrasingBeamWidth(ChewingContext *ctx, int n);
+
+/**
+ * @brief Get the number of phrasings kept for Tab at the end of buffer
+ *
+ * @param ctx
+ */
+CHEWING_API int taigi_get_phrasingBeamWidth(const ChewingContext *ctx);
+
+/*@}*/
+
+
 /*! \name Key sequence for selecting phrases
  */
 
@@ -535,6 +560,38 @@ CHEWING_API int taigi_userphrase_remove(ChewingContext *ctx, const char *phrase_
 
 CHEWING_API int taigi_userphrase_lookup(ChewingContext *ctx, const char *phrase_buf, const char *bopomofo_buf);
 
+/**
+ * @brief Convert a syllable sequence to text in one pass
+ *
+ * bopomofo_buf holds syllables with tone numbers, separated by spaces or
+ * hyphens, such as "tsiah8-png7". The best segmentation is written to
+ * phrase_buf with a space between two segments. Syllables without any phrase
+ * are copied as they are. The editing state of ctx is not changed.
+ *
+ * @return number of segments, or -1 on an invalid syllable or when
+ * phrase_len is too small.
+ */
+CHEWING_API int taigi_convert_bopomofo(ChewingContext *ctx, const char *bopomofo_buf,
+                                       char *phrase_buf, unsigned int phrase_len);
+
+/**
+ * @brief Convert many syllable sequences in parallel
+ *
+ * Each entry of bopomofo_list is converted as taigi_convert_bopomofo() does,
+ * and the result of entry i is written to phrase_buf + i * phrase_len. An
+ * entry that cannot be converted is set to an empty string. The workers share
+ * the dictionaries and user phrases of ctx, and the logger of ctx may be
+ * called from any of them.
+ *
+ * @param count number of entries in bopomofo_list
+ * @param nthread number of workers, or 0 for one per processor
+ *
+ * @return number of converted entries, or -1 on error.
+ */
+CHEWING_API int taigi_convert_bopomofo_batch(ChewingContext *ctx, const char *const bopomofo_list[],
+                                             unsigned int count, char *phrase_buf, unsigned int phrase_len,
+                                             int nthread);
+
 CHEWING_API int taigi_cand_list_first(ChewingContext *ctx);
 CHEWING_API int taigi_cand_list_last(ChewingContext *ctx);
 CHEWING_API int taigi_cand_list_has_next(ChewingContext *ctx);
@@ -552,6 +609,20 @@ CHEWING_API ChewingContext *taigi_new2(const char *syspath,
                                          void (*logger) (void *data, int level, const char *fmt, ...),
                                          void *loggerdata);
 
+/**
+ * @brief Create a new instance like taigi_new2(), with creation flags
+ *
+ * With CHEWING_NEW_LAZY, the symbol table is loaded on the first symbol
+ * input, and the user phrase storage is opened on the first phrasing or
+ * userphrase API call. Errors of userpath are then reported there instead
+ * of by this function.
+ */
+CHEWING_API ChewingContext *taigi_new3(const char *syspath,
+                                         const char *userpath,
+                                         int flags,
+                                         void (*logger) (void *data, int level, const char *fmt, ...),
+                                         void *loggerdata);
+
 CHEWING_API int taigi_phone_to_bopomofo(unsigned short phone, char *buf, unsigned short len);
 
 /* *INDENT-OFF* */
@@ -0,0 +1,106 @@
+/**
+ * bigram.c
+ *
+ * Copyright (c) 2026
+ *      libchewing Core Team. See ChangeLog for details.
+ *
+ * See the file "COPYING" for information on usage and redistribution
+ * of this file.
+ */
+
+/**
+ * @file bigram.c
+ *
+ * @brief Optional phrase bigram table built by init_database from a segmented
+ * corpus. See BigramHeader.
+ */
+
+#ifdef HAVE_CONFIG_H
+#    include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "global-private.h"
+#include "plat_mmap.h"
+#include "bigram-private.h"
+#include "private.h"
+
+void TerminateBigram(ChewingData *pgdata)
+{
+    pgdata->shared->bigram = NULL;
+    pgdata->shared->bigram_mask = 0;
+    plat_mmap_close(&pgdata->shared->bigram_mmap);
+}
+
+/*
+ * Load BIGRAM_FILE in prefix. The table is optional, so a missing or unusable
+ * file leaves shared->bigram NULL and is not an error.
+ */
+int InitBigram(ChewingData *pgdata, const char *prefix)
+{
+    char filename[PATH_MAX];
+    const BigramHeader *header;
+    const char *buf;
+    size_t len;
+    size_t offset;
+    size_t file_size;
+    uint32_t slot_count;
+
+    pgdata->shared->bigram = NULL;
+    pgdata->shared->bigram_mask = 0;
+    plat_mmap_set_invalid(&pgdata->shared->bigram_mmap);
+
+    len = snprintf(filename, sizeof(filename), "%s" PLAT_SEPARATOR "%s", prefix, BIGRAM_FILE);
+    if (len + 1 > sizeof(filename))
+        return -1;
+
+    file_size = plat_mmap_create(&pgdata->shared->bigram_mmap, filename, FLAG_ATTRIBUTE_READ);
+    if (file_size <= 0)
+        return 0;
+
+    offset = 0;
+    buf = (const char *) plat_mmap_set_view(&pgdata->shared->bigram_mmap, &offset, &file_size);
+    if (!buf || file_size < sizeof(BigramHeader))
+        goto ignore;
+
+    header = (const BigramHeader *) buf;
+    slot_count = header->slot_count;
+    if (memcmp(header->magic, BIGRAM_MAGIC, sizeof(header->magic))
+        || header->version != BIGRAM_VERSION
+        || header->byte_order != TREE_INDEX_BYTE_ORDER
+        || slot_count == 0 || (slot_count & (slot_count - 1))
+        || (file_size - sizeof(BigramHeader)) / sizeof(BigramSlot) < slot_count)
+        goto ignore;
+
+    pgdata->shared->bigram = (const BigramSlot *) (buf + sizeof(BigramHeader));
+    pgdata->shared->bigram_mask = slot_count - 1;
+    return 0;
+
+  ignore:
+    LOG_WARN("Ignore unusable %s", filename);
+    TerminateBigram(pgdata);
+    return 0;
+}
+
+/* Return the bonus of phrase hash next following phrase hash prev, or 0. */
+int GetBigramBonus(const ChewingData *pgdata, uint32_t prev, uint32_t next)
+{
+    const BigramSlot *slot;
+    uint32_t mask = pgdata->shared->bigram_mask;
+    uint32_t i;
+    uint32_t probe;
+
+    if (!pgdata->shared->bigram)
+        return 0;
+
+    for (i = HashBigramKey(prev, next), probe = 0; probe <= mask; ++i, ++probe) {
+        slot = &pgdata->shared->bigram[i & mask];
+        if (!slot->prev)
+            break;
+        if (slot->prev == prev && slot->next == next)
+            return slot->bonus;
+    }
+    return 0;
+}
@@ -38,7 +38,7 @@ static void ChangeSelectIntervalAndBreakpoint(ChewingData *pgdata, int from, int
 
     IntervalType inte;
 
-    
+    InvalidatePhrasingCache(pgdata);
     inte.from = from;
     inte.to = to;
     for (i = 0; i < pgdata->nSelect; i++) {
@@ -162,46 +162,141 @@ static void SetAvailInfo(ChewingData *pgdata, int begin, int end)
     }
 }
 
-/* FIXME: Improper use of len parameter */
-static int ChoiceTheSame(ChoiceInfo *pci, const char *str, int len)
+void ChoiceClear(ChewingData *pgdata)
+{
+    pgdata->choiceInfo.nTotalChoice = 0;
+    pgdata->choiceInfo.choiceBufLen = 0;
+}
+
+/**
+ * @brief Append the first len bytes of str as a new choice.
+ *
+ * @return index of the new choice, or -1 if there is no room for it.
+ */
+int ChoiceAppend(ChewingData *pgdata, const char *str, int len)
+{
+    ChoiceInfo *pci = &pgdata->choiceInfo;
+
+    assert(pci->nTotalChoice < MAX_CHOICE);
+    if (len < 0 || len + 1 > MAX_CHOICE_STR_BUF - pci->choiceBufLen) {
+        LOG_WARN("No room for choice %d of %d bytes", pci->nTotalChoice, len);
+        return -1;
+    }
+
+    memcpy(pci->choiceBuf + pci->choiceBufLen, str, len);
+    pci->choiceBuf[pci->choiceBufLen + len] = '\0';
+    pci->totalChoicePos[pci->nTotalChoice] = CHOICE_IN_BUF | pci->choiceBufLen;
+    pci->choiceBufLen += len + 1;
+    return pci->nTotalChoice++;
+}
+
+/**
+ * @brief Append a choice which is a string of the dictionary.
+ *
+ * Nothing is copied, the choice refers to the dictionary mmap.
+ *
+ * @return index of the new choice.
+ */
+int ChoiceAppendDict(ChewingData *pgdata, const char *str)
+{
+    ChoiceInfo *pci = &pgdata->choiceInfo;
+
+    assert(pci->nTotalChoice < MAX_CHOICE);
+    assert(str >= pgdata->shared->dict);
+    pci->totalChoicePos[pci->nTotalChoice] = (uint32_t) (str - pgdata->shared->dict);
+    return pci->nTotalChoice++;
+}
+
+const char *ChoiceString(const ChewingData *pgdata, int index)
+{
+    uint32_t pos = pgdata->choiceInfo.totalChoicePos[index];
+
+    if (pos & CHOICE_IN_BUF)
+        return pgdata->choiceInfo.choiceBuf + (pos & ~CHOICE_IN_BUF);
+    return pgdata->shared->dict + pos;
+}
+
+#define CHOICE_SET_SIZE (1024)     /* power of 2, larger than MAX_CHOICE */
+
+/**
+ * @brief Set of the choices appended by one SetChoiceInfo call.
+ *
+ * Open addressing with linear probing. A slot holds choice index + 1, or 0
+ * when it is empty.
+ */
+typedef struct ChoiceSet {
+    uint16_t slot[CHOICE_SET_SIZE];
+} ChoiceSet;
+
+static unsigned int HashChoice(const char *str, int len)
 {
+    unsigned int hash = 2166136261u;
     int i;
 
-    for (i = 0; i < pci->nTotalChoice; i++)
-        if (!memcmp(pci->totalChoiceStr[i], str, len))
-            return 1;
-    return 0;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-static void ChoiceInfoAppendChi(ChewingData *pgdata, ChoiceInfo *pci, uint32_t phone)
+/**
+ * @brief Look up the first len bytes of str in the choice set.
+ *
+ * @return the slot holding the same choice, or the empty slot where it
+ * should be stored.
+ */
+static uint16_t *ChoiceSetFind(ChewingData *pgdata, ChoiceSet *set, const char *str, int len)
 {
-    Phrase tempWord;
-    int len;
+    unsigned int i = HashChoice(str, len) & (CHOICE_SET_SIZE - 1);
+    const char *choice;
+
+    for (;; i = (i + 1) & (CHOICE_SET_SIZE - 1)) {
+        if (set->slot[i] == 0)
+            return &set->slot[i];
+        choice = ChoiceString(pgdata, set->slot[i] - 1);
+        if (!strncmp(choice, str, len) && choice[len] == '\0')
+            return &set->slot[i];
+    }
+}
+
+/**
+ * @brief Check whether the first len bytes of str is already a choice.
+ *
+ * If not, the caller appends it and records it with ChoiceSetAdd().
+ */
+static int ChoiceTheSame(ChewingData *pgdata, ChoiceSet *set, const char *str, int len)
+{
+    return *ChoiceSetFind(pgdata, set, str, len) != 0;
+}
+
+static void ChoiceSetAdd(ChewingData *pgdata, ChoiceSet *set, int index)
+{
+    const char *choice = ChoiceString(pgdata, index);
+
+    *ChoiceSetFind(pgdata, set, choice, strlen(choice)) = index + 1;
+}
+
+static void ChoiceInfoAppendChi(ChewingData *pgdata, ChoiceInfo *pci, ChoiceSet *set, uint32_t phone)
+{
+    DictIterator iter;
+    const char *str;
+    int type;
+    int index;
 
     TRACX("---- %s, %d -----\n", __func__, __LINE__);
-    if (GetCharFirst(pgdata, &tempWord, phone)) {
-        do {
-            //len = ueBytesFromChar(tempWord.phrase[0]);
-            len = strlen(tempWord.phrase);
-	    TRACX("---- string len=%d xxxxx\n", strlen(tempWord.phrase));
-	    {
-		    int j;
-		    for (j=0;j< 10;j++) {
-			    TRACX("%02X ", (unsigned char) tempWord.phrase[j]);
-		    }
-	    }
-            if (ChoiceTheSame(pci, tempWord.phrase, len))
-                continue;
-            assert(pci->nTotalChoice < MAX_CHOICE);
-            memcpy(pci->totalChoiceStr[pci->nTotalChoice], tempWord.phrase, len);
-            pci->totalChoiceStr[pci->nTotalChoice]
-                [len] = '\0';
-	    pci->totalChoiceType[pci->nTotalChoice] = tempWord.type;
-	    TRACE_TYPE("---- %s, %d: totalChoiceStr[%d]=%s, type=%d\n", __func__, __LINE__,
-			    pci->nTotalChoice, pci->totalChoiceStr[pci->nTotalChoice],
-			    pci->totalChoiceType[pci->nTotalChoice]);
-            pci->nTotalChoice++;
-        } while (GetVocabNext(pgdata, &tempWord));
+    if (!GetCharRange(pgdata, &iter, phone))
+        return;
+
+    /* characters are read in place, sorted and unique within a syllable */
+    while ((str = GetCharNext(pgdata, &iter, &type)) != NULL) {
+        if (ChoiceTheSame(pgdata, set, str, strlen(str)))
+            continue;
+        index = ChoiceAppendDict(pgdata, str);
+        ChoiceSetAdd(pgdata, set, index);
+        pci->totalChoiceType[index] = type;
+        TRACE_TYPE("---- %s, %d: choice[%d]=%s, type=%d\n", __func__, __LINE__,
+                   index, ChoiceString(pgdata, index), pci->totalChoiceType[index]);
     }
 }
 
@@ -214,9 +309,12 @@ static void ChoiceInfoAppendChi(ChewingData *pgdata, ChoiceInfo *pci, uint32_t p
 static void SetChoiceInfo(ChewingData *pgdata)
 {
     Phrase tempPhrase;
+    DictIterator iter;
     int len;
+    int index;
     UserPhraseData *pUserPhraseData;
     uint32_t userPhoneSeq[MAX_PHONE_SEQ_LEN];
+    ChoiceSet set;
 
     ChoiceInfo *pci = &(pgdata->choiceInfo);
     AvailInfo *pai = &(pgdata->availInfo);
@@ -226,33 +324,39 @@ static void SetChoiceInfo(ChewingData *pgdata)
     int candPerPage = pgdata->config.candPerPage;
 
     /* Clears previous candidates. */
-    memset(pci->totalChoiceStr, '\0', MAX_CHOICE * MAX_PHRASE_LEN * MAX_UTF8_SIZE + 1);
+    ChoiceClear(pgdata);
+    memset(&set, 0, sizeof(set));
 
-    pci->nTotalChoice = 0;
     len = pai->avail[pai->currentAvail].len;
     assert(len);
 
     /* secondly, read tree phrase */
     if (len == 1) {             /* single character */
-        ChoiceInfoAppendChi(pgdata, pci, phoneSeq[cursor]);
+        ChoiceInfoAppendChi(pgdata, pci, &set, phoneSeq[cursor]);
 
         if (phoneSeq[cursor] != phoneSeqAlt[cursor]) {
-            ChoiceInfoAppendChi(pgdata, pci, phoneSeqAlt[cursor]);
+            ChoiceInfoAppendChi(pgdata, pci, &set, phoneSeqAlt[cursor]);
         }
     }
     /* phrase */
     else {
         if (pai->avail[pai->currentAvail].id) {
-            GetPhraseFirst(pgdata, &tempPhrase, pai->avail[pai->currentAvail].id);
+            GetPhraseFirst(pgdata, &iter, &tempPhrase, pai->avail[pai->currentAvail].id);
             do {
-                if (ChoiceTheSame(pci, tempPhrase.phrase, len * ueBytesFromChar(tempPhrase.phrase[0]))) {
+                if (ChoiceTheSame(pgdata, &set, tempPhrase.phrase, ueStrNBytes(tempPhrase.phrase, len))) {
                     continue;
                 }
 		TRACE_TYPE("%s, %d, Got phrase=%s, type=%d\n", __func__, __LINE__, tempPhrase.phrase, tempPhrase.type);
-                ueStrNCpy(pci->totalChoiceStr[pci->nTotalChoice], tempPhrase.phrase, len, 1);
-		pci->totalChoiceType[pci->nTotalChoice] =  tempPhrase.type;
-                pci->nTotalChoice++;
-            } while (GetVocabNext(pgdata, &tempPhrase));
+                /* only a phrase cut to len characters needs a copy */
+                if (ueStrLen(tempPhrase.phrase) <= len)
+                    index = ChoiceAppendDict(pgdata, GetVocabString(pgdata, &iter));
+                else
+                    index = ChoiceAppend(pgdata, tempPhrase.phrase, ueStrNBytes(tempPhrase.phrase, len));
+                if (index < 0)
+                    break;
+                ChoiceSetAdd(pgdata, &set, index);
+		pci->totalChoiceType[index] =  tempPhrase.type;
+            } while (GetVocabNext(pgdata, &iter, &tempPhrase));
         }
 
         memcpy(userPhoneSeq, &phoneSeq[cursor], sizeof(uint32_t) * len);
@@ -263,12 +367,14 @@ static void SetChoiceInfo(ChewingData *pgdata)
         if (pUserPhraseData) {
             do {
                 /* check if the phrase is already in the choice list */
-                if (ChoiceTheSame(pci, pUserPhraseData->wordSeq, len * ueBytesFromChar(pUserPhraseData->wordSeq[0])))
+                if (ChoiceTheSame(pgdata, &set, pUserPhraseData->wordSeq, ueStrNBytes(pUserPhraseData->wordSeq, len)))
                     continue;
                 /* otherwise store it */
-                ueStrNCpy(pci->totalChoiceStr[pci->nTotalChoice], pUserPhraseData->wordSeq, len, 1);
-		pci->totalChoiceType[pci->nTotalChoice] = TYPE_HAN;
-                pci->nTotalChoice++;
+                index = ChoiceAppend(pgdata, pUserPhraseData->wordSeq, ueStrNBytes(pUserPhraseData->wordSeq, len));
+                if (index < 0)
+                    break;
+                ChoiceSetAdd(pgdata, &set, index);
+		pci->totalChoiceType[index] = TYPE_HAN;
             } while ((pUserPhraseData = UserGetPhraseNext(pgdata, userPhoneSeq)) != NULL);
         }
         UserGetPhraseEnd(pgdata, userPhoneSeq);
@@ -281,10 +387,12 @@ static void SetChoiceInfo(ChewingData *pgdata)
                 //if (ChoiceTheSame(pci, pUserPhraseData->wordSeq, strlen(pUserPhraseData->wordSeq[0])))
                  //   continue;
                 /* otherwise store it */
-                strncpy(pci->totalChoiceStr[pci->nTotalChoice], pUserPhraseData->wordSeq, MAX_PHRASE_LEN * MAX_UTF8_SIZE + 1);
-		pci->totalChoiceType[pci->nTotalChoice] = TYPE_TAILO;
+                index = ChoiceAppend(pgdata, pUserPhraseData->wordSeq,
+                                     min(strlen(pUserPhraseData->wordSeq), MAX_PHRASE_LEN * MAX_UTF8_SIZE));
+                if (index < 0)
+                    break;
+		pci->totalChoiceType[index] = TYPE_TAILO;
 		printf("\tCopying Tailo: len=%d\t, (%s)\n", len, pUserPhraseData->wordSeq);
-                pci->nTotalChoice++;
             } while ((pUserPhraseData = TailoGetPhraseNext(pgdata, userPhoneSeq)) != NULL);
         }
         TailoGetPhraseEnd(pgdata, userPhoneSeq);
@@ -477,24 +585,25 @@ static void ChangeUserData(ChewingData *pgdata, int selectNo, int type)
 {
     uint32_t userPhoneSeq[MAX_PHONE_SEQ_LEN];
     int len;
-    char *p = NULL;
+    const char *p = NULL;
+    const char *str = ChoiceString(pgdata, selectNo);
 
     /* This function is used to determine how many word there, len is Number of word */
     if (pgdata->choiceInfo.totalChoiceType[selectNo] == TYPE_TAILO) {
-	    p = pgdata->choiceInfo.totalChoiceStr[selectNo];
+	    p = str;
 	    len = 1;
 	    while (p = strchr(p, '-')) {
 		    ++p;
 		    ++len;
 	    }
     }  else
-	    len = ueStrLen(pgdata->choiceInfo.totalChoiceStr[selectNo]);
+	    len = ueStrLen(str);
 
 
-    TRACX("<<<<<---- %s, %d, selectNo=%d, type=%d, str=%s, len=%d ----->>>>\n", __func__, __LINE__, selectNo, type, pgdata->choiceInfo.totalChoiceStr[selectNo], len);
+    TRACX("<<<<<---- %s, %d, selectNo=%d, type=%d, str=%s, len=%d ----->>>>\n", __func__, __LINE__, selectNo, type, str, len);
     memcpy(userPhoneSeq, &(pgdata->phoneSeq[PhoneSeqCursor(pgdata)]), len * sizeof(uint32_t));
     userPhoneSeq[len] = 0;
-    UserUpdatePhrase(pgdata, userPhoneSeq, pgdata->choiceInfo.totalChoiceStr[selectNo], type);
+    UserUpdatePhrase(pgdata, userPhoneSeq, str, type);
 }
 
 /** @brief commit the selected phrase. */
@@ -508,7 +617,7 @@ int ChoiceSelect(ChewingData *pgdata, int selectNo)
     ChangeSelectIntervalAndBreakpoint(pgdata,
                                       PhoneSeqCursor(pgdata),
                                       PhoneSeqCursor(pgdata) + pai->avail[pai->currentAvail].len,
-                                      pci->totalChoiceStr[selectNo],
+                                      ChoiceString(pgdata, selectNo),
 				      pci->totalChoiceType[selectNo]);
     ChoiceEndChoice(pgdata);
     return 0;
@@ -29,7 +29,7 @@
 
 void TerminateDict(ChewingData *pgdata)
 {
-    plat_mmap_close(&pgdata->static_data.dict_mmap);
+    plat_mmap_close(&pgdata->shared->dict_mmap);
 }
 
 int InitDict(ChewingData *pgdata, const char *prefix)
@@ -44,15 +44,15 @@ int InitDict(ChewingData *pgdata, const char *prefix)
     if (len + 1 > sizeof(filename))
         return -1;
 
-    plat_mmap_set_invalid(&pgdata->static_data.dict_mmap);
-    file_size = plat_mmap_create(&pgdata->static_data.dict_mmap, filename, FLAG_ATTRIBUTE_READ);
+    plat_mmap_set_invalid(&pgdata->shared->dict_mmap);
+    file_size = plat_mmap_create(&pgdata->shared->dict_mmap, filename, FLAG_ATTRIBUTE_READ);
     if (file_size <= 0)
         return -1;
 
     offset = 0;
     csize = file_size;
-    pgdata->static_data.dict = (const char *) plat_mmap_set_view(&pgdata->static_data.dict_mmap, &offset, &csize);
-    if (!pgdata->static_data.dict)
+    pgdata->shared->dict = (const char *) plat_mmap_set_view(&pgdata->shared->dict_mmap, &offset, &csize);
+    if (!pgdata->shared->dict)
         return -1;
 
     return 0;
@@ -60,51 +60,119 @@ int InitDict(ChewingData *pgdata, const char *prefix)
 
 /*
  * The function gets string of vocabulary from dictionary and its frequency from
- * tree index mmap, and stores them into buffer given by phr_ptr.
+ * tree index mmap, stores them into buffer given by phr_ptr, and moves iter to
+ * the next leaf.
  */
-static void GetVocabFromDict(ChewingData *pgdata, Phrase *phr_ptr)
+static void GetVocabFromDict(ChewingData *pgdata, DictIterator *iter, Phrase *phr_ptr)
 {
-    snprintf(phr_ptr->phrase, sizeof(phr_ptr->phrase), "%s", pgdata->static_data.dict + GetUint32(pgdata->static_data.tree_cur_pos->phrase.pos));
-    phr_ptr->freq = GetUint32(pgdata->static_data.tree_cur_pos->phrase.freq);
-    phr_ptr->type = GetUint32(pgdata->static_data.tree_cur_pos->type);
-    pgdata->static_data.tree_cur_pos++;
+    snprintf(phr_ptr->phrase, sizeof(phr_ptr->phrase), "%s", pgdata->shared->dict + GetUint32(iter->cur->phrase.pos));
+    phr_ptr->freq = GetUint32(iter->cur->phrase.freq);
+    phr_ptr->type = GetUint32(iter->cur->type);
+    iter->cur++;
     TRACX("%s, %d, get freq=%d, type=%d, phrase=%s\n", __func__, __LINE__, phr_ptr->freq, phr_ptr->type, phr_ptr->phrase);
 }
 
-int GetCharFirst(ChewingData *pgdata, Phrase *wrd_ptr, uint32_t key)
+/*
+ * Initialize iter to the characters of syllable key, and return the number of
+ * them. The character table of the index tree answers it with one probe in
+ * most cases, otherwise the children of key are searched.
+ */
+int GetCharRange(ChewingData *pgdata, DictIterator *iter, uint32_t key)
 {
-    /* &key serves as an array whose begin and end are both 0. */
-    const TreeType *pinx = TreeFindPhrase(pgdata, 0, 0, &key);
+    const TreeCharSlot *slot;
+    const TreeType *pinx;
+    uint32_t i;
 
-    if (!pinx)
+    if (pgdata->shared->tree_char) {
+        for (i = HashCharKey(key);; ++i) {
+            slot = &pgdata->shared->tree_char[i & pgdata->shared->tree_char_mask];
+            if (slot->key == key) {
+                iter->cur = pgdata->shared->tree + slot->begin;
+                iter->end = pgdata->shared->tree + slot->end;
+                return slot->end - slot->begin;
+            }
+            if (slot->key == 0)
+                break;
+        }
+        iter->cur = iter->end = NULL;
         return 0;
-    TRACX("%s, %d\n", __func__, __LINE__);
-    TreeChildRange(pgdata, pinx);
-    GetVocabFromDict(pgdata, wrd_ptr);
-    return 1;
+    }
+
+    /* &key serves as an array whose begin and end are both 0. */
+    pinx = TreeFindPhrase(pgdata, 0, 0, &key);
+    if (!pinx) {
+        iter->cur = iter->end = NULL;
+        return 0;
+    }
+    *iter = TreeChildRange(pgdata, pinx);
+    /* longer phrases follow the characters */
+    for (pinx = iter->cur; pinx < iter->end && GetUint32(pinx->key) == 0; ++pinx)
+        ;
+    iter->end = pinx;
+    return iter->end - iter->cur;
+}
+
+/*
+ * Return the string of the next character of iter, which points into the
+ * dictionary mmap, or NULL at the end. Unlike GetVocabNext, nothing is copied.
+ */
+const char *GetCharNext(ChewingData *pgdata, DictIterator *iter, int *type)
+{
+    const TreeType *leaf;
+
+    if (iter->cur >= iter->end)
+        return NULL;
+    leaf = iter->cur++;
+    *type = GetUint32(leaf->type);
+    return pgdata->shared->dict + GetUint32(leaf->phrase.pos);
 }
 
 /*
  * Given an index of parent whose children are phrase leaves (phrase_parent_id),
- * the function initializes reading position (tree_cur_pos) and ending position
- * (tree_end_pos), and fetches the first phrase into phr_ptr.
+ * the function initializes iter to the range of the children, and fetches the
+ * first phrase into phr_ptr.
  */
-int GetPhraseFirst(ChewingData *pgdata, Phrase *phr_ptr, const TreeType *phrase_parent)
+int GetPhraseFirst(ChewingData *pgdata, DictIterator *iter, Phrase *phr_ptr, const TreeType *phrase_parent)
 {
     assert(phrase_parent);
 
     TRACX("%s, %d\n", __func__, __LINE__);
-    TreeChildRange(pgdata, phrase_parent);
-    GetVocabFromDict(pgdata, phr_ptr);
+    *iter = TreeChildRange(pgdata, phrase_parent);
+    GetVocabFromDict(pgdata, iter, phr_ptr);
     return 1;
 }
 
-int GetVocabNext(ChewingData *pgdata, Phrase *phr_ptr)
+/*
+ * Return the highest frequency of the phrases under phrase_parent. init_database
+ * stores the phrase leaves of a node by descending frequency, so it is the
+ * frequency of the first one.
+ */
+int GetPhraseMaxFreq(ChewingData *pgdata, const TreeType *phrase_parent)
+{
+    DictIterator iter;
+
+    assert(phrase_parent);
+
+    iter = TreeChildRange(pgdata, phrase_parent);
+    if (iter.cur >= iter.end || GetUint32(iter.cur->key) != 0)
+        return 0;
+    return GetUint32(iter.cur->phrase.freq);
+}
+
+/*
+ * Return the string of the vocabulary fetched last with iter. It points into
+ * the dictionary mmap, so it stays valid until TerminateDict.
+ */
+const char *GetVocabString(ChewingData *pgdata, const DictIterator *iter)
+{
+    return pgdata->shared->dict + GetUint32(iter->cur[-1].phrase.pos);
+}
+
+int GetVocabNext(ChewingData *pgdata, DictIterator *iter, Phrase *phr_ptr)
 {
     TRACX("%s, %d\n", __func__, __LINE__);
-    if (pgdata->static_data.tree_cur_pos >= pgdata->static_data.tree_end_pos
-        || GetUint32(pgdata->static_data.tree_cur_pos->key) != 0)
+    if (iter->cur >= iter->end || GetUint32(iter->cur->key) != 0)
         return 0;
-    GetVocabFromDict(pgdata, phr_ptr);
+    GetVocabFromDict(pgdata, iter, phr_ptr);
     return 1;
 }
@@ -12,6 +12,7 @@
  * of this file.
  */
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
 /* ISO C99 Standard: 7.10/5.2.4.2.1 Sizes of integer types */
@@ -22,27 +23,128 @@
 #include "taigi-private.h"
 #include "taigi-utf8-util.h"
 #include "hash-private.h"
+#include "key2pho-private.h"
+#include "plat_mmap.h"
 #include "private.h"
 #include "memory-private.h"
 
-int AlcUserPhraseSeq(UserPhraseData *pData, int phonelen, int wordlen)
+#if ENABLE_USERPHRASE_FSYNC
+#    if defined(_WIN32) || defined(_WIN64) || defined(_WIN32_WCE)
+#        include <io.h>
+#        define SyncHashFile(file) _commit(_fileno(file))
+#    else
+#        include <unistd.h>
+#        define SyncHashFile(file) fsync(fileno(file))
+#    endif
+#else
+#    define SyncHashFile(file) (0)
+#endif
+
+/* cut the file at size */
+static int TruncateHashLog(const char *path, long size)
 {
-    pData->phoneSeq = ALC(uint32_t, phonelen + 1);
+#if defined(_WIN32) || defined(_WIN64) || defined(_WIN32_WCE)
+    FILE *file;
+    int ret;
 
-    if (!pData->phoneSeq)
-        goto error;
-    pData->wordSeq = ALC(char, wordlen + 1);
+    file = fopen(path, "r+b");
+    if (!file)
+        return -1;
+    ret = _chsize(_fileno(file), size);
+    if (fclose(file))
+        ret = -1;
+    return ret;
+#else
+    return truncate(path, size);
+#endif
+}
 
-    if (!pData->wordSeq)
-        goto error;
+/*
+ * uhash.dat is a checkpoint of the user phrases, followed by a log of the
+ * records appended since by HashModify() and HashRemove(). A record is never
+ * rewritten, so a crash can only leave a torn record at the end, which fails
+ * its checksum and is dropped. A later record of the same phone and word
+ * sequence replaces an earlier one, and a record with HASH_RECORD_REMOVED
+ * removes it.
+ *
+ * The file, in native byte order:
+ *      \code{
+ *            [char4]  HASH_LOG_SIG
+ *            [int32]  lifetime, rewritten by each append
+ *            [uint32] offset of the index, where the records of the checkpoint end
+ *            [uint32] number of slots of the index, a power of 2, or 0
+ *            [uint32] number of records of the checkpoint
+ *            [uint32] checksum of the three fields above
+ *            the records of the checkpoint, one per phrase
+ *            the index, a slot per [uint32] HashFunc() of the phones and
+ *                [uint32] offset of the record, 0 if the slot is empty
+ *            the records of the log
+ *      }\endcode
+ *
+ * A record:
+ *      \code{
+ *            [uint32] checksum of the rest of the record
+ *            [uint16] size of the record, a multiple of 4
+ *            [uint8]  number of phones
+ *            [uint8]  HASH_RECORD_* flags
+ *            [int32]  userfreq, recentTime, maxfreq, origfreq and type
+ *            [uint32] phones
+ *            wordSeq with its terminating zero, padded with zeros
+ *      }\endcode
+ *
+ * InitUserphrase() keeps the file mapped for the session and replays only the
+ * log, so the startup does not depend on the size of the checkpoint. A record
+ * of the checkpoint is read into an item once its phones are looked up, see
+ * HashFindBase(). The items take precedence over the checkpoint, and a removed
+ * item is kept to hide its record.
+ *
+ * Once the replaced records outnumber the phrases, StartHashCompaction() has
+ * a thread write the next checkpoint aside, from the mapped checkpoint and the
+ * items. TerminateUserphrase() appends to it the records logged since, and
+ * replaces uhash.dat with it atomically, so a crash leaves either of them.
+ */
 
-    return 1;
+/* replaced records kept in the log before it is compacted */
+#define HASH_LOG_SLACK (256)
 
-  error:
-    free(pData->phoneSeq);
-    free(pData->wordSeq);
-    return 0;
-}
+/*
+ * The items are kept in the entries of the table in insertion order, and
+ * indexed by its slots, an open addressing table with linear probing. A slot
+ * holds the hash of the phones inline, so a probe only reads the items of the
+ * same hash. The items of the same phones but different words share a cluster.
+ * The index of the checkpoint is probed the same way.
+ */
+#define HASH_MIN_SLOTS (64)
+
+/* initial size of the dirty items, modified since the last FlushHashLog() */
+#define HASH_DIRTY_SIZE (16)
+
+/*
+ * The items are allocated HASH_ITEM_BLOCK at a time, with their phones inline.
+ * The words of the items read from uhash.dat stay in the mapping, so loading
+ * it does not allocate per record.
+ */
+#define HASH_ITEM_BLOCK (256)
+
+typedef struct HASH_BLOCK {
+    struct HASH_BLOCK *next;
+    HASH_ITEM item[HASH_ITEM_BLOCK];
+} HASH_BLOCK;
+
+/* the next checkpoint, written aside by a thread, see StartHashCompaction() */
+typedef struct HASH_COMPACTION {
+    plat_thread thread;
+    int started;                /* the thread is to be joined */
+    const unsigned char *base;  /* the mapped uhash.dat, for the records of the checkpoint */
+    int base_end;
+    int base_count;
+    unsigned char *items;       /* records of the items, flagged HASH_RECORD_REMOVED once removed */
+    int items_size;
+    int lifetime;
+    int log_size;               /* of uhash.dat as the items were taken */
+    char tmpname[sizeof(((ChewingStaticData *) NULL)->hashfilename) + 4];
+    int ret;                    /* of WriteHashCheckpoint() */
+} HASH_COMPACTION;
 
 static int PhoneSeqTheSame(const uint32_t p1[], const uint32_t p2[])
 {
@@ -60,107 +162,541 @@ static int PhoneSeqTheSame(const uint32_t p1[], const uint32_t p2[])
     return 1;
 }
 
-static unsigned int HashFunc(const uint32_t phoneSeq[])
+/* FNV-1a over the phones, with the high bits mixed into the ones masked */
+static uint32_t HashFunc(const uint32_t phoneSeq[])
 {
-    int i, value = 0;
+    uint32_t hash = 2166136261u;
+    int i;
 
     for (i = 0; phoneSeq[i] != 0; i++)
-        value ^= phoneSeq[i];
-    return (value & (HASH_TABLE_SIZE - 1));
+        hash = (hash ^ phoneSeq[i]) * 16777619u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
 }
 
-HASH_ITEM *HashFindPhonePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], HASH_ITEM *pItemLast)
+/*
+ * Pack the entries and place the items in new slots, at most a quarter of
+ * them used. The items keep their order, which is the insertion order.
+ */
+static int RebuildHashTable(HASH_TABLE *table)
 {
-    HASH_ITEM *pNow = pItemLast ? pItemLast->next : pgdata->static_data.hashtable[HashFunc(phoneSeq)];
+    HASH_SLOT *slots;
+    HASH_ITEM *pItem;
+    unsigned int size = HASH_MIN_SLOTS;
+    unsigned int i;
+    uint32_t hash;
+    int count = 0;
+    int entry;
+
+    while (size < 4 * ((unsigned int) table->item_count + 1))
+        size *= 2;
+    slots = ALC(HASH_SLOT, size);
+    if (!slots)
+        return -1;
+    for (i = 0; i < size; ++i)
+        slots[i].entry = -1;
 
-    for (; pNow; pNow = pNow->next)
-        if (PhoneSeqTheSame(pNow->data.phoneSeq, phoneSeq))
-            return pNow;
-    return NULL;
+    for (entry = 0; entry < table->entry_count; ++entry) {
+        pItem = table->entries[entry];
+        if (!pItem)
+            continue;
+        pItem->entry = count;
+        table->entries[count++] = pItem;
+
+        hash = HashFunc(pItem->data.phoneSeq);
+        i = hash & (size - 1);
+        while (slots[i].entry >= 0)
+            i = (i + 1) & (size - 1);
+        slots[i].hash = hash;
+        slots[i].entry = pItem->entry;
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = size - 1;
+    table->entry_count = count;
+    return 0;
 }
 
-HASH_ITEM **HashFindHead(ChewingData *pgdata, const uint32_t phoneSeq[])
+/* make room for one more item */
+static int ReserveHashItem(HASH_TABLE *table)
 {
-    assert(pgdata);
-    assert(phoneSeq);
+    HASH_ITEM **entries;
+    int size;
+
+    if (table->entry_count == table->entry_size) {
+        if (table->entry_count - table->item_count >= table->entry_count / 4 && table->entry_count > 0)
+            return RebuildHashTable(table);
+
+        size = table->entry_size ? table->entry_size * 2 : HASH_MIN_SLOTS;
+        entries = realloc(table->entries, size * sizeof(HASH_ITEM *));
+        if (!entries)
+            return -1;
+        table->entries = entries;
+        table->entry_size = size;
+    }
 
-    return &pgdata->static_data.hashtable[HashFunc(phoneSeq)];
+    /* keep at most half of the slots used */
+    if (!table->slots || 2 * ((unsigned int) table->item_count + 1) > table->slot_mask + 1)
+        return RebuildHashTable(table);
+    return 0;
 }
 
-HASH_ITEM *HashFindEntry(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
+/* return the slot of the item of phoneSeq and wordSeq, or -1 */
+static int HashFindSlot(const HASH_TABLE *table, const uint32_t phoneSeq[], const char wordSeq[])
 {
+    const HASH_SLOT *slots = table->slots;
+    unsigned int mask = table->slot_mask;
+    const HASH_ITEM *pItem;
+    uint32_t hash;
+    unsigned int i;
+
+    if (!slots)
+        return -1;
+
+    hash = HashFunc(phoneSeq);
+    for (i = hash & mask; slots[i].entry >= 0; i = (i + 1) & mask) {
+        if (slots[i].hash != hash)
+            continue;
+        pItem = table->entries[slots[i].entry];
+        if (!strcmp(pItem->data.wordSeq, wordSeq) && PhoneSeqTheSame(pItem->data.phoneSeq, phoneSeq))
+            return i;
+    }
+    return -1;
+}
+
+/* unlink the item in the slot from the table, and return it */
+static HASH_ITEM *HashDeleteSlot(HASH_TABLE *table, unsigned int slot)
+{
+    HASH_SLOT *slots = table->slots;
+    unsigned int mask = table->slot_mask;
     HASH_ITEM *pItem;
-    int hashvalue;
+    unsigned int i;
 
-    hashvalue = HashFunc(phoneSeq);
+    pItem = table->entries[slots[slot].entry];
+    table->entries[pItem->entry] = NULL;
+    --table->item_count;
 
-    for (pItem = pgdata->static_data.hashtable[hashvalue]; pItem; pItem = pItem->next) {
-        if (!strcmp(pItem->data.wordSeq, wordSeq) && PhoneSeqTheSame(pItem->data.phoneSeq, phoneSeq)) {
-            return pItem;
-        }
+    /*
+     * Move back the following items of the cluster whose home slot is not
+     * after the hole, so that the probes do not stop at it.
+     */
+    for (i = (slot + 1) & mask; slots[i].entry >= 0; i = (i + 1) & mask) {
+        if (((i - (slots[i].hash & mask)) & mask) < ((i - slot) & mask))
+            continue;
+        slots[slot] = slots[i];
+        slot = i;
     }
-    return NULL;
+    slots[slot].entry = -1;
+
+    /* keep the removed entries from dominating FindNextHash() */
+    if (table->entry_count - table->item_count > table->item_count + HASH_MIN_SLOTS)
+        RebuildHashTable(table);
+    return pItem;
 }
 
-HASH_ITEM *HashInsert(ChewingData *pgdata, UserPhraseData *pData)
+/* take an item from the free items, or from the first of the blocks */
+static HASH_ITEM *AllocHashItem(HASH_TABLE *table)
 {
-    int hashvalue;
+    HASH_BLOCK *block;
     HASH_ITEM *pItem;
 
-    pItem = HashFindEntry(pgdata, pData->phoneSeq, pData->wordSeq);
-    if (pItem != NULL)
+    if (table->free_items) {
+        pItem = table->free_items;
+        table->free_items = pItem->next;
         return pItem;
+    }
+
+    if (!table->blocks || table->block_used == HASH_ITEM_BLOCK) {
+        block = ALC(HASH_BLOCK, 1);
+        if (!block)
+            return NULL;
+        block->next = table->blocks;
+        table->blocks = block;
+        table->block_used = 0;
+    }
+    return &table->blocks->item[table->block_used++];
+}
+
+/* return pItem to the free items */
+void FreeHashItem(ChewingData *pgdata, HASH_ITEM *pItem)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
 
-    pItem = ALC(HASH_ITEM, 1);
     if (!pItem)
+        return;
+    if (pItem->word_owned)
+        free(pItem->data.wordSeq);
+    memset(pItem, 0, sizeof(*pItem));
+    pItem->next = table->free_items;
+    table->free_items = pItem;
+}
+
+/* insert a new item of pData, with wordSeq instead of pData->wordSeq */
+static HASH_ITEM *HashInsertItem(HASH_TABLE *table, const UserPhraseData *pData, char *wordSeq, int word_owned)
+{
+    HASH_ITEM *pItem;
+    unsigned int mask;
+    unsigned int i;
+    uint32_t hash;
+    int len;
+
+    len = GetPhoneLen(pData->phoneSeq);
+    if (len > MAX_PHRASE_LEN)
+        return NULL;
+
+    if (ReserveHashItem(table))
         return NULL;            /* Error occurs */
 
-    hashvalue = HashFunc(pData->phoneSeq);
-    /* set the new element */
-    pItem->next = pgdata->static_data.hashtable[hashvalue];
+    pItem = AllocHashItem(table);
+    if (!pItem)
+        return NULL;            /* Error occurs */
 
-    memcpy(&(pItem->data), pData, sizeof(pItem->data));
+    /* set the new element */
+    pItem->data = *pData;
+    memcpy(pItem->phoneSeq, pData->phoneSeq, len * sizeof(pData->phoneSeq[0]));
+    pItem->phoneSeq[len] = 0;
+    pItem->data.phoneSeq = pItem->phoneSeq;
+    pItem->data.wordSeq = wordSeq;
+    pItem->word_owned = word_owned;
     pItem->item_index = -1;
+    pItem->base = 0;
+    pItem->removed = 0;
+    pItem->dirty = -1;
+    pItem->entry = table->entry_count++;
+    table->entries[pItem->entry] = pItem;
+    ++table->item_count;
 
     /* set link to the new element */
-    pgdata->static_data.hashtable[hashvalue] = pItem;
+    hash = HashFunc(pItem->phoneSeq);
+    mask = table->slot_mask;
+    i = hash & mask;
+    while (table->slots[i].entry >= 0)
+        i = (i + 1) & mask;
+    table->slots[i].hash = hash;
+    table->slots[i].entry = pItem->entry;
 
     return pItem;
 }
 
-HASH_ITEM *FindNextHash(const ChewingData *pgdata, HASH_ITEM *curr)
+/* FNV-1a of size bytes */
+static uint32_t HashChecksum(const unsigned char *buf, int size)
 {
-    unsigned int hash_value = 0;
+    uint32_t hash = 2166136261u;
+    int i;
 
-    assert(pgdata);
+    for (i = 0; i < size; ++i) {
+        hash ^= buf[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* checksum of the record after the checksum field */
+static uint32_t HashRecordChecksum(const unsigned char *record, int size)
+{
+    return HashChecksum(record + 4, size - 4);
+}
+
+/* return the size of the record of pItem, or 0 if it does not fit in one */
+static int HashRecordSize(const HASH_ITEM *pItem)
+{
+    int phonelen;
+    int size;
+
+    phonelen = GetPhoneLen(pItem->data.phoneSeq);
+    size = (HASH_RECORD_HEADER_SIZE + phonelen * 4 + strlen(pItem->data.wordSeq) + 1 + 3) & ~3;
+    if (phonelen == 0 || phonelen > MAX_PHRASE_LEN || size > HASH_RECORD_MAX_SIZE)
+        return 0;
+    return size;
+}
 
-    if (curr) {
-        if (curr->next)
-            return curr->next;
-        /* Find next entry in hash table. */
-        hash_value = HashFunc(curr->data.phoneSeq) + 1;
+/* return the size of the record, or 0 if pItem does not fit in one */
+static int HashItem2Record(unsigned char *record, const HASH_ITEM *pItem, int flags)
+{
+    unsigned char *pc;
+    int phonelen;
+    int wordsize;
+    int size;
+    int i;
+
+    size = HashRecordSize(pItem);
+    if (!size)
+        return 0;
+    phonelen = GetPhoneLen(pItem->data.phoneSeq);
+    wordsize = strlen(pItem->data.wordSeq) + 1;
+
+    memset(record, 0, size);
+    PutUint16PreservedEndian(size, &record[4]);
+    record[6] = phonelen;
+    record[7] = flags;
+    PutInt32PreservedEndian(pItem->data.userfreq, &record[8]);
+    PutInt32PreservedEndian(pItem->data.recentTime, &record[12]);
+    PutInt32PreservedEndian(pItem->data.maxfreq, &record[16]);
+    PutInt32PreservedEndian(pItem->data.origfreq, &record[20]);
+    PutInt32PreservedEndian(pItem->data.type, &record[24]);
+
+    pc = &record[HASH_RECORD_HEADER_SIZE];
+    for (i = 0; i < phonelen; i++) {
+        PutInt32PreservedEndian(pItem->data.phoneSeq[i], pc);
+        pc += 4;
     }
+    memcpy(pc, pItem->data.wordSeq, wordsize);
+
+    PutInt32PreservedEndian(HashRecordChecksum(record, size), &record[0]);
+    return size;
+}
+
+/**
+ * Read the record into pData, with its phones in phoneSeq of MAX_PHRASE_LEN + 1
+ * and its word in place.
+ *
+ * @return size of the record, or 0 for a torn or corrupted record, the end of
+ * the log
+ */
+static int ReadHashRecord(const unsigned char *record, size_t avail, UserPhraseData *pData, uint32_t phoneSeq[],
+                          int *flags)
+{
+    const unsigned char *pc;
+    const char *end;
+    int phonelen;
+    int size;
+    int i;
 
-    for (; hash_value < HASH_TABLE_SIZE; ++hash_value)
-        if (pgdata->static_data.hashtable[hash_value])
-            return pgdata->static_data.hashtable[hash_value];
+    if (avail < HASH_RECORD_HEADER_SIZE)
+        return 0;
+
+    size = GetUint16PreservedEndian(&record[4]);
+    phonelen = record[6];
+    if (size < HASH_RECORD_HEADER_SIZE || size > HASH_RECORD_MAX_SIZE || size % 4 || (size_t) size > avail)
+        return 0;
+    if ((uint32_t) GetInt32PreservedEndian(&record[0]) != HashRecordChecksum(record, size))
+        return 0;
+    if (phonelen == 0 || phonelen > MAX_PHRASE_LEN || HASH_RECORD_HEADER_SIZE + phonelen * 4 >= size)
+        return 0;
+
+    pc = &record[HASH_RECORD_HEADER_SIZE + phonelen * 4];
+    end = memchr(pc, 0, size - (HASH_RECORD_HEADER_SIZE + phonelen * 4));
+    if (!end)
+        return 0;
+
+    pData->userfreq = GetInt32PreservedEndian(&record[8]);
+    pData->recentTime = GetInt32PreservedEndian(&record[12]);
+    pData->maxfreq = GetInt32PreservedEndian(&record[16]);
+    pData->origfreq = GetInt32PreservedEndian(&record[20]);
+    pData->type = GetInt32PreservedEndian(&record[24]);
+
+    for (i = 0; i < phonelen; i++)
+        phoneSeq[i] = GetInt32PreservedEndian(&record[HASH_RECORD_HEADER_SIZE + i * 4]);
+    phoneSeq[phonelen] = 0;
+    pData->phoneSeq = phoneSeq;
+    pData->wordSeq = (char *) pc;
+
+    *flags = record[7];
+    return size;
+}
+
+/* whether the valid records are of the same phones and word */
+static int HashRecordSameKey(const unsigned char *record1, const unsigned char *record2)
+{
+    int phonelen = record1[6];
+    int word = HASH_RECORD_HEADER_SIZE + phonelen * 4;
+
+    if (record2[6] != phonelen
+        || memcmp(&record1[HASH_RECORD_HEADER_SIZE], &record2[HASH_RECORD_HEADER_SIZE], phonelen * 4))
+        return 0;
+    return !strcmp((const char *) &record1[word], (const char *) &record2[word]);
+}
+
+/* insert an item of pRecord, the record at offset of the checkpoint */
+static HASH_ITEM *LoadBaseItem(HASH_TABLE *table, const UserPhraseData *pRecord, int offset)
+{
+    HASH_ITEM *pItem;
+
+    pItem = HashInsertItem(table, pRecord, pRecord->wordSeq, 0);
+    if (pItem)
+        pItem->base = pItem->item_index = offset;
+    return pItem;
+}
+
+/*
+ * Insert the item of the record of phoneSeq and wordSeq in the checkpoint,
+ * which the caller has not found in the table, and return it. Without
+ * wordSeq, insert those of the records of phoneSeq which are not in the table
+ * yet, and return NULL.
+ */
+static HASH_ITEM *HashFindBase(HASH_TABLE *table, const uint32_t phoneSeq[], const char wordSeq[])
+{
+    UserPhraseData record;
+    uint32_t recordPhoneSeq[MAX_PHRASE_LEN + 1];
+    const unsigned char *slot;
+    uint32_t hash;
+    unsigned int i;
+    unsigned int n;
+    int offset;
+    int flags;
+
+    if (!table->index)
+        return NULL;
+
+    /* the index is read from the file, so the probe is bounded by its size */
+    hash = HashFunc(phoneSeq);
+    for (i = hash & table->index_mask, n = 0; n <= table->index_mask; i = (i + 1) & table->index_mask, ++n) {
+        slot = table->index + (size_t) i * 8;
+        offset = GetInt32PreservedEndian(&slot[4]);
+        if (offset == 0)
+            break;
+        if ((uint32_t) GetInt32PreservedEndian(&slot[0]) != hash)
+            continue;
+        if (offset < HASH_LOG_HEADER_SIZE || offset >= table->base_end
+            || !ReadHashRecord(table->map + offset, table->base_end - offset, &record, recordPhoneSeq, &flags)
+            || !PhoneSeqTheSame(recordPhoneSeq, phoneSeq))
+            continue;
+        if (wordSeq) {
+            if (!strcmp(record.wordSeq, wordSeq))
+                return LoadBaseItem(table, &record, offset);
+        } else if (HashFindSlot(table, phoneSeq, record.wordSeq) < 0) {
+            LoadBaseItem(table, &record, offset);
+        }
+    }
     return NULL;
 }
 
-static void HashItem2String(char *str, HASH_ITEM *pItem)
+/* return the item of phoneSeq and wordSeq, removed or not, or NULL */
+static HASH_ITEM *HashLookup(HASH_TABLE *table, const uint32_t phoneSeq[], const char wordSeq[])
 {
-    int i, len;
-    char buf[FIELD_SIZE];
+    int slot;
 
-    sprintf(str, "%s ", pItem->data.wordSeq);
-    len = ueStrLen(pItem->data.wordSeq);
-    for (i = 0; i < len; i++) {
-        sprintf(buf, "%hu ", pItem->data.phoneSeq[i]);
-        strcat(str, buf);
+    slot = HashFindSlot(table, phoneSeq, wordSeq);
+    if (slot >= 0)
+        return table->entries[table->slots[slot].entry];
+    return HashFindBase(table, phoneSeq, wordSeq);
+}
+
+HASH_ITEM *HashFindPhonePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], HASH_ITEM *pItemLast)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_ITEM *pItem;
+    uint32_t hash;
+    unsigned int mask;
+    unsigned int i;
+
+    if (!table)
+        return NULL;
+
+    /* the whole cluster is in the table from the first call on */
+    if (!pItemLast)
+        HashFindBase(table, phoneSeq, NULL);
+    if (!table->slots)
+        return NULL;
+
+    hash = HashFunc(phoneSeq);
+    mask = table->slot_mask;
+    for (i = hash & mask; table->slots[i].entry >= 0; i = (i + 1) & mask) {
+        if (table->slots[i].hash != hash)
+            continue;
+        pItem = table->entries[table->slots[i].entry];
+        if (!PhoneSeqTheSame(pItem->data.phoneSeq, phoneSeq))
+            continue;
+        if (pItemLast) {
+            /* resume after pItemLast */
+            if (pItem == pItemLast)
+                pItemLast = NULL;
+            continue;
+        }
+        if (pItem->removed)
+            continue;
+        return pItem;
     }
-    sprintf(buf, "%d %d %d %d",
-            pItem->data.userfreq, pItem->data.recentTime, pItem->data.maxfreq, pItem->data.origfreq);
-    strcat(str, buf);
+    return NULL;
+}
+
+HASH_ITEM *HashFindEntry(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
+{
+    HASH_ITEM *pItem;
+
+    if (!pgdata->static_data.hash_table)
+        return NULL;
+    pItem = HashLookup(pgdata->static_data.hash_table, phoneSeq, wordSeq);
+    return pItem && !pItem->removed ? pItem : NULL;
+}
+
+/* return the item of pData, inserting a copy of pData if there is none */
+HASH_ITEM *HashInsert(ChewingData *pgdata, const UserPhraseData *pData)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_ITEM *pItem;
+    char *wordSeq;
+
+    pItem = HashLookup(table, pData->phoneSeq, pData->wordSeq);
+    if (pItem && pItem->removed) {
+        /* the phrase is back, as pData */
+        pItem->data.userfreq = pData->userfreq;
+        pItem->data.recentTime = pData->recentTime;
+        pItem->data.maxfreq = pData->maxfreq;
+        pItem->data.origfreq = pData->origfreq;
+        pItem->data.type = pData->type;
+        pItem->removed = 0;
+        ++table->phrase_count;
+    }
+    if (pItem)
+        return pItem;
+
+    wordSeq = strdup(pData->wordSeq);
+    if (!wordSeq)
+        return NULL;
+    pItem = HashInsertItem(table, pData, wordSeq, 1);
+    if (!pItem) {
+        free(wordSeq);
+        return NULL;
+    }
+    ++table->phrase_count;
+    return pItem;
+}
+
+/* the phrases of the checkpoint in its order, then the others in insertion order */
+HASH_ITEM *FindNextHash(ChewingData *pgdata, HASH_ITEM *curr)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    UserPhraseData record;
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];
+    HASH_ITEM *pItem;
+    int pos = HASH_LOG_HEADER_SIZE;
+    int entry = 0;
+    int size;
+    int flags;
+    int slot;
+
+    assert(pgdata);
+
+    if (!table)
+        return NULL;
+
+    if (curr && curr->base) {
+        pos = curr->base + GetUint16PreservedEndian(table->map + curr->base + 4);
+    } else if (curr) {
+        pos = table->base_end;
+        entry = curr->entry + 1;
+    }
+
+    for (; pos < table->base_end; pos += size) {
+        size = ReadHashRecord(table->map + pos, table->base_end - pos, &record, phoneSeq, &flags);
+        if (!size)
+            break;
+        slot = HashFindSlot(table, record.phoneSeq, record.wordSeq);
+        pItem = slot >= 0 ? table->entries[table->slots[slot].entry] : LoadBaseItem(table, &record, pos);
+        if (pItem && !pItem->removed)
+            return pItem;
+    }
+
+    for (; entry < table->entry_count; ++entry) {
+        pItem = table->entries[entry];
+        if (pItem && !pItem->base && !pItem->removed)
+            return pItem;
+    }
+    return NULL;
 }
 
 /*
@@ -198,36 +734,479 @@ static void HashItem2Binary(char *str, HASH_ITEM *pItem)
     pItem->data.wordSeq[(unsigned char) *pc] = '\0';
 }
 
-void HashModify(ChewingData *pgdata, HASH_ITEM *pItem)
+/* the name of the next checkpoint, written before it replaces uhash.dat */
+static int HashTmpName(const ChewingData *pgdata, char *tmpname, size_t size)
+{
+    int len;
+
+    len = snprintf(tmpname, size, "%s.tmp", pgdata->static_data.hashfilename);
+    return len < 0 || (size_t) len >= size ? -1 : 0;
+}
+
+static void PutHashLogHeader(unsigned char *header, int lifetime, int index, unsigned int slots, int count)
+{
+    memset(header, 0, HASH_LOG_HEADER_SIZE);
+    memcpy(header, HASH_LOG_SIG, strlen(HASH_LOG_SIG));
+    PutInt32PreservedEndian(lifetime, &header[4]);
+    PutInt32PreservedEndian(index, &header[8]);
+    PutInt32PreservedEndian(slots, &header[12]);
+    PutInt32PreservedEndian(count, &header[16]);
+    PutInt32PreservedEndian(HashChecksum(&header[8], 12), &header[20]);
+}
+
+static void FreeHashCompaction(HASH_COMPACTION *c)
+{
+    free(c->items);
+    free(c);
+}
+
+/* take the records of the items, which replace those of the checkpoint */
+static HASH_COMPACTION *NewHashCompaction(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_COMPACTION *c;
+    HASH_ITEM *pItem;
+    int size = 0;
+    int i;
+
+    c = ALC(HASH_COMPACTION, 1);
+    if (!c)
+        return NULL;
+
+    for (i = 0; i < table->entry_count; ++i) {
+        if (table->entries[i])
+            size += HashRecordSize(table->entries[i]);
+    }
+    c->items = ALC(unsigned char, size + 1);
+    if (!c->items || HashTmpName(pgdata, c->tmpname, sizeof(c->tmpname))) {
+        FreeHashCompaction(c);
+        return NULL;
+    }
+    for (i = 0; i < table->entry_count; ++i) {
+        pItem = table->entries[i];
+        if (pItem)
+            c->items_size += HashItem2Record(c->items + c->items_size, pItem, pItem->removed ? HASH_RECORD_REMOVED : 0);
+    }
+
+    c->base = table->map;
+    c->base_end = table->base_end;
+    c->base_count = table->base_count;
+    c->lifetime = pgdata->static_data.taigi_lifetime;
+    c->log_size = table->log_size;
+    c->ret = -1;
+    return c;
+}
+
+/*
+ * Write the next checkpoint to c->tmpname: the records of the checkpoint in
+ * c->base in their order, each replaced by the record of the item of the same
+ * phones and word, then the records of the other items, and the index. It may
+ * run in a thread of its own, so it reads nothing but c.
+ */
+static int WriteHashCheckpoint(HASH_COMPACTION *c)
+{
+    unsigned char header[HASH_LOG_HEADER_SIZE] = { 0 };
+    UserPhraseData record;
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];
+    HASH_SLOT *items = NULL;    /* c->items by their phones, entry is the offset of the record */
+    char *written = NULL;       /* the record of the slot of items replaced one of the checkpoint */
+    uint32_t *records = NULL;   /* hash and offset of the records written */
+    unsigned char *index = NULL;
+    const unsigned char *src;
+    FILE *outfile = NULL;
+    unsigned int mask = HASH_MIN_SLOTS - 1;
+    unsigned int slots = 0;
+    unsigned int i;
+    uint32_t hash;
+    int item_count = 0;
+    int count = 0;
+    int offset = HASH_LOG_HEADER_SIZE;
+    int pos;
+    int size;
+    int flags;
+    int ret = -1;
+
+    for (pos = 0; pos < c->items_size; pos += GetUint16PreservedEndian(&c->items[pos + 4]))
+        ++item_count;
+    while (mask + 1 < 2 * (unsigned int) item_count + 1)
+        mask = mask * 2 + 1;
+    items = ALC(HASH_SLOT, mask + 1);
+    written = ALC(char, mask + 1);
+    records = ALC(uint32_t, 2 * ((size_t) c->base_count + item_count) + 2);
+    if (!items || !written || !records)
+        goto end;
+
+    for (i = 0; i <= mask; ++i)
+        items[i].entry = -1;
+    for (pos = 0; pos < c->items_size; pos += size) {
+        size = ReadHashRecord(c->items + pos, c->items_size - pos, &record, phoneSeq, &flags);
+        if (!size)
+            break;
+        hash = HashFunc(phoneSeq);
+        i = hash & mask;
+        while (items[i].entry >= 0)
+            i = (i + 1) & mask;
+        items[i].hash = hash;
+        items[i].entry = pos;
+    }
+
+    outfile = fopen(c->tmpname, "wb");
+    if (!outfile)
+        goto end;
+
+    /* the header is written last */
+    fwrite(header, 1, sizeof(header), outfile);
+
+    for (pos = HASH_LOG_HEADER_SIZE; pos < c->base_end && count < c->base_count; pos += size) {
+        size = ReadHashRecord(c->base + pos, c->base_end - pos, &record, phoneSeq, &flags);
+        if (!size)
+            break;
+        src = c->base + pos;
+        hash = HashFunc(phoneSeq);
+        for (i = hash & mask; items[i].entry >= 0; i = (i + 1) & mask) {
+            if (items[i].hash == hash && HashRecordSameKey(c->items + items[i].entry, src)) {
+                written[i] = 1;
+                src = c->items + items[i].entry;
+                break;
+            }
+        }
+        if (src[7] & HASH_RECORD_REMOVED)
+            continue;
+        fwrite(src, 1, GetUint16PreservedEndian(&src[4]), outfile);
+        records[2 * count] = hash;
+        records[2 * count + 1] = offset;
+        offset += GetUint16PreservedEndian(&src[4]);
+        ++count;
+    }
+
+    for (pos = 0; pos < c->items_size; pos += size) {
+        src = c->items + pos;
+        size = ReadHashRecord(src, c->items_size - pos, &record, phoneSeq, &flags);
+        if (!size)
+            break;
+        hash = HashFunc(phoneSeq);
+        i = hash & mask;
+        while (items[i].entry >= 0 && items[i].entry != pos)
+            i = (i + 1) & mask;
+        if (items[i].entry < 0 || written[i] || (flags & HASH_RECORD_REMOVED))
+            continue;
+        fwrite(src, 1, size, outfile);
+        records[2 * count] = hash;
+        records[2 * count + 1] = offset;
+        offset += size;
+        ++count;
+    }
+
+    /* keep at most half of the slots of the index used */
+    if (count > 0) {
+        slots = HASH_MIN_SLOTS;
+        while (slots < 2 * (unsigned int) count)
+            slots *= 2;
+        index = ALC(unsigned char, (size_t) slots * 8);
+        if (!index)
+            goto end;
+        for (pos = 0; pos < count; ++pos) {
+            i = records[2 * pos] & (slots - 1);
+            while (GetInt32PreservedEndian(&index[(size_t) i * 8 + 4]) != 0)
+                i = (i + 1) & (slots - 1);
+            PutInt32PreservedEndian(records[2 * pos], &index[(size_t) i * 8]);
+            PutInt32PreservedEndian(records[2 * pos + 1], &index[(size_t) i * 8 + 4]);
+        }
+        fwrite(index, 1, (size_t) slots * 8, outfile);
+    }
+
+    PutHashLogHeader(header, c->lifetime, offset, slots, count);
+    if (fseek(outfile, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), outfile) == sizeof(header)
+        && !ferror(outfile) && fflush(outfile) == 0 && SyncHashFile(outfile) == 0)
+        ret = 0;
+
+  end:
+    if (outfile) {
+        if (fclose(outfile))
+            ret = -1;
+        if (ret)
+            PLAT_UNLINK(c->tmpname);
+    }
+    free(items);
+    free(written);
+    free(records);
+    free(index);
+    return ret;
+}
+
+static PLAT_THREAD_FUNC(RunHashCompaction, arg)
+{
+    HASH_COMPACTION *c = (HASH_COMPACTION *) arg;
+
+    c->ret = WriteHashCheckpoint(c);
+    PLAT_THREAD_RETURN;
+}
+
+/*
+ * Have a thread write the next checkpoint, once the replaced records
+ * outnumber the phrases. It is done once per session, as the mapping it reads
+ * stays the same until TerminateUserphrase().
+ */
+static void StartHashCompaction(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_COMPACTION *c;
+
+    if (table->compaction || table->readonly || table->record_count <= 2 * table->phrase_count + HASH_LOG_SLACK)
+        return;
+
+    c = NewHashCompaction(pgdata);
+    if (!c)
+        return;
+    table->compaction = c;
+    c->started = (plat_thread_create(&c->thread, RunHashCompaction, c) == 0);
+    if (!c->started)
+        LOG_WARN("Cannot start compacting %s", pgdata->static_data.hashfilename);
+}
+
+/* wait for the thread, and drop the next checkpoint */
+static void DiscardHashCompaction(HASH_TABLE *table)
+{
+    HASH_COMPACTION *c = table->compaction;
+
+    table->compaction = NULL;
+    if (c->started) {
+        plat_thread_join(c->thread);
+        PLAT_UNLINK(c->tmpname);
+    }
+    FreeHashCompaction(c);
+}
+
+/*
+ * Wait for the next checkpoint, and append to it the records logged since it
+ * was started. The caller replaces uhash.dat with it.
+ */
+static int FinishHashCompaction(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_COMPACTION *c = table->compaction;
+    UserPhraseData record;
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];
+    unsigned char *buf = NULL;
+    FILE *file;
+    long size = -1;
+    long pos = 0;
+    int len;
+    int flags;
+    int ret = -1;
+
+    table->compaction = NULL;
+    if (!c->started) {
+        FreeHashCompaction(c);
+        return -1;
+    }
+    plat_thread_join(c->thread);
+
+    /* the records of the dirty items would be missing */
+    if (c->ret == 0 && table->dirty_count == 0) {
+        file = fopen(pgdata->static_data.hashfilename, "rb");
+        if (file) {
+            if (fseek(file, 0, SEEK_END) == 0)
+                size = ftell(file) - c->log_size;
+            if (size >= 0 && fseek(file, c->log_size, SEEK_SET) == 0)
+                buf = ALC(unsigned char, size + 1);
+            if (buf && fread(buf, 1, size, file) != (size_t) size) {
+                free(buf);
+                buf = NULL;
+            }
+            fclose(file);
+        }
+    }
+
+    if (buf) {
+        /* up to a torn record */
+        for (pos = 0; pos < size; pos += len) {
+            len = ReadHashRecord(buf + pos, size - pos, &record, phoneSeq, &flags);
+            if (!len)
+                break;
+        }
+        file = fopen(c->tmpname, "r+b");
+        if (file) {
+            if (fseek(file, strlen(HASH_LOG_SIG), SEEK_SET) == 0
+                && fwrite(&pgdata->static_data.taigi_lifetime, 1, 4, file) == 4
+                && fseek(file, 0, SEEK_END) == 0 && fwrite(buf, 1, pos, file) == (size_t) pos
+                && fflush(file) == 0 && SyncHashFile(file) == 0)
+                ret = 0;
+            if (fclose(file))
+                ret = -1;
+        }
+    }
+
+    if (ret) {
+        LOG_ERROR("Cannot compact %s", pgdata->static_data.hashfilename);
+        PLAT_UNLINK(c->tmpname);
+    }
+    free(buf);
+    FreeHashCompaction(c);
+    return ret;
+}
+
+/* write the next checkpoint at once */
+static int CompactHashLog(ChewingData *pgdata)
+{
+    HASH_COMPACTION *c;
+    int ret;
+
+    c = NewHashCompaction(pgdata);
+    if (!c)
+        return -1;
+    ret = WriteHashCheckpoint(c);
+    if (ret)
+        LOG_ERROR("Cannot write %s", c->tmpname);
+    FreeHashCompaction(c);
+    return ret;
+}
+
+/* replace uhash.dat with the next checkpoint, which must not be mapped */
+static int ReplaceHashLog(ChewingData *pgdata)
 {
+    char tmpname[sizeof(pgdata->static_data.hashfilename) + 4];
+
+    if (HashTmpName(pgdata, tmpname, sizeof(tmpname)))
+        return -1;
+    if (PLAT_REPLACE(tmpname, pgdata->static_data.hashfilename)) {
+        LOG_ERROR("Cannot replace %s with %s", pgdata->static_data.hashfilename, tmpname);
+        PLAT_UNLINK(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Append the records of the dirty items, and of pExtra with flags if not NULL,
+ * with a single write. The items stay dirty if the write fails.
+ */
+static int AppendHashRecords(ChewingData *pgdata, HASH_ITEM *pExtra, int flags)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
     FILE *outfile;
-    char str[FIELD_SIZE + 1];
+    unsigned char *buf;
+    HASH_ITEM *pItem;
+    long offset;
+    int count = 0;
+    int len = 0;
+    int size;
+    int i;
+    int ret = -1;
+
+    if (table->dirty_count == 0 && !pExtra)
+        return 0;
+
+    /* the records after a torn one would be lost */
+    if (table->readonly)
+        return -1;
+
+    buf = ALC(unsigned char, (table->dirty_count + 1) * HASH_RECORD_MAX_SIZE);
+    if (!buf)
+        return -1;
 
     outfile = fopen(pgdata->static_data.hashfilename, "r+b");
     if (!outfile)
-        return;
+        goto end;
 
     /* update "lifetime" */
-    fseek(outfile, strlen(BIN_HASH_SIG), SEEK_SET);
+    fseek(outfile, strlen(HASH_LOG_SIG), SEEK_SET);
     fwrite(&pgdata->static_data.taigi_lifetime, 1, 4, outfile);
-    sprintf(str, "%d", pgdata->static_data.taigi_lifetime);
-    DEBUG_OUT("HashModify-1: '%-75s'\n", str);
 
-    /* update record */
-    if (pItem->item_index < 0) {
-        fseek(outfile, 0, SEEK_END);
-        pItem->item_index = (ftell(outfile) - 4 - strlen(BIN_HASH_SIG)) / FIELD_SIZE;
-    } else {
-        fseek(outfile, pItem->item_index * FIELD_SIZE + 4 + strlen(BIN_HASH_SIG), SEEK_SET);
+    fseek(outfile, 0, SEEK_END);
+    offset = ftell(outfile);
+    for (i = 0; i <= table->dirty_count; ++i) {
+        pItem = i < table->dirty_count ? table->dirty[i] : pExtra;
+        if (!pItem)
+            break;
+        size = HashItem2Record(buf + len, pItem, pItem == pExtra ? flags : 0);
+        if (!size)
+            continue;
+        pItem->item_index = offset + len;
+        len += size;
+        ++count;
     }
 
-    HashItem2String(str, pItem);
-    DEBUG_OUT("HashModify-2: '%-75s'\n", str);
-
-    HashItem2Binary(str, pItem);
-    fwrite(str, 1, FIELD_SIZE, outfile);
-    fflush(outfile);
+    if (fwrite(buf, 1, len, outfile) == (size_t) len && fflush(outfile) == 0 && SyncHashFile(outfile) == 0) {
+        for (i = 0; i < table->dirty_count; ++i)
+            table->dirty[i]->dirty = -1;
+        table->dirty_count = 0;
+        table->record_count += count;
+        table->log_size = offset + len;
+        ret = 0;
+    }
     fclose(outfile);
+
+  end:
+    free(buf);
+    return ret;
+}
+
+/* the record of pItem is appended by the next FlushHashLog() */
+void HashModify(ChewingData *pgdata, HASH_ITEM *pItem)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_ITEM **dirty;
+    int size;
+
+    if (pItem->dirty >= 0)
+        return;
+
+    if (table->dirty_count == table->dirty_size) {
+        size = table->dirty_size ? table->dirty_size * 2 : HASH_DIRTY_SIZE;
+        dirty = realloc(table->dirty, size * sizeof(HASH_ITEM *));
+        if (!dirty) {
+            /* write it now */
+            AppendHashRecords(pgdata, pItem, 0);
+            return;
+        }
+        table->dirty = dirty;
+        table->dirty_size = size;
+    }
+    pItem->dirty = table->dirty_count++;
+    table->dirty[pItem->dirty] = pItem;
+}
+
+int FlushHashLog(ChewingData *pgdata)
+{
+    int ret;
+
+    ret = AppendHashRecords(pgdata, NULL, 0);
+    if (ret == 0)
+        StartHashCompaction(pgdata);
+    return ret;
+}
+
+/* remove pItem from the table, but keep it to hide its record in the checkpoint */
+static void DropHashItem(ChewingData *pgdata, HASH_ITEM *pItem)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    int slot;
+
+    --table->phrase_count;
+    if (pItem->base) {
+        pItem->removed = 1;
+        return;
+    }
+    slot = HashFindSlot(table, pItem->data.phoneSeq, pItem->data.wordSeq);
+    if (slot >= 0)
+        FreeHashItem(pgdata, HashDeleteSlot(table, slot));
+}
+
+/* remove pItem from the log and the table */
+void HashRemove(ChewingData *pgdata, HASH_ITEM *pItem)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+
+    if (pItem->dirty >= 0) {
+        /* the removal record replaces the pending one */
+        table->dirty[pItem->dirty] = table->dirty[--table->dirty_count];
+        table->dirty[pItem->dirty]->dirty = pItem->dirty;
+        pItem->dirty = -1;
+    }
+    AppendHashRecords(pgdata, pItem, HASH_RECORD_REMOVED);
+    DropHashItem(pgdata, pItem);
+    StartHashCompaction(pgdata);
 }
 
 static int isValidChineseString(char *str)
@@ -474,106 +1453,305 @@ static int migrate_hash_to_bin(ChewingData *pgdata)
     return 1;
 }
 
-void FreeHashItem(HASH_ITEM *pItem)
+/*
+ * Apply the record at offset of the log to the table. The word of a new item
+ * stays in the mapping.
+ */
+static int ApplyHashRecord(ChewingData *pgdata, const UserPhraseData *pRecord, int flags, int offset)
 {
-    while (pItem) {
-        HASH_ITEM *next = pItem->next;
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_ITEM *pItem;
 
-        free(pItem->data.phoneSeq);
-        free(pItem->data.wordSeq);
-        free(pItem);
-        pItem = next;
+    pItem = HashLookup(table, pRecord->phoneSeq, pRecord->wordSeq);
+
+    if (flags & HASH_RECORD_REMOVED) {
+        if (pItem && !pItem->removed)
+            DropHashItem(pgdata, pItem);
+        return 0;
     }
+
+    if (pItem) {
+        /* replace the earlier record, of the same phones and word */
+        if (pItem->removed) {
+            pItem->removed = 0;
+            ++table->phrase_count;
+        }
+        pItem->data.userfreq = pRecord->userfreq;
+        pItem->data.recentTime = pRecord->recentTime;
+        pItem->data.maxfreq = pRecord->maxfreq;
+        pItem->data.origfreq = pRecord->origfreq;
+        pItem->data.type = pRecord->type;
+    } else {
+        pItem = HashInsertItem(table, pRecord, pRecord->wordSeq, 0);
+        if (!pItem)
+            return -1;
+        ++table->phrase_count;
+    }
+    pItem->item_index = offset;
+    return 0;
 }
 
-void TerminateUserphrase(ChewingData *pgdata)
+/* replay the records of the mapping from pos, up to a torn one */
+static int ReplayHashLog(ChewingData *pgdata, int pos)
 {
-    HASH_ITEM *pItem;
-    int i;
-
-    for (i = 0; i < HASH_TABLE_SIZE; ++i) {
-        pItem = pgdata->static_data.hashtable[i];
-        FreeHashItem(pItem);
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    UserPhraseData record;
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];
+    int flags;
+    int size;
+
+    for (; (size_t) pos < table->map_size; pos += size) {
+        size = ReadHashRecord(table->map + pos, table->map_size - pos, &record, phoneSeq, &flags);
+        if (!size)
+            break;
+        ++table->record_count;
+        if (ApplyHashRecord(pgdata, &record, flags, pos))
+            return -1;
     }
+    table->log_size = pos;
+    return 0;
 }
 
-int InitUserphrase(struct ChewingData *pgdata, const char *path)
+/* read uhash.dat of fixed size records, or of text, into the table */
+static int migrate_hash_to_log(ChewingData *pgdata)
 {
-    HASH_ITEM item, *pItem, *pPool = NULL;
-    int item_index, hashvalue, iret, fsize, hdrlen, oldest = INT_MAX;
+    HASH_ITEM item;
+    int item_index = 0, iret, fsize, hdrlen;
     char *dump, *seekdump;
 
-    strncpy(pgdata->static_data.hashfilename, path, sizeof(pgdata->static_data.hashfilename));
-    memset(pgdata->static_data.hashtable, 0, sizeof(pgdata->static_data.hashtable));
-
-  open_hash_file:
-    dump = _load_hash_file(pgdata->static_data.hashfilename, &fsize);
     hdrlen = strlen(BIN_HASH_SIG) + sizeof(pgdata->static_data.taigi_lifetime);
-    item_index = 0;
+    dump = _load_hash_file(pgdata->static_data.hashfilename, &fsize);
+    if (dump && fsize >= hdrlen && memcmp(dump, BIN_HASH_SIG, strlen(BIN_HASH_SIG)) != 0) {
+        /* perform migrate from text-based to binary form */
+        free(dump);
+        if (!migrate_hash_to_bin(pgdata))
+            return -1;
+        dump = _load_hash_file(pgdata->static_data.hashfilename, &fsize);
+    }
     if (dump == NULL || fsize < hdrlen) {
-        FILE *outfile;
+        free(dump);
+        return -1;
+    }
 
-        outfile = fopen(pgdata->static_data.hashfilename, "w+b");
-        if (!outfile) {
-            if (dump) {
-                free(dump);
-            }
-            return -1;
-        }
-        pgdata->static_data.taigi_lifetime = 0;
-        fwrite(BIN_HASH_SIG, 1, strlen(BIN_HASH_SIG), outfile);
-        fwrite(&pgdata->static_data.taigi_lifetime, 1, sizeof(pgdata->static_data.taigi_lifetime), outfile);
-        fclose(outfile);
-    } else {
-        if (memcmp(dump, BIN_HASH_SIG, strlen(BIN_HASH_SIG)) != 0) {
-            /* perform migrate from text-based to binary form */
-            free(dump);
-            if (!migrate_hash_to_bin(pgdata)) {
-                return -1;
-            }
-            goto open_hash_file;
+    pgdata->static_data.taigi_lifetime = *(int *) (dump + strlen(BIN_HASH_SIG));
+    seekdump = dump + hdrlen;
+    fsize -= hdrlen;
+
+    while (fsize >= FIELD_SIZE) {
+        iret = ReadHashItem_bin(seekdump, &item, item_index++);
+        seekdump += FIELD_SIZE;
+        fsize -= FIELD_SIZE;
+        /* Ignore illegal data */
+        if (iret == -1) {
+            --item_index;
+            continue;
         }
 
-        pgdata->static_data.taigi_lifetime = *(int *) (dump + strlen(BIN_HASH_SIG));
-        seekdump = dump + hdrlen;
-        fsize -= hdrlen;
-
-        while (fsize >= FIELD_SIZE) {
-            iret = ReadHashItem_bin(seekdump, &item, item_index++);
-            /* Ignore illegal data */
-            if (iret == -1) {
-                seekdump += FIELD_SIZE;
-                fsize -= FIELD_SIZE;
-                --item_index;
-                continue;
-            } else if (iret == 0)
-                break;
+        HashInsert(pgdata, &item.data);
+        free(item.data.phoneSeq);
+        free(item.data.wordSeq);
+    }
+    free(dump);
 
-            pItem = ALC(HASH_ITEM, 1);
+    return 0;
+}
 
-            memcpy(pItem, &item, sizeof(HASH_ITEM));
-            pItem->next = pPool;
-            pPool = pItem;
+/* start uhash.dat with an empty checkpoint */
+static int CreateHashLog(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    unsigned char header[HASH_LOG_HEADER_SIZE];
+    FILE *outfile;
+    int ret;
 
-            if (oldest > pItem->data.recentTime) {
-                oldest = pItem->data.recentTime;
-            }
+    pgdata->static_data.taigi_lifetime = 0;
+    PutHashLogHeader(header, 0, HASH_LOG_HEADER_SIZE, 0, 0);
+    outfile = fopen(pgdata->static_data.hashfilename, "w+b");
+    if (!outfile)
+        return -1;
+    ret = fwrite(header, 1, sizeof(header), outfile) == sizeof(header) ? 0 : -1;
+    if (fclose(outfile))
+        ret = -1;
+    table->log_size = HASH_LOG_HEADER_SIZE;
+    return ret;
+}
+
+/**
+ * Map uhash.dat, and replay the log after the checkpoint.
+ *
+ * @return 0, 1 if it is of an older format, read into the table only, or -1
+ */
+static int LoadHashLog(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    const unsigned char *buf;
+    size_t file_size;
+    size_t offset = 0;
+    unsigned int slots;
+    int index;
+    int count;
+
+    file_size = plat_mmap_create(&table->mmap, pgdata->static_data.hashfilename, FLAG_ATTRIBUTE_READ);
+    buf = file_size > 0 ? plat_mmap_set_view(&table->mmap, &offset, &file_size) : NULL;
+
+    if (!buf || file_size < HASH_LOG_V1_HEADER_SIZE) {
+        plat_mmap_close(&table->mmap);
+        return CreateHashLog(pgdata);
+    }
+    table->map = buf;
+    table->map_size = file_size;
+    pgdata->static_data.taigi_lifetime = GetInt32PreservedEndian(buf + 4);
+
+    if (memcmp(buf, HASH_LOG_V1_SIG, strlen(HASH_LOG_V1_SIG)) == 0)
+        return ReplayHashLog(pgdata, HASH_LOG_V1_HEADER_SIZE) ? -1 : 1;
+
+    if (memcmp(buf, HASH_LOG_SIG, strlen(HASH_LOG_SIG)) != 0) {
+        /* the migration renames the file, which cannot be mapped on Windows */
+        plat_mmap_close(&table->mmap);
+        table->map = NULL;
+        table->map_size = 0;
+        return migrate_hash_to_log(pgdata) ? -1 : 1;
+    }
+
+    if (file_size < HASH_LOG_HEADER_SIZE
+        || (uint32_t) GetInt32PreservedEndian(&buf[20]) != HashChecksum(&buf[8], 12)) {
+        LOG_ERROR("%s is corrupted", pgdata->static_data.hashfilename);
+        return -1;
+    }
+    index = GetInt32PreservedEndian(&buf[8]);
+    slots = GetInt32PreservedEndian(&buf[12]);
+    count = GetInt32PreservedEndian(&buf[16]);
+    if (index < HASH_LOG_HEADER_SIZE || index % 4 || count < 0 || (slots & (slots - 1))
+        || (size_t) index + (size_t) slots * 8 > file_size) {
+        LOG_ERROR("%s is corrupted", pgdata->static_data.hashfilename);
+        return -1;
+    }
+
+    if (slots) {
+        table->index = buf + index;
+        table->index_mask = slots - 1;
+    }
+    table->base_end = index;
+    table->base_count = count;
+    table->phrase_count = count;
+    table->record_count = count;
+    return ReplayHashLog(pgdata, index + slots * 8);
+}
+
+/* free the items and close the mapping, but keep the table */
+static void ClearHashTable(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    HASH_BLOCK *block;
+    int i;
+
+    if (table->compaction)
+        DiscardHashCompaction(table);
+    for (i = 0; i < table->entry_count; ++i) {
+        if (table->entries[i] && table->entries[i]->word_owned)
+            free(table->entries[i]->data.wordSeq);
+    }
+    while (table->blocks) {
+        block = table->blocks;
+        table->blocks = block->next;
+        free(block);
+    }
+    free(table->entries);
+    free(table->slots);
+    free(table->dirty);
+    plat_mmap_close(&table->mmap);
+    memset(table, 0, sizeof(*table));
+    plat_mmap_set_invalid(&table->mmap);
+}
 
-            seekdump += FIELD_SIZE;
-            fsize -= FIELD_SIZE;
+void TerminateUserphrase(ChewingData *pgdata)
+{
+    HASH_TABLE *table = pgdata->static_data.hash_table;
+    int replace = 0;
+
+    if (!table)
+        return;
+
+    AppendHashRecords(pgdata, NULL, 0);
+    if (table->compaction)
+        replace = !FinishHashCompaction(pgdata);
+
+    /* save the dirty items of a log that cannot be appended */
+    if (!replace && (table->readonly || table->dirty_count))
+        replace = !CompactHashLog(pgdata);
+
+    ClearHashTable(pgdata);
+    if (replace)
+        ReplaceHashLog(pgdata);
+    free(table);
+    pgdata->static_data.hash_table = NULL;
+}
+
+int InitUserphrase(struct ChewingData *pgdata, const char *path)
+{
+    char tmpname[sizeof(pgdata->static_data.hashfilename) + 4];
+    struct stat st;
+    HASH_TABLE *table;
+    int readonly = 0;
+    int size;
+    int ret;
+
+    strncpy(pgdata->static_data.hashfilename, path, sizeof(pgdata->static_data.hashfilename));
+    pgdata->static_data.hash_batch = 0;
+    pgdata->static_data.hash_table = NULL;
+
+    /*
+     * A checkpoint left by ReplaceHashLog() is complete if uhash.dat is gone,
+     * as an older version removed uhash.dat before renaming the new log over it.
+     */
+    if (!HashTmpName(pgdata, tmpname, sizeof(tmpname)) && stat(tmpname, &st) == 0) {
+        if (stat(pgdata->static_data.hashfilename, &st) != 0) {
+            LOG_WARN("Recover %s from %s", pgdata->static_data.hashfilename, tmpname);
+            if (PLAT_REPLACE(tmpname, pgdata->static_data.hashfilename)) {
+                LOG_ERROR("Cannot rename %s to %s", tmpname, pgdata->static_data.hashfilename);
+                return -1;
+            }
+        } else {
+            PLAT_UNLINK(tmpname);
         }
-        free(dump);
+    }
 
-        while (pPool) {
-            pItem = pPool;
-            pPool = pItem->next;
+    table = ALC(HASH_TABLE, 1);
+    if (!table)
+        return -1;
+    plat_mmap_set_invalid(&table->mmap);
+    pgdata->static_data.hash_table = table;
+
+    ret = LoadHashLog(pgdata);
+    if (ret > 0) {
+        /* write the checkpoint of the older file */
+        ret = CompactHashLog(pgdata);
+        ClearHashTable(pgdata);
+        if (ret == 0)
+            ret = ReplaceHashLog(pgdata);
+        if (ret == 0)
+            ret = LoadHashLog(pgdata);
+    }
 
-            hashvalue = HashFunc(pItem->data.phoneSeq);
-            pItem->next = pgdata->static_data.hashtable[hashvalue];
-            pgdata->static_data.hashtable[hashvalue] = pItem;
-            pItem->data.recentTime -= oldest;
+    if (ret == 0 && (size_t) table->log_size < table->map_size) {
+        /* drop the torn record, so that the next one is appended after the last valid one */
+        size = table->log_size;
+        LOG_WARN("Drop %ld bytes at the end of %s", (long) (table->map_size - size), pgdata->static_data.hashfilename);
+        /* a mapped file cannot be truncated on Windows */
+        ClearHashTable(pgdata);
+        if (TruncateHashLog(pgdata->static_data.hashfilename, size)) {
+            LOG_ERROR("Cannot truncate %s, the user phrases are saved by compacting it", pgdata->static_data.hashfilename);
+            readonly = 1;
         }
-        pgdata->static_data.taigi_lifetime -= oldest;
+        ret = LoadHashLog(pgdata);
+        table->readonly = readonly;
+    }
+
+    if (ret) {
+        ClearHashTable(pgdata);
+        free(table);
+        pgdata->static_data.hash_table = NULL;
+        return -1;
     }
     return 0;
 }
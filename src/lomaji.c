@@ -90,7 +90,7 @@ static int EndKeyProcess(ChewingData *pgdata, int key, int searchTimes)
 {
     BopomofoData *pBopomofo = &(pgdata->bopomofoData);
     uint32_t u32Pho, u32PhoAlt;
-    Phrase tempword;
+    DictIterator iter;
     int pho_inx;
 
     TRACX("##### %s, %d Start\n", __func__, __LINE__);
@@ -116,13 +116,12 @@ static int EndKeyProcess(ChewingData *pgdata, int key, int searchTimes)
 	    pBopomofo->pho_inx[len] = pho_inx;
 
     u32Pho = UintFromPhoneInx(pBopomofo->pho_inx);
-    if (GetCharFirst(pgdata, &tempword, u32Pho) == 0) {
+    if (GetCharRange(pgdata, &iter, u32Pho) == 0) {
 	TRACX("%s, %d, u32Pho=%d\n", __func__, __LINE__, u32Pho);
         BopomofoRemoveAll(pBopomofo);
         return BOPOMOFO_NO_WORD;
     }
 
-    TRACX("%s, %d, get tempword: phrase=%s, freq=%d\n", __func__ , __LINE__, tempword.phrase, tempword.freq);
     pBopomofo->phone = u32Pho;
     pBopomofo->phoneAlt = u32Pho;
     memset(pBopomofo->pho_inx, 0, sizeof(pBopomofo->pho_inx));
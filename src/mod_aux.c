@@ -19,6 +19,7 @@
 #include "global.h"
 #include "taigi-private.h"
 #include "bopomofo-private.h"
+#include "choice-private.h"
 #include "taigiio.h"
 #include "taigi-utf8-util.h"
 #include "private.h"
@@ -333,7 +334,7 @@ CHEWING_API const char *taigi_cand_String_static(ChewingContext *ctx)
     LOG_API("");
 
     if (taigi_cand_hasNext(ctx)) {
-        s = ctx->output->pci->totalChoiceStr[ctx->cand_no];
+        s = ChoiceString(pgdata, ctx->cand_no);
 	LOG_API("%s, Get: %s\n", __func__, s);
         ctx->cand_no++;
     }
@@ -21,6 +21,7 @@
 
 #        include <sys/types.h>
 #        include <errno.h>
+#        include <pthread.h>
 
 #        define PLAT_SEPARATOR "/"
 #        define PLAT_TMPDIR "/tmp"
@@ -35,6 +36,30 @@
 
 #        define PLAT_UNLINK(path) \
 	unlink(path)
+/* replace newpath with oldpath atomically, 0 on success */
+#        define PLAT_REPLACE(oldpath, newpath) \
+	rename(oldpath, newpath)
+
+#        define PLAT_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#        define plat_mutex_lock(mutex) \
+	pthread_mutex_lock(mutex)
+#        define plat_mutex_unlock(mutex) \
+	pthread_mutex_unlock(mutex)
+#        define plat_mutex_init(mutex) \
+	pthread_mutex_init(mutex, NULL)
+#        define plat_mutex_destroy(mutex) \
+	pthread_mutex_destroy(mutex)
+
+#        define PLAT_THREAD_FUNC(name, arg) \
+	void *name(void *arg)
+#        define PLAT_THREAD_RETURN \
+	return NULL
+#        define plat_thread_create(thread, func, arg) \
+	pthread_create(thread, NULL, func, arg)
+#        define plat_thread_join(thread) \
+	pthread_join(thread, NULL)
+#        define plat_cpu_count() \
+	((int) sysconf(_SC_NPROCESSORS_ONLN))
 
 /* GNU Hurd doesn't define PATH_MAX */
 #        ifndef PATH_MAX
@@ -53,6 +78,9 @@ extern "C" {
         int fAccessAttr;
     } plat_mmap;
 
+    typedef pthread_mutex_t plat_mutex;
+    typedef pthread_t plat_thread;
+
 #        ifdef __cplusplus
 }
 #        endif                  /* __cplusplus */
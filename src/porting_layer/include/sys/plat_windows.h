@@ -40,6 +40,30 @@
 	MoveFile(oldpath, newpath)
 #        define PLAT_UNLINK(path) \
 	_unlink(path)
+/* replace newpath with oldpath atomically, 0 on success */
+#        define PLAT_REPLACE(oldpath, newpath) \
+	(MoveFileEx(oldpath, newpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1)
+
+#        define PLAT_MUTEX_INITIALIZER SRWLOCK_INIT
+#        define plat_mutex_lock(mutex) \
+	AcquireSRWLockExclusive(mutex)
+#        define plat_mutex_unlock(mutex) \
+	ReleaseSRWLockExclusive(mutex)
+#        define plat_mutex_init(mutex) \
+	InitializeSRWLock(mutex)
+#        define plat_mutex_destroy(mutex) \
+	((void) (mutex))
+
+#        define PLAT_THREAD_FUNC(name, arg) \
+	DWORD WINAPI name(LPVOID arg)
+#        define PLAT_THREAD_RETURN \
+	return 0
+#        define plat_thread_create(thread, func, arg) \
+	((*(thread) = CreateThread(NULL, 0, func, arg, 0, NULL)) ? 0 : -1)
+#        define plat_thread_join(thread) \
+	(WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+#        define plat_cpu_count() \
+	((int) GetActiveProcessorCount(ALL_PROCESSOR_GROUPS))
 
 /* strtok_s is simply the Windows version of strtok_r which is standard
    everywhere else.
@@ -60,6 +84,9 @@ extern "C" {
         int fAccessAttr;
     } plat_mmap;
 
+    typedef SRWLOCK plat_mutex;
+    typedef HANDLE plat_thread;
+
 #        ifdef __cplusplus
 }
 #        endif                  /* __cplusplus */
@@ -86,6 +86,10 @@ void *plat_mmap_set_view(plat_mmap *handle, size_t * offset, size_t * sizet)
     (*offset) = ((size_t) ((*offset) / pagesize)) * pagesize;
     handle->sizet = (*sizet) = edge - (*offset);
     handle->address = mmap(0, *sizet, PROT_READ, MAP_SHARED, handle->fd, *offset);
+    if (handle->address == MAP_FAILED) {
+        /* the callers check for NULL */
+        handle->address = NULL;
+    }
 
     return handle->address;
 }
@@ -59,9 +59,10 @@ size_t plat_mmap_create(plat_mmap *handle, const char *file, int fileAccessAttr)
                                                 OPEN_EXISTING,
                                                 FILE_ATTRIBUTE_NORMAL, NULL);
 #    else                       /* !_WIN32_WCE */
+        /* uhash.dat stays mapped while the records are appended, see hash.c */
         handle->fd_file = CreateFileA(file,
                                       GENERIC_READ,
-                                      FILE_SHARE_READ,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE,
                                       NULL, OPEN_EXISTING,
                                       FILE_ATTRIBUTE_READONLY |
                                       FILE_FLAG_RANDOM_ACCESS, 0);
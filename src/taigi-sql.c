@@ -31,100 +31,56 @@
 #define LOG_VERBOSE(fmt, ...)
 #endif
 
+/* milliseconds to wait for the database locked by another connection */
+#define USERPHRASE_BUSY_TIMEOUT (500)
 
 const SqlStmtUserphrase SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_COUNT] = {
     {
-     "SELECT length, phrase, "
-     "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, "
-     "phone_6, phone_7, phone_8, phone_9, phone_10 " "FROM tailo_v1",
-     {-1, -1, -1, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12},
+     "SELECT length, phrase, phone FROM tailo_v2",
+     {-1, -1, -1, -1, 0, 1, -1, 2, -1},
      },
     {
-     "SELECT time, orig_freq, max_freq, user_freq, phrase, type "
-     "FROM tailo_v1 WHERE length = ?5 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {0, 1, 2, 3, -1, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "SELECT time, orig_freq, max_freq, user_freq FROM tailo_v2 WHERE phone = ?8 AND phrase = ?6",
+     {0, 1, 2, 3, -1, -1, -1, -1, -1},
      },
     {
-     "SELECT time, orig_freq, max_freq, user_freq "
-     "FROM tailo_v1 WHERE length = ?5 AND phrase = ?6 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {0, 1, 2, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "INSERT OR REPLACE INTO tailo_v2 ("
+     "time, orig_freq, max_freq, user_freq, length, phrase, type, phone) "
+     "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)",
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1},
      },
     {
-     "INSERT OR REPLACE INTO tailo_v1 ("
-     "time, orig_freq, max_freq, user_freq, length, phrase, type, "
-     "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, "
-     "phone_6, phone_7, phone_8, phone_9, phone_10) "
-     "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, " "?10, ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20)",
-     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-     },
-    {
-     "DELETE FROM tailo_v1 WHERE length = ?5 AND phrase = ?6 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-     },
-    {
-     "SELECT MAX(user_freq) FROM tailo_v1 WHERE length = ?5 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {-1, -1, -1, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "DELETE FROM tailo_v2 WHERE phone = ?8 AND phrase = ?6",
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1},
      },
 };
 
-
-
 const SqlStmtUserphrase SQL_STMT_USERPHRASE[STMT_USERPHRASE_COUNT] = {
     {
-     "SELECT length, phrase, "
-     "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, "
-     "phone_6, phone_7, phone_8, phone_9, phone_10 " "FROM userphrase_v1",
-     {-1, -1, -1, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12},
-     },
-    {
-     "SELECT time, orig_freq, max_freq, user_freq, phrase, type "
-     "FROM userphrase_v1 WHERE length = ?5 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {0, 1, 2, 3, -1, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "SELECT length, phrase, phone FROM userphrase_v2",
+     {-1, -1, -1, -1, 0, 1, -1, 2, -1},
      },
     {
-     "SELECT time, orig_freq, max_freq, user_freq "
-     "FROM userphrase_v1 WHERE length = ?5 AND phrase = ?6 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {0, 1, 2, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     /* both tables in one round trip, source is USERPHRASE_SOURCE_* */
+     "SELECT time, orig_freq, max_freq, user_freq, phrase, type, 0 AS source "
+     "FROM userphrase_v2 WHERE phone = ?8 UNION ALL "
+     "SELECT time, orig_freq, max_freq, user_freq, phrase, type, 1 "
+     "FROM tailo_v2 WHERE phone = ?8 ORDER BY user_freq DESC, phrase",
+     {0, 1, 2, 3, -1, 4, 5, -1, 6},
      },
     {
-     "INSERT OR REPLACE INTO userphrase_v1 ("
-     "time, orig_freq, max_freq, user_freq, length, phrase, type, "
-     "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, "
-     "phone_6, phone_7, phone_8, phone_9, phone_10) "
-     "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, " "?10, ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20)",
-     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "SELECT time, orig_freq, max_freq, user_freq FROM userphrase_v2 WHERE phone = ?8 AND phrase = ?6",
+     {0, 1, 2, 3, -1, -1, -1, -1, -1},
      },
     {
-     "DELETE FROM userphrase_v1 WHERE length = ?5 AND phrase = ?6 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "INSERT OR REPLACE INTO userphrase_v2 ("
+     "time, orig_freq, max_freq, user_freq, length, phrase, type, phone) "
+     "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)",
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1},
      },
     {
-     "SELECT MAX(user_freq) FROM userphrase_v1 WHERE length = ?5 AND "
-     "phone_0 = ?10 AND phone_1 = ?11 AND phone_2 = ?12 AND "
-     "phone_3 = ?13 AND phone_4 = ?14 AND phone_5 = ?15 AND "
-     "phone_6 = ?16 AND phone_7 = ?17 AND phone_8 = ?18 AND " "phone_9 = ?19 AND phone_10 = ?20",
-     {-1, -1, -1, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     "DELETE FROM userphrase_v2 WHERE phone = ?8 AND phrase = ?6",
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1},
      },
 };
 
@@ -174,44 +130,29 @@ static int CreateTable(ChewingData *pgdata)
 {
     int ret;
 
-    STATIC_ASSERT(MAX_PHRASE_LEN == 11);
-
    LOG_ERROR("%s, %d\n", __func__, __LINE__);
     ret = sqlite3_exec(pgdata->static_data.db,
-                       "CREATE TABLE IF NOT EXISTS userphrase_v1 ("
+                       "CREATE TABLE IF NOT EXISTS userphrase_v2 ("
                        "time INTEGER,"
                        "user_freq INTEGER,"
                        "max_freq INTEGER,"
                        "orig_freq INTEGER,"
                        "length INTEGER,"
-                       "phone_0 INTEGER,"
-                       "phone_1 INTEGER,"
-                       "phone_2 INTEGER,"
-                       "phone_3 INTEGER,"
-                       "phone_4 INTEGER,"
-                       "phone_5 INTEGER,"
-                       "phone_6 INTEGER,"
-                       "phone_7 INTEGER,"
-                       "phone_8 INTEGER,"
-                       "phone_9 INTEGER,"
-                       "phone_10 INTEGER,"
+                       "phone BLOB,"
                        "phrase TEXT,"
-		       "type INTEGER,"
-                       "PRIMARY KEY ("
-                       "phone_0,"
-                       "phone_1,"
-                       "phone_2,"
-                       "phone_3,"
-                       "phone_4,"
-                       "phone_5,"
-                       "phone_6,"
-                       "phone_7,"
-                       "phone_8,"
-                       "phone_9,"
-                       "phone_10,"
-                       "phrase)" ")", NULL, NULL, NULL);
+                       "type INTEGER,"
+                       "PRIMARY KEY (phone, phrase)" ")", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot create table userphrase_v2, error = %d", ret);
+        return -1;
+    }
+
+    /* cover SELECT_BY_PHONE so that a lookup does not read the table */
+    ret = sqlite3_exec(pgdata->static_data.db,
+                       "CREATE INDEX IF NOT EXISTS userphrase_v2_phone ON userphrase_v2 ("
+                       "phone, phrase, type, time, orig_freq, max_freq, user_freq)", NULL, NULL, NULL);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("Cannot create table userphrase_v1, error = %d", ret);
+        LOG_ERROR("Cannot create index userphrase_v2_phone, error = %d", ret);
         return -1;
     }
 
@@ -226,45 +167,153 @@ static int CreateTable(ChewingData *pgdata)
     }
 
     ret = sqlite3_exec(pgdata->static_data.db,
-                       "CREATE TABLE IF NOT EXISTS tailo_v1 ("
+                       "CREATE TABLE IF NOT EXISTS tailo_v2 ("
                        "time INTEGER,"
                        "user_freq INTEGER,"
                        "max_freq INTEGER,"
                        "orig_freq INTEGER,"
                        "length INTEGER,"
-                       "phone_0 INTEGER,"
-                       "phone_1 INTEGER,"
-                       "phone_2 INTEGER,"
-                       "phone_3 INTEGER,"
-                       "phone_4 INTEGER,"
-                       "phone_5 INTEGER,"
-                       "phone_6 INTEGER,"
-                       "phone_7 INTEGER,"
-                       "phone_8 INTEGER,"
-                       "phone_9 INTEGER,"
-                       "phone_10 INTEGER,"
+                       "phone BLOB,"
                        "phrase TEXT,"
                        "type INTEGER,"
-                       "PRIMARY KEY ("
-                       "phone_0,"
-                       "phone_1,"
-                       "phone_2,"
-                       "phone_3,"
-                       "phone_4,"
-                       "phone_5,"
-                       "phone_6,"
-                       "phone_7,"
-                       "phone_8,"
-                       "phone_9,"
-                       "phone_10,"
-                       "phrase)" ")", NULL, NULL, NULL);
+                       "PRIMARY KEY (phone, phrase)" ")", NULL, NULL, NULL);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("Cannot create table userphrase_v1, error = %d", ret);
+        LOG_ERROR("Cannot create table tailo_v2, error = %d", ret);
+        return -1;
+    }
+
+    ret = sqlite3_exec(pgdata->static_data.db,
+                       "CREATE INDEX IF NOT EXISTS tailo_v2_phone ON tailo_v2 ("
+                       "phone, phrase, type, time, orig_freq, max_freq, user_freq)", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot create index tailo_v2_phone, error = %d", ret);
         return -1;
     }
     return 0;
 }
 
+int PackPhoneBlob(unsigned char blob[], const uint32_t phoneSeq[], int len)
+{
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        blob[i * PHONE_BLOB_UNIT] = phoneSeq[i] >> 24;
+        blob[i * PHONE_BLOB_UNIT + 1] = phoneSeq[i] >> 16;
+        blob[i * PHONE_BLOB_UNIT + 2] = phoneSeq[i] >> 8;
+        blob[i * PHONE_BLOB_UNIT + 3] = phoneSeq[i];
+    }
+    return len * PHONE_BLOB_UNIT;
+}
+
+/* Return the length of the phone sequence, which is 0 terminated if room. */
+int UnpackPhoneBlob(uint32_t phoneSeq[], int max_len, const unsigned char blob[], int size)
+{
+    int len = size / PHONE_BLOB_UNIT;
+    int i;
+
+    if (len > max_len)
+        len = max_len;
+
+    for (i = 0; i < len; ++i) {
+        phoneSeq[i] = (uint32_t) blob[i * PHONE_BLOB_UNIT] << 24
+            | (uint32_t) blob[i * PHONE_BLOB_UNIT + 1] << 16
+            | (uint32_t) blob[i * PHONE_BLOB_UNIT + 2] << 8 | blob[i * PHONE_BLOB_UNIT + 3];
+    }
+    if (len < max_len)
+        phoneSeq[len] = 0;
+    return len;
+}
+
+/*
+ * Copy the rows of the v1 table of one column per phone into its v2 table by
+ * the UPSERT statement upsert, then drop the v1 table. A database without the
+ * v1 table is left as it is, and so is a v1 table failed to migrate, which
+ * is tried again next time.
+ */
+static void MigrateTableV1(ChewingData *pgdata, const char *table, sqlite3_stmt *upsert)
+{
+    char stmt[256];
+    sqlite3_stmt *select = NULL;
+    uint32_t phoneSeq[MAX_PHRASE_LEN];
+    unsigned char blob[MAX_PHRASE_LEN * PHONE_BLOB_UNIT];
+    int len;
+    int i;
+    int ret;
+
+    /* the binds of tailo_v2 are the same as userphrase_v2 */
+    STATIC_ASSERT((int) BIND_USERPHRASE_PHONE == (int) BIND_TAILOPHRASE_PHONE);
+    STATIC_ASSERT(MAX_PHRASE_LEN == 11);
+
+    assert(pgdata);
+    assert(upsert);
+
+    snprintf(stmt, sizeof(stmt),
+             "SELECT time, orig_freq, max_freq, user_freq, length, phrase, type, "
+             "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, "
+             "phone_6, phone_7, phone_8, phone_9, phone_10 FROM %s", table);
+    ret = sqlite3_prepare_v2(pgdata->static_data.db, stmt, -1, &select, NULL);
+    if (ret != SQLITE_OK) {
+        /* no such table */
+        sqlite3_finalize(select);
+        return;
+    }
+
+    LOG_INFO("Migrate %s", table);
+    ret = sqlite3_exec(pgdata->static_data.db, "BEGIN", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot begin transaction, error = %d", ret);
+        goto end;
+    }
+
+    while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+        len = sqlite3_column_int(select, 4);
+        if (len < 1 || len > MAX_PHRASE_LEN) {
+            LOG_WARN("skip row due to length = %d", len);
+            continue;
+        }
+        for (i = 0; i < len; ++i)
+            phoneSeq[i] = sqlite3_column_int(select, 7 + i);
+
+        /* column 0 ~ 6 are bound to ?1 ~ ?7 */
+        for (i = 0; i < BIND_USERPHRASE_PHONE - 1; ++i)
+            sqlite3_bind_value(upsert, i + 1, sqlite3_column_value(select, i));
+        sqlite3_bind_blob(upsert, BIND_USERPHRASE_PHONE, blob, PackPhoneBlob(blob, phoneSeq, len), SQLITE_STATIC);
+
+        ret = sqlite3_step(upsert);
+        sqlite3_reset(upsert);
+        if (ret != SQLITE_DONE) {
+            LOG_ERROR("sqlite3_step returns %d", ret);
+            goto rollback;
+        }
+    }
+    if (ret != SQLITE_DONE) {
+        LOG_ERROR("sqlite3_step returns %d", ret);
+        goto rollback;
+    }
+    sqlite3_finalize(select);
+    select = NULL;
+
+    snprintf(stmt, sizeof(stmt), "DROP TABLE %s", table);
+    ret = sqlite3_exec(pgdata->static_data.db, stmt, NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot drop table %s, error = %d", table, ret);
+        goto rollback;
+    }
+
+    ret = sqlite3_exec(pgdata->static_data.db, "COMMIT", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot commit transaction, error = %d", ret);
+        goto rollback;
+    }
+    goto end;
+
+  rollback:
+    sqlite3_exec(pgdata->static_data.db, "ROLLBACK", NULL, NULL, NULL);
+  end:
+    sqlite3_clear_bindings(upsert);
+    sqlite3_finalize(select);
+}
+
 static int SetupUserphraseLifeTime(ChewingData *pgdata)
 {
     int ret;
@@ -316,7 +365,8 @@ static int SetupUserphraseLifeTime(ChewingData *pgdata)
     pgdata->static_data.original_lifetime = sqlite3_column_int(pgdata->static_data.stmt_config[STMT_CONFIG_SELECT],
                                                                SQL_STMT_CONFIG[STMT_CONFIG_SELECT].column
                                                                [COLUMN_CONFIG_VALUE]);
-    pgdata->static_data.new_lifetime = pgdata->static_data.original_lifetime;
+    /* keep the keystrokes counted before a lazy open, see LoadUserphrase() */
+    pgdata->static_data.new_lifetime += pgdata->static_data.original_lifetime;
 
     ret = sqlite3_reset(pgdata->static_data.stmt_config[STMT_CONFIG_SELECT]);
     if (ret != SQLITE_OK) {
@@ -396,6 +446,20 @@ static int ConfigDatabase(ChewingData *pgdata)
         return -1;
     }
 
+    /* wait for the short transactions of other connections, see FlushUserphrase() */
+    ret = sqlite3_busy_timeout(pgdata->static_data.db, USERPHRASE_BUSY_TIMEOUT);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot set busy timeout, error = %d", ret);
+    }
+
+#if ENABLE_SQLITE3_WAL
+    /* not fatal, WAL does not work on some network file systems */
+    ret = sqlite3_exec(pgdata->static_data.db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot set journal_mode=WAL, error = %d", ret);
+    }
+#endif
+
     return 0;
 }
 
@@ -573,6 +637,9 @@ int InitUserphrase(ChewingData *pgdata, const char *path)
         goto error;
     }
 
+    MigrateTableV1(pgdata, "userphrase_v1", pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT]);
+    MigrateTableV1(pgdata, "tailo_v1", pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT]);
+
     ret = SetupUserphraseLifeTime(pgdata);
     if (ret) {
         LOG_ERROR("SetupUserphraseLiftTime returns %d", ret);
@@ -596,7 +663,9 @@ void TerminateUserphrase(ChewingData *pgdata)
     int ret;
 
    LOG_ERROR("%s, %d\n", __func__, __LINE__);
+    FlushUserphrase(pgdata);
     UpdateLifeTime(pgdata);
+    TerminateUserPhraseCache(pgdata);
 
     for (i = 0; i < ARRAY_SIZE(pgdata->static_data.stmt_config); ++i) {
         sqlite3_finalize(pgdata->static_data.stmt_config[i]);
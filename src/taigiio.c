@@ -24,6 +24,7 @@
 #include "userphrase-private.h"
 #include "choice-private.h"
 #include "dict-private.h"
+#include "bigram-private.h"
 #include "tree-private.h"
 #include "pinyin-private.h"
 #include "private.h"
@@ -149,6 +150,197 @@ static void NullLogger(void *data UNUSED, int level UNUSED, const char *fmt UNUS
 {
 }
 
+/* Shared data of every system data directory in use, see AcquireSharedData() */
+static ChewingSharedData *g_shared_data;
+static plat_mutex g_shared_data_lock = PLAT_MUTEX_INITIALIZER;
+
+static void TerminateSharedData(ChewingData *pgdata)
+{
+    free(pgdata->shared->symbol_path);
+    pgdata->shared->symbol_path = NULL;
+    TerminateEasySymbolTable(pgdata);
+    TerminateSymbolTable(pgdata);
+    TerminateBigram(pgdata);
+    TerminateTree(pgdata);
+    TerminateDict(pgdata);
+}
+
+static int LoadSharedData(ChewingData *pgdata, const char *search_path, int flags)
+{
+    char path[PATH_MAX];
+    int ret;
+
+    plat_mmap_set_invalid(&pgdata->shared->dict_mmap);
+    plat_mmap_set_invalid(&pgdata->shared->tree_mmap);
+    plat_mmap_set_invalid(&pgdata->shared->bigram_mmap);
+
+    ret = find_path_by_files(search_path, DICT_FILES, path, sizeof(path));
+    if (ret) {
+        LOG_ERROR("find_path_by_files returns %d", ret);
+        return -1;
+    }
+
+    ret = InitDict(pgdata, path);
+    if (ret) {
+        LOG_ERROR("InitDict returns %d", ret);
+        return -1;
+    }
+
+    ret = InitTree(pgdata, path);
+    if (ret) {
+        LOG_ERROR("InitTree returns %d", ret);
+        return -1;
+    }
+
+    ret = InitBigram(pgdata, path);
+    if (ret) {
+        LOG_ERROR("InitBigram returns %d", ret);
+        return -1;
+    }
+
+    ret = find_path_by_files(search_path, SYMBOL_TABLE_FILES, path, sizeof(path));
+    if (ret) {
+        LOG_ERROR("find_path_by_files returns %d", ret);
+        return -1;
+    }
+
+    if (flags & CHEWING_NEW_LAZY) {
+        pgdata->shared->symbol_path = strdup(path);
+        if (!pgdata->shared->symbol_path)
+            return -1;
+    } else {
+        ret = InitSymbolTable(pgdata, path);
+        if (ret) {
+            LOG_ERROR("InitSymbolTable returns %d", ret);
+            return -1;
+        }
+    }
+
+    ret = find_path_by_files(search_path, EASY_SYMBOL_FILES, path, sizeof(path));
+    if (ret) {
+        LOG_ERROR("find_path_by_files returns %d", ret);
+        return -1;
+    }
+
+    ret = InitEasySymbolInput(pgdata, path);
+    if (ret) {
+        LOG_ERROR("InitEasySymbolInput returns %d", ret);
+        return -1;
+    }
+
+    ret = find_path_by_files(search_path, PINYIN_FILES, path, sizeof(path));
+    if (ret) {
+        LOG_ERROR("find_path_by_files returns %d", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void LoadSymbolTableLocked(ChewingData *pgdata)
+{
+    int ret;
+
+    if (!pgdata->shared->symbol_path)
+        return;
+
+    ret = InitSymbolTable(pgdata, pgdata->shared->symbol_path);
+    if (ret)
+        LOG_ERROR("InitSymbolTable returns %d", ret);
+    free(pgdata->shared->symbol_path);
+    pgdata->shared->symbol_path = NULL;
+}
+
+/**
+ * @brief Load the symbol table if the context was created with
+ * CHEWING_NEW_LAZY and no context has loaded it yet.
+ */
+void LoadSymbolTable(ChewingData *pgdata)
+{
+    plat_mutex_lock(&g_shared_data_lock);
+    LoadSymbolTableLocked(pgdata);
+    plat_mutex_unlock(&g_shared_data_lock);
+}
+
+/**
+ * @brief Attach the read-only data of search_path to pgdata.
+ *
+ * The dictionary, the index and the symbol tables are loaded by the first
+ * context using search_path. Later contexts only take a reference. With
+ * CHEWING_NEW_LAZY, the symbol table is left to LoadSymbolTable().
+ *
+ * @return 0 on success, -1 when the data cannot be loaded.
+ */
+static int AcquireSharedData(ChewingData *pgdata, const char *search_path, int flags)
+{
+    ChewingSharedData *shared;
+    int ret = 0;
+
+    plat_mutex_lock(&g_shared_data_lock);
+
+    for (shared = g_shared_data; shared; shared = shared->next) {
+        if (!strcmp(shared->path, search_path))
+            break;
+    }
+
+    if (shared) {
+        ++shared->refcount;
+        pgdata->shared = shared;
+        if (!(flags & CHEWING_NEW_LAZY))
+            LoadSymbolTableLocked(pgdata);
+    } else {
+        shared = ALC(ChewingSharedData, 1);
+        if (!shared) {
+            ret = -1;
+            goto end;
+        }
+        shared->path = strdup(search_path);
+        pgdata->shared = shared;
+        if (!shared->path || LoadSharedData(pgdata, search_path, flags)) {
+            TerminateSharedData(pgdata);
+            free(shared->path);
+            free(shared);
+            pgdata->shared = NULL;
+            ret = -1;
+            goto end;
+        }
+        shared->refcount = 1;
+        shared->next = g_shared_data;
+        g_shared_data = shared;
+    }
+
+  end:
+    plat_mutex_unlock(&g_shared_data_lock);
+    return ret;
+}
+
+/**
+ * @brief Drop the reference of pgdata, and unload the shared data when it
+ * was the last one.
+ */
+static void ReleaseSharedData(ChewingData *pgdata)
+{
+    ChewingSharedData **prev;
+    ChewingSharedData *shared = pgdata->shared;
+
+    if (!shared)
+        return;
+
+    plat_mutex_lock(&g_shared_data_lock);
+
+    if (--shared->refcount == 0) {
+        for (prev = &g_shared_data; *prev != shared; prev = &(*prev)->next)
+            ;
+        *prev = shared->next;
+        TerminateSharedData(pgdata);
+        free(shared->path);
+        free(shared);
+    }
+    pgdata->shared = NULL;
+
+    plat_mutex_unlock(&g_shared_data_lock);
+}
+
 static ChewingData *allocate_ChewingData(void (*logger) (void *data, int level, const char *fmt, ...), void *loggerdata)
 {
     static const int DEFAULT_SELKEY[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9', '0' };
@@ -158,6 +350,7 @@ static ChewingData *allocate_ChewingData(void (*logger) (void *data, int level,
     if (data) {
         data->config.candPerPage = MAX_SELKEY;
         data->config.maxChiSymbolLen = MAX_CHI_SYMBOL_LEN;
+        data->phrasingBeamWidth = DEFAULT_PHRASING_BEAM;
         data->logger = logger;
         data->loggerData = loggerdata;
         memcpy(data->config.selKey, DEFAULT_SELKEY, sizeof(data->config.selKey));
@@ -169,12 +362,19 @@ static ChewingData *allocate_ChewingData(void (*logger) (void *data, int level,
 CHEWING_API ChewingContext *taigi_new2(const char *syspath,
                                          const char *userpath,
                                          void (*logger) (void *data, int level, const char *fmt, ...), void *loggerdata)
+{
+    return taigi_new3(syspath, userpath, 0, logger, loggerdata);
+}
+
+CHEWING_API ChewingContext *taigi_new3(const char *syspath,
+                                         const char *userpath,
+                                         int flags,
+                                         void (*logger) (void *data, int level, const char *fmt, ...), void *loggerdata)
 {
     ChewingContext *ctx;
     ChewingData *pgdata;
     int ret;
     char search_path[PATH_MAX + 1] = {0};
-    char path[PATH_MAX];
     char *userphrase_path = NULL;
 
     if (!logger)
@@ -208,21 +408,9 @@ CHEWING_API ChewingContext *taigi_new2(const char *syspath,
         }
     }
 
-    ret = find_path_by_files(search_path, DICT_FILES, path, sizeof(path));
+    ret = AcquireSharedData(ctx->data, search_path, flags);
     if (ret) {
-        LOG_ERROR("find_path_by_files returns %d", ret);
-        goto error;
-    }
-
-    ret = InitDict(ctx->data, path);
-    if (ret) {
-        LOG_ERROR("InitDict returns %d", ret);
-        goto error;
-    }
-
-    ret = InitTree(ctx->data, path);
-    if (ret) {
-        LOG_ERROR("InitTree returns %d", ret);
+        LOG_ERROR("AcquireSharedData returns %d", ret);
         goto error;
     }
 
@@ -232,50 +420,22 @@ CHEWING_API ChewingContext *taigi_new2(const char *syspath,
         userphrase_path = GetDefaultUserPhrasePath(ctx->data);
     }
     if (!userphrase_path) {
-        LOG_ERROR("GetUserPhraseStoragePath returns %p", path);
+        LOG_ERROR("GetUserPhraseStoragePath returns %p", userphrase_path);
         goto error;
     }
 
-    ret = InitUserphrase(ctx->data, userphrase_path);
-    free(userphrase_path);
-
-    if (ret) {
-        LOG_ERROR("InitSql returns %d", ret);
-        goto error;
+    /* LoadUserphrase() opens it on first use */
+    ctx->data->static_data.userphrase_path = userphrase_path;
+    if (!(flags & CHEWING_NEW_LAZY)) {
+        ret = LoadUserphrase(ctx->data);
+        if (ret) {
+            LOG_ERROR("LoadUserphrase returns %d", ret);
+            goto error;
+        }
     }
 
     ctx->cand_no = 0;
 
-    ret = find_path_by_files(search_path, SYMBOL_TABLE_FILES, path, sizeof(path));
-    if (ret) {
-        LOG_ERROR("find_path_by_files returns %d", ret);
-        goto error;
-    }
-
-    ret = InitSymbolTable(ctx->data, path);
-    if (ret) {
-        LOG_ERROR("InitSymbolTable returns %d", ret);
-        goto error;
-    }
-
-    ret = find_path_by_files(search_path, EASY_SYMBOL_FILES, path, sizeof(path));
-    if (ret) {
-        LOG_ERROR("find_path_by_files returns %d", ret);
-        goto error;
-    }
-
-    ret = InitEasySymbolInput(ctx->data, path);
-    if (ret) {
-        LOG_ERROR("InitEasySymbolInput returns %d", ret);
-        goto error;
-    }
-
-    ret = find_path_by_files(search_path, PINYIN_FILES, path, sizeof(path));
-    if (ret) {
-        LOG_ERROR("find_path_by_files returns %d", ret);
-        goto error;
-    }
-
     return ctx;
   error:
     taigi_delete(ctx);
@@ -312,8 +472,15 @@ static void __reset_pgdata(ChewingData *pgdata)
 CHEWING_API int taigi_Reset(ChewingContext *ctx)
 {
     ChewingData *pgdata;
+    ChewingSharedData *shared;
     ChewingStaticData static_data;
     ChewingConfigData old_config;
+    struct PhrasingCache *phrasingCache;
+    ChewingData *convertData;
+    int phrasingBeamWidth;
+#if WITH_SQLITE3
+    struct UserPhraseCache *userphraseCache;
+#endif
     void (*logger) (void *data, int level, const char *fmt, ...);
     void *loggerData;
 
@@ -324,14 +491,30 @@ CHEWING_API int taigi_Reset(ChewingContext *ctx)
 
     LOG_API("===================");
 
+    InvalidatePhrasingCache(pgdata);
+
     /* Backup old config and restore it after clearing pgdata structure. */
     old_config = pgdata->config;
+    shared = pgdata->shared;
     static_data = pgdata->static_data;
+    phrasingCache = pgdata->phrasingCache;
+    convertData = pgdata->convertData;
+    phrasingBeamWidth = pgdata->phrasingBeamWidth;
+#if WITH_SQLITE3
+    userphraseCache = pgdata->userphraseCache;
+#endif
     logger = pgdata->logger;
     loggerData = pgdata->loggerData;
     memset(pgdata, 0, sizeof(ChewingData));
     pgdata->config = old_config;
+    pgdata->shared = shared;
     pgdata->static_data = static_data;
+    pgdata->phrasingCache = phrasingCache;
+    pgdata->convertData = convertData;
+    pgdata->phrasingBeamWidth = phrasingBeamWidth;
+#if WITH_SQLITE3
+    pgdata->userphraseCache = userphraseCache;
+#endif
     pgdata->logger = logger;
     pgdata->loggerData = loggerData;
 
@@ -391,11 +574,15 @@ CHEWING_API void taigi_delete(ChewingContext *ctx)
 {
     if (ctx) {
         if (ctx->data) {
-            TerminateEasySymbolTable(ctx->data);
-            TerminateSymbolTable(ctx->data);
-            TerminateUserphrase(ctx->data);
-            TerminateTree(ctx->data);
-            TerminateDict(ctx->data);
+            if (ctx->data->static_data.userphrase_ready)
+                TerminateUserphrase(ctx->data);
+            free(ctx->data->static_data.userphrase_path);
+            TerminatePhrasingCache(ctx->data);
+            if (ctx->data->convertData) {
+                TerminatePhrasingCache(ctx->data->convertData);
+                free(ctx->data->convertData);
+            }
+            ReleaseSharedData(ctx->data);
             free(ctx->data);
         }
 
@@ -469,6 +656,35 @@ CHEWING_API int taigi_get_maxChiSymbolLen(const ChewingContext *ctx)
     return ctx->data->config.maxChiSymbolLen;
 }
 
+CHEWING_API void taigi_set_phrasingBeamWidth(ChewingContext *ctx, int n)
+{
+    ChewingData *pgdata;
+
+    if (!ctx) {
+        return;
+    }
+    pgdata = ctx->data;
+
+    LOG_API("n = %d", n);
+
+    if (MIN_PHRASING_BEAM <= n && n <= MAX_PHRASING_BEAM)
+        ctx->data->phrasingBeamWidth = n;
+}
+
+CHEWING_API int taigi_get_phrasingBeamWidth(const ChewingContext *ctx)
+{
+    const ChewingData *pgdata;
+
+    if (!ctx) {
+        return -1;
+    }
+    pgdata = ctx->data;
+
+    LOG_API("phrasingBeamWidth = %d", ctx->data->phrasingBeamWidth);
+
+    return ctx->data->phrasingBeamWidth;
+}
+
 CHEWING_API void taigi_set_selKey(ChewingContext *ctx, const int *selkeys, int len)
 {
     ChewingData *pgdata;
@@ -1921,7 +2137,12 @@ CHEWING_API int taigi_userphrase_enumerate(ChewingContext *ctx)
 
     LOG_API("");
 
+    if (LoadUserphrase(pgdata))
+        return -1;
+
 #if WITH_SQLITE3
+    /* enumerate the pending rows too */
+    FlushUserphrase(pgdata);
     assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT]);
     ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT]);
     if (ret != SQLITE_OK) {
@@ -1987,7 +2208,6 @@ CHEWING_API int taigi_userphrase_get(ChewingContext *ctx,
 #if WITH_SQLITE3
     const char *phrase;
     int length;
-    int i;
     uint32_t phone_array[MAX_PHRASE_LEN + 1] = { 0 };
 #endif
 
@@ -2016,11 +2236,11 @@ CHEWING_API int taigi_userphrase_get(ChewingContext *ctx,
         return -1;
     }
 
-    for (i = 0; i < length && i < MAX_PHRASE_LEN; ++i) {
-        phone_array[i] = sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT],
-                                            SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT].column[COLUMN_USERPHRASE_PHONE_0
-                                                                                               + i]);
-    }
+    UnpackPhoneBlob(phone_array, MAX_PHRASE_LEN,
+                    sqlite3_column_blob(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT],
+                                        SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT].column[COLUMN_USERPHRASE_PHONE]),
+                    sqlite3_column_bytes(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT],
+                                         SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT].column[COLUMN_USERPHRASE_PHONE]));
 
     strncpy(phrase_buf, phrase, phrase_len);
     BopomofoFromUintArray(bopomofo_buf, bopomofo_len, phone_array);
@@ -2137,6 +2357,10 @@ CHEWING_API int taigi_userphrase_lookup(ChewingContext *ctx, const char *phrase_
         return 0;
     }
 
+    /* the phrase may be changed by another context since it was cached */
+    if (UserSyncPhraseCache(pgdata))
+        InvalidatePhrasingCache(pgdata);
+
     user_phrase_data = UserGetPhraseFirst(pgdata, phone_buf);
     while (user_phrase_data) {
         if (phrase_buf == NULL || strcmp(phrase_buf, user_phrase_data->wordSeq) == 0)
@@ -2148,6 +2372,275 @@ CHEWING_API int taigi_userphrase_lookup(ChewingContext *ctx, const char *phrase_
     return user_phrase_data == NULL ? 0 : 1;
 }
 
+/*
+ * Let conv borrow the dictionaries and the user phrases of pgdata. conv has
+ * its own phoneSeq and phrasing cache so the editing state of pgdata is not
+ * touched.
+ */
+static void SetupConvertData(ChewingData *conv, ChewingData *pgdata)
+{
+    conv->config = pgdata->config;
+    conv->shared = pgdata->shared;
+    conv->static_data = pgdata->static_data;
+    conv->static_data.userphrase_path = NULL;
+#if WITH_SQLITE3
+    conv->userphraseCache = pgdata->userphraseCache;
+#endif
+    conv->logger = pgdata->logger;
+    conv->loggerData = pgdata->loggerData;
+    conv->nPhoneSeq = 0;
+}
+
+/*
+ * Prepare the scratch context of taigi_convert_bopomofo().
+ */
+static ChewingData *BeginConvertData(ChewingData *pgdata)
+{
+    ChewingData *conv = pgdata->convertData;
+
+    if (!conv) {
+        conv = ALC(ChewingData, 1);
+        if (!conv)
+            return NULL;
+        pgdata->convertData = conv;
+    }
+
+    /* a lazy context opens its user phrases in pgdata, not in the copy */
+    LoadUserphrase(pgdata);
+    SetupConvertData(conv, pgdata);
+
+    /* user phrases of pgdata may be changed since the last conversion */
+    InvalidatePhrasingCache(conv);
+    return conv;
+}
+
+static void EndConvertData(ChewingData *pgdata)
+{
+#if WITH_SQLITE3
+    /* the lookup cache may be created by the scratch context */
+    pgdata->userphraseCache = pgdata->convertData->userphraseCache;
+#endif
+}
+
+/*
+ * Convert bopomofo_buf with the scratch context pgdata. See
+ * taigi_convert_bopomofo() for the format.
+ */
+static int ConvertBopomofo(ChewingData *pgdata, const char *bopomofo_buf, char *phrase_buf, unsigned int phrase_len)
+{
+    static const char SEPARATOR[] = " -";
+
+    char syllable[MAX_UTF8_SIZE * BOPOMOFO_SIZE + 1];
+    const char *p;
+    size_t used = 0;
+    size_t len;
+    uint32_t phone;
+    int nSeg = 0;
+    int end;
+    int ret;
+
+    pgdata->nPhoneSeq = 0;
+    phrase_buf[0] = 0;
+    p = bopomofo_buf + strspn(bopomofo_buf, SEPARATOR);
+    while (*p || pgdata->nPhoneSeq) {
+        /*
+         * Phrase the rest at the end of input. For a full buffer, the last
+         * segment is phrased again with the syllables after it.
+         */
+        if (!*p || pgdata->nPhoneSeq == MAX_CHI_SYMBOL_LEN) {
+            end = *p ? pgdata->nPhoneSeq - 1 : pgdata->nPhoneSeq;
+            ret = PhrasingText(pgdata, phrase_buf, phrase_len, &used, &end);
+            if (ret < 0) {
+                LOG_ERROR("phrase_len %u is too small", phrase_len);
+                return -1;
+            }
+            nSeg += ret;
+            pgdata->nPhoneSeq -= end;
+            memmove(pgdata->phoneSeq, pgdata->phoneSeq + end, sizeof(pgdata->phoneSeq[0]) * pgdata->nPhoneSeq);
+            memmove(pgdata->phoneSeqAlt, pgdata->phoneSeqAlt + end,
+                    sizeof(pgdata->phoneSeqAlt[0]) * pgdata->nPhoneSeq);
+            continue;
+        }
+
+        len = strcspn(p, SEPARATOR);
+        if (len >= sizeof(syllable)) {
+            LOG_ERROR("Invalid syllable in %s", bopomofo_buf);
+            return -1;
+        }
+        memcpy(syllable, p, len);
+        syllable[len] = 0;
+
+        phone = UintFromPhone(syllable);
+        if (!phone) {
+            LOG_ERROR("Invalid syllable %s", syllable);
+            return -1;
+        }
+        pgdata->phoneSeq[pgdata->nPhoneSeq] = phone;
+        pgdata->phoneSeqAlt[pgdata->nPhoneSeq] = phone;
+        ++pgdata->nPhoneSeq;
+
+        p += len;
+        p += strspn(p, SEPARATOR);
+    }
+
+    return nSeg;
+}
+
+CHEWING_API int taigi_convert_bopomofo(ChewingContext *ctx, const char *bopomofo_buf,
+                                       char *phrase_buf, unsigned int phrase_len)
+{
+    ChewingData *pgdata;
+    ChewingData *conv;
+    int ret;
+
+    if (!ctx || !bopomofo_buf || !phrase_buf || phrase_len == 0) {
+        return -1;
+    }
+    pgdata = ctx->data;
+
+    LOG_API("bopomofo = %s", bopomofo_buf);
+
+    conv = BeginConvertData(pgdata);
+    if (!conv)
+        return -1;
+
+    ret = ConvertBopomofo(conv, bopomofo_buf, phrase_buf, phrase_len);
+    if (ret < 0)
+        phrase_buf[0] = 0;
+
+    EndConvertData(pgdata);
+    return ret;
+}
+
+typedef struct ConvertBatch {
+    /* guards next */
+    plat_mutex lock;
+    /* guards the user phrases of the caller, see tree.c */
+    plat_mutex userphrase_lock;
+    const char *const *bopomofo_list;
+    unsigned int count;
+    unsigned int next;
+    char *phrase_buf;
+    unsigned int phrase_len;
+} ConvertBatch;
+
+typedef struct ConvertWorker {
+    ChewingData data;
+    ConvertBatch *batch;
+    plat_thread thread;
+    int started;
+    unsigned int nDone;
+} ConvertWorker;
+
+/*
+ * Take CONVERT_BATCH_CHUNK inputs at a time until the batch is done. Each
+ * worker has its own ChewingData, only the user phrases are locked.
+ */
+static PLAT_THREAD_FUNC(RunConvertWorker, arg)
+{
+    ConvertWorker *worker = (ConvertWorker *) arg;
+    ConvertBatch *batch = worker->batch;
+    unsigned int from;
+    unsigned int to;
+    char *phrase_buf;
+
+    for (;;) {
+        plat_mutex_lock(&batch->lock);
+        from = batch->next;
+        to = (batch->count - from > CONVERT_BATCH_CHUNK) ? from + CONVERT_BATCH_CHUNK : batch->count;
+        batch->next = to;
+        plat_mutex_unlock(&batch->lock);
+
+        if (from >= to)
+            break;
+
+        for (; from < to; ++from) {
+            phrase_buf = batch->phrase_buf + (size_t) from * batch->phrase_len;
+            if (!batch->bopomofo_list[from]
+                || ConvertBopomofo(&worker->data, batch->bopomofo_list[from], phrase_buf, batch->phrase_len) < 0) {
+                phrase_buf[0] = 0;
+                continue;
+            }
+            ++worker->nDone;
+        }
+    }
+
+    PLAT_THREAD_RETURN;
+}
+
+CHEWING_API int taigi_convert_bopomofo_batch(ChewingContext *ctx, const char *const bopomofo_list[],
+                                             unsigned int count, char *phrase_buf, unsigned int phrase_len,
+                                             int nthread)
+{
+    ChewingData *pgdata;
+    ConvertBatch batch;
+    ConvertWorker *worker;
+    int nDone = 0;
+    int i;
+
+    if (!ctx || !bopomofo_list || !phrase_buf || phrase_len == 0) {
+        return -1;
+    }
+    pgdata = ctx->data;
+
+    LOG_API("count = %u, nthread = %d", count, nthread);
+
+    if (nthread <= 0)
+        nthread = plat_cpu_count();
+    nthread = max(1, min(nthread, MAX_CONVERT_THREAD));
+    /* no more workers than chunks */
+    if ((unsigned int) nthread > count / CONVERT_BATCH_CHUNK + 1)
+        nthread = count / CONVERT_BATCH_CHUNK + 1;
+
+    worker = ALC(ConvertWorker, nthread);
+    if (!worker)
+        return -1;
+
+    batch.bopomofo_list = bopomofo_list;
+    batch.count = count;
+    batch.next = 0;
+    batch.phrase_buf = phrase_buf;
+    batch.phrase_len = phrase_len;
+    plat_mutex_init(&batch.lock);
+    plat_mutex_init(&batch.userphrase_lock);
+
+    LoadUserphrase(pgdata);
+    for (i = 0; i < nthread; ++i) {
+        SetupConvertData(&worker[i].data, pgdata);
+        worker[i].data.userphraseLock = (nthread > 1) ? &batch.userphrase_lock : NULL;
+        worker[i].batch = &batch;
+    }
+
+    /* the calling thread is the first worker */
+    for (i = 1; i < nthread; ++i) {
+        worker[i].started = (plat_thread_create(&worker[i].thread, RunConvertWorker, &worker[i]) == 0);
+        if (!worker[i].started)
+            LOG_WARN("Cannot create worker %d", i);
+    }
+    RunConvertWorker(&worker[0]);
+
+    for (i = 0; i < nthread; ++i) {
+        if (worker[i].started)
+            plat_thread_join(worker[i].thread);
+        nDone += worker[i].nDone;
+        TerminatePhrasingCache(&worker[i].data);
+#if WITH_SQLITE3
+        /* a worker creates the lookup cache when pgdata has none */
+        if (worker[i].data.userphraseCache != pgdata->userphraseCache) {
+            if (!pgdata->userphraseCache)
+                pgdata->userphraseCache = worker[i].data.userphraseCache;
+            else
+                TerminateUserPhraseCache(&worker[i].data);
+        }
+#endif
+    }
+
+    plat_mutex_destroy(&batch.lock);
+    plat_mutex_destroy(&batch.userphrase_lock);
+    free(worker);
+    return nDone;
+}
+
 CHEWING_API const char *taigi_cand_string_by_index_static(ChewingContext *ctx, int index)
 {
     ChewingData *pgdata;
@@ -2161,7 +2654,7 @@ CHEWING_API const char *taigi_cand_string_by_index_static(ChewingContext *ctx, i
     LOG_API("index = %d", index);
 
     if (0 <= index && index < ctx->output->pci->nTotalChoice) {
-        s = ctx->output->pci->totalChoiceStr[index];
+        s = ChoiceString(pgdata, index);
     } else {
         s = "";
     }
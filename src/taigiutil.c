@@ -29,6 +29,7 @@
 #include "taigiutil.h"
 #include "bopomofo-private.h"
 #include "choice-private.h"
+#include "dict-private.h"
 #include "tree-private.h"
 #include "userphrase-private.h"
 #include "private.h"
@@ -125,14 +126,17 @@ int HaninSymbolInput(ChewingData *pgdata)
     ChoiceInfo *pci = &(pgdata->choiceInfo);
     AvailInfo *pai = &(pgdata->availInfo);
 
+    LoadSymbolTable(pgdata);
+
     /* No available symbol table */
-    if (!pgdata->static_data.symbol_table)
+    if (!pgdata->shared->symbol_table)
         return BOPOMOFO_ABSORB;
 
-    pci->nTotalChoice = 0;
-    for (i = 0; i < pgdata->static_data.n_symbol_entry; i++) {
-        strcpy(pci->totalChoiceStr[pci->nTotalChoice], pgdata->static_data.symbol_table[i]->category);
-        pci->nTotalChoice++;
+    ChoiceClear(pgdata);
+    for (i = 0; i < pgdata->shared->n_symbol_entry; i++) {
+        if (ChoiceAppend(pgdata, pgdata->shared->symbol_table[i]->category,
+                         strlen(pgdata->shared->symbol_table[i]->category)) < 0)
+            break;
     }
     pai->avail[0].len = 1;
     pai->avail[0].id = NULL;
@@ -298,15 +302,15 @@ int EasySymbolInput(int key, ChewingData *pgdata)
 
     _index = FindEasySymbolIndex(key);
     if (-1 != _index) {
-        for (loop = 0; loop < pgdata->static_data.g_easy_symbol_num[_index]; ++loop) {
-            ueStrNCpy(wordbuf, ueStrSeek(pgdata->static_data.g_easy_symbol_value[_index], loop), 1, 1);
+        for (loop = 0; loop < pgdata->shared->g_easy_symbol_num[_index]; ++loop) {
+            ueStrNCpy(wordbuf, ueStrSeek(pgdata->shared->g_easy_symbol_value[_index], loop), 1, 1);
             rtn = _Inner_InternalSpecialSymbol(key, pgdata, key, wordbuf);
         }
         return SYMBOL_KEY_OK;
     }
 
     rtn = InternalSpecialSymbol(key, pgdata, nSpecial,
-                                G_EASY_SYMBOL_KEY, (const char **) pgdata->static_data.g_easy_symbol_value);
+                                G_EASY_SYMBOL_KEY, (const char **) pgdata->shared->g_easy_symbol_value);
     if (rtn == BOPOMOFO_IGNORE)
         rtn = SpecialSymbolInput(key, pgdata);
     return (rtn == BOPOMOFO_IGNORE ? SYMBOL_KEY_ERROR : SYMBOL_KEY_OK);
@@ -319,10 +323,10 @@ int SymbolChoice(ChewingData *pgdata, int sel_i)
     int symbol_type;
     int key;
 
-    if (!pgdata->static_data.symbol_table && pgdata->choiceInfo.isSymbol != SYMBOL_CHOICE_UPDATE)
+    if (!pgdata->shared->symbol_table && pgdata->choiceInfo.isSymbol != SYMBOL_CHOICE_UPDATE)
         return BOPOMOFO_ABSORB;
 
-    if (pgdata->choiceInfo.isSymbol == SYMBOL_CATEGORY_CHOICE && 0 == pgdata->static_data.symbol_table[sel_i]->nSymbols)
+    if (pgdata->choiceInfo.isSymbol == SYMBOL_CATEGORY_CHOICE && 0 == pgdata->shared->symbol_table[sel_i]->nSymbols)
         symbol_type = SYMBOL_CHOICE_INSERT;
     else
         symbol_type = pgdata->choiceInfo.isSymbol;
@@ -333,11 +337,11 @@ int SymbolChoice(ChewingData *pgdata, int sel_i)
         AvailInfo *pai = &pgdata->availInfo;
 
         /* Display all symbols in this category */
-        pci->nTotalChoice = 0;
-        for (i = 0; i < pgdata->static_data.symbol_table[sel_i]->nSymbols; i++) {
-            ueStrNCpy(pci->totalChoiceStr[pci->nTotalChoice],
-                      pgdata->static_data.symbol_table[sel_i]->symbols[i], 1, 1);
-            pci->nTotalChoice++;
+        ChoiceClear(pgdata);
+        for (i = 0; i < pgdata->shared->symbol_table[sel_i]->nSymbols; i++) {
+            if (ChoiceAppend(pgdata, pgdata->shared->symbol_table[sel_i]->symbols[i],
+                             ueStrNBytes(pgdata->shared->symbol_table[sel_i]->symbols[i], 1)) < 0)
+                break;
         }
         pai->avail[0].len = 1;
         pai->avail[0].id = NULL;
@@ -364,11 +368,11 @@ int SymbolChoice(ChewingData *pgdata, int sel_i)
                 symbol_type = SYMBOL_CHOICE_UPDATE;
             }
         }
-        strncpy(buf->char_, pgdata->choiceInfo.totalChoiceStr[sel_i], sizeof(buf->char_) - 1);
+        strncpy(buf->char_, ChoiceString(pgdata, sel_i), sizeof(buf->char_) - 1);
         buf->category = TAIGI_SYMBOL;
 
         /* This is very strange */
-        key = FindSymbolKey(pgdata->choiceInfo.totalChoiceStr[sel_i]);
+        key = FindSymbolKey(ChoiceString(pgdata, sel_i));
         pgdata->symbolKeyBuf[pgdata->chiSymbolCursor] = key ? key : NO_SYM_KEY;
 
         pgdata->bUserArrCnnct[PhoneSeqCursor(pgdata)] = 0;
@@ -688,7 +692,7 @@ int ModifyChi(uint32_t phone, uint32_t phoneAlt, ChewingData *pgdata, int key)
     int cursor = PhoneSeqCursor(pgdata);
     char *pos;
     uint32_t offset = 0;
-    Phrase tempword;
+    DictIterator iter;
 
     if(cursor >= pgdata->chiSymbolBufLen)
 	    cursor--;
@@ -712,7 +716,7 @@ int ModifyChi(uint32_t phone, uint32_t phoneAlt, ChewingData *pgdata, int key)
     phone2 = (phone2 & 0xfffffff0) + offset; 
 
     /** Test if this Phone has words **/
-    if (GetCharFirst(pgdata, &tempword, phone2) == 0) {
+    if (GetCharRange(pgdata, &iter, phone2) == 0) {
 	printf("%s, %d, No word for such tone=%d, phone=%d\n", __func__, __LINE__, offset, phone2);
         return -1;
     }
@@ -1014,14 +1018,15 @@ int AddSelect(ChewingData *pgdata, int sel_i)
 
     /* change "selectStr" , "selectInterval" , and "nSelect" of ChewingData */
     if (pgdata->choiceInfo.totalChoiceType[sel_i] == TYPE_TAILO) {
-	    strncpy(pgdata->selectStr[nSelect], pgdata->choiceInfo.totalChoiceStr[sel_i], MAX_PHONE_SEQ_LEN * MAX_UTF8_SIZE + 1);
+	    strncpy(pgdata->selectStr[nSelect], ChoiceString(pgdata, sel_i), MAX_PHONE_SEQ_LEN * MAX_UTF8_SIZE + 1);
     } else {
-	    ueStrNCpy(pgdata->selectStr[nSelect], pgdata->choiceInfo.totalChoiceStr[sel_i], length, 1);
+	    ueStrNCpy(pgdata->selectStr[nSelect], ChoiceString(pgdata, sel_i), length, 1);
     }
     cursor = PhoneSeqCursor(pgdata);
     pgdata->selectInterval[nSelect].from = cursor;
     pgdata->selectInterval[nSelect].to = cursor + length;
     pgdata->nSelect++;
+    InvalidatePhrasingCache(pgdata);
     return 0;
 }
 
@@ -1357,10 +1362,10 @@ int OpenSymbolChoice(ChewingData *pgdata)
         ChoiceEndChoice(pgdata);
         return 0;
     }
-    pci->nTotalChoice = 0;
+    ChoiceClear(pgdata);
     for (i = 1; pBuf[i]; i++) {
-        ueStrNCpy(pci->totalChoiceStr[pci->nTotalChoice], pBuf[i], ueStrLen(pBuf[i]), 1);
-        pci->nTotalChoice++;
+        if (ChoiceAppend(pgdata, pBuf[i], ueStrNBytes(pBuf[i], ueStrLen(pBuf[i]))) < 0)
+            break;
     }
 
     pci->nChoicePerPage = pgdata->config.candPerPage;
@@ -1395,8 +1400,8 @@ int InitSymbolTable(ChewingData *pgdata, const char *prefix)
     size_t size;
     int ret = -1;
 
-    pgdata->static_data.n_symbol_entry = 0;
-    pgdata->static_data.symbol_table = NULL;
+    pgdata->shared->n_symbol_entry = 0;
+    pgdata->shared->symbol_table = NULL;
 
     ret = asprintf(&filename, "%s" PLAT_SEPARATOR "%s", prefix, SYMBOL_TABLE_FILE);
     if (ret == -1)
@@ -1416,7 +1421,7 @@ int InitSymbolTable(ChewingData *pgdata, const char *prefix)
     if (!entry)
         goto error;
 
-    while (fgets(line, LINE_LEN, file) && pgdata->static_data.n_symbol_entry < MAX_SYMBOL_ENTRY) {
+    while (fgets(line, LINE_LEN, file) && pgdata->shared->n_symbol_entry < MAX_SYMBOL_ENTRY) {
 
         category_end = strpbrk(line, "=\r\n");
         if (!category_end)
@@ -1428,44 +1433,44 @@ int InitSymbolTable(ChewingData *pgdata, const char *prefix)
             *symbols_end = 0;
             len = ueStrLen(symbols);
 
-            entry[pgdata->static_data.n_symbol_entry] =
+            entry[pgdata->shared->n_symbol_entry] =
                 (SymbolEntry *) malloc(sizeof(entry[0][0]) + sizeof(entry[0][0].symbols[0]) * len);
-            if (!entry[pgdata->static_data.n_symbol_entry])
+            if (!entry[pgdata->shared->n_symbol_entry])
                 goto error;
-            entry[pgdata->static_data.n_symbol_entry]
+            entry[pgdata->shared->n_symbol_entry]
                 ->nSymbols = len;
 
             symbol = symbols;
 
             for (i = 0; i < len; ++i) {
-                ueStrNCpy(entry[pgdata->static_data.n_symbol_entry]->symbols[i], symbol, 1, 1);
+                ueStrNCpy(entry[pgdata->shared->n_symbol_entry]->symbols[i], symbol, 1, 1);
                 // FIXME: What if symbol is combining sequences.
                 symbol += ueBytesFromChar(symbol[0]);
             }
 
 
         } else {
-            entry[pgdata->static_data.n_symbol_entry] = (SymbolEntry *) malloc(sizeof(entry[0][0]));
-            if (!entry[pgdata->static_data.n_symbol_entry])
+            entry[pgdata->shared->n_symbol_entry] = (SymbolEntry *) malloc(sizeof(entry[0][0]));
+            if (!entry[pgdata->shared->n_symbol_entry])
                 goto error;
 
-            entry[pgdata->static_data.n_symbol_entry]
+            entry[pgdata->shared->n_symbol_entry]
                 ->nSymbols = 0;
         }
 
         *category_end = 0;
-        ueStrNCpy(entry[pgdata->static_data.n_symbol_entry]->category, line, MAX_PHRASE_LEN, 1);
+        ueStrNCpy(entry[pgdata->shared->n_symbol_entry]->category, line, MAX_PHRASE_LEN, 1);
 
-        ++pgdata->static_data.n_symbol_entry;
+        ++pgdata->shared->n_symbol_entry;
     }
 
-    size = sizeof(*pgdata->static_data.symbol_table) * pgdata->static_data.n_symbol_entry;
+    size = sizeof(*pgdata->shared->symbol_table) * pgdata->shared->n_symbol_entry;
     if (!size)
         goto end;
-    pgdata->static_data.symbol_table = (SymbolEntry **) malloc(size);
-    if (!pgdata->static_data.symbol_table)
+    pgdata->shared->symbol_table = (SymbolEntry **) malloc(size);
+    if (!pgdata->shared->symbol_table)
         goto error;
-    memcpy(pgdata->static_data.symbol_table, entry, size);
+    memcpy(pgdata->shared->symbol_table, entry, size);
 
     ret = 0;
   end:
@@ -1476,7 +1481,7 @@ int InitSymbolTable(ChewingData *pgdata, const char *prefix)
     return ret;
 
   error:
-    for (i = 0; i < pgdata->static_data.n_symbol_entry; ++i) {
+    for (i = 0; i < pgdata->shared->n_symbol_entry; ++i) {
         free(entry[i]);
     }
     goto end;
@@ -1486,12 +1491,12 @@ void TerminateSymbolTable(ChewingData *pgdata)
 {
     unsigned int i;
 
-    if (pgdata->static_data.symbol_table) {
-        for (i = 0; i < pgdata->static_data.n_symbol_entry; ++i)
-            free(pgdata->static_data.symbol_table[i]);
-        free(pgdata->static_data.symbol_table);
-        pgdata->static_data.n_symbol_entry = 0;
-        pgdata->static_data.symbol_table = NULL;
+    if (pgdata->shared->symbol_table) {
+        for (i = 0; i < pgdata->shared->n_symbol_entry; ++i)
+            free(pgdata->shared->symbol_table[i]);
+        free(pgdata->shared->symbol_table);
+        pgdata->shared->n_symbol_entry = 0;
+        pgdata->shared->symbol_table = NULL;
     }
 }
 
@@ -1543,9 +1548,9 @@ int InitEasySymbolInput(ChewingData *pgdata, const char *prefix)
 
         ueStrNCpy(symbol, &line[2], len, 1);
 
-        free(pgdata->static_data.g_easy_symbol_value[_index]);
-        pgdata->static_data.g_easy_symbol_value[_index] = symbol;
-        pgdata->static_data.g_easy_symbol_num[_index] = len;
+        free(pgdata->shared->g_easy_symbol_value[_index]);
+        pgdata->shared->g_easy_symbol_value[_index] = symbol;
+        pgdata->shared->g_easy_symbol_num[_index] = len;
     }
     ret = 0;
 
@@ -1567,11 +1572,11 @@ void TerminateEasySymbolTable(ChewingData *pgdata)
     unsigned int i;
 
     for (i = 0; i < EASY_SYMBOL_KEY_TAB_LEN; ++i) {
-        if (NULL != pgdata->static_data.g_easy_symbol_value[i]) {
-            free(pgdata->static_data.g_easy_symbol_value[i]);
-            pgdata->static_data.g_easy_symbol_value[i] = NULL;
+        if (NULL != pgdata->shared->g_easy_symbol_value[i]) {
+            free(pgdata->shared->g_easy_symbol_value[i]);
+            pgdata->shared->g_easy_symbol_value[i] = NULL;
         }
-        pgdata->static_data.g_easy_symbol_num[i] = 0;
+        pgdata->shared->g_easy_symbol_num[i] = 0;
     }
 }
 
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_CONFIG_H
 #    include <config.h>
@@ -117,6 +118,7 @@ int main(int argc, char *argv[])
 {
     plat_mmap dict_mmap;
     plat_mmap tree_mmap;
+    const char *index;
 
     if (argc != 2) {
         printf(USAGE, argv[0]);
@@ -125,7 +127,11 @@ int main(int argc, char *argv[])
 
 
     dict = (const char *) read_input(argv[1], DICT_FILE, &dict_mmap);
-    root = (const TreeType *) read_input(argv[1], PHONE_TREE_FILE, &tree_mmap);
+    index = (const char *) read_input(argv[1], PHONE_TREE_FILE, &tree_mmap);
+    if (!memcmp(index, TREE_INDEX_MAGIC, strlen(TREE_INDEX_MAGIC)))
+        root = (const TreeType *) (index + GetUint32(&((const TreeIndexHeader *) index)->node_offset));
+    else
+        root = (const TreeType *) index;
 
     printf("%s, %d\n", __func__, __LINE__);
     dump(0, 0);
@@ -24,6 +24,17 @@
  *            [24-bit uint] phrase.pos; for leaf nodes (key == 0), position of phrase in dictionary
  *            [24-bit uint] phrase.freq; for leaf nodes (key == 0), frequency of the phrase
  *      }\endcode
+ *      The leaves of a node come first among its children, by descending
+ * frequency.\n
+ *      The array is preceded by a TreeIndexHeader and followed by packed keys
+ * and child ranges of all nodes, and a hash table of the characters of each
+ * syllable, see TreeIndexHeader.\n
+ *      With an optional corpus, it also outputs a table of phrase bigrams, see
+ * BigramHeader.\n
+ *      Only the characters are kept in memory. The phrases are streamed through
+ * an external merge sort, by text to write the dictionary and then by phones,
+ * and the array is written level by level from the phrases sorted by phones,
+ * so the memory used does not grow with tsi.src.\n
  */
 
 #include <assert.h>
@@ -47,14 +58,19 @@
 #define BEGIN                 "begin"
 #define END                   "end"
 #define MAX_LINE_LEN          (1024)
-#define MAX_WORD_DATA         (60000)
 #define MAX_PHRASE_BUF_LEN    (149)
-#define MAX_PHRASE_DATA       (420000)
+#define WORD_CHUNK_LEN        (4096)    /* characters allocated at a time */
+#define SORT_RUN_LEN          (1 << 16) /* phrases sorted in memory at a time */
+#define MAX_SORT_RUN          (64)      /* runs merged at a time */
+#define MAX_CORPUS_LINE_LEN   (16384)
+#define MIN_BIGRAM_COUNT      (2)
+#define BIGRAM_BONUS_PER_BIT  (500)     /* half a syllable of rule_largest_sum */
 
 const char USAGE[] =
-    "Usage: %s <phone.cin> <tsi.src>\n"
+    "Usage: %s <phone.cin> <tsi.src> [corpus]\n"
     "This program creates the following new files:\n"
-    "* " PHONE_TREE_FILE "\n\tindex to phrase file (dictionary)\n" "* " DICT_FILE "\n\tmain phrase file\n";
+    "* " PHONE_TREE_FILE "\n\tindex to phrase file (dictionary)\n" "* " DICT_FILE "\n\tmain phrase file\n"
+    "* " BIGRAM_FILE "\n\tphrase bigram table, only with corpus, a text of phrases separated by spaces\n";
 
 /* An additional pos helps avoid duplicate Chinese strings. */
 typedef struct {
@@ -70,28 +86,64 @@ typedef struct {
     int index;                  /* For stable sorting. */
 } WordData;
 
+/* A leaf of the tree, with the phones leading to it. */
+typedef struct {
+    uint32_t phone[MAX_PHRASE_LEN + 1];
+    uint32_t pos;
+    uint32_t freq;
+    uint32_t type;
+} LeafData;
+
 /*
- * Please see TreeType for data field. pFirstChild points to the first of its
- * child list. pNextSibling points to its right sibling, where it and its right
- * sibling are both in the child list of its parent. However, pNextSibling will
- * become next-pointer like linked list, which makes writing of index-tree file
- * become a sequential traversal rather than BFS.
+ * External merge sort of PhraseData. The records are collected into a run of
+ * SORT_RUN_LEN, and each full run is sorted and written to a temporary file.
+ * MAX_SORT_RUN files are merged into one when there are more, so that any
+ * number of records is sorted in bounded memory. A single run is never
+ * written.
  */
-typedef struct _tNODE {
-    TreeType data;
-    struct _tNODE *pFirstChild;
-    struct _tNODE *pNextSibling;
-} NODE;
-
-WordData word_data[MAX_WORD_DATA];
-char word_matched[MAX_WORD_DATA];
+typedef struct {
+    int (*compare) (const void *, const void *);
+    PhraseData *run;
+    size_t run_len;
+    size_t run_pos;             /* next record of run, when it is not written */
+    FILE *file[MAX_SORT_RUN];
+    PhraseData head[MAX_SORT_RUN];      /* the current record of each file */
+    int heap[MAX_SORT_RUN];     /* the files ordered by their head */
+    int heap_len;
+    int num_file;
+} PhraseSort;
+
+WordData *word_data;
+char *word_matched;
 int num_word_data = 0;
+int word_data_size = 0;
 
-PhraseData phrase_data[MAX_PHRASE_DATA];
+/* the phrases of tsi.src, sorted by text and then by phones */
+PhraseSort phrase_by_text;
+PhraseSort phrase_by_phone;
 int num_phrase_data = 0;
-int top_phrase_data = MAX_PHRASE_DATA;
 
-NODE *root;
+/*
+ * Counts of the corpus, keyed by HashPhraseString(). A pair with next 0 is the
+ * count of prev as the former phrase, and a pair with prev 0 is the count of
+ * next as the latter phrase. Count 0 marks an empty slot.
+ */
+typedef struct {
+    uint32_t prev;
+    uint32_t next;
+    uint32_t count;
+} BigramCount;
+
+BigramCount *bigram_count;
+uint32_t bigram_count_size;
+uint32_t num_bigram_count;
+uint32_t num_bigram_pair;
+uint32_t num_bigram_token;
+
+/* HashPhraseString() of each phrase in the dictionary, 0 marks an empty slot */
+uint32_t *dict_hash;
+uint32_t dict_hash_size;
+uint32_t num_dict_hash;
 
 void strip(char *line)
 {
@@ -114,17 +166,23 @@ void strip(char *line)
     }
 }
 
-/* word_data is sorted reversely, for stack-like push operation. */
+/*
+ * By phone, and then by descending frequency, so the characters of a syllable
+ * come out by descending frequency, in the order of phone.cin for a tie.
+ */
 int compare_word_by_phone(const void *x, const void *y)
 {
     const WordData *a = (const WordData *) x;
     const WordData *b = (const WordData *) y;
 
     if (a->text->phone[0] != b->text->phone[0])
-        return b->text->phone[0] - a->text->phone[0];
+        return a->text->phone[0] < b->text->phone[0] ? -1 : 1;
+
+    if (a->text->freq != b->text->freq)
+        return a->text->freq > b->text->freq ? -1 : 1;
 
     /* Compare original index for stable sort */
-    return b->index - a->index;
+    return a->index - b->index;
 }
 
 int compare_word_by_text(const void *x, const void *y)
@@ -162,6 +220,199 @@ int is_exception_phrase(PhraseData *phrase, int pos)
     return 0;
 }
 
+/* Compare phone sequences, a sequence before the longer ones it begins. */
+int compare_phone_seq(const uint32_t *a, const uint32_t *b)
+{
+    int i;
+
+    for (i = 0; i <= MAX_PHRASE_LEN; ++i) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+        if (a[i] == 0)
+            break;
+    }
+    return 0;
+}
+
+/*
+ * By phones, and then by descending frequency and descending text, which is
+ * the order of the leaves of a node.
+ */
+int compare_phrase_by_phone(const void *x, const void *y)
+{
+    const PhraseData *a = (const PhraseData *) x;
+    const PhraseData *b = (const PhraseData *) y;
+    int cmp = compare_phone_seq(a->phone, b->phone);
+
+    if (cmp)
+        return cmp;
+    if (a->freq != b->freq)
+        return a->freq > b->freq ? -1 : 1;
+    return strcmp(b->phrase, a->phrase);
+}
+
+void init_phrase_sort(PhraseSort *sort, int (*compare) (const void *, const void *))
+{
+    memset(sort, 0, sizeof(*sort));
+    sort->compare = compare;
+    sort->run = ALC(PhraseData, SORT_RUN_LEN);
+    if (!sort->run) {
+        fprintf(stderr, "Memory allocation failed on sorting phrases.\n");
+        exit(-1);
+    }
+}
+
+/* Whether the head of file a comes before the head of file b. */
+int sort_head_before(const PhraseSort *sort, int a, int b)
+{
+    int cmp = sort->compare(&sort->head[a], &sort->head[b]);
+
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+void sift_sort_heap(PhraseSort *sort, int i)
+{
+    int child;
+    int tmp;
+
+    for (child = 2 * i + 1; child < sort->heap_len; i = child, child = 2 * i + 1) {
+        if (child + 1 < sort->heap_len && sort_head_before(sort, sort->heap[child + 1], sort->heap[child]))
+            ++child;
+        if (!sort_head_before(sort, sort->heap[child], sort->heap[i]))
+            break;
+        tmp = sort->heap[i];
+        sort->heap[i] = sort->heap[child];
+        sort->heap[child] = tmp;
+    }
+}
+
+/* Rewind the files and order them by their first record. */
+void begin_sort_merge(PhraseSort *sort)
+{
+    int i;
+
+    sort->heap_len = 0;
+    for (i = 0; i < sort->num_file; ++i) {
+        rewind(sort->file[i]);
+        if (fread(&sort->head[i], sizeof(PhraseData), 1, sort->file[i]) == 1)
+            sort->heap[sort->heap_len++] = i;
+    }
+    for (i = sort->heap_len / 2 - 1; i >= 0; --i)
+        sift_sort_heap(sort, i);
+}
+
+/* Take the next record of the merged files, or return 0 at the end. */
+int next_sort_merge(PhraseSort *sort, PhraseData *phrase)
+{
+    int top;
+
+    if (sort->heap_len == 0)
+        return 0;
+
+    top = sort->heap[0];
+    *phrase = sort->head[top];
+    if (fread(&sort->head[top], sizeof(PhraseData), 1, sort->file[top]) != 1)
+        sort->heap[0] = sort->heap[--sort->heap_len];
+    sift_sort_heap(sort, 0);
+    return 1;
+}
+
+FILE *open_temp_file()
+{
+    FILE *file = tmpfile();
+
+    if (!file) {
+        fprintf(stderr, "Error opening a temporary file.\n");
+        exit(-1);
+    }
+    return file;
+}
+
+void write_temp_file(const void *data, size_t size, size_t count, FILE *file)
+{
+    if (fwrite(data, size, count, file) != count) {
+        fprintf(stderr, "Error writing a temporary file.\n");
+        exit(-1);
+    }
+}
+
+/* Merge all of the files into the first one. */
+void merge_sort_files(PhraseSort *sort)
+{
+    PhraseData phrase;
+    FILE *file = open_temp_file();
+    int i;
+
+    begin_sort_merge(sort);
+    while (next_sort_merge(sort, &phrase))
+        write_temp_file(&phrase, sizeof(phrase), 1, file);
+
+    for (i = 0; i < sort->num_file; ++i)
+        fclose(sort->file[i]);
+    sort->file[0] = file;
+    sort->num_file = 1;
+}
+
+/* Sort the run and write it to a new file. */
+void write_sort_run(PhraseSort *sort)
+{
+    FILE *file;
+
+    if (sort->num_file == MAX_SORT_RUN)
+        merge_sort_files(sort);
+
+    qsort(sort->run, sort->run_len, sizeof(PhraseData), sort->compare);
+    file = open_temp_file();
+    write_temp_file(sort->run, sizeof(PhraseData), sort->run_len, file);
+    sort->file[sort->num_file++] = file;
+    sort->run_len = 0;
+}
+
+void put_phrase_sort(PhraseSort *sort, const PhraseData *phrase)
+{
+    if (sort->run_len == SORT_RUN_LEN)
+        write_sort_run(sort);
+    sort->run[sort->run_len++] = *phrase;
+}
+
+/* Sort the records put so far, to be taken by get_phrase_sort(). */
+void end_phrase_sort(PhraseSort *sort)
+{
+    if (sort->num_file == 0) {
+        qsort(sort->run, sort->run_len, sizeof(PhraseData), sort->compare);
+        sort->run_pos = 0;
+        return;
+    }
+
+    if (sort->run_len)
+        write_sort_run(sort);
+    free(sort->run);
+    sort->run = NULL;
+    begin_sort_merge(sort);
+}
+
+/* Take the next record in order, or return 0 at the end. */
+int get_phrase_sort(PhraseSort *sort, PhraseData *phrase)
+{
+    if (sort->num_file == 0) {
+        if (sort->run_pos == sort->run_len)
+            return 0;
+        *phrase = sort->run[sort->run_pos++];
+        return 1;
+    }
+    return next_sort_merge(sort, phrase);
+}
+
+void free_phrase_sort(PhraseSort *sort)
+{
+    int i;
+
+    for (i = 0; i < sort->num_file; ++i)
+        fclose(sort->file[i]);
+    free(sort->run);
+    memset(sort, 0, sizeof(*sort));
+}
+
 void store_phrase(const char *line, int line_num)
 {
     const char DELIM[] = " \t\n";
@@ -172,6 +423,7 @@ void store_phrase(const char *line, int line_num)
     char *bopomofo;
     char bopomofo_buf[32];
     size_t phrase_len;
+    PhraseData data;
     WordData word;              /* For check. */
     WordData *found_word = NULL;
     size_t i, j;
@@ -181,10 +433,7 @@ void store_phrase(const char *line, int line_num)
     if (strlen(buf) == 0)
         return;
 
-    if (num_phrase_data >= top_phrase_data) {
-        fprintf(stderr, "Need to increase MAX_PHRASE_DATA to process\n");
-        exit(-1);
-    }
+    memset(&data, 0, sizeof(data));
 
     /* read phrase */
     phrase = strtok(buf, DELIM);
@@ -192,7 +441,7 @@ void store_phrase(const char *line, int line_num)
         fprintf(stderr, "Error reading line %d, `%s'\n", line_num, line);
         exit(-1);
     }
-    strncpy(phrase_data[num_phrase_data].phrase, phrase, sizeof(phrase_data[0].phrase) - 1);
+    strncpy(data.phrase, phrase, sizeof(data.phrase) - 1);
 
     /* read frequency */
     freq = strtok(NULL, DELIM);
@@ -201,10 +450,10 @@ void store_phrase(const char *line, int line_num)
         exit(-1);
     }
 
-    phrase_data[num_phrase_data].freq = strtoul(freq, &endptr, 0);
-    phrase_data[num_phrase_data].type = TYPE_HAN;
+    data.freq = strtoul(freq, &endptr, 0);
+    data.type = TYPE_HAN;
     if ((*freq == '\0' || *endptr != '\0') ||
-        (phrase_data[num_phrase_data].freq == UINT32_MAX && errno == ERANGE)) {
+        (data.freq == UINT32_MAX && errno == ERANGE)) {
         fprintf(stderr, "Error reading frequency `%s' in line %d, `%s'\n", freq, line_num, line);
         exit(-1);
     }
@@ -213,8 +462,8 @@ void store_phrase(const char *line, int line_num)
     for (bopomofo = strtok(NULL, DELIM), phrase_len = 0;
          bopomofo && phrase_len < MAX_PHRASE_LEN; bopomofo = strtok(NULL, DELIM), ++phrase_len) {
 
-        phrase_data[num_phrase_data].phone[phrase_len] = UintFromPhone(bopomofo);
-        if (phrase_data[num_phrase_data].phone[phrase_len] == 0) {
+        data.phone[phrase_len] = UintFromPhone(bopomofo);
+        if (data.phone[phrase_len] == 0) {
             fprintf(stderr, "Error reading bopomofo `%s' in line %d, `%s'\n", bopomofo, line_num, line);
             exit(-1);
         }
@@ -224,9 +473,9 @@ void store_phrase(const char *line, int line_num)
     }
 #if 0
     /* check phrase length & bopomofo length */
-    if ((size_t) ueStrLen(phrase_data[num_phrase_data].phrase) != phrase_len) {
+    if ((size_t) ueStrLen(data.phrase) != phrase_len) {
         fprintf(stderr, "Phrase length and bopomofo length mismatch in line %d, `%s'\n", line_num, line);
-        fprintf(stderr, "\tcalculated len=%d, recorded len=%d\n", ueStrLen(phrase_data[num_phrase_data].phrase), phrase_len);
+        fprintf(stderr, "\tcalculated len=%d, recorded len=%d\n", ueStrLen(data.phrase), phrase_len);
         exit(-1);
     }
 #endif
@@ -235,30 +484,30 @@ void store_phrase(const char *line, int line_num)
 
     assert(word.text);
     for (i = 0; i < phrase_len; ++i) {
-        ueStrNCpy(word.text->phrase, ueStrSeek(phrase_data[num_phrase_data].phrase, i), 1, 1);
-        word.text->phone[0] = phrase_data[num_phrase_data].phone[i];
+        ueStrNCpy(word.text->phrase, ueStrSeek(data.phrase, i), 1, 1);
+        word.text->phone[0] = data.phone[i];
         found_word = bsearch(&word, word_data, num_word_data, sizeof(word), compare_word_by_text);
         if ((found_word == NULL ||
              (phrase_len == 1 &&
-              word_matched[found_word - word_data])) && !is_exception_phrase(&phrase_data[num_phrase_data], i)) {
+              word_matched[found_word - word_data])) && !is_exception_phrase(&data, i)) {
 
             PhoneFromUint(bopomofo_buf, sizeof(bopomofo_buf), word.text->phone[0]);
 
             fprintf(stderr, "Error in phrase `%s'. Word `%s' has no phone %d (%s) in line %d\n",
-                    phrase_data[num_phrase_data].phrase, word.text->phrase, word.text->phone[0], bopomofo_buf,
+                    data.phrase, word.text->phrase, word.text->phone[0], bopomofo_buf,
                     line_num);
             fprintf(stderr, "\tAdd the following struct to EXCEPTION_PHRASE if this is good phrase\n\t{\"");
-            for (j = 0; j < strlen(phrase_data[num_phrase_data].phrase); ++j) {
-                fprintf(stderr, "\\x%02X", (unsigned char) phrase_data[num_phrase_data].phrase[j]);
+            for (j = 0; j < strlen(data.phrase); ++j) {
+                fprintf(stderr, "\\x%02X", (unsigned char) data.phrase[j]);
             }
-            fprintf(stderr, "\" /* %s */ , 0, {%d", phrase_data[num_phrase_data].phrase,
-                    phrase_data[num_phrase_data].phone[0]);
+            fprintf(stderr, "\" /* %s */ , 0, {%d", data.phrase,
+                    data.phone[0]);
             for (j = 1; j < phrase_len; ++j) {
-                fprintf(stderr, ", %d", phrase_data[num_phrase_data].phone[j]);
+                fprintf(stderr, ", %d", data.phone[j]);
             }
             fprintf(stderr, "} /* ");
             for (j = 0; j < phrase_len; ++j) {
-                PhoneFromUint(bopomofo_buf, sizeof(bopomofo_buf), phrase_data[num_phrase_data].phone[j]);
+                PhoneFromUint(bopomofo_buf, sizeof(bopomofo_buf), data.phone[j]);
                 fprintf(stderr, "%s ", bopomofo_buf);
             }
             fprintf(stderr, "*/, 0},\n");
@@ -267,9 +516,10 @@ void store_phrase(const char *line, int line_num)
     }
     free(word.text);
 
-    if (phrase_len >= 2)
+    if (phrase_len >= 2) {
+        put_phrase_sort(&phrase_by_text, &data);
         ++num_phrase_data;
-    else
+    } else if (found_word)
         word_matched[found_word - word_data] = 1;
 }
 
@@ -303,15 +553,49 @@ void read_tsi_src(const char *filename)
         exit(-1);
     }
 
+    word_matched = ALC(char, num_word_data + 1);
+    assert(word_matched);
+    init_phrase_sort(&phrase_by_text, compare_phrase);
+
     while (fgets(buf, sizeof(buf), tsi_src)) {
         ++line_num;
         store_phrase(buf, line_num);
     }
 
-    qsort(phrase_data, num_phrase_data, sizeof(phrase_data[0]), compare_phrase);
+    end_phrase_sort(&phrase_by_text);
     fclose(tsi_src);
 }
 
+/*
+ * Make room for word_data[num_word_data]. The texts are allocated by chunks of
+ * WORD_CHUNK_LEN, so they do not move when word_data grows.
+ */
+void alloc_word()
+{
+    static PhraseData *chunk;
+    static int chunk_used = WORD_CHUNK_LEN;
+    WordData *data;
+
+    if (num_word_data == word_data_size) {
+        word_data_size = word_data_size ? 2 * word_data_size : WORD_CHUNK_LEN;
+        data = realloc(word_data, word_data_size * sizeof(WordData));
+        if (!data) {
+            fprintf(stderr, "Memory allocation failed on reading characters.\n");
+            exit(-1);
+        }
+        word_data = data;
+    }
+    if (chunk_used == WORD_CHUNK_LEN) {
+        chunk = ALC(PhraseData, WORD_CHUNK_LEN);
+        if (!chunk) {
+            fprintf(stderr, "Memory allocation failed on reading characters.\n");
+            exit(-1);
+        }
+        chunk_used = 0;
+    }
+    word_data[num_word_data].text = &chunk[chunk_used++];
+}
+
 void store_tailo(const char *line, const int line_num)
 {
     char phone_buf[32];
@@ -324,15 +608,7 @@ void store_tailo(const char *line, const int line_num)
     if (strlen(buf) == 0)
         return;
 
-    if (num_word_data >= MAX_WORD_DATA) {
-        fprintf(stderr, "Need to increase MAX_WORD_DATA to process\n");
-        exit(-1);
-    }
-    if (top_phrase_data <= num_phrase_data) {
-        fprintf(stderr, "Need to increase MAX_PHRASE_DATA to process\n");
-        exit(-1);
-    }
-    word_data[num_word_data].text = &phrase_data[--top_phrase_data];
+    alloc_word();
 
 #define UTF8_FORMAT_STRING(len1, len2) \
     "%" __stringify(len1) "[^ ]" " " \
@@ -365,15 +641,7 @@ void store_word(const char *line, const int line_num)
     if (strlen(buf) == 0)
         return;
 
-    if (num_word_data >= MAX_WORD_DATA) {
-        fprintf(stderr, "Need to increase MAX_WORD_DATA to process\n");
-        exit(-1);
-    }
-    if (top_phrase_data <= num_phrase_data) {
-        fprintf(stderr, "Need to increase MAX_PHRASE_DATA to process\n");
-        exit(-1);
-    }
-    word_data[num_word_data].text = &phrase_data[--top_phrase_data];
+    alloc_word();
 
 #define UTF8_FORMAT_STRING(len1, len2) \
     "%" __stringify(len1) "[^ ]" " " \
@@ -516,110 +784,54 @@ void read_phone_cin(const char *filename)
     qsort(word_data, num_word_data, sizeof(word_data[0]), compare_word_no_duplicated);
 }
 
-NODE *new_node(uint32_t key)
-{
-    NODE *pnew = ALC(NODE, 1);
-
-    if (pnew == NULL) {
-        fprintf(stderr, "Memory allocation failed on constructing phrase tree.\n");
-        exit(-1);
-    }
-    memset(&pnew->data, 0, sizeof(pnew->data));
-    PutUint32(key, pnew->data.key);
-    pnew->pFirstChild = NULL;
-    pnew->pNextSibling = NULL;
-    return pnew;
-}
-
-/*
- * This function puts FindKey() and Insert() together. It first searches for the
- * specified key and performs FindKey() on hit. Otherwise, it inserts a new node
- * at proper position and returns the newly inserted child.
- */
-NODE *find_or_insert(NODE * parent, uint32_t key)
+uint32_t *find_dict_hash(uint32_t hash)
 {
-    NODE *prev = NULL;
-    NODE *p;
-    NODE *pnew;
-
-    for (p = parent->pFirstChild; p && GetUint32(p->data.key) <= key; prev = p, p = p->pNextSibling)
-        if (GetUint32(p->data.key) == key)
-            return p;
+    uint32_t i;
 
-    pnew = new_node(key);
-    pnew->pNextSibling = p;
-    if (prev == NULL)
-        parent->pFirstChild = pnew;
-    else
-        prev->pNextSibling = pnew;
-    pnew->pNextSibling = p;
-    return pnew;
-}
+    for (i = HashCharKey(hash);; ++i) {
+        uint32_t *slot = &dict_hash[i & (dict_hash_size - 1)];
 
-void insert_leaf(NODE * parent, long phr_pos, uint32_t freq, uint32_t type)
-{
-    NODE *prev = NULL;
-    NODE *p;
-    NODE *pnew;
-
-    for (p = parent->pFirstChild; p && GetUint32(p->data.key) == 0; prev = p, p = p->pNextSibling)
-        if (GetUint32(p->data.phrase.freq) <= freq)
-            break;
-
-    pnew = new_node(0);
-    PutUint32((uint32_t) phr_pos, pnew->data.phrase.pos);
-    PutUint32(freq, pnew->data.phrase.freq);
-    PutUint32(type, pnew->data.type);
-    if (prev == NULL)
-        parent->pFirstChild = pnew;
-    else
-        prev->pNextSibling = pnew;
-    pnew->pNextSibling = p;
+        if (!*slot || *slot == hash)
+            return slot;
+    }
 }
 
-void construct_phrase_tree()
+/* Add the hash of a phrase written to the dictionary, see read_bigram_corpus(). */
+void add_dict_hash(uint32_t hash)
 {
-    NODE *levelPtr;
-    int i;
-    int j;
-
-    /* First, assume that words are in order of their phones and indices. */
-    qsort(word_data, num_word_data, sizeof(word_data[0]), compare_word_by_phone);
-
-    /* Key value of root will become tree_size later. */
-    root = new_node(1);
-
-    /* Second, insert word_data as the first level of children. */
-    for (i = 0; i < num_word_data; i++) {
-        if (i == 0 || word_data[i].text->phone[0] != word_data[i - 1].text->phone[0]) {
-            levelPtr = new_node(word_data[i].text->phone[0]);
-            levelPtr->pNextSibling = root->pFirstChild;
-            root->pFirstChild = levelPtr;
+    uint32_t *old = dict_hash;
+    uint32_t old_size = dict_hash_size;
+    uint32_t *slot;
+    uint32_t i;
+
+    /* keep the load factor at most 1/2 */
+    if (2 * (num_dict_hash + 1) > dict_hash_size) {
+        dict_hash_size = dict_hash_size ? 2 * dict_hash_size : 1024;
+        dict_hash = ALC(uint32_t, dict_hash_size);
+        assert(dict_hash);
+        for (i = 0; i < old_size; ++i) {
+            if (old[i])
+                *find_dict_hash(old[i]) = old[i];
         }
-        levelPtr = new_node(0);
-        PutUint32((uint32_t) word_data[i].text->pos, levelPtr->data.phrase.pos);
-        PutUint32(word_data[i].text->freq, levelPtr->data.phrase.freq);
-        PutUint32(word_data[i].text->type, levelPtr->data.type);
-        levelPtr->pNextSibling = root->pFirstChild->pFirstChild;
-        root->pFirstChild->pFirstChild = levelPtr;
+        free(old);
     }
 
-    /* Third, insert phrases having length at least 2. */
-    for (i = 0; i < num_phrase_data; ++i) {
-        levelPtr = root;
-        for (j = 0; phrase_data[i].phone[j] != 0; ++j)
-            levelPtr = find_or_insert(levelPtr, phrase_data[i].phone[j]);
-        insert_leaf(levelPtr, phrase_data[i].pos, phrase_data[i].freq, phrase_data[i].type);
+    slot = find_dict_hash(hash);
+    if (!*slot) {
+        *slot = hash;
+        ++num_dict_hash;
     }
 }
 
 void write_phrase_data()
 {
     FILE *dict_file;
+    PhraseData phrase;
+    PhraseData last_phrase;
     PhraseData *cur_phr;
     PhraseData *last_phr = NULL;
-    int i;
-    int j;
+    int has_phrase;
+    int i = 0;
 
     dict_file = fopen(DICT_FILE, "wb");
 
@@ -628,48 +840,267 @@ void write_phrase_data()
         exit(-1);
     }
 
+    init_phrase_sort(&phrase_by_phone, compare_phrase_by_phone);
+
     /*
      * Duplicate Chinese strings with common pronunciation are detected and
      * not written into system dictionary. Written phrases are separated by
      * '\0', for convenience of mmap usage.
-     * Note: word_data and phrase_data have been qsorted by strcmp in
-     *       reading.
+     * Note: word_data and phrase_by_text have been sorted by strcmp in
+     *       reading. The phrases are passed on to phrase_by_phone with their
+     *       pos.
      */
-    for (i = j = 0; i < num_word_data || j < num_phrase_data; last_phr = cur_phr) {
-        if (i == num_word_data)
-            cur_phr = &phrase_data[j++];
-        else if (j == num_phrase_data)
-            cur_phr = word_data[i++].text;
-        else if (strcmp(word_data[i].text->phrase, phrase_data[j].phrase) < 0)
+    has_phrase = get_phrase_sort(&phrase_by_text, &phrase);
+    while (i < num_word_data || has_phrase) {
+        if (!has_phrase || (i < num_word_data && strcmp(word_data[i].text->phrase, phrase.phrase) < 0))
             cur_phr = word_data[i++].text;
         else
-            cur_phr = &phrase_data[j++];
+            cur_phr = &phrase;
 
         if (last_phr && !strcmp(cur_phr->phrase, last_phr->phrase))
             cur_phr->pos = last_phr->pos;
         else {
             cur_phr->pos = ftell(dict_file);
             fwrite(cur_phr->phrase, strlen(cur_phr->phrase) + 1, 1, dict_file);
+            add_dict_hash(HashPhraseString(cur_phr->phrase));
         }
+
+        if (cur_phr == &phrase) {
+            /* report the same phrase with the same phones */
+            if (last_phr == &last_phrase)
+                compare_phrase(&last_phrase, &phrase);
+            put_phrase_sort(&phrase_by_phone, &phrase);
+            last_phrase = phrase;
+            last_phr = &last_phrase;
+            has_phrase = get_phrase_sort(&phrase_by_text, &phrase);
+        } else
+            last_phr = cur_phr;
     }
 
     fclose(dict_file);
+    free_phrase_sort(&phrase_by_text);
+    end_phrase_sort(&phrase_by_phone);
+}
+
+/*
+ * Write the characters and the phrases to a temporary file of LeafData, sorted
+ * by phones and then in the order of the leaves of a node.
+ */
+FILE *write_leaf_file()
+{
+    FILE *leaf_file = open_temp_file();
+    PhraseData phrase;
+    const PhraseData *cur_phr;
+    LeafData leaf;
+    int has_phrase;
+    int i = 0;
+
+    qsort(word_data, num_word_data, sizeof(word_data[0]), compare_word_by_phone);
+
+    has_phrase = get_phrase_sort(&phrase_by_phone, &phrase);
+    while (i < num_word_data || has_phrase) {
+        if (!has_phrase || (i < num_word_data && compare_phone_seq(word_data[i].text->phone, phrase.phone) < 0))
+            cur_phr = word_data[i++].text;
+        else
+            cur_phr = &phrase;
+
+        /* a character without a valid phone cannot be reached in the tree */
+        if (cur_phr->phone[0] != 0) {
+            memcpy(leaf.phone, cur_phr->phone, sizeof(leaf.phone));
+            leaf.pos = (uint32_t) cur_phr->pos;
+            leaf.freq = cur_phr->freq;
+            leaf.type = cur_phr->type;
+            write_temp_file(&leaf, sizeof(leaf), 1, leaf_file);
+        }
+
+        if (cur_phr == &phrase)
+            has_phrase = get_phrase_sort(&phrase_by_phone, &phrase);
+    }
+
+    free_phrase_sort(&phrase_by_phone);
+    return leaf_file;
+}
+
+/*
+ * Write the nodes of a level of the tree to node_file, where level 1 holds the
+ * children of the root. Under the node of their first level - 1 phones, a
+ * record of level - 1 phones is a leaf, and the longer records share an
+ * internal node for each phone[level - 1]. As the records are sorted by
+ * phones, the leaves come first and the nodes are in BFS order. The child
+ * range of each node of the previous level is written to range_file, given
+ * begin, the position of the first node of this level. At level 2, chars gets
+ * the character leaves of each syllable. Return the number of nodes.
+ */
+uint32_t write_level(FILE *leaf_file, int level, uint32_t begin, FILE *node_file, FILE *range_file, TreeCharSlot *chars)
+{
+    LeafData leaf;
+    LeafData last;
+    TreeType node;
+    uint32_t range[2];
+    uint32_t count = 0;
+    uint32_t num_parent = 0;
+    int has_last = 0;
+    int len;
+
+    rewind(leaf_file);
+    while (fread(&leaf, sizeof(leaf), 1, leaf_file) == 1) {
+        for (len = 0; leaf.phone[len]; ++len)
+            ;
+        if (len < level - 1)
+            continue;
+
+        if (!has_last || memcmp(leaf.phone, last.phone, (level - 1) * sizeof(leaf.phone[0]))) {
+            if (has_last) {
+                range[1] = begin + count;
+                write_temp_file(range, sizeof(range), 1, range_file);
+            }
+            range[0] = begin + count;
+            if (level == 2) {
+                chars[num_parent].key = leaf.phone[0];
+                chars[num_parent].begin = chars[num_parent].end = begin + count;
+            }
+            ++num_parent;
+        }
+
+        memset(&node, 0, sizeof(node));
+        if (len == level - 1) {
+            PutUint32(leaf.pos, node.phrase.pos);
+            PutUint32(leaf.freq, node.phrase.freq);
+            PutUint32(leaf.type, node.type);
+            write_temp_file(&node, sizeof(node), 1, node_file);
+            ++count;
+            if (level == 2)
+                chars[num_parent - 1].end = begin + count;
+        } else if (!has_last || memcmp(leaf.phone, last.phone, level * sizeof(leaf.phone[0]))) {
+            PutUint32(leaf.phone[level - 1], node.key);
+            write_temp_file(&node, sizeof(node), 1, node_file);
+            ++count;
+        }
+
+        last = leaf;
+        has_last = 1;
+    }
+
+    if (has_last) {
+        range[1] = begin + count;
+        write_temp_file(range, sizeof(range), 1, range_file);
+    }
+    return count;
+}
+
+/* Pad the output with zeros up to the next TREE_INDEX_ALIGN boundary. */
+long write_align(FILE *output)
+{
+    static const char zero[TREE_INDEX_ALIGN];
+    long pos = ftell(output);
+    long pad = (TREE_INDEX_ALIGN - pos % TREE_INDEX_ALIGN) % TREE_INDEX_ALIGN;
+
+    fwrite(zero, 1, pad, output);
+    return pos + pad;
+}
+
+/*
+ * Write the character table: a slot for each syllable under the root with the
+ * range of its character leaves. See TreeCharSlot.
+ */
+void write_char_table(FILE *output, const TreeCharSlot *chars, uint32_t num_char)
+{
+    TreeCharSlot *slot;
+    uint32_t slot_count = 1;
+    uint32_t i;
+    uint32_t j;
+
+    /* keep the load factor at most 1/2 */
+    while (slot_count < 2 * num_char)
+        slot_count *= 2;
+    slot = ALC(TreeCharSlot, slot_count);
+    assert(slot);
+
+    for (i = 0; i < num_char; ++i) {
+        if (chars[i].begin == chars[i].end)
+            continue;
+
+        for (j = HashCharKey(chars[i].key); slot[j & (slot_count - 1)].key; ++j)
+            ;
+        slot[j & (slot_count - 1)] = chars[i];
+    }
+
+    fwrite(&slot_count, sizeof(slot_count), 1, output);
+    fwrite(slot, sizeof(TreeCharSlot), slot_count, output);
+    free(slot);
+}
+
+/*
+ * Write the versioned index: TreeIndexHeader, the TreeType nodes, the packed
+ * native-endian keys and child ranges, and the character table. See
+ * TreeIndexHeader. The nodes are read from node_file once for each section.
+ */
+void write_index_sections(FILE *output, FILE *node_file, uint32_t tree_size, const TreeCharSlot *chars,
+                          uint32_t num_char)
+{
+    TreeIndexHeader header;
+    TreeType node;
+    uint32_t key;
+    uint32_t range[2];
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TREE_INDEX_MAGIC, sizeof(header.magic));
+    PutUint32(TREE_INDEX_VERSION, &header.version);
+    header.byte_order = TREE_INDEX_BYTE_ORDER;
+    PutUint32(tree_size, &header.node_count);
+    fwrite(&header, sizeof(header), 1, output);
+
+    PutUint32(write_align(output), &header.node_offset);
+    rewind(node_file);
+    while (fread(&node, sizeof(node), 1, node_file) == 1)
+        fwrite(&node, sizeof(node), 1, output);
+
+    PutUint32(write_align(output), &header.key_offset);
+    rewind(node_file);
+    while (fread(&node, sizeof(node), 1, node_file) == 1) {
+        key = GetUint32(node.key);
+        fwrite(&key, sizeof(key), 1, output);
+    }
+
+    PutUint32(write_align(output), &header.range_offset);
+    rewind(node_file);
+    while (fread(&node, sizeof(node), 1, node_file) == 1) {
+        if (GetUint32(node.key) != 0) {
+            range[0] = GetUint32(node.child.begin);
+            range[1] = GetUint32(node.child.end);
+        } else {
+            range[0] = range[1] = 0;
+        }
+        fwrite(range, sizeof(range), 1, output);
+    }
+
+    PutUint32(write_align(output), &header.char_offset);
+    write_char_table(output, chars, num_char);
+
+    fseek(output, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, output);
+    fseek(output, 0, SEEK_END);
 }
 
 /*
- * This function performs BFS to compute child.begin and child.end of each node.
- * It sponteneously converts tree structure into a linked list. Writing the tree
- * into index file is then implemented by pure sequential traversal.
+ * The tree is written in BFS order, one level at a time by write_level(), and
+ * the child ranges of each level are filled in when the levels are joined
+ * behind the root, whose key is the tree size.
  */
 void write_index_tree()
 {
-    /* (Circular) queue implementation is hidden within this function. */
-    NODE **queue;
-    NODE *p;
-    NODE *pNext;
-    size_t head = 0, tail = 0;
-    size_t tree_size = 1;
-    size_t q_len = num_word_data + num_phrase_data + 1;
+    FILE *leaf_file;
+    FILE *node_file[MAX_PHRASE_LEN + 2];
+    FILE *range_file[MAX_PHRASE_LEN + 2];
+    FILE *tree_file;
+    TreeCharSlot *chars = NULL;
+    TreeType node;
+    uint32_t range[2];
+    uint32_t tree_size = 1;
+    uint32_t num_char = 0;
+    uint32_t count;
+    int num_level;
+    int level;
 
     FILE *output = fopen(PHONE_TREE_FILE, "wb");
 
@@ -678,53 +1109,246 @@ void write_index_tree()
         exit(-1);
     }
 
-    queue = ALC(NODE *, q_len);
-    assert(queue);
-
-    queue[head++] = root;
-    while (head != tail) {
-        p = queue[tail++];
-        if (tail >= q_len)
-            tail = 0;
-        if (GetUint32(p->data.key) != 0) {
-            PutUint32(tree_size, p->data.child.begin);
-
-            /*
-             * The latest inserted element must have a NULL
-             * pNextSibling value, and the following code let
-             * it point to the next child list to serialize
-             * them.
-             */
-            if (head == 0)
-                queue[q_len - 1]->pNextSibling = p->pFirstChild;
-            else
-                queue[head - 1]->pNextSibling = p->pFirstChild;
-
-            for (pNext = p->pFirstChild; pNext; pNext = pNext->pNextSibling) {
-                queue[head++] = pNext;
-                if (head == q_len)
-                    head = 0;
-                tree_size++;
+    leaf_file = write_leaf_file();
+
+    for (num_level = 1; num_level <= MAX_PHRASE_LEN + 1; ++num_level) {
+        node_file[num_level] = open_temp_file();
+        range_file[num_level - 1] = open_temp_file();
+        count = write_level(leaf_file, num_level, tree_size, node_file[num_level], range_file[num_level - 1], chars);
+        tree_size += count;
+        if (num_level == 1) {
+            num_char = count;
+            chars = ALC(TreeCharSlot, num_char + 1);
+            assert(chars);
+        }
+        if (count == 0 || num_level == MAX_PHRASE_LEN + 1)
+            break;
+    }
+    fclose(leaf_file);
+
+    tree_file = open_temp_file();
+    memset(&node, 0, sizeof(node));
+    PutUint32(tree_size, node.key);
+    rewind(range_file[0]);
+    if (fread(range, sizeof(range), 1, range_file[0]) != 1)
+        range[0] = range[1] = 1;
+    PutUint32(range[0], node.child.begin);
+    PutUint32(range[1], node.child.end);
+    write_temp_file(&node, sizeof(node), 1, tree_file);
+    fclose(range_file[0]);
+
+    for (level = 1; level <= num_level; ++level) {
+        rewind(node_file[level]);
+        if (level < num_level)
+            rewind(range_file[level]);
+        while (fread(&node, sizeof(node), 1, node_file[level]) == 1) {
+            if (GetUint32(node.key) != 0) {
+                if (level == num_level || fread(range, sizeof(range), 1, range_file[level]) != 1) {
+                    fprintf(stderr, "Missing children of a node in level %d.\n", level);
+                    exit(-1);
+                }
+                PutUint32(range[0], node.child.begin);
+                PutUint32(range[1], node.child.end);
+            }
+            write_temp_file(&node, sizeof(node), 1, tree_file);
+        }
+        fclose(node_file[level]);
+        if (level < num_level)
+            fclose(range_file[level]);
+    }
+
+    write_index_sections(output, tree_file, tree_size, chars, num_char);
+    fclose(tree_file);
+    free(chars);
+
+    fclose(output);
+}
+
+BigramCount *find_bigram_count(BigramCount *table, uint32_t size, uint32_t prev, uint32_t next)
+{
+    uint32_t i;
+
+    for (i = HashBigramKey(prev, next);; ++i) {
+        BigramCount *slot = &table[i & (size - 1)];
+
+        if (!slot->count || (slot->prev == prev && slot->next == next))
+            return slot;
+    }
+}
+
+void add_bigram_count(uint32_t prev, uint32_t next)
+{
+    BigramCount *old = bigram_count;
+    uint32_t old_size = bigram_count_size;
+    BigramCount *slot;
+    uint32_t i;
+
+    /* keep the load factor at most 1/2 */
+    if (2 * (num_bigram_count + 1) > bigram_count_size) {
+        bigram_count_size = bigram_count_size ? 2 * bigram_count_size : 1024;
+        bigram_count = ALC(BigramCount, bigram_count_size);
+        assert(bigram_count);
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].count)
+                *find_bigram_count(bigram_count, bigram_count_size, old[i].prev, old[i].next) = old[i];
+        }
+        free(old);
+    }
+
+    slot = find_bigram_count(bigram_count, bigram_count_size, prev, next);
+    if (!slot->count) {
+        slot->prev = prev;
+        slot->next = next;
+        ++num_bigram_count;
+        if (prev && next)
+            ++num_bigram_pair;
+    }
+    ++slot->count;
+}
+
+/*
+ * Count the pairs of adjacent phrases in the corpus. A word not in the
+ * dictionary breaks the pairs like the end of a line.
+ */
+void read_bigram_corpus(const char *filename)
+{
+    FILE *corpus;
+    char buf[MAX_CORPUS_LINE_LEN];
+    char *token;
+    uint32_t prev;
+    uint32_t next;
+    int line_num = 0;
+
+    corpus = fopen(filename, "r");
+    if (!corpus) {
+        fprintf(stderr, "Error opening the file %s\n", filename);
+        exit(-1);
+    }
+
+    while (fgets(buf, sizeof(buf), corpus)) {
+        ++line_num;
+        if (!strchr(buf, '\n') && !feof(corpus)) {
+            fprintf(stderr, "Line %d of %s is too long\n", line_num, filename);
+            exit(-1);
+        }
+
+        prev = 0;
+        for (token = strtok(buf, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+            next = HashPhraseString(token);
+            if (!dict_hash_size || !*find_dict_hash(next)) {
+                prev = 0;
+                continue;
+            }
+            if (prev) {
+                add_bigram_count(prev, next);
+                add_bigram_count(prev, 0);
+                add_bigram_count(0, next);
+                ++num_bigram_token;
             }
+            prev = next;
+        }
+    }
 
-            PutUint32(tree_size, p->data.child.end);
+    fclose(corpus);
+}
+
+/* Return log2(x) * 1024 for x >= 1. */
+int fixed_log2(double x)
+{
+    int ret = 0;
+    int bit;
+
+    while (x >= 2.0) {
+        x /= 2.0;
+        ret += 1024;
+    }
+    for (bit = 512; bit; bit >>= 1) {
+        x *= x;
+        if (x >= 2.0) {
+            x /= 2.0;
+            ret += bit;
         }
     }
-    PutUint32(tree_size, root->data.key);
+    return ret;
+}
+
+/*
+ * Return the bonus of a pair, or 0 when it is not written. Pairs seen at least
+ * MIN_BIGRAM_COUNT times and more often than by chance get
+ * BIGRAM_BONUS_PER_BIT for each bit of their pointwise mutual information.
+ */
+int get_bigram_bonus(const BigramCount *pair)
+{
+    double ratio;
+
+    if (!pair->count || !pair->prev || !pair->next || pair->count < MIN_BIGRAM_COUNT)
+        return 0;
+
+    ratio = (double) pair->count * num_bigram_token
+        / find_bigram_count(bigram_count, bigram_count_size, pair->prev, 0)->count
+        / find_bigram_count(bigram_count, bigram_count_size, 0, pair->next)->count;
+    if (ratio <= 1.0)
+        return 0;
+    return (int) ((long) fixed_log2(ratio) * BIGRAM_BONUS_PER_BIT / 1024);
+}
+
+void write_bigram()
+{
+    FILE *output;
+    BigramHeader header;
+    BigramSlot *slot;
+    uint32_t slot_count = 1;
+    uint32_t num_slot = 0;
+    uint32_t i;
+    uint32_t j;
+    int bonus;
+
+    output = fopen(BIGRAM_FILE, "wb");
+    if (!output) {
+        fprintf(stderr, "Error opening file " BIGRAM_FILE " for output.\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < bigram_count_size; ++i) {
+        if (get_bigram_bonus(&bigram_count[i]) > 0)
+            ++num_slot;
+    }
 
-    for (p = root; p; p = pNext) {
-        fwrite(&p->data, sizeof(TreeType), 1, output);
-        pNext = p->pNextSibling;
-        free(p);
+    /* keep the load factor at most 1/2 */
+    while (slot_count < 2 * num_slot)
+        slot_count *= 2;
+    slot = ALC(BigramSlot, slot_count);
+    assert(slot);
+
+    for (i = 0; i < bigram_count_size; ++i) {
+        bonus = get_bigram_bonus(&bigram_count[i]);
+        if (bonus <= 0)
+            continue;
+
+        for (j = HashBigramKey(bigram_count[i].prev, bigram_count[i].next); slot[j & (slot_count - 1)].prev; ++j)
+            ;
+        j &= slot_count - 1;
+        slot[j].prev = bigram_count[i].prev;
+        slot[j].next = bigram_count[i].next;
+        slot[j].bonus = bonus;
     }
-    free(queue);
 
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BIGRAM_MAGIC, sizeof(header.magic));
+    header.version = BIGRAM_VERSION;
+    header.byte_order = TREE_INDEX_BYTE_ORDER;
+    header.slot_count = slot_count;
+    fwrite(&header, sizeof(header), 1, output);
+    fwrite(slot, sizeof(BigramSlot), slot_count, output);
+    free(slot);
     fclose(output);
+
+    printf("%u of %u phrase pairs written to " BIGRAM_FILE "\n", num_slot, num_bigram_pair);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
+    if (argc != 3 && argc != 4) {
         printf(USAGE, argv[0]);
         return -1;
     }
@@ -736,8 +1360,10 @@ int main(int argc, char *argv[])
     printf("------- %s, %d --------\n", __func__, __LINE__);
     write_phrase_data();
     printf("------- %s, %d --------\n", __func__, __LINE__);
-    construct_phrase_tree();
-    printf("------- %s, %d --------\n", __func__, __LINE__);
     write_index_tree();
+    if (argc == 4) {
+        read_bigram_corpus(argv[3]);
+        write_bigram();
+    }
     return 0;
 }
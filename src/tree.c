@@ -27,6 +27,7 @@
 #include "global.h"
 #include "global-private.h"
 #include "dict-private.h"
+#include "bigram-private.h"
 #include "memory-private.h"
 #include "tree-private.h"
 #include "private.h"
@@ -34,7 +35,17 @@
 #include "taigiutil.h"
 #include "key2pho-private.h"
 
-#define INTERVAL_SIZE ( ( MAX_PHONE_SEQ_LEN + 1 ) * MAX_PHONE_SEQ_LEN / 2 )
+
+/* Child lists not longer than this are scanned linearly in the packed keys. */
+#define TREE_LINEAR_SEARCH_LEN (16)
+
+/* at most one interval for each row of PhrasingCache */
+#define MAX_TREE_INTERVAL (MAX_PHONE_SEQ_LEN * MAX_PHRASE_LEN)
+
+#define PHRASING_ARENA_CHUNK_SIZE (64 * 1024)
+#define PHRASING_ARENA_KEEP_CHUNKS (4)
+#define PHRASING_ARENA_ALIGN (16)
+#define PHRASING_ARENA_ROUND(size) (((size) + PHRASING_ARENA_ALIGN - 1) & ~(size_t) (PHRASING_ARENA_ALIGN - 1))
 
 #ifndef LOG_API_TREE
 #undef LOG_API
@@ -48,6 +59,7 @@
 typedef struct PhraseIntervalType {
     int from, to, source;
     Phrase *p_phr;
+    unsigned int serial;        /* identifies p_phr across Phrasing() calls */
 } PhraseIntervalType;
 
 typedef struct RecordNode {
@@ -57,15 +69,134 @@ typedef struct RecordNode {
     int nMatchCnnct;            /* match how many Cnnct. */
 } RecordNode;
 
+typedef struct PhrasingArenaChunk {
+    struct PhrasingArenaChunk *next;
+    size_t size;
+    size_t used;
+} PhrasingArenaChunk;
+
+/*
+ * Bump allocator for the records of one Phrasing() call. Nothing is freed
+ * one by one; ResetPhrasingArena() rewinds all chunks at the end of the call
+ * and keeps them, so a steady stream of keystrokes does not touch the heap.
+ */
+typedef struct PhrasingArena {
+    PhrasingArenaChunk *head;
+    PhrasingArenaChunk *cur;
+} PhrasingArena;
+
 typedef struct TreeDataType {
     int leftmost[MAX_PHONE_SEQ_LEN + 1];
-    char graph[MAX_PHONE_SEQ_LEN + 1][MAX_PHONE_SEQ_LEN + 1];
-    PhraseIntervalType interval[MAX_INTERVAL];
+    PhraseIntervalType interval[MAX_TREE_INTERVAL];
     int nInterval;
     RecordNode *phList;
     int nPhListLen;
+    PhrasingArena *arena;
 } TreeDataType;
 
+/*
+ * Intervals found by FindInterval and the DP table of DoDpPhrasing, kept
+ * between keystrokes. Rows are indexed by the beginning of an interval and
+ * its length, so a row is found by FindIntervalRow in one pass. The phone
+ * sequence and breakpoints of the last call decide which rows are still
+ * valid; Phrase objects are owned by the rows and recycled through
+ * freePhrase, and the highest score records live in scoreNode.
+ */
+typedef struct PhrasingCache {
+    int valid;
+    unsigned int serial;
+    uint32_t phoneSeq[MAX_PHONE_SEQ_LEN];
+    int bArrBrkpt[MAX_PHONE_SEQ_LEN + 1];
+    int nPhoneSeq;
+    IntervalType selectInterval[MAX_PHONE_SEQ_LEN];
+    int nSelect;
+    PhraseIntervalType row[MAX_PHONE_SEQ_LEN][MAX_PHRASE_LEN];
+
+    /* input of the last DoDpPhrasing and its highest score records */
+    PhraseIntervalType dpInterval[MAX_TREE_INTERVAL];
+    int nDpInterval;
+    RecordNode *highest_score[MAX_PHONE_SEQ_LEN];
+    RecordNode scoreNode[MAX_PHONE_SEQ_LEN];
+    int scoreIndex[MAX_PHONE_SEQ_LEN][MAX_PHONE_SEQ_LEN];
+    PhraseIntervalType sortBuf[MAX_TREE_INTERVAL];
+
+    /* scratch state of one Phrasing() call */
+    TreeDataType treeData;
+
+    Phrase *freePhrase[MAX_PHONE_SEQ_LEN * MAX_PHRASE_LEN];
+    int nFreePhrase;
+    PhrasingArena arena;
+} PhrasingCache;
+
+static void *PhrasingArenaAlloc(PhrasingArena *arena, size_t size)
+{
+    PhrasingArenaChunk *chunk;
+    size_t header = PHRASING_ARENA_ROUND(sizeof(PhrasingArenaChunk));
+    size_t chunk_size;
+    void *ret;
+
+    size = PHRASING_ARENA_ROUND(size);
+    for (chunk = arena->cur; chunk; chunk = chunk->next) {
+        if (chunk->size - chunk->used >= size)
+            break;
+    }
+
+    if (!chunk) {
+        chunk_size = size > PHRASING_ARENA_CHUNK_SIZE ? size : PHRASING_ARENA_CHUNK_SIZE;
+        chunk = malloc(header + chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        if (arena->cur) {
+            chunk->next = arena->cur->next;
+            arena->cur->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+    }
+    arena->cur = chunk;
+
+    ret = (char *) chunk + header + chunk->used;
+    chunk->used += size;
+    memset(ret, 0, size);
+    return ret;
+}
+
+#define ARENA_ALC(arena, type, n) (type *) PhrasingArenaAlloc((arena), sizeof(type) * (n))
+
+static void ResetPhrasingArena(PhrasingArena *arena)
+{
+    PhrasingArenaChunk *chunk;
+    PhrasingArenaChunk *next;
+    int i;
+
+    /* keep a few chunks, a long all-phrasing run may have grown many */
+    for (i = 0, chunk = arena->head; chunk; ++i, chunk = next) {
+        next = chunk->next;
+        chunk->used = 0;
+        if (i == PHRASING_ARENA_KEEP_CHUNKS - 1) {
+            chunk->next = NULL;
+        } else if (i >= PHRASING_ARENA_KEEP_CHUNKS) {
+            free(chunk);
+        }
+    }
+    arena->cur = arena->head;
+}
+
+static void TerminatePhrasingArena(PhrasingArena *arena)
+{
+    PhrasingArenaChunk *chunk;
+
+    while (arena->head) {
+        chunk = arena->head;
+        arena->head = chunk->next;
+        free(chunk);
+    }
+    arena->cur = NULL;
+}
+
 static int IsContain(IntervalType in1, IntervalType in2)
 {
     return (in1.from <= in2.from && in1.to >= in2.to);
@@ -81,39 +212,112 @@ static int PhraseIntervalContain(PhraseIntervalType in1, PhraseIntervalType in2)
     return (in1.from <= in2.from && in1.to >= in2.to);
 }
 
-static int PhraseIntervalIntersect(PhraseIntervalType in1, PhraseIntervalType in2)
+void TerminateTree(ChewingData *pgdata)
 {
-    return (max(in1.from, in2.from) < min(in1.to, in2.to));
+    pgdata->shared->tree = NULL;
+    pgdata->shared->tree_key = NULL;
+    pgdata->shared->tree_range = NULL;
+    pgdata->shared->tree_char = NULL;
+    plat_mmap_close(&pgdata->shared->tree_mmap);
 }
 
-void TerminateTree(ChewingData *pgdata)
+/*
+ * Locate the sections of a versioned index. Return 0 when the packed arrays
+ * are usable, 1 when only the TreeType nodes are usable (foreign byte order),
+ * and -1 on a malformed or unsupported index.
+ */
+static int LoadTreeIndex(ChewingData *pgdata, const char *buf, size_t size)
 {
-    pgdata->static_data.tree = NULL;
-    plat_mmap_close(&pgdata->static_data.tree_mmap);
+    const TreeIndexHeader *header = (const TreeIndexHeader *) buf;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t key_offset;
+    uint32_t range_offset;
+    uint32_t char_offset;
+    uint32_t slot_count;
+
+    version = GetUint32(&header->version);
+    if (version != TREE_INDEX_VERSION) {
+        LOG_ERROR("Unsupported index version %u", version);
+        return -1;
+    }
+
+    node_count = GetUint32(&header->node_count);
+    if (GetUint32(&header->node_offset) > size
+        || (size - GetUint32(&header->node_offset)) / sizeof(TreeType) < node_count)
+        return -1;
+    pgdata->shared->tree = (const TreeType *) (buf + GetUint32(&header->node_offset));
+    if (node_count == 0 || GetUint32(pgdata->shared->tree[0].key) != node_count)
+        return -1;
+
+    if (header->byte_order != TREE_INDEX_BYTE_ORDER)
+        return 1;
+
+    key_offset = GetUint32(&header->key_offset);
+    range_offset = GetUint32(&header->range_offset);
+    if (key_offset > size
+        || (size - key_offset) / sizeof(uint32_t) < node_count
+        || range_offset > size
+        || (size - range_offset) / (2 * sizeof(uint32_t)) < node_count)
+        return -1;
+    pgdata->shared->tree_key = (const uint32_t *) (buf + key_offset);
+    pgdata->shared->tree_range = (const uint32_t (*)[2]) (buf + range_offset);
+
+    /* the character table is optional */
+    char_offset = GetUint32(&header->char_offset);
+    if (char_offset == 0)
+        return 0;
+    if (char_offset > size || size - char_offset < sizeof(uint32_t))
+        return -1;
+    slot_count = *(const uint32_t *) (buf + char_offset);
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0
+        || (size - char_offset - sizeof(uint32_t)) / sizeof(TreeCharSlot) < slot_count)
+        return -1;
+    pgdata->shared->tree_char = (const TreeCharSlot *) (buf + char_offset + sizeof(uint32_t));
+    pgdata->shared->tree_char_mask = slot_count - 1;
+    return 0;
 }
 
 
 int InitTree(ChewingData *pgdata, const char *prefix)
 {
     char filename[PATH_MAX];
+    const char *buf;
     size_t len;
     size_t offset;
+    int ret;
 
     len = snprintf(filename, sizeof(filename), "%s" PLAT_SEPARATOR "%s", prefix, PHONE_TREE_FILE);
     if (len + 1 > sizeof(filename))
         return -1;
 
-    plat_mmap_set_invalid(&pgdata->static_data.tree_mmap);
-    pgdata->static_data.tree_size = plat_mmap_create(&pgdata->static_data.tree_mmap, filename, FLAG_ATTRIBUTE_READ);
-    if (pgdata->static_data.tree_size <= 0)
+    plat_mmap_set_invalid(&pgdata->shared->tree_mmap);
+    pgdata->shared->tree_size = plat_mmap_create(&pgdata->shared->tree_mmap, filename, FLAG_ATTRIBUTE_READ);
+    if (pgdata->shared->tree_size <= 0)
         return -1;
 
     offset = 0;
-    pgdata->static_data.tree =
-        (const TreeType *) plat_mmap_set_view(&pgdata->static_data.tree_mmap, &offset, &pgdata->static_data.tree_size);
-    if (!pgdata->static_data.tree)
+    buf = (const char *) plat_mmap_set_view(&pgdata->shared->tree_mmap, &offset, &pgdata->shared->tree_size);
+    if (!buf)
         return -1;
 
+    pgdata->shared->tree_key = NULL;
+    pgdata->shared->tree_range = NULL;
+    pgdata->shared->tree_char = NULL;
+    if (pgdata->shared->tree_size >= sizeof(TreeIndexHeader)
+        && !memcmp(buf, TREE_INDEX_MAGIC, strlen(TREE_INDEX_MAGIC))) {
+        ret = LoadTreeIndex(pgdata, buf, pgdata->shared->tree_size);
+        if (ret < 0) {
+            TerminateTree(pgdata);
+            return -1;
+        }
+        if (ret > 0)
+            LOG_INFO("Index byte order mismatches, fallback to TreeType search");
+    } else {
+        /* legacy index_tree.dat without header */
+        pgdata->shared->tree = (const TreeType *) buf;
+    }
+
     return 0;
 }
 
@@ -130,7 +334,7 @@ static int CheckBreakpoint(int from, int to, int bArrBrkpt[])
 
 int CheckTailoChoose(ChewingData *pgdata,
                            uint32_t *new_phoneSeq, int from, int to,
-                           Phrase **pp_phr,
+                           Phrase *p_phr,
                            char selectStr[][MAX_PHONE_SEQ_LEN * MAX_UTF8_SIZE + 1],
                            IntervalType selectInterval[], int nSelect)
 {
@@ -138,12 +342,10 @@ int CheckTailoChoose(ChewingData *pgdata,
     int chno, len;
     int user_alloc;
     UserPhraseData *pTailoPhraseData = NULL;
-    Phrase *p_phr = ALC(Phrase, 1);
 
     assert(p_phr);
     inte.from = from;
     inte.to = to;
-    *pp_phr = NULL;
 
     TRACY("%s, %d\n");
     /* pass 1
@@ -176,8 +378,8 @@ int CheckTailoChoose(ChewingData *pgdata,
                  * 'selectStr[chno]' test if not ok then return 0,
                  * if ok then continue to test. */
                 len = c.to - c.from;
-                if (memcmp(pgdata->tailophrase_data.wordSeq,
-                           selectStr[chno], strlen(selectStr[chno]))) {
+                if (strncmp(pgdata->tailophrase_data.wordSeq,
+                            selectStr[chno], strlen(selectStr[chno]))) {
 		    TRACY("%s, %d, selectStr=%s\n", __func__, __LINE__, selectStr[chno]);
                     break;
 		}
@@ -198,8 +400,7 @@ int CheckTailoChoose(ChewingData *pgdata,
 		p_phr->type = pgdata->tailophrase_data.type;
 		if(!p_phr->type)
 			p_phr->type = TYPE_TAILO;
-                *pp_phr = p_phr;
-		TRACY("%s, %d, *pp_phr->phrase=%s\n", __func__, __LINE__, (*pp_phr)->phrase);
+		TRACY("%s, %d, p_phr->phrase=%s\n", __func__, __LINE__, p_phr->phrase);
             }
         }
     } while ((pTailoPhraseData = TailoGetPhraseNext(pgdata, new_phoneSeq)) != NULL);
@@ -208,14 +409,13 @@ int CheckTailoChoose(ChewingData *pgdata,
     if (p_phr->freq != -1)
         return 1;
   end:
-    free(p_phr);
     return 0;
 }
 
 
 static int CheckUserChoose(ChewingData *pgdata,
                            uint32_t *new_phoneSeq, int from, int to,
-                           Phrase **pp_phr,
+                           Phrase *p_phr,
                            char selectStr[][MAX_PHONE_SEQ_LEN * MAX_UTF8_SIZE + 1],
                            IntervalType selectInterval[], int nSelect)
 {
@@ -223,12 +423,10 @@ static int CheckUserChoose(ChewingData *pgdata,
     int chno, len;
     int user_alloc;
     UserPhraseData *pUserPhraseData;
-    Phrase *p_phr = ALC(Phrase, 1);
 
     assert(p_phr);
     inte.from = from;
     inte.to = to;
-    *pp_phr = NULL;
     /* pass 1
      * if these exist one selected interval which is not contained by inte
      * but has intersection with inte, then inte is an unacceptable interval
@@ -259,8 +457,8 @@ static int CheckUserChoose(ChewingData *pgdata,
                  * 'selectStr[chno]' test if not ok then return 0,
                  * if ok then continue to test. */
                 len = c.to - c.from;
-                if (memcmp(ueStrSeek(pUserPhraseData->wordSeq, c.from - from),
-                           selectStr[chno], ueStrNBytes(selectStr[chno], len))) {
+                if (strncmp(ueStrSeek(pUserPhraseData->wordSeq, c.from - from),
+                            selectStr[chno], ueStrNBytes(selectStr[chno], len))) {
                     break;
 		}
             }
@@ -278,9 +476,8 @@ static int CheckUserChoose(ChewingData *pgdata,
 		if(!p_phr->type)
 			p_phr->type = TYPE_HAN;
 			
-                *pp_phr = p_phr;
-		TRACY("%s, %d, pp_phr=0x%x, freq=%d, type=%d\n", __func__, __LINE__,
-				(uint32_t) *pp_phr, p_phr->freq, p_phr->type);
+		TRACY("%s, %d, p_phr=0x%x, freq=%d, type=%d\n", __func__, __LINE__,
+				(uint32_t) p_phr, p_phr->freq, p_phr->type);
             }
         }
     } while ((pUserPhraseData = UserGetPhraseNext(pgdata, new_phoneSeq)) != NULL);
@@ -289,7 +486,6 @@ static int CheckUserChoose(ChewingData *pgdata,
     if (p_phr->freq != -1)
         return 1;
   end:
-    free(p_phr);
     return 0;
 }
 
@@ -297,21 +493,20 @@ static int CheckUserChoose(ChewingData *pgdata,
  * phrase is said to satisfy a choose interval if
  * their intersections are the same */
 static int CheckChoose(ChewingData *pgdata,
-                       const TreeType *phrase_parent, int from, int to, Phrase **pp_phr,
+                       const TreeType *phrase_parent, int from, int to, Phrase *phrase,
                        char selectStr[][MAX_PHONE_SEQ_LEN * MAX_UTF8_SIZE + 1],
                        IntervalType selectInterval[], int nSelect)
 {
     IntervalType inte, c;
+    DictIterator iter;
     int chno, len;
-    Phrase *phrase = ALC(Phrase, 1);
 
     assert(phrase);
     inte.from = from;
     inte.to = to;
-    *pp_phr = NULL;
 
     /* if there exist one phrase satisfied all selectStr then return 1, else return 0. */
-    GetPhraseFirst(pgdata, phrase, phrase_parent);
+    GetPhraseFirst(pgdata, &iter, phrase, phrase_parent);
     do {
         for (chno = 0; chno < nSelect; chno++) {
             c = selectInterval[chno];
@@ -330,13 +525,10 @@ static int CheckChoose(ChewingData *pgdata,
 		    goto end;
             }
         }
-        if (chno == nSelect) {
-            *pp_phr = phrase;
+        if (chno == nSelect)
             return 1;
-        }
-    } while (GetVocabNext(pgdata, phrase));
+    } while (GetVocabNext(pgdata, &iter, phrase));
 end:
-    free(phrase);
     return 0;
 }
 
@@ -345,56 +537,178 @@ static int CompTreeType(const void *a, const void *b)
     return GetUint32(((TreeType *) a)->key) - GetUint32(((TreeType *) b)->key);
 }
 
+/*
+ * Search key in the packed key array within [begin, end). Binary search only
+ * narrows the range down to a couple of cache lines, the rest is scanned.
+ */
+static int TreeSearchKey(const uint32_t *tree_key, uint32_t begin, uint32_t end, uint32_t key)
+{
+    uint32_t mid;
+
+    while (end - begin > TREE_LINEAR_SEARCH_LEN) {
+        mid = begin + (end - begin) / 2;
+        if (tree_key[mid] <= key)
+            begin = mid;
+        else
+            end = mid;
+    }
+    for (; begin < end && tree_key[begin] <= key; ++begin) {
+        if (tree_key[begin] == key)
+            return begin;
+    }
+    return -1;
+}
+
+/*
+ * Return the child of parent whose key is key, or NULL if there is none.
+ */
+static const TreeType *TreeFindChild(ChewingData *pgdata, const TreeType *parent, uint32_t key)
+{
+    const TreeType *tree = pgdata->shared->tree;
+    TreeType target;
+    uint32_t range[2];
+    int pos;
+
+    if (pgdata->shared->tree_key) {
+        pos = parent - tree;
+        range[0] = pgdata->shared->tree_range[pos][0];
+        range[1] = pgdata->shared->tree_range[pos][1];
+        assert(range[1] >= range[0]);
+        pos = TreeSearchKey(pgdata->shared->tree_key, range[0], range[1], key);
+        return pos < 0 ? NULL : tree + pos;
+    }
+
+    PutUint32(key, target.key);
+    range[0] = GetUint32(parent->child.begin);
+    range[1] = GetUint32(parent->child.end);
+    assert(range[1] >= range[0]);
+    return (const TreeType *) bsearch(&target, tree + range[0], range[1] - range[0], sizeof(TreeType), CompTreeType);
+}
+
+/*
+ * Return TREE_CURSOR_PHRASE if node has phrases, that is, its first child is a
+ * leaf, and TREE_CURSOR_CONTINUE if node has internal children, that is, its
+ * last child is not a leaf.
+ */
+static int TreeNodeState(ChewingData *pgdata, const TreeType *node)
+{
+    const TreeType *tree = pgdata->shared->tree;
+    uint32_t first, last;
+    int state = TREE_CURSOR_DEAD_END;
+
+    if (pgdata->shared->tree_key) {
+        first = pgdata->shared->tree_key[pgdata->shared->tree_range[node - tree][0]];
+        last = pgdata->shared->tree_key[pgdata->shared->tree_range[node - tree][1] - 1];
+    } else {
+        first = GetUint32(tree[GetUint32(node->child.begin)].key);
+        last = GetUint32(tree[GetUint32(node->child.end) - 1].key);
+    }
+
+    if (first == 0)
+        state |= TREE_CURSOR_PHRASE;
+    if (last != 0)
+        state |= TREE_CURSOR_CONTINUE;
+    return state;
+}
+
+/**
+ * @brief start a prefix walk at the root of the phrase tree.
+ */
+void TreeCursorInit(ChewingData *pgdata, TreeCursor *cursor)
+{
+    cursor->node = pgdata->shared->tree;
+}
+
+/**
+ * @brief descend the cursor by one syllable.
+ *
+ * @return TREE_CURSOR_DEAD_END when no phrase starts with the walked syllables,
+ * otherwise a combination of TREE_CURSOR_PHRASE (cursor->node has phrases and
+ * can be passed to GetPhraseFirst) and TREE_CURSOR_CONTINUE (longer phrases
+ * exist). A dead cursor stays dead.
+ */
+int TreeCursorNext(ChewingData *pgdata, TreeCursor *cursor, uint32_t phone)
+{
+    if (!cursor->node)
+        return TREE_CURSOR_DEAD_END;
+
+    cursor->node = TreeFindChild(pgdata, cursor->node, phone);
+    if (!cursor->node)
+        return TREE_CURSOR_DEAD_END;
+    return TreeNodeState(pgdata, cursor->node);
+}
+
 /** @brief search for the phrases have the same pronunciation.*/
 /* if phoneSeq[begin] ~ phoneSeq[end] is a phrase, then add an interval
  * from (begin) to (end+1)
  */
 const TreeType *TreeFindPhrase(ChewingData *pgdata, int begin, int end, const uint32_t *phoneSeq)
 {
-    TreeType target;
-    const TreeType *tree_p = pgdata->static_data.tree;
-    uint32_t range[2];
+    TreeCursor cursor;
+    int state = TREE_CURSOR_DEAD_END;
     int i;
 
+    TreeCursorInit(pgdata, &cursor);
     for (i = begin; i <= end; i++) {
-        PutUint32(phoneSeq[i], target.key);
-        range[0] = GetUint32(tree_p->child.begin);
-        range[1] = GetUint32(tree_p->child.end);
-
-	DEBUG_OUT("%s: phoneSeq[%d]=%d, target.key=%d, range[0]=%d, range[1]=%d\n",
-		__func__, i, phoneSeq[i], target.key, range[0], range[1]);
-        assert(range[1] >= range[0]);
-        tree_p = (const TreeType *) bsearch(&target, pgdata->static_data.tree + range[0],
-                                            range[1] - range[0], sizeof(TreeType), CompTreeType);
+	DEBUG_OUT("%s: phoneSeq[%d]=%d\n", __func__, i, phoneSeq[i]);
+        state = TreeCursorNext(pgdata, &cursor, phoneSeq[i]);
 
         /* if not found any word then fail. */
-        if (!tree_p)
+        if (state == TREE_CURSOR_DEAD_END)
             return NULL;
     }
     /* If its child has no key value of 0, then it is only a "half" phrase. */
-    if (GetUint32(pgdata->static_data.tree[GetUint32(tree_p->child.begin)].key) != 0)
+    if (!(state & TREE_CURSOR_PHRASE))
         return NULL;
-    return tree_p;
+    return cursor.node;
 }
 
 /**
  * @brief get child range of a given parent node.
  */
-void TreeChildRange(ChewingData *pgdata, const TreeType *parent)
+DictIterator TreeChildRange(ChewingData *pgdata, const TreeType *parent)
 {
+    DictIterator iter;
+
     TRACX("%s, %d\n", __func__, __LINE__);
-    pgdata->static_data.tree_cur_pos = pgdata->static_data.tree + GetUint32(parent->child.begin);
-    pgdata->static_data.tree_end_pos = pgdata->static_data.tree + GetUint32(parent->child.end);
+    iter.cur = pgdata->shared->tree + GetUint32(parent->child.begin);
+    iter.end = pgdata->shared->tree + GetUint32(parent->child.end);
+    return iter;
+}
+
+/* Phrase objects of the rows are recycled instead of going back to the heap */
+static Phrase *AllocRowPhrase(PhrasingCache *cache, const Phrase *phrase)
+{
+    Phrase *ret;
+
+    if (cache->nFreePhrase > 0)
+        ret = cache->freePhrase[--cache->nFreePhrase];
+    else
+        ret = ALC(Phrase, 1);
+    if (ret)
+        *ret = *phrase;
+    return ret;
+}
+
+static void FreeRowPhrase(PhrasingCache *cache, Phrase *phrase)
+{
+    if (!phrase)
+        return;
+    /* no more Phrase objects than row slots are ever allocated */
+    assert(cache->nFreePhrase < (int) ARRAY_SIZE(cache->freePhrase));
+    cache->freePhrase[cache->nFreePhrase++] = phrase;
 }
 
-static void AddInterval(TreeDataType *ptd, int begin, int end, Phrase *p_phrase, int dict_or_user)
+static void AddInterval(PhrasingCache *cache, int begin, int end, Phrase *p_phrase, int dict_or_user)
 {
+    PhraseIntervalType *inter = &cache->row[begin][end - begin];
+
     TRACX("%s, %d\n", __func__, __LINE__);
-    ptd->interval[ptd->nInterval].from = begin;
-    ptd->interval[ptd->nInterval].to = end + 1;
-    ptd->interval[ptd->nInterval].p_phr = p_phrase;
-    ptd->interval[ptd->nInterval].source = dict_or_user;
-    ptd->nInterval++;
+    inter->from = begin;
+    inter->to = end + 1;
+    inter->p_phr = p_phrase;
+    inter->source = dict_or_user;
+    inter->serial = ++cache->serial;
 }
 
 /* Item which inserts to interval array */
@@ -405,22 +719,48 @@ typedef enum {
     USED_PHRASE_TAILO,            /**< Dict phrase */
 } UsedPhraseMode;
 
-static void FindInterval(ChewingData *pgdata, TreeDataType *ptd)
+/*
+ * The workers of taigi_convert_bopomofo_batch() share the user phrases of the
+ * caller, including the sqlite statements and the lookup cache.
+ */
+static void LockUserphrase(ChewingData *pgdata)
+{
+    if (pgdata->userphraseLock)
+        plat_mutex_lock(pgdata->userphraseLock);
+}
+
+static void UnlockUserphrase(ChewingData *pgdata)
+{
+    if (pgdata->userphraseLock)
+        plat_mutex_unlock(pgdata->userphraseLock);
+}
+
+/*
+ * Find all intervals beginning at begin and store them into the row of the
+ * phrasing cache.
+ */
+static void FindIntervalRow(ChewingData *pgdata, PhrasingCache *cache, int begin)
 {
-    int end, begin;
+    int end;
+    TreeCursor cursor;
+    int tree_state;
     const TreeType *phrase_parent;
-    Phrase *p_phrase, *puserphrase = NULL, *pdictphrase = NULL, *ptailophrase = NULL;
+    Phrase userphrase_buf, dictphrase_buf, tailophrase_buf;
+    Phrase *puserphrase = NULL, *pdictphrase = NULL, *ptailophrase = NULL;
     UsedPhraseMode i_used_phrase = USED_PHRASE_NONE;
     uint32_t new_phoneSeq[MAX_PHONE_SEQ_LEN];
     UserPhraseData *userphrase = NULL, *tailophrase = NULL;
 
-    TRACX("====== %s, %d START, pgdata->nPhoneSeq=%d\n", __func__,__LINE__, pgdata->nPhoneSeq);
-    for (begin = 0; begin < pgdata->nPhoneSeq; begin++) {
+    TRACX("====== %s, %d START, begin=%d\n", __func__,__LINE__, begin);
+    {
+        /* walk the dictionary one syllable per end instead of from the root */
+        TreeCursorInit(pgdata, &cursor);
         for (end = begin; end < min(pgdata->nPhoneSeq, begin + MAX_PHRASE_LEN); end++) {
             if (!CheckBreakpoint(begin, end + 1, pgdata->bArrBrkpt)) {
 		TRACX("%s, %d, Break!!\n", __func__, __LINE__);
                 break;
 	    }
+            tree_state = TreeCursorNext(pgdata, &cursor, pgdata->phoneSeq[end]);
 
             /* set new_phoneSeq */
             memcpy(new_phoneSeq, &pgdata->phoneSeq[begin], sizeof(uint32_t) * (end - begin + 1));
@@ -431,14 +771,14 @@ static void FindInterval(ChewingData *pgdata, TreeDataType *ptd)
 	    TRACX("XXXXXX pgdata->userphrase_data=0x%x, pgdata->tailophrase_data=0x%x\n",
 			    &pgdata->userphrase_data, &pgdata->tailophrase_data);
 
+	    LockUserphrase(pgdata);
 	    /* Get the Tailo phrase */
             tailophrase = TailoGetPhraseFirst(pgdata, new_phoneSeq);
             TailoGetPhraseEnd(pgdata, new_phoneSeq);
 
             if (tailophrase && CheckTailoChoose(pgdata, new_phoneSeq, begin, end + 1,
-                                              &p_phrase, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
-                ptailophrase = p_phrase;
-		p_phrase = NULL;
+                                              &tailophrase_buf, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
+                ptailophrase = &tailophrase_buf;
 		TRACX("%s:%d Get Tailophrase=%s\n", __func__, __LINE__, ptailophrase);
             }
 	    /* Get the Tailo phrase -- End */
@@ -446,20 +786,19 @@ static void FindInterval(ChewingData *pgdata, TreeDataType *ptd)
             UserGetPhraseEnd(pgdata, new_phoneSeq);
 
             if (userphrase && CheckUserChoose(pgdata, new_phoneSeq, begin, end + 1,
-                                              &p_phrase, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
-                puserphrase = p_phrase;
-		p_phrase = NULL;
+                                              &userphrase_buf, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
+                puserphrase = &userphrase_buf;
 		TRACX("%s: Get userphrase=%s\n", __func__, puserphrase);
             }
+            UnlockUserphrase(pgdata);
 
             /* check dict phrase */
-            phrase_parent = TreeFindPhrase(pgdata, begin, end, pgdata->phoneSeq);
+            phrase_parent = (tree_state & TREE_CURSOR_PHRASE) ? cursor.node : NULL;
             if (phrase_parent &&
                 CheckChoose(pgdata,
                             phrase_parent, begin, end + 1,
-                            &p_phrase, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
-                pdictphrase = p_phrase;
-		p_phrase = NULL;
+                            &dictphrase_buf, pgdata->selectStr, pgdata->selectInterval, pgdata->nSelect)) {
+                pdictphrase = &dictphrase_buf;
 		TRACX("!!! Get pdictphrase, type=%d, phrase=%s !!!\n", pdictphrase->type, pdictphrase);
 	    }
 
@@ -512,74 +851,164 @@ static void FindInterval(ChewingData *pgdata, TreeDataType *ptd)
             switch (i_used_phrase) {
             case USED_PHRASE_USER:
 		TRACY("%s, %d, Using User, phrase=%s\n", __func__,__LINE__, puserphrase->phrase);
-                AddInterval(ptd, begin, end, puserphrase, IS_USER_PHRASE);
+                AddInterval(cache, begin, end, AllocRowPhrase(cache, puserphrase), IS_USER_PHRASE);
                 break;
             case USED_PHRASE_DICT:
 		TRACY("%s, %d, Using Dict, phase=%s\n", __func__,__LINE__, pdictphrase->phrase);
-                AddInterval(ptd, begin, end, pdictphrase, IS_DICT_PHRASE);
+                AddInterval(cache, begin, end, AllocRowPhrase(cache, pdictphrase), IS_DICT_PHRASE);
                 break;
             case USED_PHRASE_TAILO:
 		TRACY("%s, %d, Using Tailo, phrase=%s\n", __func__,__LINE__, ptailophrase->phrase);
-                AddInterval(ptd, begin, end, ptailophrase, IS_TAILO_PHRASE);
+                AddInterval(cache, begin, end, AllocRowPhrase(cache, ptailophrase), IS_TAILO_PHRASE);
                 break;
             case USED_PHRASE_NONE:
             default:
 	        TRACY("%s, %d, Not Using it\n", __func__,__LINE__);
                 break;
             }
-		if (puserphrase != NULL && i_used_phrase != USED_PHRASE_USER) {
-		    TRACX("XXXXX %s, %d\n", __func__, __LINE__);
-		    free(puserphrase);
-		    puserphrase = NULL;
-		}
-		if (pdictphrase != NULL && i_used_phrase != USED_PHRASE_DICT) {
-		    TRACX("XXXXX %s, %d\n", __func__, __LINE__);
-		    free(pdictphrase);
-		    pdictphrase = NULL;
-		}
-		if (ptailophrase != NULL && i_used_phrase != USED_PHRASE_TAILO) {
-		    TRACX("XXXXX %s, %d\n", __func__, __LINE__);
-		    free(ptailophrase);
-		    ptailophrase = NULL;
-		}
 	    TRACX("%s, %d XXXXXXXXXXXXXXX\n", __func__, __LINE__);
         }
     }
 }
 
-static void SetInfo(int len, TreeDataType *ptd)
+static void ReleaseRows(PhrasingCache *cache, int from, int to)
 {
-    int i, a;
+    int begin, i;
 
-    for (i = 0; i <= len; i++)
-        ptd->leftmost[i] = i;
-    for (i = 0; i < ptd->nInterval; i++) {
-        ptd->graph[ptd->interval[i].from][ptd->interval[i].to] = 1;
-        ptd->graph[ptd->interval[i].to][ptd->interval[i].from] = 1;
+    for (begin = from; begin < to; ++begin) {
+        for (i = 0; i < MAX_PHRASE_LEN; ++i)
+            FreeRowPhrase(cache, cache->row[begin][i].p_phr);
+        memset(cache->row[begin], 0, sizeof(cache->row[begin]));
     }
+}
 
-    /* set leftmost */
-    for (a = 0; a <= len; a++) {
-        for (i = 0; i <= len; i++) {
-            if (!(ptd->graph[a][i]))
-                continue;
-            if (ptd->leftmost[i] < ptd->leftmost[a])
-                ptd->leftmost[a] = ptd->leftmost[i];
-        }
-    }
+static void ReleaseHighestScore(PhrasingCache *cache, int from)
+{
+    int end;
+
+    for (end = from; end < MAX_PHONE_SEQ_LEN; ++end)
+        cache->highest_score[end] = NULL;
+}
+
+/**
+ * @brief drop all intervals kept by the phrasing cache.
+ *
+ * Must be called whenever phrases may be found differently for an unchanged
+ * phone sequence, such as a new selection or an updated user phrase.
+ */
+void InvalidatePhrasingCache(ChewingData *pgdata)
+{
+    PhrasingCache *cache = pgdata->phrasingCache;
+
+    if (!cache)
+        return;
+
+    ReleaseRows(cache, 0, cache->nPhoneSeq);
+    ReleaseHighestScore(cache, 0);
+    cache->nPhoneSeq = 0;
+    cache->nDpInterval = 0;
+    cache->valid = 0;
+}
+
+void TerminatePhrasingCache(ChewingData *pgdata)
+{
+    PhrasingCache *cache = pgdata->phrasingCache;
+
+    if (!cache)
+        return;
+
+    InvalidatePhrasingCache(pgdata);
+    while (cache->nFreePhrase > 0)
+        free(cache->freePhrase[--cache->nFreePhrase]);
+    TerminatePhrasingArena(&cache->arena);
+    free(pgdata->phrasingCache);
+    pgdata->phrasingCache = NULL;
+}
+
+static int IsSameSyllable(const ChewingData *pgdata, int pos, const PhrasingCache *cache, int cache_pos)
+{
+    return pgdata->phoneSeq[pos] == cache->phoneSeq[cache_pos]
+        && pgdata->bArrBrkpt[pos] == cache->bArrBrkpt[cache_pos];
 }
 
 /*
- * First we compare the 'nMatchCnnct'.
- * If the values are the same, we will compare the 'score'
+ * Rebuild only the rows touched since the last call. The changed range is the
+ * part between the common prefix and the common suffix of the old and the new
+ * phone sequence, which covers AddChi, ModifyChi, ChewingKillChar and every
+ * other edit. A row before the change is kept when none of its intervals can
+ * reach the change, and a row after the change is shifted.
  */
-static int CompRecord(const RecordNode **pa, const RecordNode **pb)
+static void FindInterval(ChewingData *pgdata, TreeDataType *ptd)
 {
-    int diff = (*pb)->nMatchCnnct - (*pa)->nMatchCnnct;
+    PhrasingCache *cache = pgdata->phrasingCache;
+    int nPhoneSeq = pgdata->nPhoneSeq;
+    int prefix = 0, suffix = 0;
+    int first, delta, begin, i;
+
+    if (cache->valid
+        && cache->nSelect == pgdata->nSelect
+        && !memcmp(cache->selectInterval, pgdata->selectInterval, sizeof(pgdata->selectInterval[0]) * pgdata->nSelect)) {
+        while (prefix < min(nPhoneSeq, cache->nPhoneSeq) && IsSameSyllable(pgdata, prefix, cache, prefix))
+            ++prefix;
+        while (suffix < min(nPhoneSeq, cache->nPhoneSeq) - prefix
+               && IsSameSyllable(pgdata, nPhoneSeq - 1 - suffix, cache, cache->nPhoneSeq - 1 - suffix))
+            ++suffix;
+    }
+    first = max(prefix - MAX_PHRASE_LEN + 1, 0);
+    delta = nPhoneSeq - cache->nPhoneSeq;
+
+    ReleaseRows(cache, first, cache->nPhoneSeq - suffix);
+    if (delta != 0 && suffix > 0) {
+        memmove(cache->row[nPhoneSeq - suffix], cache->row[cache->nPhoneSeq - suffix], sizeof(cache->row[0]) * suffix);
+        for (begin = nPhoneSeq - suffix; begin < nPhoneSeq; ++begin) {
+            for (i = 0; i < MAX_PHRASE_LEN; ++i) {
+                cache->row[begin][i].from += delta;
+                cache->row[begin][i].to += delta;
+            }
+        }
+    }
+    for (begin = first; begin < nPhoneSeq - suffix; ++begin) {
+        memset(cache->row[begin], 0, sizeof(cache->row[begin]));
+        FindIntervalRow(pgdata, cache, begin);
+    }
+    if (delta < 0)
+        memset(cache->row[nPhoneSeq], 0, sizeof(cache->row[0]) * -delta);
+
+    memcpy(cache->phoneSeq, pgdata->phoneSeq, sizeof(cache->phoneSeq));
+    memcpy(cache->bArrBrkpt, pgdata->bArrBrkpt, sizeof(cache->bArrBrkpt));
+    cache->nPhoneSeq = nPhoneSeq;
+    memcpy(cache->selectInterval, pgdata->selectInterval, sizeof(cache->selectInterval));
+    cache->nSelect = pgdata->nSelect;
+    cache->valid = 1;
+
+    /* intervals are listed in the order of (from, to) */
+    for (begin = 0; begin < nPhoneSeq; ++begin) {
+        for (i = 0; i < MAX_PHRASE_LEN; ++i) {
+            if (cache->row[begin][i].p_phr)
+                ptd->interval[ptd->nInterval++] = cache->row[begin][i];
+        }
+    }
+}
 
-    if (diff)
-        return diff;
-    return ((*pb)->score - (*pa)->score);
+static void SetInfo(int len, TreeDataType *ptd)
+{
+    /* bit i of start[a] is set when an interval goes from i to a */
+    uint64_t start[MAX_PHONE_SEQ_LEN + 1];
+    uint64_t bits;
+    int i, a;
+
+    memset(start, 0, sizeof(start[0]) * (len + 1));
+    for (i = 0; i < ptd->nInterval; i++)
+        start[ptd->interval[i].to] |= (uint64_t) 1 << ptd->interval[i].from;
+
+    /* set leftmost */
+    for (a = 0; a <= len; a++) {
+        ptd->leftmost[a] = a;
+        for (bits = start[a], i = 0; bits; bits >>= 1, i++) {
+            if ((bits & 1) && ptd->leftmost[i] < ptd->leftmost[a])
+                ptd->leftmost[a] = ptd->leftmost[i];
+        }
+    }
 }
 
 /*
@@ -591,55 +1020,43 @@ static int CompRecord(const RecordNode **pa, const RecordNode **pb)
  */
 static void Discard1(TreeDataType *ptd)
 {
-    int a, b;
-    char failflag[INTERVAL_SIZE];
+    int i;
+    int depth;
+    int straddle[MAX_PHONE_SEQ_LEN + 1];
+    int owner[MAX_PHONE_SEQ_LEN + 1];
     int nInterval2;
 
-    memset(failflag, 0, sizeof(failflag));
-    for (a = 0; a < ptd->nInterval; a++) {
-        if (failflag[a])
-            continue;
-        for (b = 0; b < ptd->nInterval; b++) {
-            if (a == b || failflag[b])
-                continue;
-
-            /* interval b is in interval a */
-            if (PhraseIntervalContain(ptd->interval[a], ptd->interval[b]))
-                continue;
-
-            /* interval b is in front of interval a */
-            if (ptd->interval[b].to <= ptd->interval[a].from)
-                continue;
-
-            /* interval b is in back of interval a */
-            if (ptd->interval[a].to <= ptd->interval[b].from)
-                continue;
+    /*
+     * An interval crossed by or inside another one never removes anything,
+     * and the others, which cannot overlap each other, remove everything
+     * inside them. Interval i is crossed by or inside another one if and only
+     * if some interval starts before and ends after one of its endpoints, so
+     * a sweep over the positions is enough.
+     */
+    memset(straddle, 0, sizeof(straddle));
+    for (i = 0; i < ptd->nInterval; i++) {
+        straddle[ptd->interval[i].from + 1]++;
+        straddle[ptd->interval[i].to]--;
+    }
+    for (i = 0, depth = 0; i <= MAX_PHONE_SEQ_LEN; i++) {
+        depth += straddle[i];
+        straddle[i] = depth;
+        owner[i] = -1;
+    }
 
-            break;
-        }
-        /* if any other interval b is inside or leftside or rightside the
-         * interval a */
-        if (b >= ptd->nInterval) {
-            /* then kill all the intervals inside the interval a */
-            int i;
-
-            for (i = 0; i < ptd->nInterval; i++) {
-                if (!failflag[i] && i != a && PhraseIntervalContain(ptd->interval[a], ptd->interval[i])) {
-                    failflag[i] = 1;
-                }
-            }
+    /* the first one of the same intervals removes the others */
+    for (i = 0; i < ptd->nInterval; i++) {
+        if (!straddle[ptd->interval[i].from] && !straddle[ptd->interval[i].to] && owner[ptd->interval[i].from] == -1) {
+            for (depth = ptd->interval[i].from; depth < ptd->interval[i].to; depth++)
+                owner[depth] = i;
         }
     }
-    /* discard all the intervals whose failflag[a] = 1 */
+
+    /* discard all the intervals inside another owner */
     nInterval2 = 0;
-    for (a = 0; a < ptd->nInterval; a++) {
-        if (!failflag[a]) {
-            ptd->interval[nInterval2++] = ptd->interval[a];
-        } else {
-            if (ptd->interval[a].p_phr != NULL) {
-                free(ptd->interval[a].p_phr);
-            }
-        }
+    for (i = 0; i < ptd->nInterval; i++) {
+        if (owner[ptd->interval[i].from] == -1 || owner[ptd->interval[i].from] == i)
+            ptd->interval[nInterval2++] = ptd->interval[i];
     }
     ptd->nInterval = nInterval2;
 }
@@ -657,30 +1074,36 @@ static void Discard1(TreeDataType *ptd)
  */
 static void Discard2(TreeDataType *ptd)
 {
-    int i, j;
-    char overwrite[MAX_PHONE_SEQ_LEN];
-    char failflag[INTERVAL_SIZE];
+    int i;
+    int depth;
+    int cover[MAX_PHONE_SEQ_LEN + 1];
+    int overwrite[MAX_PHONE_SEQ_LEN + 1];
     int nInterval2;
 
-    memset(failflag, 0, sizeof(failflag));
+    /*
+     * Interval i is overwritten by other intervals when any of its positions
+     * is covered by more than one interval. overwrite[] counts such positions
+     * before each position.
+     */
+    memset(cover, 0, sizeof(cover));
     for (i = 0; i < ptd->nInterval; i++) {
-        if (ptd->leftmost[ptd->interval[i].from] == 0)
-            continue;
-        /* test if interval i is overwrited by other intervals */
-        memset(overwrite, 0, sizeof(overwrite));
-        for (j = 0; j < ptd->nInterval; j++) {
-            if (j == i)
-                continue;
-            memset(&overwrite[ptd->interval[j].from], 1, ptd->interval[j].to - ptd->interval[j].from);
-        }
-        if (memchr(&overwrite[ptd->interval[i].from], 1, ptd->interval[i].to - ptd->interval[i].from))
-            failflag[i] = 1;
+        cover[ptd->interval[i].from]++;
+        cover[ptd->interval[i].to]--;
     }
-    /* discard all the intervals whose failflag[a] = 1 */
+    overwrite[0] = 0;
+    for (i = 0, depth = 0; i < MAX_PHONE_SEQ_LEN; i++) {
+        depth += cover[i];
+        overwrite[i + 1] = overwrite[i] + (depth > 1);
+    }
+
+    /* discard all the intervals overwritten and not connected to head */
     nInterval2 = 0;
-    for (i = 0; i < ptd->nInterval; i++)
-        if (!failflag[i])
-            ptd->interval[nInterval2++] = ptd->interval[i];
+    for (i = 0; i < ptd->nInterval; i++) {
+        if (ptd->leftmost[ptd->interval[i].from] != 0
+            && overwrite[ptd->interval[i].to] > overwrite[ptd->interval[i].from])
+            continue;
+        ptd->interval[nInterval2++] = ptd->interval[i];
+    }
     ptd->nInterval = nInterval2;
 }
 
@@ -841,103 +1264,11 @@ static int IsRecContain(const int *intA, int nA, const int *intB, int nB, const
     return 1;
 }
 
-static void SortListByScore(TreeDataType *ptd)
-{
-    int i, listLen;
-    RecordNode *p, **arr;
-
-    for (listLen = 0, p = ptd->phList; p; listLen++, p = p->next);
-    ptd->nPhListLen = listLen;
-
-    arr = ALC(RecordNode *, listLen);
-
-    assert(arr);
-
-    for (i = 0, p = ptd->phList; i < listLen; p = p->next, i++) {
-        arr[i] = p;
-        p->score = LoadPhraseAndCountScore(p->arrIndex, p->nInter, ptd);
-    }
-
-    qsort(arr, listLen, sizeof(RecordNode *), (CompFuncType) CompRecord);
-
-    ptd->phList = arr[0];
-    for (i = 1; i < listLen; i++) {
-        arr[i - 1]->next = arr[i];
-    }
-    arr[listLen - 1]->next = NULL;
-
-    free(arr);
-}
-
-/* when record==NULL then output the "link list" */
-static void SaveRecord(const int *record, int nInter, TreeDataType *ptd)
-{
-    RecordNode *now, *p, *pre;
-
-    printf("<<<< %s, %d, Inter=%d >>>>\n", __func__, __LINE__, nInter);
-    pre = NULL;
-    for (p = ptd->phList; p;) {
-        /* if  'p' contains 'record', then discard 'record'. */
-        if (IsRecContain(p->arrIndex, p->nInter, record, nInter, ptd))
-            return;
-
-        /* if 'record' contains 'p', then discard 'p'
-         * -- We must deal with the linked list. */
-        if (IsRecContain(record, nInter, p->arrIndex, p->nInter, ptd)) {
-            RecordNode *tp = p;
-
-            if (pre)
-                pre->next = p->next;
-            else
-                ptd->phList = ptd->phList->next;
-            p = p->next;
-            free(tp->arrIndex);
-            free(tp);
-        } else
-            pre = p, p = p->next;
-    }
-    now = ALC(RecordNode, 1);
-
-    assert(now);
-    now->next = ptd->phList;
-    now->arrIndex = ALC(int, nInter);
-
-    assert(now->arrIndex);
-    now->nInter = nInter;
-    memcpy(now->arrIndex, record, nInter * sizeof(int));
-    ptd->phList = now;
-}
-
-static void RecursiveSave(int depth, int to, int *record, TreeDataType *ptd)
-{
-    int first, i;
-
-    /* to find first interval */
-    for (first = record[depth - 1] + 1; ptd->interval[first].from < to && first < ptd->nInterval; first++);
-
-    if (first == ptd->nInterval) {
-        SaveRecord(record + 1, depth - 1, ptd);
-        return;
-    }
-    record[depth] = first;
-    RecursiveSave(depth + 1, ptd->interval[first].to, record, ptd);
-    /* for each interval which intersects first */
-    for (i = first + 1; PhraseIntervalIntersect(ptd->interval[first], ptd->interval[i]) && i < ptd->nInterval; i++) {
-        record[depth] = i;
-        RecursiveSave(depth + 1, ptd->interval[i].to, record, ptd);
-    }
-}
-
-static void SaveList(TreeDataType *ptd)
-{
-    int record[MAX_PHONE_SEQ_LEN + 1] = { -1 };
-
-    RecursiveSave(1, 0, record, ptd);
-}
-
 static void InitPhrasing(TreeDataType *ptd)
 {
-    memset(ptd, 0, sizeof(TreeDataType));
+    ptd->nInterval = 0;
+    ptd->phList = NULL;
+    ptd->nPhListLen = 0;
 }
 
 static void SaveDispInterval(PhrasingOutput *ppo, TreeDataType *ptd)
@@ -953,43 +1284,12 @@ static void SaveDispInterval(PhrasingOutput *ppo, TreeDataType *ptd)
 
 static void CleanUpMem(TreeDataType *ptd)
 {
-    int i;
-    RecordNode *pNode;
-
-    for (i = 0; i < ptd->nInterval; i++) {
-        if (ptd->interval[i].p_phr) {
-            free(ptd->interval[i].p_phr);
-            ptd->interval[i].p_phr = NULL;
-        }
-    }
-    while (ptd->phList != NULL) {
-        pNode = ptd->phList;
-        ptd->phList = pNode->next;
-        free(pNode->arrIndex);
-        free(pNode);
-    }
-}
-
-static void CountMatchCnnct(TreeDataType *ptd, const int *bUserArrCnnct, int nPhoneSeq)
-{
-    RecordNode *p;
-    int i, k, sum;
-
-    for (p = ptd->phList; p; p = p->next) {
-        /* for each record, count its 'nMatchCnnct' */
-        for (sum = 0, i = 1; i < nPhoneSeq; i++) {
-            if (!bUserArrCnnct[i])
-                continue;
-            /* check if matching 'cnnct' */
-            for (k = 0; k < p->nInter; k++) {
-                if (ptd->interval[p->arrIndex[k]].from < i && ptd->interval[p->arrIndex[k]].to > i) {
-                    sum++;
-                    break;
-                }
-            }
-        }
-        p->nMatchCnnct = sum;
-    }
+    /*
+     * Phrase objects of intervals and the highest score records are owned by
+     * the phrasing cache, everything else of this call lives in the arena.
+     */
+    ptd->phList = NULL;
+    ResetPhrasingArena(ptd->arena);
 }
 
 static void ShowList(ChewingData *pgdata, const TreeDataType *ptd)
@@ -1039,18 +1339,23 @@ static RecordNode *NextCut(TreeDataType *tdt, PhrasingOutput *ppo)
     return tdt->phList;
 }
 
-static int SortByIncreaseEnd(const void *x, const void *y)
+/*
+ * Sort intervals by the increase order of end. The sort is stable, so the
+ * intervals having the same end stay in the order of from, and the same set of
+ * intervals always produces the same array.
+ */
+static void SortByIncreaseEnd(TreeDataType *pdt, PhraseIntervalType sorted[])
 {
-    const PhraseIntervalType *interval_x = (const PhraseIntervalType *) x;
-    const PhraseIntervalType *interval_y = (const PhraseIntervalType *) y;
-
-    if (interval_x->to < interval_y->to)
-        return -1;
-
-    if (interval_x->to > interval_y->to)
-        return 1;
+    int count[MAX_PHONE_SEQ_LEN + 2] = { 0 };
+    int i;
 
-    return 0;
+    for (i = 0; i < pdt->nInterval; ++i)
+        ++count[pdt->interval[i].to + 1];
+    for (i = 1; i < MAX_PHONE_SEQ_LEN + 2; ++i)
+        count[i] += count[i - 1];
+    for (i = 0; i < pdt->nInterval; ++i)
+        sorted[count[pdt->interval[i].to]++] = pdt->interval[i];
+    memcpy(pdt->interval, sorted, sizeof(pdt->interval[0]) * pdt->nInterval);
 }
 
 static RecordNode *DuplicateRecordAndInsertInterval(const RecordNode *record, TreeDataType *pdt, const int interval_id)
@@ -1062,16 +1367,14 @@ static RecordNode *DuplicateRecordAndInsertInterval(const RecordNode *record, Tr
 
 
     TRACX("<<<< %s, %d, interval_id=%d >>>>\n", __func__, __LINE__, interval_id);
-    ret = ALC(RecordNode, 1);
+    ret = ARENA_ALC(pdt->arena, RecordNode, 1);
 
     if (!ret)
         return NULL;
 
-    ret->arrIndex = ALC(int, record->nInter + 1);
-    if (!ret->arrIndex) {
-        free(ret);
+    ret->arrIndex = ARENA_ALC(pdt->arena, int, record->nInter + 1);
+    if (!ret->arrIndex)
         return NULL;
-    }
     ret->nInter = record->nInter + 1;
     memcpy(ret->arrIndex, record->arrIndex, sizeof(record->arrIndex[0]) * record->nInter);
 
@@ -1089,16 +1392,14 @@ static RecordNode *CreateSingleIntervalRecord(TreeDataType *pdt, const int inter
     assert(pdt);
 
     TRACX("<<<< %s, %d >>>>\n", __func__, __LINE__);
-    ret = ALC(RecordNode, 1);
+    ret = ARENA_ALC(pdt->arena, RecordNode, 1);
 
     if (!ret)
         return NULL;
 
-    ret->arrIndex = ALC(int, 1);
-    if (!ret->arrIndex) {
-        free(ret);
+    ret->arrIndex = ARENA_ALC(pdt->arena, int, 1);
+    if (!ret->arrIndex)
         return NULL;
-    }
 
     ret->nInter = 1;
     ret->arrIndex[0] = interval_id;
@@ -1108,20 +1409,18 @@ static RecordNode *CreateSingleIntervalRecord(TreeDataType *pdt, const int inter
     return ret;
 }
 
-static RecordNode *CreateNullIntervalRecord()
+static RecordNode *CreateNullIntervalRecord(TreeDataType *pdt)
 {
     RecordNode *ret = NULL;
-    ret = ALC(RecordNode, 1);
+    ret = ARENA_ALC(pdt->arena, RecordNode, 1);
 
     TRACX("<<<< %s, %d >>>>\n", __func__, __LINE__);
     if (!ret)
         return NULL;
 
-    ret->arrIndex = ALC(int, 1);
-    if (!ret->arrIndex) {
-        free(ret);
+    ret->arrIndex = ARENA_ALC(pdt->arena, int, 1);
+    if (!ret->arrIndex)
         return NULL;
-    }
 
     ret->nInter = 0;
     ret->score = 0;
@@ -1129,21 +1428,28 @@ static RecordNode *CreateNullIntervalRecord()
     return ret;
 }
 
-static void FreeRecord(RecordNode *node)
+/* keep record as the highest score phrasing ending at end */
+static RecordNode *SaveHighestScore(PhrasingCache *cache, int end, const RecordNode *record)
 {
-    if (node) {
-        free(node->arrIndex);
-        free(node);
-    }
+    RecordNode *node = &cache->scoreNode[end];
+
+    assert(record->nInter <= MAX_PHONE_SEQ_LEN);
+    *node = *record;
+    node->arrIndex = cache->scoreIndex[end];
+    node->next = NULL;
+    memcpy(node->arrIndex, record->arrIndex, sizeof(record->arrIndex[0]) * record->nInter);
+    return node;
 }
 
 static void DoDpPhrasing(ChewingData *pgdata, TreeDataType *pdt)
 {
-    RecordNode *highest_score[MAX_PHONE_SEQ_LEN] = { 0 };
+    PhrasingCache *cache = pgdata->phrasingCache;
+    RecordNode **highest_score = cache->highest_score;
     RecordNode *tmp;
     int prev_end;
     int end;
     int interval_id;
+    int valid_to;
 
     assert(pgdata);
     assert(pdt);
@@ -1166,15 +1472,32 @@ static void DoDpPhrasing(ChewingData *pgdata, TreeDataType *pdt)
      */
 
     /* The interval shall be sorted by the increase order of end. */
-    {
-	    int i;
-	    for (i = 0; i < pgdata->nSelect; i++) {
-		TRACZ("@@@@@@ %s, %d, pgdata->selectStr[%d]=%s\n", __func__, __LINE__, i, pgdata->selectStr[i]);
-	    }
+    SortByIncreaseEnd(pdt, cache->sortBuf);
+
+    /*
+     * highest_score is kept from the last call. P(0,y-1) only depends on the
+     * intervals ending at or before y, so it is still valid when all these
+     * intervals are the same as last time.
+     */
+    for (interval_id = 0; interval_id < pdt->nInterval && interval_id < cache->nDpInterval; ++interval_id) {
+        if (pdt->interval[interval_id].serial != cache->dpInterval[interval_id].serial
+            || pdt->interval[interval_id].from != cache->dpInterval[interval_id].from
+            || pdt->interval[interval_id].to != cache->dpInterval[interval_id].to)
+            break;
     }
-    qsort(pdt->interval, pdt->nInterval, sizeof(pdt->interval[0]), SortByIncreaseEnd);
+    valid_to = MAX_PHONE_SEQ_LEN + 1;
+    if (interval_id < pdt->nInterval)
+        valid_to = pdt->interval[interval_id].to;
+    if (interval_id < cache->nDpInterval)
+        valid_to = min(valid_to, cache->dpInterval[interval_id].to);
+    ReleaseHighestScore(cache, valid_to - 1);
 
-    for (interval_id = 0; interval_id < pdt->nInterval; ++interval_id) {
+    memcpy(cache->dpInterval, pdt->interval, sizeof(pdt->interval[0]) * pdt->nInterval);
+    cache->nDpInterval = pdt->nInterval;
+
+    for (interval_id = 0; interval_id < pdt->nInterval && pdt->interval[interval_id].to < valid_to; ++interval_id);
+
+    for (; interval_id < pdt->nInterval; ++interval_id) {
         /*
          * XXX: pdt->interval.to is excluding, while end is
          * including, so we need to minus one here.
@@ -1185,6 +1508,9 @@ static void DoDpPhrasing(ChewingData *pgdata, TreeDataType *pdt)
 
         if (prev_end >= 0) {
 	    TRACZ("@@@@@@ %s, %d, highest_score[%d], interval_id=%d\n", __func__, __LINE__,  prev_end, interval_id);
+            /* no phrasing reaches the beginning of this interval */
+            if (!highest_score[prev_end])
+                continue;
             tmp = DuplicateRecordAndInsertInterval(highest_score[prev_end], pdt, interval_id);
 	}
         else {
@@ -1195,56 +1521,391 @@ static void DoDpPhrasing(ChewingData *pgdata, TreeDataType *pdt)
         if (!tmp)
             continue;
 
-        if (highest_score[end] == NULL || highest_score[end]->score < tmp->score) {
-            FreeRecord(highest_score[end]);
-            highest_score[end] = tmp;
-        } else
-            FreeRecord(tmp);
+        if (highest_score[end] == NULL || highest_score[end]->score < tmp->score)
+            highest_score[end] = SaveHighestScore(cache, end, tmp);
     }
 
     if (pgdata->nPhoneSeq - 1 < 0 || highest_score[pgdata->nPhoneSeq - 1] == NULL) {
 	TRACX("-->>-->> %s, %d, pgdata->nPhoneSeq=%d\n", __func__, __LINE__, pgdata->nPhoneSeq);
-        pdt->phList = CreateNullIntervalRecord();
+        pdt->phList = CreateNullIntervalRecord(pdt);
     } else {
         pdt->phList = highest_score[pgdata->nPhoneSeq - 1];
     }
     pdt->nPhListLen = 1;
+}
 
-    for (end = 0; end < pgdata->nPhoneSeq - 1; ++end)
-        FreeRecord(highest_score[end]);
+/*
+ * A partial phrasing of DoBeamPhrasing, linked to the one it extends. The
+ * terms of LoadPhraseAndCountScore are kept so that extending it by one
+ * interval costs O(MAX_PHRASE_LEN) and the score is the same as computed over
+ * the whole record. With the bigram table, the score also has the bonus of
+ * each pair of adjacent phrases, see ExtendBeamNode().
+ */
+typedef struct BeamNode {
+    const struct BeamNode *prev;
+    int interval_id;
+    int nInter;
+    int sumLen;
+    int lenVariance;            /* sum of |len_i - len_j| over all pairs */
+    int freqSum;
+    int nMatchCnnct;
+    int bonusSum;               /* bigram bonus of the adjacent pairs */
+    int score;
+    unsigned char nLen[MAX_PHRASE_LEN + 1];     /* number of intervals of each length */
+} BeamNode;
 
-    {
-	    int i;
-	    for (i = 0; i < pgdata->nSelect; i++) {
-		TRACZ("@@@@@@ %s, %d, pgdata->selectStr[%d]=%s\n", __func__, __LINE__, i, pgdata->selectStr[i]);
-	    }
+/*
+ * First we compare the 'nMatchCnnct'.
+ * If the values are the same, we will compare the 'score'
+ */
+static int CompBeamNode(const BeamNode *a, const BeamNode *b)
+{
+    int diff = b->nMatchCnnct - a->nMatchCnnct;
+
+    if (diff)
+        return diff;
+    return b->score - a->score;
+}
+
+/*
+ * Hash the phrase of each interval for GetBigramBonus(). Return NULL when
+ * there is no bigram table.
+ */
+static uint32_t *HashIntervalPhrases(ChewingData *pgdata, TreeDataType *pdt)
+{
+    uint32_t *hash;
+    int interval_id;
+
+    if (!pgdata->shared->bigram)
+        return NULL;
+
+    hash = ARENA_ALC(pdt->arena, uint32_t, pdt->nInterval);
+    if (!hash)
+        return NULL;
+    for (interval_id = 0; interval_id < pdt->nInterval; ++interval_id)
+        hash[interval_id] = HashPhraseString(pdt->interval[interval_id].p_phr->phrase);
+    return hash;
+}
+
+/*
+ * Extend prev by the interval. hash is the phrase hash of each interval from
+ * HashIntervalPhrases(), or NULL for no bigram bonus.
+ */
+static void ExtendBeamNode(ChewingData *pgdata, BeamNode *node, const BeamNode *prev, const TreeDataType *pdt,
+                           int interval_id, const uint32_t *hash)
+{
+    const PhraseIntervalType *inter = &pdt->interval[interval_id];
+    int len = inter->to - inter->from;
+    int i;
+
+    assert(len > 0 && len <= MAX_PHRASE_LEN);
+
+    *node = *prev;
+    node->prev = prev;
+    node->interval_id = interval_id;
+    for (i = 1; i <= MAX_PHRASE_LEN; ++i)
+        node->lenVariance += prev->nLen[i] * abs(len - i);
+    ++node->nLen[len];
+    ++node->nInter;
+    node->sumLen += len;
+    /* We adjust the 'freq' of One-word Phrase */
+    node->freqSum += (len == 1) ? (inter->p_phr->freq / 512) : inter->p_phr->freq;
+    for (i = inter->from + 1; i < inter->to; ++i) {
+        if (pgdata->bUserArrCnnct[i])
+            ++node->nMatchCnnct;
     }
+    /* a syllable without any phrase breaks the pair */
+    if (hash && prev->nInter > 0 && pdt->interval[prev->interval_id].to == inter->from)
+        node->bonusSum += GetBigramBonus(pgdata, hash[prev->interval_id], hash[interval_id]);
+
+    /* see LoadPhraseAndCountScore */
+    node->score = 1000 * node->sumLen;
+    node->score += 1000 * (6 * node->sumLen / node->nInter);
+    node->score += 100 * -node->lenVariance;
+    node->score += node->freqSum;
+    node->score += node->bonusSum;
 }
 
-int Phrasing(ChewingData *pgdata, int all_phrasing)
+/*
+ * Insert node into beam, which is sorted by CompBeamNode and holds at most
+ * width nodes. Return the slot to store node to, or NULL when node is not
+ * better than any of a full beam.
+ */
+static const BeamNode **InsertBeamNode(const BeamNode **beam, int *nBeam, int width, const BeamNode *node)
 {
-    TreeDataType treeData;
+    int i;
 
-    DEBUG_OUT("\n");
-    TRACY("^^^^^ %s, %d, all_pharseing=%d\n", __func__, __LINE__, all_phrasing);
-    InitPhrasing(&treeData);
+    if (*nBeam == width) {
+        if (CompBeamNode(node, beam[width - 1]) >= 0)
+            return NULL;
+        --*nBeam;
+    }
+    for (i = *nBeam; i > 0 && CompBeamNode(node, beam[i - 1]) < 0; --i)
+        beam[i] = beam[i - 1];
+    ++*nBeam;
+    return &beam[i];
+}
+
+static RecordNode *CreateBeamRecord(TreeDataType *pdt, const BeamNode *node)
+{
+    RecordNode *ret;
+    const BeamNode *p;
+
+    ret = ARENA_ALC(pdt->arena, RecordNode, 1);
+    if (!ret)
+        return NULL;
+    ret->arrIndex = ARENA_ALC(pdt->arena, int, max(node->nInter, 1));
+    if (!ret->arrIndex)
+        return NULL;
+
+    ret->nInter = node->nInter;
+    ret->score = node->score;
+    ret->nMatchCnnct = node->nMatchCnnct;
+    for (p = node; p->nInter > 0; p = p->prev)
+        ret->arrIndex[p->nInter - 1] = p->interval_id;
+    return ret;
+}
+
+/*
+ * Find the k best phrasings for NextCut, where k is the beam width. It is the
+ * DP of DoDpPhrasing keeping the best k records ending at each position
+ * instead of one, so time and memory are bounded by k times the number of
+ * intervals. A syllable without any phrase is left as it is. With the bigram
+ * table, the phrasings are ranked with the bonus like DoViterbiPhrasing.
+ */
+static void DoBeamPhrasing(ChewingData *pgdata, TreeDataType *pdt)
+{
+    static const BeamNode ROOT;
+    static const BeamNode *const ROOT_BEAM[1] = { &ROOT };
+
+    int width = pgdata->phrasingBeamWidth;
+    int len = pgdata->nPhoneSeq;
+    const BeamNode **beam;
+    const BeamNode *const *prev_beam;
+    const BeamNode **slot;
+    int nBeam[MAX_PHONE_SEQ_LEN];
+    int nPrev;
+    BeamNode tmp;
+    BeamNode *node;
+    const uint32_t *hash;
+    RecordNode *records[MAX_PHRASING_BEAM];
+    RecordNode **tail;
+    int interval_id;
+    int end;
+    int i;
+    int j;
+
+    pdt->phList = NULL;
+    pdt->nPhListLen = 0;
+    if (len <= 0)
+        goto null_record;
+
+    beam = ARENA_ALC(pdt->arena, const BeamNode *, len * width);
+    if (!beam)
+        goto null_record;
+    memset(nBeam, 0, sizeof(nBeam));
+
+    /* The interval shall be sorted by the increase order of end. */
+    SortByIncreaseEnd(pdt, pgdata->phrasingCache->sortBuf);
+    hash = HashIntervalPhrases(pgdata, pdt);
+
+    for (end = 0, interval_id = 0; end < len; ++end) {
+        for (; interval_id < pdt->nInterval && pdt->interval[interval_id].to - 1 == end; ++interval_id) {
+            if (pdt->interval[interval_id].from == 0) {
+                prev_beam = ROOT_BEAM;
+                nPrev = 1;
+            } else {
+                prev_beam = &beam[(pdt->interval[interval_id].from - 1) * width];
+                nPrev = nBeam[pdt->interval[interval_id].from - 1];
+            }
+            for (i = 0; i < nPrev; ++i) {
+                ExtendBeamNode(pgdata, &tmp, prev_beam[i], pdt, interval_id, hash);
+                slot = InsertBeamNode(&beam[end * width], &nBeam[end], width, &tmp);
+                if (!slot)
+                    continue;
+                node = ARENA_ALC(pdt->arena, BeamNode, 1);
+                if (!node)
+                    goto null_record;
+                *node = tmp;
+                *slot = node;
+            }
+        }
+
+        if (nBeam[end] == 0) {
+            prev_beam = end ? &beam[(end - 1) * width] : ROOT_BEAM;
+            nBeam[end] = end ? nBeam[end - 1] : 1;
+            memcpy(&beam[end * width], prev_beam, sizeof(beam[0]) * nBeam[end]);
+        }
+    }
+
+    for (i = 0; i < nBeam[len - 1]; ++i) {
+        records[i] = CreateBeamRecord(pdt, beam[(len - 1) * width + i]);
+        if (!records[i])
+            goto null_record;
+    }
+
+    /*
+     * A phrasing whose intervals are all inside the intervals of another one
+     * is only a finer cut of it, and is not listed.
+     */
+    tail = &pdt->phList;
+    for (i = 0; i < nBeam[len - 1]; ++i) {
+        for (j = 0; j < nBeam[len - 1]; ++j) {
+            if (j != i && IsRecContain(records[j]->arrIndex, records[j]->nInter,
+                                       records[i]->arrIndex, records[i]->nInter, pdt))
+                break;
+        }
+        if (j < nBeam[len - 1])
+            continue;
+        records[i]->next = NULL;
+        *tail = records[i];
+        tail = &records[i]->next;
+        ++pdt->nPhListLen;
+    }
+    if (pdt->phList)
+        return;
+
+  null_record:
+    pdt->phList = CreateNullIntervalRecord(pdt);
+    pdt->nPhListLen = 1;
+}
+
+/*
+ * DoDpPhrasing with the bigram table. The score of a phrasing is its score of
+ * LoadPhraseAndCountScore plus the bonus of each pair of adjacent phrases, see
+ * ExtendBeamNode(), so the highest score phrasing is kept for each last
+ * interval instead of each end, which is the Viterbi algorithm over intervals.
+ */
+static void DoViterbiPhrasing(ChewingData *pgdata, TreeDataType *pdt)
+{
+    static const BeamNode ROOT;
+
+    int len = pgdata->nPhoneSeq;
+    /* intervals ending at end are [first[end], first[end + 1]) */
+    int first[MAX_PHONE_SEQ_LEN + 1];
+    const BeamNode **best;
+    const uint32_t *hash;
+    BeamNode tmp;
+    BeamNode candidate;
+    BeamNode *node;
+    int interval_id;
+    int prev_id;
+    int end;
+    int from;
+
+    pdt->phList = NULL;
+    pdt->nPhListLen = 1;
+    if (len <= 0 || pdt->nInterval == 0)
+        goto null_record;
+
+    best = ARENA_ALC(pdt->arena, const BeamNode *, pdt->nInterval);
+    if (!best)
+        goto null_record;
+
+    /* The interval shall be sorted by the increase order of end. */
+    SortByIncreaseEnd(pdt, pgdata->phrasingCache->sortBuf);
+    hash = HashIntervalPhrases(pgdata, pdt);
+    if (!hash)
+        goto null_record;
+
+    for (end = 0, interval_id = 0; end <= len; ++end) {
+        first[end] = interval_id;
+        while (interval_id < pdt->nInterval && pdt->interval[interval_id].to - 1 == end)
+            ++interval_id;
+    }
+
+    for (interval_id = 0; interval_id < pdt->nInterval; ++interval_id) {
+        best[interval_id] = NULL;
+        from = pdt->interval[interval_id].from;
+
+        if (from == 0) {
+            ExtendBeamNode(pgdata, &tmp, &ROOT, pdt, interval_id, hash);
+        } else {
+            tmp.nInter = 0;
+            for (prev_id = first[from - 1]; prev_id < first[from]; ++prev_id) {
+                /* no phrasing reaches the beginning of this interval */
+                if (!best[prev_id])
+                    continue;
+                ExtendBeamNode(pgdata, &candidate, best[prev_id], pdt, interval_id, hash);
+                if (tmp.nInter == 0 || tmp.score < candidate.score)
+                    tmp = candidate;
+            }
+            if (tmp.nInter == 0)
+                continue;
+        }
 
-    FindInterval(pgdata, &treeData);
-    SetInfo(pgdata->nPhoneSeq, &treeData);
-    Discard1(&treeData);
-    Discard2(&treeData);
+        node = ARENA_ALC(pdt->arena, BeamNode, 1);
+        if (!node)
+            goto null_record;
+        *node = tmp;
+        best[interval_id] = node;
+    }
+
+    for (prev_id = -1, interval_id = first[len - 1]; interval_id < first[len]; ++interval_id) {
+        if (best[interval_id] && (prev_id == -1 || best[prev_id]->score < best[interval_id]->score))
+            prev_id = interval_id;
+    }
+    if (prev_id != -1)
+        pdt->phList = CreateBeamRecord(pdt, best[prev_id]);
+    if (pdt->phList)
+        return;
+
+  null_record:
+    pdt->phList = CreateNullIntervalRecord(pdt);
+}
+
+/*
+ * Find the best phrasing of pgdata->phoneSeq into the phList of the returned
+ * TreeDataType, which is owned by the phrasing cache. The caller shall
+ * release it with CleanUpMem(). Return NULL when out of memory.
+ */
+static TreeDataType *FindBestPhrasing(ChewingData *pgdata, int all_phrasing)
+{
+    TreeDataType *ptd;
+
+    if (!pgdata->phrasingCache) {
+        pgdata->phrasingCache = ALC(PhrasingCache, 1);
+        if (!pgdata->phrasingCache) {
+            LOG_ERROR("ALC returns %p", pgdata->phrasingCache);
+            return NULL;
+        }
+    }
+    ptd = &pgdata->phrasingCache->treeData;
+    LockUserphrase(pgdata);
+    if (UserSyncPhraseCache(pgdata))
+        InvalidatePhrasingCache(pgdata);
+    UnlockUserphrase(pgdata);
+    InitPhrasing(ptd);
+    ptd->arena = &pgdata->phrasingCache->arena;
+
+    FindInterval(pgdata, ptd);
+    SetInfo(pgdata->nPhoneSeq, ptd);
+    Discard1(ptd);
+    Discard2(ptd);
     if (all_phrasing) {
 	TRACY("%s, %d\n", __func__, __LINE__);
-        SaveList(&treeData);
-        CountMatchCnnct(&treeData, pgdata->bUserArrCnnct, pgdata->nPhoneSeq);
-        SortListByScore(&treeData);
-        NextCut(&treeData, &pgdata->phrOut);
+        DoBeamPhrasing(pgdata, ptd);
+        NextCut(ptd, &pgdata->phrOut);
+    } else if (pgdata->shared->bigram) {
+        DoViterbiPhrasing(pgdata, ptd);
     } else {
 	TRACY("%s, %d\n", __func__, __LINE__);
-        DoDpPhrasing(pgdata, &treeData);
+        DoDpPhrasing(pgdata, ptd);
     }
 
-    ShowList(pgdata, &treeData);
+    ShowList(pgdata, ptd);
+    return ptd;
+}
+
+int Phrasing(ChewingData *pgdata, int all_phrasing)
+{
+    TreeDataType *ptd;
+
+    DEBUG_OUT("\n");
+    TRACY("^^^^^ %s, %d, all_pharseing=%d\n", __func__, __LINE__, all_phrasing);
+    ptd = FindBestPhrasing(pgdata, all_phrasing);
+    if (!ptd)
+        return -1;
 
     TRACY("%s, %d\n", __func__, __LINE__);
     {
@@ -1254,17 +1915,80 @@ int Phrasing(ChewingData *pgdata, int all_phrasing)
 	    }
     }
     /* set phrasing output */
-    OutputRecordStr(pgdata, &treeData);
+    OutputRecordStr(pgdata, ptd);
     {
 	    int i;
 	    for (i = 0; i < pgdata->nSelect; i++) {
 		TRACZ("@@@@@@ %s, %d, pgdata->selectStr[%d]=%s\n", __func__, __LINE__, i, pgdata->selectStr[i]);
 	    }
     }
-    SaveDispInterval(&pgdata->phrOut, &treeData);
+    SaveDispInterval(&pgdata->phrOut, ptd);
 
     /* free "phrase" */
-    CleanUpMem(&treeData);
+    CleanUpMem(ptd);
     TRACY("%s, %d\n", __func__, __LINE__);
     return 0;
 }
+
+/*
+ * Append str and a separating space to buf. Return 0 on success, or -1 when
+ * buf is too small.
+ */
+static int AppendSegment(char *buf, size_t buf_len, size_t *used, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (*used + len + (*used ? 1 : 0) + 1 > buf_len)
+        return -1;
+    if (*used)
+        buf[(*used)++] = ' ';
+    memcpy(buf + *used, str, len + 1);
+    *used += len;
+    return 0;
+}
+
+int PhrasingText(ChewingData *pgdata, char *buf, size_t buf_len, size_t *used, int *end)
+{
+    TreeDataType *ptd;
+    const PhraseIntervalType *inter;
+    const char *str;
+    char syllable[MAX_UTF8_SIZE * BOPOMOFO_SIZE + 1];
+    int pos = 0;
+    int next;
+    int i = 0;
+    int nSeg = 0;
+
+    ptd = FindBestPhrasing(pgdata, 0);
+    if (!ptd)
+        return -1;
+
+    /* The best path is ordered by position. Syllables without any phrase are
+     * kept as they are. */
+    while (pos < *end) {
+        inter = (ptd->phList && i < ptd->phList->nInter) ? &ptd->interval[ptd->phList->arrIndex[i]] : NULL;
+        if (inter && inter->from == pos) {
+            str = inter->p_phr->phrase;
+            next = inter->to;
+            ++i;
+        } else {
+            PhoneFromUint(syllable, sizeof(syllable), pgdata->phoneSeq[pos]);
+            str = syllable;
+            next = pos + 1;
+        }
+        /* the last segment may continue after *end */
+        if (next == pgdata->nPhoneSeq && *end < pgdata->nPhoneSeq && pos > 0)
+            break;
+        if (AppendSegment(buf, buf_len, used, str))
+            goto error;
+        pos = next;
+        ++nSeg;
+    }
+
+    *end = pos;
+    CleanUpMem(ptd);
+    return nSeg;
+
+  error:
+    CleanUpMem(ptd);
+    return -1;
+}
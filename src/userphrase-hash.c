@@ -20,6 +20,7 @@
 #include "taigi-utf8-util.h"
 #include "hash-private.h"
 #include "dict-private.h"
+#include "key2pho-private.h"
 #include "tree-private.h"
 #include "userphrase-private.h"
 #include "private.h"
@@ -28,12 +29,13 @@
 static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[], int len)
 {
     const TreeType *tree_pos;
+    DictIterator iter;
     int retval;
     Phrase *phrase = ALC(Phrase, 1);
 
     tree_pos = TreeFindPhrase(pgdata, 0, len - 1, phoneSeq);
     if (tree_pos) {
-        GetPhraseFirst(pgdata, phrase, tree_pos);
+        GetPhraseFirst(pgdata, &iter, phrase, tree_pos);
         do {
             /* find the same phrase */
             if (!strcmp(phrase->phrase, wordSeq)) {
@@ -41,7 +43,7 @@ static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], cons
                 free(phrase);
                 return retval;
             }
-        } while (GetVocabNext(pgdata, phrase));
+        } while (GetVocabNext(pgdata, &iter, phrase));
     }
 
     free(phrase);
@@ -52,17 +54,18 @@ static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], cons
 static int LoadMaxFreq(ChewingData *pgdata, const uint32_t phoneSeq[], int len)
 {
     const TreeType *tree_pos;
+    DictIterator iter;
     Phrase *phrase = ALC(Phrase, 1);
     int maxFreq = FREQ_INIT_VALUE;
     UserPhraseData *uphrase;
 
     tree_pos = TreeFindPhrase(pgdata, 0, len - 1, phoneSeq);
     if (tree_pos) {
-        GetPhraseFirst(pgdata, phrase, tree_pos);
+        GetPhraseFirst(pgdata, &iter, phrase, tree_pos);
         do {
             if (phrase->freq > maxFreq)
                 maxFreq = phrase->freq;
-        } while (GetVocabNext(pgdata, phrase));
+        } while (GetVocabNext(pgdata, &iter, phrase));
     }
     free(phrase);
 
@@ -122,7 +125,8 @@ static void LogUserPhrase(ChewingData *pgdata,
 
 void UserUpdatePhraseBegin(ChewingData *pgdata)
 {
-    /* compatibile with sqlite userphrase */
+    /* the records are appended together by UserUpdatePhraseEnd() */
+    pgdata->static_data.hash_batch = 1;
 }
 
 int UserUpdatePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[], int type)
@@ -131,19 +135,20 @@ int UserUpdatePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
     UserPhraseData data;
     int len;
 
-    len = ueStrLen(wordSeq);
+    len = GetPhoneLen(phoneSeq);
     if (len > MAX_PHRASE_LEN)
         return USER_UPDATE_FAIL;
 
+    if (LoadUserphrase(pgdata))
+        return USER_UPDATE_FAIL;
+
+    InvalidatePhrasingCache(pgdata);
+
     pItem = HashFindEntry(pgdata, phoneSeq, wordSeq);
     if (!pItem) {
-        if (!AlcUserPhraseSeq(&data, len, strlen(wordSeq))) {
-            return USER_UPDATE_FAIL;
-        }
-
-        memcpy(data.phoneSeq, phoneSeq, len * sizeof(phoneSeq[0]));
-        data.phoneSeq[len] = 0;
-        strcpy(data.wordSeq, wordSeq);
+        /* HashInsert() copies the phones and the word */
+        data.phoneSeq = (uint32_t *) phoneSeq;
+        data.wordSeq = (char *) wordSeq;
 
         /* load initial freq */
         data.origfreq = LoadOriginalFreq(pgdata, phoneSeq, wordSeq, len);
@@ -151,10 +156,15 @@ int UserUpdatePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
 
         data.userfreq = data.origfreq;
         data.recentTime = pgdata->static_data.taigi_lifetime;
+        data.type = type;
         pItem = HashInsert(pgdata, &data);
+        if (!pItem)
+            return USER_UPDATE_FAIL;
         LogUserPhrase(pgdata, phoneSeq, wordSeq, pItem->data.origfreq, pItem->data.maxfreq, pItem->data.userfreq,
                       pItem->data.recentTime);
         HashModify(pgdata, pItem);
+        if (!pgdata->static_data.hash_batch)
+            FlushHashLog(pgdata);
         return USER_UPDATE_INSERT;
     } else {
         pItem->data.maxfreq = LoadMaxFreq(pgdata, phoneSeq, len);
@@ -166,49 +176,82 @@ int UserUpdatePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
         LogUserPhrase(pgdata, phoneSeq, wordSeq, pItem->data.origfreq, pItem->data.maxfreq, pItem->data.userfreq,
                       pItem->data.recentTime);
         HashModify(pgdata, pItem);
+        if (!pgdata->static_data.hash_batch)
+            FlushHashLog(pgdata);
         return USER_UPDATE_MODIFY;
     }
 }
 
 void UserUpdatePhraseEnd(ChewingData *pgdata)
 {
-    /* compatibile with sqlite userphrase */
+    pgdata->static_data.hash_batch = 0;
+    FlushHashLog(pgdata);
 }
 
 int UserRemovePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
 {
-    HASH_ITEM **prev = NULL;
     HASH_ITEM *item = NULL;
 
     assert(pgdata);
     assert(phoneSeq);
     assert(wordSeq);
 
-    prev = HashFindHead(pgdata, phoneSeq);
-    item = *prev;
+    if (LoadUserphrase(pgdata))
+        return 0;
 
-    while (item) {
-        if (strcmp(item->data.wordSeq, wordSeq) == 0) {
-            /* Remove this phrase by removing */
-            item->data.phoneSeq[0] = 0;
-            item->data.wordSeq[0] = 0;
-            HashModify(pgdata, item);
+    InvalidatePhrasingCache(pgdata);
 
-            *prev = item->next;
-            FreeHashItem(item);
+    item = HashFindEntry(pgdata, phoneSeq, wordSeq);
+    if (!item)
+        return 0;
 
-            return 1;
-        }
-        prev = &item->next;
-        item = item->next;
-    }
+    HashRemove(pgdata, item);
+    return 1;
+}
 
-    return 0;
+/* find the next item of phoneSeq after pItemLast, of the Tai-lo type or not */
+static HASH_ITEM *FindPhonePhraseOfType(ChewingData *pgdata, const uint32_t phoneSeq[], HASH_ITEM *pItemLast,
+                                        int tailo)
+{
+    do {
+        pItemLast = HashFindPhonePhrase(pgdata, phoneSeq, pItemLast);
+    } while (pItemLast && (pItemLast->data.type == TYPE_TAILO) != tailo);
+    return pItemLast;
+}
+
+UserPhraseData *TailoGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    if (LoadUserphrase(pgdata))
+        return NULL;
+
+    pgdata->prev_tailophrase = FindPhonePhraseOfType(pgdata, phoneSeq, NULL, 1);
+    if (!pgdata->prev_tailophrase)
+        return NULL;
+    /* the callers read pgdata->tailophrase_data, as with the sqlite userphrase */
+    pgdata->tailophrase_data = pgdata->prev_tailophrase->data;
+    return &pgdata->tailophrase_data;
+}
+
+UserPhraseData *TailoGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    pgdata->prev_tailophrase = FindPhonePhraseOfType(pgdata, phoneSeq, pgdata->prev_tailophrase, 1);
+    if (!pgdata->prev_tailophrase)
+        return NULL;
+    pgdata->tailophrase_data = pgdata->prev_tailophrase->data;
+    return &pgdata->tailophrase_data;
+}
+
+void TailoGetPhraseEnd(ChewingData *pgdata UNUSED, const uint32_t phoneSeq[] UNUSED)
+{
+    /* compatibile with sqlite userphrase */
 }
 
 UserPhraseData *UserGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
 {
-    pgdata->prev_userphrase = HashFindPhonePhrase(pgdata, phoneSeq, NULL);
+    if (LoadUserphrase(pgdata))
+        return NULL;
+
+    pgdata->prev_userphrase = FindPhonePhraseOfType(pgdata, phoneSeq, NULL, 0);
     if (!pgdata->prev_userphrase)
         return NULL;
     return &(pgdata->prev_userphrase->data);
@@ -216,7 +259,7 @@ UserPhraseData *UserGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[
 
 UserPhraseData *UserGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
 {
-    pgdata->prev_userphrase = HashFindPhonePhrase(pgdata, phoneSeq, pgdata->prev_userphrase);
+    pgdata->prev_userphrase = FindPhonePhraseOfType(pgdata, phoneSeq, pgdata->prev_userphrase, 0);
     if (!pgdata->prev_userphrase)
         return NULL;
     return &(pgdata->prev_userphrase->data);
@@ -227,6 +270,12 @@ void UserGetPhraseEnd(ChewingData *pgdata, const uint32_t phoneSeq[])
     /* FIXME: Remove this */
 }
 
+int UserSyncPhraseCache(ChewingData *pgdata UNUSED)
+{
+    /* the hash table lives in this context only */
+    return 0;
+}
+
 void IncreaseLifeTime(ChewingData *pgdata)
 {
     assert(pgdata);
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "private.h"
 #include "taigi-utf8-util.h"
@@ -32,50 +33,95 @@
 #define LOG_VERBOSE(fmt...)
 #endif
 
+/* learned rows, or seconds since the first of them, before they are written */
+#define USERPHRASE_PENDING_SIZE (16)
+#define USERPHRASE_PENDING_TIME (5)
+
+/* learned rows kept while the database cannot be written, see FlushUserphrase() */
+#define USERPHRASE_PENDING_MAX (1024)
+
+/*
+ * Phone sequence keyed cache in front of STMT_USERPHRASE_SELECT_BY_PHONE,
+ * which returns the rows of both the userphrase and the tailophrase tables.
+ * Phrasing looks up every sub-sequence of the buffer on each keystroke and
+ * most of them have no entry at all, so an entry without rows is kept too,
+ * meaning "nothing here".
+ */
+#define USERPHRASE_CACHE_SIZE (1024)    /* must be a power of 2 */
+#define USERPHRASE_CACHE_LOAD (USERPHRASE_CACHE_SIZE / 4 * 3)
+
+typedef struct UserPhraseCacheEntry {
+    int used;
+    int len;
+    uint32_t phoneSeq[MAX_PHRASE_LEN];
+    /* rows of each USERPHRASE_SOURCE_*, see ComparePhraseCacheRow() */
+    int nRow[USERPHRASE_SOURCE_COUNT];  /* 0 means no phrase for this phone sequence */
+    UserPhraseData *row[USERPHRASE_SOURCE_COUNT];       /* wordSeq of each row is owned by the entry */
+} UserPhraseCacheEntry;
+
+/* a row learned by UserUpdatePhrase() and not written yet, see FlushUserphrase() */
+typedef struct UserPhrasePending {
+    int source;
+    int len;
+    uint32_t phoneSeq[MAX_PHRASE_LEN + 1];
+    UserPhraseData row;         /* wordSeq is owned */
+} UserPhrasePending;
+
+typedef struct UserPhraseCache {
+    UserPhraseCacheEntry entry[USERPHRASE_CACHE_SIZE];
+    int nEntry;
+
+    /* pending rows are kept when the entries are cleared */
+    UserPhrasePending *pending;
+    int nPending;
+    int pendingSize;
+    time_t pendingTime;         /* when the first pending row was queued */
+    time_t retryTime;           /* no flush is due before it, after a failed one */
+
+    /* position of the running Get*PhraseFirst/Next iteration of each table */
+    const UserPhraseCacheEntry *cur[USERPHRASE_SOURCE_COUNT];
+    int curRow[USERPHRASE_SOURCE_COUNT];
+
+    sqlite3_stmt *stmt_data_version;
+    int has_data_version;       /* data_version is known, see GetDataVersion() */
+    unsigned int data_version;
+} UserPhraseCache;
+
+static UserPhraseCache *GetPhraseCache(ChewingData *pgdata);
+static const UserPhraseCacheEntry *LoadPhraseCacheEntry(ChewingData *pgdata, const uint32_t phoneSeq[]);
+static void UpdatePhraseCacheRow(ChewingData *pgdata, int source, const uint32_t phoneSeq[],
+                                 const UserPhraseData *data);
+static void InvalidateUserPhraseCache(ChewingData *pgdata);
+
 
 static int TailoBindPhone(ChewingData *pgdata, int index, const uint32_t phoneSeq[], int len)
 {
-    int i;
+    unsigned char blob[MAX_PHRASE_LEN * PHONE_BLOB_UNIT];
     int ret;
 
     assert(pgdata);
     assert(phoneSeq);
 
-    LOG_VERBOSE("%s, %d, len=%d\n", __func__, __LINE__, len);
+    LOG_VERBOSE("len=%d\n", len);
     if (len > MAX_PHRASE_LEN) {
         LOG_WARN("phoneSeq length %d > MAX_PHRASE_LEN(%d)", len, MAX_PHRASE_LEN);
         return -1;
     }
 
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[index], BIND_TAILOPHRASE_LENGTH, len);
+    ret = sqlite3_bind_blob(pgdata->static_data.stmt_tailophrase[index], BIND_TAILOPHRASE_PHONE,
+                            blob, PackPhoneBlob(blob, phoneSeq, len), SQLITE_TRANSIENT);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
+        LOG_ERROR("sqlite3_bind_blob returns %d", ret);
         return ret;
     }
 
-    for (i = 0; i < len; ++i) {
-        ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[index], BIND_TAILOPHRASE_PHONE_0 + i, phoneSeq[i]);
-        if (ret != SQLITE_OK) {
-            LOG_ERROR("sqlite3_bind_int returns %d, 2nd par=%d, phoneSeq[%d]=%d\n", ret, BIND_TAILOPHRASE_PHONE_0 + i, i, phoneSeq[i]);
-            return ret;
-        }
-    }
-
-    for (i = len; i < MAX_PHRASE_LEN; ++i) {
-        ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[index], BIND_TAILOPHRASE_PHONE_0 + i, 0);
-        if (ret != SQLITE_OK) {
-            LOG_ERROR("sqlite3_bind_int returns %d, 2nd par=%d, phoneSeq[%d]=%d\n", ret, BIND_TAILOPHRASE_PHONE_0 + i, i, phoneSeq[i]);
-            return ret;
-        }
-    }
-
     return SQLITE_OK;
 }
 
 
 static int UserBindPhone(ChewingData *pgdata, int index, const uint32_t phoneSeq[], int len)
 {
-    int i;
+    unsigned char blob[MAX_PHRASE_LEN * PHONE_BLOB_UNIT];
     int ret;
 
     assert(pgdata);
@@ -87,28 +133,13 @@ static int UserBindPhone(ChewingData *pgdata, int index, const uint32_t phoneSeq
         return -1;
     }
 
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[index], BIND_USERPHRASE_LENGTH, len);
+    ret = sqlite3_bind_blob(pgdata->static_data.stmt_userphrase[index], BIND_USERPHRASE_PHONE,
+                            blob, PackPhoneBlob(blob, phoneSeq, len), SQLITE_TRANSIENT);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
+        LOG_ERROR("sqlite3_bind_blob returns %d", ret);
         return ret;
     }
 
-    for (i = 0; i < len; ++i) {
-        ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[index], BIND_USERPHRASE_PHONE_0 + i, phoneSeq[i]);
-        if (ret != SQLITE_OK) {
-            LOG_ERROR("sqlite3_bind_int returns %d, 2nd par=%d, phoneSeq[%d]=%d\n", ret, BIND_USERPHRASE_PHONE_0 + i, i, phoneSeq[i]);
-            return ret;
-        }
-    }
-
-    for (i = len; i < MAX_PHRASE_LEN; ++i) {
-        ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[index], BIND_USERPHRASE_PHONE_0 + i, 0);
-        if (ret != SQLITE_OK) {
-            LOG_ERROR("sqlite3_bind_int returns %d, 2nd par=%d, phoneSeq[%d]=%d\n", ret, BIND_USERPHRASE_PHONE_0 + i, i, phoneSeq[i]);
-            return ret;
-        }
-    }
-
     return SQLITE_OK;
 }
 
@@ -117,6 +148,7 @@ static int UserBindPhone(ChewingData *pgdata, int index, const uint32_t phoneSeq
 static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[], int len)
 {
     const TreeType *tree_pos;
+    DictIterator iter;
     int retval;
     Phrase *phrase = ALC(Phrase, 1);
 
@@ -124,7 +156,7 @@ static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], cons
     LOG_VERBOSE("%s, %d, len=%d\n", __func__, __LINE__, len);
     tree_pos = TreeFindPhrase(pgdata, 0, len - 1, phoneSeq);
     if (tree_pos) {
-        GetPhraseFirst(pgdata, phrase, tree_pos);
+        GetPhraseFirst(pgdata, &iter, phrase, tree_pos);
         do {
             /* find the same phrase */
             if (!strcmp(phrase->phrase, wordSeq)) {
@@ -132,57 +164,35 @@ static int LoadOriginalFreq(ChewingData *pgdata, const uint32_t phoneSeq[], cons
                 free(phrase);
                 return retval;
             }
-        } while (GetVocabNext(pgdata, phrase));
+        } while (GetVocabNext(pgdata, &iter, phrase));
     }
 
     free(phrase);
     return FREQ_INIT_VALUE;
 }
 
-/* find the maximum frequency of the same phrase */
-static int LoadMaxFreq(ChewingData *pgdata, const uint32_t phoneSeq[], int len)
+/*
+ * find the maximum frequency of the same phrase, from the first leaf in the
+ * static dict and the first cached row of source
+ */
+static int LoadMaxFreq(ChewingData *pgdata, int source, const uint32_t phoneSeq[], int len)
 {
     const TreeType *tree_pos;
-    Phrase *phrase = ALC(Phrase, 1);
+    const UserPhraseCacheEntry *entry;
     int maxFreq = FREQ_INIT_VALUE;
-    int max_userphrase_freq;
-    int ret;
+    int freq;
 
     LOG_VERBOSE("%s, %d, len=%d\n", __func__, __LINE__, len);
     tree_pos = TreeFindPhrase(pgdata, 0, len - 1, phoneSeq);
     if (tree_pos) {
-        GetPhraseFirst(pgdata, phrase, tree_pos);
-        do {
-            if (phrase->freq > maxFreq)
-                maxFreq = phrase->freq;
-        } while (GetVocabNext(pgdata, phrase));
+        freq = GetPhraseMaxFreq(pgdata, tree_pos);
+        if (freq > maxFreq)
+            maxFreq = freq;
     }
-    free(phrase);
 
-    assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_GET_MAX_FREQ]);
-
-    ret = UserBindPhone(pgdata, STMT_USERPHRASE_GET_MAX_FREQ, phoneSeq, len);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("UserBindPhone returns %d", ret);
-        return maxFreq;
-    }
-
-    ret = sqlite3_step(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_GET_MAX_FREQ]);
-    if (ret != SQLITE_ROW)
-        return maxFreq;
-
-    ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_GET_MAX_FREQ]);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_reset returns %d", ret);
-        return maxFreq;
-    }
-
-    max_userphrase_freq = sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_GET_MAX_FREQ],
-                                             SQL_STMT_USERPHRASE[STMT_USERPHRASE_GET_MAX_FREQ].column
-                                             [COLUMN_USERPHRASE_USER_FREQ]);
-
-    if (max_userphrase_freq > maxFreq)
-        maxFreq = max_userphrase_freq;
+    entry = LoadPhraseCacheEntry(pgdata, phoneSeq);
+    if (entry && entry->nRow[source] && entry->row[source][0].userfreq > maxFreq)
+        maxFreq = entry->row[source][0].userfreq;
 
     return maxFreq;
 }
@@ -236,9 +246,101 @@ static void LogUserPhrase(ChewingData *pgdata,
              wordSeq, buf, orig_freq, max_freq, user_freq, recent_time);
 }
 
+static UserPhrasePending *FindPendingRow(UserPhraseCache *cache, int source, const uint32_t phoneSeq[], int len,
+                                         const char wordSeq[])
+{
+    int i;
+
+    for (i = 0; i < cache->nPending; ++i) {
+        if (cache->pending[i].source == source && cache->pending[i].len == len &&
+            !memcmp(cache->pending[i].phoneSeq, phoneSeq, len * sizeof(phoneSeq[0])) &&
+            !strcmp(cache->pending[i].row.wordSeq, wordSeq))
+            return &cache->pending[i];
+    }
+    return NULL;
+}
+
+/* queue data as the row of source to be written, replacing a pending one */
+static int QueuePendingRow(UserPhraseCache *cache, int source, const uint32_t phoneSeq[], int len,
+                           const UserPhraseData *data)
+{
+    UserPhrasePending *pending;
+    char *wordSeq;
+
+    pending = FindPendingRow(cache, source, phoneSeq, len, data->wordSeq);
+    if (pending) {
+        wordSeq = pending->row.wordSeq;
+    } else {
+        if (cache->nPending >= USERPHRASE_PENDING_MAX)
+            return -1;
+        if (cache->nPending == cache->pendingSize) {
+            pending = realloc(cache->pending, (cache->pendingSize + USERPHRASE_PENDING_SIZE) * sizeof(*pending));
+            if (!pending)
+                return -1;
+            cache->pending = pending;
+            cache->pendingSize += USERPHRASE_PENDING_SIZE;
+        }
+        wordSeq = strdup(data->wordSeq);
+        if (!wordSeq)
+            return -1;
+        if (cache->nPending == 0)
+            cache->pendingTime = time(NULL);
+        pending = &cache->pending[cache->nPending++];
+        pending->source = source;
+        pending->len = len;
+        memcpy(pending->phoneSeq, phoneSeq, len * sizeof(phoneSeq[0]));
+        pending->phoneSeq[len] = 0;
+    }
+
+    pending->row = *data;
+    pending->row.phoneSeq = NULL;
+    pending->row.wordSeq = wordSeq;
+    return 0;
+}
+
+static void FreePendingRows(UserPhraseCache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->nPending; ++i)
+        free(cache->pending[i].row.wordSeq);
+    cache->nPending = 0;
+}
+
+/*
+ * Whether the pending rows shall be written now, or as soon as possible if
+ * asap is set. Either waits for USERPHRASE_PENDING_TIME after a failed flush.
+ */
+static int IsPendingDue(ChewingData *pgdata, int asap)
+{
+    UserPhraseCache *cache = pgdata->userphraseCache;
+    time_t now;
+
+    if (!cache || !cache->nPending)
+        return 0;
+    now = time(NULL);
+    if (now < cache->retryTime)
+        return 0;
+    return asap || cache->nPending >= USERPHRASE_PENDING_SIZE || now - cache->pendingTime >= USERPHRASE_PENDING_TIME;
+}
+
+/*
+ * The rows learned by AutoLearnPhrase are written behind: they are queued in
+ * memory, where the lookups of this connection see them at once, until there
+ * are USERPHRASE_PENDING_SIZE of them or the first of them is
+ * USERPHRASE_PENDING_TIME seconds old. Then FlushUserphrase() writes them in
+ * one short transaction, so that the journal is not created and deleted on
+ * each commit, and no transaction is left open to lock out other connections
+ * between the calls. While the database is locked by another connection, at
+ * most USERPHRASE_PENDING_MAX rows are kept, and no flush is tried for
+ * USERPHRASE_PENDING_TIME after a failed one, so that the keystrokes do not
+ * wait for the busy timeout.
+ */
 void UserUpdatePhraseBegin(ChewingData *pgdata)
 {
-    sqlite3_exec(pgdata->static_data.db, "BEGIN", 0, 0, 0);
+    if (LoadUserphrase(pgdata))
+        return;
+    pgdata->static_data.userphrase_batch = 1;
 }
 
 /*
@@ -247,6 +349,9 @@ void UserUpdatePhraseBegin(ChewingData *pgdata)
  */
 static int UserUpdatePhrase_Tailo(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
 {
+    UserPhraseCache *cache;
+    UserPhrasePending *pending;
+    UserPhraseData row;
     int ret;
     int action;
     int phone_len;
@@ -287,17 +392,32 @@ static int UserUpdatePhrase_Tailo(ChewingData *pgdata, const uint32_t phoneSeq[]
         goto end;
     }
 
+    cache = GetPhraseCache(pgdata);
+    if (!cache) {
+        LOG_ERROR("GetPhraseCache returns %p", cache);
+        action = USER_UPDATE_FAIL;
+        goto end;
+    }
+
     recent_time = GetCurrentLifeTime(pgdata);
 
     ret = sqlite3_step(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE]);
-    if (ret == SQLITE_ROW) {
+    pending = FindPendingRow(cache, USERPHRASE_SOURCE_TAILO, phoneSeq, phone_len, wordSeq);
+    if (pending) {
+        /* the pending row is newer than the one in the database */
+        action = USER_UPDATE_MODIFY;
+
+        orig_freq = pending->row.origfreq;
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_TAILO, phoneSeq, phone_len);
+        user_freq = UpdateFreq(pending->row.userfreq, max_freq, orig_freq, recent_time - pending->row.recentTime);
+    } else if (ret == SQLITE_ROW) {
         action = USER_UPDATE_MODIFY;
 
         orig_freq = sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE],
                                        SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE].column
                                        [COLUMN_TAILOPHRASE_ORIG_FREQ]);
 
-        max_freq = LoadMaxFreq(pgdata, phoneSeq, phone_len);
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_TAILO, phoneSeq, phone_len);
 
         user_freq = sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE],
                                        SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE].column
@@ -312,82 +432,26 @@ static int UserUpdatePhrase_Tailo(ChewingData *pgdata, const uint32_t phoneSeq[]
         action = USER_UPDATE_INSERT;
 
         orig_freq = LoadOriginalFreq(pgdata, phoneSeq, wordSeq, word_len);
-        max_freq = LoadMaxFreq(pgdata, phoneSeq, phone_len);
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_TAILO, phoneSeq, phone_len);
         user_freq = orig_freq;
     }
 
-    assert(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT]);
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                           BIND_TAILOPHRASE_TIME, recent_time);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                           BIND_TAILOPHRASE_USER_FREQ, user_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                           BIND_TAILOPHRASE_MAX_FREQ, max_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                           BIND_TAILOPHRASE_ORIG_FREQ, orig_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = TailoBindPhone(pgdata, STMT_TAILOPHRASE_UPSERT, phoneSeq, phone_len);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("TailoBindPhone returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_text(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                            BIND_TAILOPHRASE_PHRASE, wordSeq, -1, SQLITE_STATIC);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_text returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT],
-                           BIND_TAILOPHRASE_TYPE, TYPE_TAILO);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_step(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT]);
-    if (ret != SQLITE_DONE) {
-        LOG_ERROR("sqlite3_step returns %d", ret);
+    row.wordSeq = (char *) wordSeq;
+    row.userfreq = user_freq;
+    row.recentTime = recent_time;
+    row.origfreq = orig_freq;
+    row.maxfreq = max_freq;
+    row.type = TYPE_TAILO;
+    if (QueuePendingRow(cache, USERPHRASE_SOURCE_TAILO, phoneSeq, phone_len, &row)) {
+        LOG_ERROR("QueuePendingRow fails");
         action = USER_UPDATE_FAIL;
         goto end;
     }
+    UpdatePhraseCacheRow(pgdata, USERPHRASE_SOURCE_TAILO, phoneSeq, &row);
 
     LogUserPhrase(pgdata, phoneSeq, wordSeq, orig_freq, max_freq, user_freq, recent_time);
 
   end:
-    ret = sqlite3_reset(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT]);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_reset returns %d", ret);
-    }
-
     ret = sqlite3_reset(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE_PHRASE]);
     if (ret != SQLITE_OK) {
         LOG_ERROR("sqlite3_reset returns %d", ret);
@@ -399,6 +463,9 @@ static int UserUpdatePhrase_Tailo(ChewingData *pgdata, const uint32_t phoneSeq[]
 
 static int UserUpdatePhrase_Han(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
 {
+    UserPhraseCache *cache;
+    UserPhrasePending *pending;
+    UserPhraseData row;
     int ret;
     int action;
     int phone_len;
@@ -438,17 +505,32 @@ static int UserUpdatePhrase_Han(ChewingData *pgdata, const uint32_t phoneSeq[],
         goto end;
     }
 
+    cache = GetPhraseCache(pgdata);
+    if (!cache) {
+        LOG_ERROR("GetPhraseCache returns %p", cache);
+        action = USER_UPDATE_FAIL;
+        goto end;
+    }
+
     recent_time = GetCurrentLifeTime(pgdata);
 
     ret = sqlite3_step(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE]);
-    if (ret == SQLITE_ROW) {
+    pending = FindPendingRow(cache, USERPHRASE_SOURCE_USER, phoneSeq, phone_len, wordSeq);
+    if (pending) {
+        /* the pending row is newer than the one in the database */
+        action = USER_UPDATE_MODIFY;
+
+        orig_freq = pending->row.origfreq;
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_USER, phoneSeq, phone_len);
+        user_freq = UpdateFreq(pending->row.userfreq, max_freq, orig_freq, recent_time - pending->row.recentTime);
+    } else if (ret == SQLITE_ROW) {
         action = USER_UPDATE_MODIFY;
 
         orig_freq = sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE],
                                        SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE].column
                                        [COLUMN_USERPHRASE_ORIG_FREQ]);
 
-        max_freq = LoadMaxFreq(pgdata, phoneSeq, phone_len);
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_USER, phoneSeq, phone_len);
 
         user_freq = sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE],
                                        SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE].column
@@ -463,82 +545,26 @@ static int UserUpdatePhrase_Han(ChewingData *pgdata, const uint32_t phoneSeq[],
         action = USER_UPDATE_INSERT;
 
         orig_freq = LoadOriginalFreq(pgdata, phoneSeq, wordSeq, word_len);
-        max_freq = LoadMaxFreq(pgdata, phoneSeq, phone_len);
+        max_freq = LoadMaxFreq(pgdata, USERPHRASE_SOURCE_USER, phoneSeq, phone_len);
         user_freq = orig_freq;
     }
 
-    assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT]);
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                           BIND_USERPHRASE_TIME, recent_time);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                           BIND_USERPHRASE_USER_FREQ, user_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                           BIND_USERPHRASE_MAX_FREQ, max_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                           BIND_USERPHRASE_ORIG_FREQ, orig_freq);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = UserBindPhone(pgdata, STMT_USERPHRASE_UPSERT, phoneSeq, phone_len);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("UserBindPhone returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_text(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                            BIND_USERPHRASE_PHRASE, wordSeq, -1, SQLITE_STATIC);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_text returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_bind_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT],
-                           BIND_USERPHRASE_TYPE, TYPE_HAN);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_bind_int returns %d", ret);
-        action = USER_UPDATE_FAIL;
-        goto end;
-    }
-
-    ret = sqlite3_step(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT]);
-    if (ret != SQLITE_DONE) {
-        LOG_ERROR("sqlite3_step returns %d", ret);
+    row.wordSeq = (char *) wordSeq;
+    row.userfreq = user_freq;
+    row.recentTime = recent_time;
+    row.origfreq = orig_freq;
+    row.maxfreq = max_freq;
+    row.type = TYPE_HAN;
+    if (QueuePendingRow(cache, USERPHRASE_SOURCE_USER, phoneSeq, phone_len, &row)) {
+        LOG_ERROR("QueuePendingRow fails");
         action = USER_UPDATE_FAIL;
         goto end;
     }
+    UpdatePhraseCacheRow(pgdata, USERPHRASE_SOURCE_USER, phoneSeq, &row);
 
     LogUserPhrase(pgdata, phoneSeq, wordSeq, orig_freq, max_freq, user_freq, recent_time);
 
   end:
-    ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT]);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_reset returns %d", ret);
-    }
-
     ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE_PHRASE]);
     if (ret != SQLITE_OK) {
         LOG_ERROR("sqlite3_reset returns %d", ret);
@@ -549,22 +575,111 @@ static int UserUpdatePhrase_Han(ChewingData *pgdata, const uint32_t phoneSeq[],
 
 int UserUpdatePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[], int type)
 {
-    int phone_len;
-    int word_len;
+    int action;
 
     assert(pgdata);
     assert(phoneSeq);
     assert(wordSeq);
 
+    if (LoadUserphrase(pgdata))
+        return USER_UPDATE_FAIL;
+
+    InvalidatePhrasingCache(pgdata);
+
     if (type == TYPE_TAILO)
-	    return UserUpdatePhrase_Tailo(pgdata, phoneSeq, wordSeq);
+	    action = UserUpdatePhrase_Tailo(pgdata, phoneSeq, wordSeq);
+    else
+	    action = UserUpdatePhrase_Han(pgdata, phoneSeq, wordSeq);
+
+    /* outside of a batch, the row is written at once */
+    if (!pgdata->static_data.userphrase_batch && IsPendingDue(pgdata, 1))
+        FlushUserphrase(pgdata);
 
-    return UserUpdatePhrase_Han(pgdata, phoneSeq, wordSeq);
+    return action;
 }
 
 void UserUpdatePhraseEnd(ChewingData *pgdata)
 {
-    sqlite3_exec(pgdata->static_data.db, "END", 0, 0, 0);
+    if (!pgdata->static_data.userphrase_ready)
+        return;
+    pgdata->static_data.userphrase_batch = 0;
+    if (IsPendingDue(pgdata, 0))
+        FlushUserphrase(pgdata);
+}
+
+static int WritePendingRow(ChewingData *pgdata, const UserPhrasePending *pending)
+{
+    sqlite3_stmt *stmt;
+    unsigned char blob[MAX_PHRASE_LEN * PHONE_BLOB_UNIT];
+    int ret;
+
+    /* the binds of tailo_v2 are the same as userphrase_v2 */
+    STATIC_ASSERT((int) BIND_USERPHRASE_PHONE == (int) BIND_TAILOPHRASE_PHONE);
+
+    if (pending->source == USERPHRASE_SOURCE_TAILO)
+        stmt = pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_UPSERT];
+    else
+        stmt = pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_UPSERT];
+    assert(stmt);
+
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_TIME, pending->row.recentTime);
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_ORIG_FREQ, pending->row.origfreq);
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_MAX_FREQ, pending->row.maxfreq);
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_USER_FREQ, pending->row.userfreq);
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_LENGTH, pending->len);
+    sqlite3_bind_text(stmt, BIND_USERPHRASE_PHRASE, pending->row.wordSeq, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, BIND_USERPHRASE_TYPE, pending->row.type);
+    sqlite3_bind_blob(stmt, BIND_USERPHRASE_PHONE, blob, PackPhoneBlob(blob, pending->phoneSeq, pending->len),
+                      SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/*
+ * Write the pending rows in one transaction. When it fails, such as another
+ * connection is writing for longer than the busy timeout, the transaction is
+ * rolled back and the rows are kept for the next flush, which is not due for
+ * USERPHRASE_PENDING_TIME.
+ */
+void FlushUserphrase(ChewingData *pgdata)
+{
+    UserPhraseCache *cache = pgdata->userphraseCache;
+    int ret;
+    int i;
+
+    if (!cache || !cache->nPending)
+        return;
+
+    ret = sqlite3_exec(pgdata->static_data.db, "BEGIN", 0, 0, 0);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot begin transaction, error = %d", ret);
+        goto retry;
+    }
+
+    for (i = 0; i < cache->nPending; ++i) {
+        ret = WritePendingRow(pgdata, &cache->pending[i]);
+        if (ret != SQLITE_OK) {
+            LOG_ERROR("sqlite3_step returns %d", ret);
+            goto rollback;
+        }
+    }
+
+    ret = sqlite3_exec(pgdata->static_data.db, "COMMIT", 0, 0, 0);
+    if (ret != SQLITE_OK) {
+        LOG_ERROR("Cannot commit transaction, error = %d", ret);
+        goto rollback;
+    }
+
+    FreePendingRows(cache);
+    cache->retryTime = 0;
+    return;
+
+  rollback:
+    sqlite3_exec(pgdata->static_data.db, "ROLLBACK", 0, 0, 0);
+  retry:
+    cache->retryTime = time(NULL) + USERPHRASE_PENDING_TIME;
 }
 
 int UserRemovePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char wordSeq[])
@@ -577,8 +692,18 @@ int UserRemovePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
     assert(phoneSeq);
     assert(wordSeq);
 
+    if (LoadUserphrase(pgdata))
+        return 0;
+
     assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_DELETE]);
 
+    /* a pending row would be written back after the removal */
+    FlushUserphrase(pgdata);
+    if (pgdata->userphraseCache && pgdata->userphraseCache->nPending)
+        return 0;
+
+    InvalidatePhrasingCache(pgdata);
+
     len = GetPhoneLen(phoneSeq);
     ret = UserBindPhone(pgdata, STMT_USERPHRASE_DELETE, phoneSeq, len);
     if (ret != SQLITE_OK) {
@@ -600,6 +725,7 @@ int UserRemovePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
     }
 
     affected = sqlite3_changes(pgdata->static_data.db);
+    InvalidateUserPhraseCache(pgdata);
 
   end:
     ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_DELETE]);
@@ -610,144 +736,414 @@ int UserRemovePhrase(ChewingData *pgdata, const uint32_t phoneSeq[], const char
     return affected;
 }
 
-UserPhraseData *TailoGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
+static UserPhraseCache *GetPhraseCache(ChewingData *pgdata)
+{
+    if (!pgdata->userphraseCache)
+        pgdata->userphraseCache = ALC(UserPhraseCache, 1);
+    return pgdata->userphraseCache;
+}
+
+static unsigned int HashPhraseCacheKey(const uint32_t phoneSeq[], int len)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= phoneSeq[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* the order of STMT_USERPHRASE_SELECT_BY_PHONE: decreasing user frequency, then phrase */
+static int ComparePhraseCacheRow(const UserPhraseData *a, const UserPhraseData *b)
+{
+    if (a->userfreq != b->userfreq)
+        return a->userfreq > b->userfreq ? -1 : 1;
+    return strcmp(a->wordSeq, b->wordSeq);
+}
+
+static void FreePhraseCacheRows(UserPhraseCacheEntry *entry)
+{
+    int source;
+    int i;
+
+    for (source = 0; source < USERPHRASE_SOURCE_COUNT; ++source) {
+        for (i = 0; i < entry->nRow[source]; ++i)
+            free(entry->row[source][i].wordSeq);
+        free(entry->row[source]);
+    }
+}
+
+static void ClearPhraseCache(UserPhraseCache *cache)
+{
+    int i;
+
+    for (i = 0; i < USERPHRASE_CACHE_SIZE; ++i) {
+        if (cache->entry[i].used)
+            FreePhraseCacheRows(&cache->entry[i]);
+    }
+    memset(cache->entry, 0, sizeof(cache->entry));
+    cache->nEntry = 0;
+    memset(cache->cur, 0, sizeof(cache->cur));
+}
+
+static int ReadPhraseCacheRows(sqlite3_stmt *stmt, const SqlStmtUserphrase *sql, UserPhraseCacheEntry *entry)
 {
+    UserPhraseData *row;
+    const char *text;
+    int size[USERPHRASE_SOURCE_COUNT] = { 0 };
+    int source;
     int ret;
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        source = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_SOURCE]);
+        if (source < 0 || source >= USERPHRASE_SOURCE_COUNT)
+            continue;
+        if (entry->nRow[source] == size[source]) {
+            size[source] = size[source] ? size[source] * 2 : 4;
+            row = realloc(entry->row[source], size[source] * sizeof(*row));
+            if (!row)
+                return SQLITE_NOMEM;
+            entry->row[source] = row;
+        }
+        row = &entry->row[source][entry->nRow[source]];
+        row->phoneSeq = NULL;
+        text = (const char *) sqlite3_column_text(stmt, sql->column[COLUMN_USERPHRASE_PHRASE]);
+        row->wordSeq = strdup(text ? text : "");
+        if (!row->wordSeq)
+            return SQLITE_NOMEM;
+        row->recentTime = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_TIME]);
+        row->userfreq = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_USER_FREQ]);
+        row->maxfreq = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_MAX_FREQ]);
+        row->origfreq = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_ORIG_FREQ]);
+        row->type = sqlite3_column_int(stmt, sql->column[COLUMN_USERPHRASE_TYPE]);
+        ++entry->nRow[source];
+    }
+
+    return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+/* return the entry of phoneSeq, or the unused entry where it goes */
+static UserPhraseCacheEntry *ProbePhraseCache(UserPhraseCache *cache, const uint32_t phoneSeq[], int len)
+{
+    UserPhraseCacheEntry *entry;
+    unsigned int pos;
+
+    pos = HashPhraseCacheKey(phoneSeq, len) & (USERPHRASE_CACHE_SIZE - 1);
+    for (;; pos = (pos + 1) & (USERPHRASE_CACHE_SIZE - 1)) {
+        entry = &cache->entry[pos];
+        if (!entry->used)
+            return entry;
+        if (entry->len == len && !memcmp(entry->phoneSeq, phoneSeq, len * sizeof(phoneSeq[0])))
+            return entry;
+    }
+}
+
+/* add or replace the row of source in entry, keeping the order of the rows */
+static int MergePhraseCacheRow(UserPhraseCacheEntry *entry, int source, const UserPhraseData *data)
+{
+    UserPhraseData *row;
+    UserPhraseData tmp;
+    int i;
+
+    for (i = 0; i < entry->nRow[source]; ++i) {
+        if (!strcmp(entry->row[source][i].wordSeq, data->wordSeq))
+            break;
+    }
+
+    if (i == entry->nRow[source]) {
+        row = realloc(entry->row[source], (i + 1) * sizeof(*row));
+        if (!row)
+            return -1;
+        entry->row[source] = row;
+        row[i].wordSeq = strdup(data->wordSeq);
+        if (!row[i].wordSeq)
+            return -1;
+        ++entry->nRow[source];
+    }
+
+    row = entry->row[source];
+    tmp = *data;
+    tmp.phoneSeq = NULL;
+    tmp.wordSeq = row[i].wordSeq;
+
+    for (; i > 0 && ComparePhraseCacheRow(&row[i - 1], &tmp) > 0; --i)
+        row[i] = row[i - 1];
+    for (; i + 1 < entry->nRow[source] && ComparePhraseCacheRow(&row[i + 1], &tmp) < 0; ++i)
+        row[i] = row[i + 1];
+    row[i] = tmp;
+    return 0;
+}
+
+/* find the cache entry of phoneSeq, query both tables when it is not cached */
+static const UserPhraseCacheEntry *LoadPhraseCacheEntry(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    UserPhraseCache *cache;
+    UserPhraseCacheEntry *entry;
+    sqlite3_stmt *stmt;
     int len;
+    int ret;
+    int i;
 
-    assert(pgdata);
-    assert(phoneSeq);
+    len = GetPhoneLen(phoneSeq);
+    LOG_INFO("len=%d", len);
+    if (len > MAX_PHRASE_LEN) {
+        LOG_WARN("phoneSeq length %d > MAX_PHRASE_LEN(%d)", len, MAX_PHRASE_LEN);
+        return NULL;
+    }
+
+    cache = GetPhraseCache(pgdata);
+    if (!cache)
+        return NULL;
+
+    entry = ProbePhraseCache(cache, phoneSeq, len);
+    if (entry->used)
+        return entry;
+
+    if (cache->nEntry >= USERPHRASE_CACHE_LOAD) {
+        ClearPhraseCache(cache);
+        entry = ProbePhraseCache(cache, phoneSeq, len);
+    }
 
-    assert(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE]);
-    ret = sqlite3_reset(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE]);
+    assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE]);
+    stmt = pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE];
+    ret = UserBindPhone(pgdata, STMT_USERPHRASE_SELECT_BY_PHONE, phoneSeq, len);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_reset returns %d", ret);
+        LOG_ERROR("UserBindPhone returns %d", ret);
+        sqlite3_reset(stmt);
         return NULL;
     }
 
-    len = GetPhoneLen(phoneSeq);
-    LOG_INFO("len=%d", len);
-    ret = TailoBindPhone(pgdata, STMT_TAILOPHRASE_SELECT_BY_PHONE, phoneSeq, len);
+    memset(entry, 0, sizeof(*entry));
+    entry->len = len;
+    memcpy(entry->phoneSeq, phoneSeq, len * sizeof(phoneSeq[0]));
+
+    ret = ReadPhraseCacheRows(stmt, &SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE], entry);
+    sqlite3_reset(stmt);
+
+    /* the pending rows are not in the database yet */
+    for (i = 0; ret == SQLITE_OK && i < cache->nPending; ++i) {
+        if (cache->pending[i].len == len && !memcmp(cache->pending[i].phoneSeq, phoneSeq, len * sizeof(phoneSeq[0]))
+            && MergePhraseCacheRow(entry, cache->pending[i].source, &cache->pending[i].row))
+            ret = SQLITE_NOMEM;
+    }
+
     if (ret != SQLITE_OK) {
-        LOG_ERROR("TailoBindPhone returns %d", ret);
+        /* do not remember a partial result */
+        LOG_ERROR("sqlite3_step returns %d", ret);
+        FreePhraseCacheRows(entry);
+        memset(entry, 0, sizeof(*entry));
         return NULL;
     }
-    
-    return TailoGetPhraseNext(pgdata, phoneSeq);
+
+    entry->used = 1;
+    ++cache->nEntry;
+    return entry;
 }
 
-UserPhraseData *TailoGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
+static UserPhraseData *GetPhraseCacheRow(ChewingData *pgdata, int source, UserPhraseData *data,
+                                         const uint32_t phoneSeq[])
 {
-    int ret;
+    UserPhraseCache *cache = pgdata->userphraseCache;
+    const UserPhraseCacheEntry *entry;
 
-    assert(pgdata);
-    assert(phoneSeq);
+    if (!cache || !cache->cur[source])
+        return NULL;
 
-    ret = sqlite3_step(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE]);
-    if (ret != SQLITE_ROW)
+    entry = cache->cur[source];
+    if (cache->curRow[source] >= entry->nRow[source]) {
+        cache->cur[source] = NULL;
         return NULL;
+    }
 
-    /* FIXME: shall not remove const here. */
-    pgdata->tailophrase_data.wordSeq =
-        (char *) sqlite3_column_text(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                                     SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column
-                                     [COLUMN_TAILOPHRASE_PHRASE]);
-    pgdata->tailophrase_data.phoneSeq = (uint32_t *) phoneSeq;
+    *data = entry->row[source][cache->curRow[source]++];
+    data->phoneSeq = (uint32_t *) phoneSeq;
+    return data;
+}
 
-    pgdata->tailophrase_data.recentTime =
-        sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column[COLUMN_TAILOPHRASE_TIME]);
+static void InvalidateUserPhraseCache(ChewingData *pgdata)
+{
+    if (pgdata->userphraseCache)
+        ClearPhraseCache(pgdata->userphraseCache);
+}
 
-    pgdata->tailophrase_data.userfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column[COLUMN_TAILOPHRASE_USER_FREQ]);
+/*
+ * Apply a row just learned to source to the cached entry of phoneSeq, so that
+ * learning a phrase does not reload the cache. A phone sequence which is not
+ * cached is queried on its next lookup anyway.
+ */
+static void UpdatePhraseCacheRow(ChewingData *pgdata, int source, const uint32_t phoneSeq[],
+                                 const UserPhraseData *data)
+{
+    UserPhraseCache *cache = pgdata->userphraseCache;
+    UserPhraseCacheEntry *entry;
 
-    pgdata->tailophrase_data.maxfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column[COLUMN_TAILOPHRASE_MAX_FREQ]);
+    if (!cache)
+        return;
 
-    pgdata->tailophrase_data.origfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column[COLUMN_TAILOPHRASE_ORIG_FREQ]);
+    entry = ProbePhraseCache(cache, phoneSeq, GetPhoneLen(phoneSeq));
+    if (!entry->used)
+        return;
 
-    pgdata->tailophrase_data.type =
-        sqlite3_column_int(pgdata->static_data.stmt_tailophrase[STMT_TAILOPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_TAILOPHRASE[STMT_TAILOPHRASE_SELECT_BY_PHONE].column[COLUMN_TAILOPHRASE_TYPE]);
+    if (MergePhraseCacheRow(entry, source, data)) {
+        InvalidateUserPhraseCache(pgdata);
+        return;
+    }
 
-    return &(pgdata->tailophrase_data);
+    if (cache->cur[source] == entry)
+        cache->cur[source] = NULL;
 }
 
-void TailoGetPhraseEnd(ChewingData *pgdata UNUSED, const uint32_t phoneSeq[] UNUSED)
+void TerminateUserPhraseCache(ChewingData *pgdata)
 {
-    /* FIXME: Remove this */
+    if (!pgdata->userphraseCache)
+        return;
+    ClearPhraseCache(pgdata->userphraseCache);
+    if (pgdata->userphraseCache->nPending)
+        LOG_WARN("Drop %d pending rows", pgdata->userphraseCache->nPending);
+    FreePendingRows(pgdata->userphraseCache);
+    free(pgdata->userphraseCache->pending);
+    sqlite3_finalize(pgdata->userphraseCache->stmt_data_version);
+    free(pgdata->userphraseCache);
+    pgdata->userphraseCache = NULL;
 }
 
-
-UserPhraseData *UserGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
+/*
+ * Get a number which changes when another connection commits to the database.
+ * PRAGMA data_version needs SQLite 3.8.8, older versions such as the bundled
+ * one prepare it but return no row. Then the file change counter in the
+ * database header stands in, read through the file of the connection. It is
+ * also changed by the commits of this connection, and it is not changed by
+ * commits in WAL mode, so there the version is unknown. Return 0 when the
+ * version is unknown.
+ */
+static int GetDataVersion(ChewingData *pgdata, UserPhraseCache *cache, unsigned int *version)
 {
+    sqlite3_file *file = NULL;
+    unsigned char header[28];
     int ret;
-    int len;
 
-    assert(pgdata);
-    assert(phoneSeq);
+    if (!cache->stmt_data_version) {
+        ret = sqlite3_prepare_v2(pgdata->static_data.db, "PRAGMA data_version", -1, &cache->stmt_data_version, NULL);
+        if (ret != SQLITE_OK) {
+            LOG_ERROR("sqlite3_prepare_v2 returns %d", ret);
+            cache->stmt_data_version = NULL;
+        }
+    }
 
-    assert(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE]);
-    ret = sqlite3_reset(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE]);
-    if (ret != SQLITE_OK) {
-        LOG_ERROR("sqlite3_reset returns %d", ret);
-        return NULL;
+    if (cache->stmt_data_version) {
+        ret = sqlite3_step(cache->stmt_data_version);
+        if (ret == SQLITE_ROW)
+            *version = (unsigned int) sqlite3_column_int(cache->stmt_data_version, 0);
+        sqlite3_reset(cache->stmt_data_version);
+        if (ret == SQLITE_ROW)
+            return 1;
     }
 
-    len = GetPhoneLen(phoneSeq);
-    LOG_INFO("len=%d", len);
-    ret = UserBindPhone(pgdata, STMT_USERPHRASE_SELECT_BY_PHONE, phoneSeq, len);
+    ret = sqlite3_file_control(pgdata->static_data.db, "main", SQLITE_FCNTL_FILE_POINTER, &file);
+    if (ret != SQLITE_OK || !file || !file->pMethods)
+        return 0;
+    ret = file->pMethods->xRead(file, header, sizeof(header), 0);
     if (ret != SQLITE_OK) {
-        LOG_ERROR("UserBindPhone returns %d", ret);
-        return NULL;
+        LOG_ERROR("xRead returns %d", ret);
+        return 0;
     }
 
-    return UserGetPhraseNext(pgdata, phoneSeq);
+    /* the file format write version is 2 in WAL mode */
+    if (header[18] == 2)
+        return 0;
+
+    *version = ((unsigned int) header[24] << 24) | (header[25] << 16) | (header[26] << 8) | header[27];
+    return 1;
 }
 
-UserPhraseData *UserGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
+int UserSyncPhraseCache(ChewingData *pgdata)
 {
+    UserPhraseCache *cache = pgdata->userphraseCache;
+    unsigned int data_version = 0;
+    int has_data_version;
     int ret;
 
+    if (!cache)
+        return 0;
+
+    has_data_version = GetDataVersion(pgdata, cache, &data_version);
+
+    /* data_version only changes when the database is changed elsewhere */
+    ret = !has_data_version || !cache->has_data_version || data_version != cache->data_version;
+    cache->has_data_version = has_data_version;
+    cache->data_version = data_version;
+
+    /*
+     * An empty cache only starts the tracking. Without a version, the cache
+     * cannot be told to be valid and is dropped on every call.
+     */
+    if (!ret || !cache->nEntry)
+        return 0;
+    ClearPhraseCache(cache);
+    return 1;
+}
+
+UserPhraseData *TailoGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    const UserPhraseCacheEntry *entry;
+
     assert(pgdata);
     assert(phoneSeq);
 
-    ret = sqlite3_step(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE]);
-    if (ret != SQLITE_ROW)
+    if (LoadUserphrase(pgdata))
         return NULL;
 
-    /* FIXME: shall not remove const here. */
-    pgdata->userphrase_data.wordSeq =
-        (char *) sqlite3_column_text(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                                     SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column
-                                     [COLUMN_USERPHRASE_PHRASE]);
-    pgdata->userphrase_data.phoneSeq = (uint32_t *) phoneSeq;
+    entry = LoadPhraseCacheEntry(pgdata, phoneSeq);
+    if (!entry)
+        return NULL;
+
+    pgdata->userphraseCache->cur[USERPHRASE_SOURCE_TAILO] = entry;
+    pgdata->userphraseCache->curRow[USERPHRASE_SOURCE_TAILO] = 0;
+    return TailoGetPhraseNext(pgdata, phoneSeq);
+}
+
+UserPhraseData *TailoGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    assert(pgdata);
+    assert(phoneSeq);
+
+    return GetPhraseCacheRow(pgdata, USERPHRASE_SOURCE_TAILO, &pgdata->tailophrase_data, phoneSeq);
+}
+
+void TailoGetPhraseEnd(ChewingData *pgdata UNUSED, const uint32_t phoneSeq[] UNUSED)
+{
+    /* FIXME: Remove this */
+}
 
-    pgdata->userphrase_data.recentTime =
-        sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column[COLUMN_USERPHRASE_TIME]);
 
-    pgdata->userphrase_data.userfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column[COLUMN_USERPHRASE_USER_FREQ]);
+UserPhraseData *UserGetPhraseFirst(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    const UserPhraseCacheEntry *entry;
 
-    pgdata->userphrase_data.maxfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column[COLUMN_USERPHRASE_MAX_FREQ]);
+    assert(pgdata);
+    assert(phoneSeq);
 
-    pgdata->userphrase_data.origfreq =
-        sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column[COLUMN_USERPHRASE_ORIG_FREQ]);
+    if (LoadUserphrase(pgdata))
+        return NULL;
+
+    entry = LoadPhraseCacheEntry(pgdata, phoneSeq);
+    if (!entry)
+        return NULL;
+
+    pgdata->userphraseCache->cur[USERPHRASE_SOURCE_USER] = entry;
+    pgdata->userphraseCache->curRow[USERPHRASE_SOURCE_USER] = 0;
+    return UserGetPhraseNext(pgdata, phoneSeq);
+}
+
+UserPhraseData *UserGetPhraseNext(ChewingData *pgdata, const uint32_t phoneSeq[])
+{
+    assert(pgdata);
+    assert(phoneSeq);
 
-    pgdata->userphrase_data.type =
-        sqlite3_column_int(pgdata->static_data.stmt_userphrase[STMT_USERPHRASE_SELECT_BY_PHONE],
-                           SQL_STMT_USERPHRASE[STMT_USERPHRASE_SELECT_BY_PHONE].column[COLUMN_USERPHRASE_TYPE]);
-    TRACX("%s ZZZZZZZZ %d\n", __func__, pgdata->userphrase_data.type);
-    return &pgdata->userphrase_data;
+    return GetPhraseCacheRow(pgdata, USERPHRASE_SOURCE_USER, &pgdata->userphrase_data, phoneSeq);
 }
 
 void UserGetPhraseEnd(ChewingData *pgdata UNUSED, const uint32_t phoneSeq[] UNUSED)
@@ -758,4 +1154,6 @@ void UserGetPhraseEnd(ChewingData *pgdata UNUSED, const uint32_t phoneSeq[] UNUS
 void IncreaseLifeTime(ChewingData *pgdata)
 {
     ++pgdata->static_data.new_lifetime;
+    if (!pgdata->static_data.userphrase_batch && IsPendingDue(pgdata, 0))
+        FlushUserphrase(pgdata);
 }
@@ -11,6 +11,7 @@
 #include "userphrase-private.h"
 
 #include <assert.h>
+#include <stdlib.h>
 
 #include "taigi-private.h"
 #include "taigi-sql.h"
@@ -185,3 +186,24 @@ char *GetDefaultUserPhrasePath(ChewingData *pgdata)
 }
 
 #endif
+
+int LoadUserphrase(ChewingData *pgdata)
+{
+    int ret;
+
+    if (pgdata->static_data.userphrase_ready)
+        return 0;
+    if (!pgdata->static_data.userphrase_path)
+        return -1;
+
+    ret = InitUserphrase(pgdata, pgdata->static_data.userphrase_path);
+    free(pgdata->static_data.userphrase_path);
+    pgdata->static_data.userphrase_path = NULL;
+    if (ret) {
+        LOG_ERROR("InitUserphrase returns %d", ret);
+        return -1;
+    }
+
+    pgdata->static_data.userphrase_ready = 1;
+    return 0;
+}
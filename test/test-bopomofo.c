@@ -16,9 +16,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "key2pho-private.h"
 #include "bopomofo-private.h"
+#include "global-private.h"
 #include "taigi.h"
 #include "plat_types.h"
 #include "testhelper.h"
@@ -1305,6 +1307,101 @@ void test_longest_phrase()
     taigi_delete(ctx);
 }
 
+#define BIGRAM_DATA_DIR TEST_HASH_DIR "/bigram"
+
+static void copy_data_file(const char *name)
+{
+    char buf[4096];
+    char *src;
+    char *dst;
+    FILE *in;
+    FILE *out;
+    size_t len;
+    int ret;
+
+    ret = asprintf(&src, "%s/%s", CHEWING_DATA_PREFIX, name);
+    assert(ret != -1);
+    ret = asprintf(&dst, "%s/%s", BIGRAM_DATA_DIR, name);
+    assert(ret != -1);
+    in = fopen(src, "rb");
+    assert(in);
+    out = fopen(dst, "wb");
+    assert(out);
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, len, out);
+    fclose(out);
+    fclose(in);
+    free(dst);
+    free(src);
+}
+
+void test_bigram()
+{
+    static const char *const FILES[] = {
+        DICT_FILE, PHONE_TREE_FILE, SYMBOL_TABLE_FILE, SOFTKBD_TABLE_FILE, PINYIN_TAB_NAME,
+    };
+    BigramHeader header;
+    BigramSlot slot[2];
+    ChewingContext *ctx;
+    FILE *out;
+    uint32_t prev;
+    uint32_t next;
+    size_t i;
+
+    /* 一下 sái and tsi̍t 會使 have the same score without the bigram table */
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+    type_keystroke_by_string(ctx, "tsit8e7sai2");
+    ok(!strcmp(taigi_buffer_String_static(ctx), "tsi\xCC\x8Dt\xE6\x9C\x83\xE4\xBD\xBF" /* tsi̍t會使 */ ),
+       "preedit buffer shall follow the frequency without the bigram table");
+    taigi_delete(ctx);
+
+    mkdir(BIGRAM_DATA_DIR, 0755);
+    for (i = 0; i < ARRAY_SIZE(FILES); ++i)
+        copy_data_file(FILES[i]);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BIGRAM_MAGIC, sizeof(header.magic));
+    header.version = BIGRAM_VERSION;
+    header.byte_order = TREE_INDEX_BYTE_ORDER;
+    header.slot_count = ARRAY_SIZE(slot);
+    prev = HashPhraseString("\xE4\xB8\x80\xE4\xB8\x8B" /* 一下 */ );
+    next = HashPhraseString("s\xC3\xA1i" /* sái */ );
+    memset(slot, 0, sizeof(slot));
+    i = HashBigramKey(prev, next) & (ARRAY_SIZE(slot) - 1);
+    slot[i].prev = prev;
+    slot[i].next = next;
+    slot[i].bonus = 1000;
+    out = fopen(BIGRAM_DATA_DIR "/" BIGRAM_FILE, "wb");
+    assert(out);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(slot, sizeof(slot), 1, out);
+    fclose(out);
+
+    ctx = taigi_new2(BIGRAM_DATA_DIR, NULL, NULL, NULL);
+    start_testcase(ctx, fd);
+    type_keystroke_by_string(ctx, "tsit8e7sai2");
+    ok(!strcmp(taigi_buffer_String_static(ctx), "\xE4\xB8\x80\xE4\xB8\x8Bs\xC3\xA1i" /* 一下sái */ ),
+       "preedit buffer shall follow the bigram table");
+    /* Tab lists the phrasings in turn, and the last Tab returns to the first one */
+    type_keystroke_by_string(ctx, "<T>");
+    ok(strcmp(taigi_buffer_String_static(ctx), "\xE4\xB8\x80\xE4\xB8\x8Bs\xC3\xA1i" /* 一下sái */ ),
+       "Tab shall list the next phrasing");
+    type_keystroke_by_string(ctx, "<T>");
+    ok(!strcmp(taigi_buffer_String_static(ctx), "\xE4\xB8\x80\xE4\xB8\x8Bs\xC3\xA1i" /* 一下sái */ ),
+       "the first phrasing of Tab shall follow the bigram table");
+    taigi_delete(ctx);
+
+    ctx = taigi_new2(BIGRAM_DATA_DIR, NULL, NULL, NULL);
+    start_testcase(ctx, fd);
+    type_keystroke_by_string(ctx, "tsit8e7sai2");
+    type_keystroke_by_string(ctx, "hak8sing1kong2ue7");
+    ok(!strcmp(taigi_buffer_String_static(ctx),
+               "\xE4\xB8\x80\xE4\xB8\x8Bs\xC3\xA1i\xE5\xAD\xB8\xE7\x94\x9F\xE8\xAC\x9B\xE8\xA9\xB1"
+               /* 一下sái學生講話 */ ), "preedit buffer shall keep the bigram pair");
+    taigi_delete(ctx);
+}
+
 void test_auto_commit_phrase()
 {
     ChewingContext *ctx;
@@ -1788,6 +1885,7 @@ int main(int argc, char *argv[])
     test_bopomofo_buffer();
 
     test_longest_phrase();
+    test_bigram();
     test_auto_commit();
 
     test_interval();
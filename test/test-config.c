@@ -24,6 +24,9 @@ static const int MAX_CAND_PER_PAGE = 10;
 static const int DEFAULT_CAND_PER_PAGE = 10;
 static const int MIN_CHI_SYMBOL_LEN = 0;
 static const int MAX_CHI_SYMBOL_LEN = 39;
+static const int MIN_PHRASING_BEAM = 1;
+static const int MAX_PHRASING_BEAM = 32;
+static const int DEFAULT_PHRASING_BEAM = 8;
 
 static const int DEFAULT_SELECT_KEY[] = {
     '1', '2', '3', '4', '5', '6', '7', '8', '9', '0'
@@ -56,6 +59,9 @@ void test_default_value()
     ok(taigi_get_maxChiSymbolLen(ctx) == MAX_CHI_SYMBOL_LEN,
        "default maxChiSymbolLen shall be %d", MAX_CHI_SYMBOL_LEN);
 
+    ok(taigi_get_phrasingBeamWidth(ctx) == DEFAULT_PHRASING_BEAM,
+       "default phrasingBeamWidth shall be %d", DEFAULT_PHRASING_BEAM);
+
     ok(taigi_get_addPhraseDirection(ctx) == 0, "default addPhraseDirection shall be 0");
 
     ok(taigi_get_spaceAsSelection(ctx) == 0, "default spaceAsSelection shall be 0");
@@ -170,6 +176,39 @@ void test_maxChiSymbolLen()
     taigi_delete(ctx);
 }
 
+void test_set_phrasingBeamWidth()
+{
+    ChewingContext *ctx;
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    taigi_set_phrasingBeamWidth(ctx, MIN_PHRASING_BEAM);
+    ok(taigi_get_phrasingBeamWidth(ctx) == MIN_PHRASING_BEAM, "phrasingBeamWidth shall be %d", MIN_PHRASING_BEAM);
+
+    taigi_set_phrasingBeamWidth(ctx, MIN_PHRASING_BEAM - 1);
+    ok(taigi_get_phrasingBeamWidth(ctx) == MIN_PHRASING_BEAM,
+       "phrasingBeamWidth shall not change when set to %d", MIN_PHRASING_BEAM - 1);
+
+    taigi_set_phrasingBeamWidth(ctx, MAX_PHRASING_BEAM + 1);
+    ok(taigi_get_phrasingBeamWidth(ctx) == MIN_PHRASING_BEAM,
+       "phrasingBeamWidth shall not change when set to %d", MAX_PHRASING_BEAM + 1);
+
+    taigi_Reset(ctx);
+    ok(taigi_get_phrasingBeamWidth(ctx) == MIN_PHRASING_BEAM, "phrasingBeamWidth shall be kept by taigi_Reset");
+
+    /* Only the best phrasing is kept, so Tab at the end does not change it. */
+    type_keystroke_by_string(ctx, "tong7but8hng5");
+    ok_preedit_buffer(ctx, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ );
+    type_keystroke_by_string(ctx, "<T>");
+    ok_preedit_buffer(ctx, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ );
+
+    taigi_set_phrasingBeamWidth(ctx, MAX_PHRASING_BEAM);
+    ok(taigi_get_phrasingBeamWidth(ctx) == MAX_PHRASING_BEAM, "phrasingBeamWidth shall be %d", MAX_PHRASING_BEAM);
+
+    taigi_delete(ctx);
+}
+
 void test_set_selKey_normal()
 {
     ChewingContext *ctx;
@@ -544,6 +583,50 @@ void test_new2()
     test_new2_userpath();
 }
 
+void test_new3_lazy()
+{
+    ChewingContext *ctx;
+    int ret;
+
+    printf("#\n# %s\n#\n", __func__);
+    fprintf(fd, "#\n# %s\n#\n", __func__);
+
+    ctx = taigi_new3(NULL, TEST_HASH_DIR "/test.sqlite3", CHEWING_NEW_LAZY, logger, fd);
+    ok(ctx != NULL, "taigi_new3 returns `%#p' shall not be `%#p'", ctx, NULL);
+
+    type_keystroke_by_string(ctx, "`");
+    ok(taigi_cand_TotalChoice(ctx) > 0, "symbol table shall be loaded on first use");
+
+    ret = taigi_userphrase_enumerate(ctx);
+    ok(ret == 0, "taigi_userphrase_enumerate() returns %d shall be %d", ret, 0);
+
+    taigi_delete(ctx);
+}
+
+void test_new3_lazy_userpath_error()
+{
+    ChewingContext *ctx;
+    int ret;
+
+    printf("#\n# %s\n#\n", __func__);
+    fprintf(fd, "#\n# %s\n#\n", __func__);
+
+    /* the user phrase storage is not opened yet */
+    ctx = taigi_new3(NULL, TEST_HASH_DIR, CHEWING_NEW_LAZY, logger, fd);
+    ok(ctx != NULL, "taigi_new3 returns `%#p' shall not be `%#p'", ctx, NULL);
+
+    ret = taigi_userphrase_enumerate(ctx);
+    ok(ret == -1, "taigi_userphrase_enumerate() returns %d shall be %d", ret, -1);
+
+    taigi_delete(ctx);
+}
+
+void test_new3()
+{
+    test_new3_lazy();
+    test_new3_lazy_userpath_error();
+}
+
 int main(int argc, char *argv[])
 {
     char *logname;
@@ -565,6 +648,7 @@ int main(int argc, char *argv[])
     test_set_candPerPage();
     test_set_maxChiSymbolLen();
     test_maxChiSymbolLen();
+    test_set_phrasingBeamWidth();
     test_set_selKey();
     test_set_addPhraseDirection();
     test_set_spaceAsSelection();
@@ -578,6 +662,7 @@ int main(int argc, char *argv[])
     test_deprecated();
 
     test_new2();
+    test_new3();
 
     fclose(fd);
 
@@ -52,6 +52,11 @@ void test_null()
     ret = taigi_get_maxChiSymbolLen(NULL);
     ok(ret == -1, "taigi_get_maxChiSymbolLen() returns `%d' shall be `%d'", ret, -1);
 
+    taigi_set_phrasingBeamWidth(NULL, 0);     // shall not crash
+
+    ret = taigi_get_phrasingBeamWidth(NULL);
+    ok(ret == -1, "taigi_get_phrasingBeamWidth() returns `%d' shall be `%d'", ret, -1);
+
     taigi_set_selKey(NULL, NULL, 0);  // shall not crash
 
     key = taigi_get_selKey(NULL);
@@ -185,6 +190,12 @@ void test_null()
     ret = taigi_userphrase_lookup(NULL, NULL, NULL);
     ok(ret == 0, "taigi_userphrase_lookup() returns `%d' shall be `%d'", ret, 0);
 
+    ret = taigi_convert_bopomofo(NULL, NULL, NULL, 0);
+    ok(ret == -1, "taigi_convert_bopomofo() returns `%d' shall be `%d'", ret, -1);
+
+    ret = taigi_convert_bopomofo_batch(NULL, NULL, 0, NULL, 0, 0);
+    ok(ret == -1, "taigi_convert_bopomofo_batch() returns `%d' shall be `%d'", ret, -1);
+
     ret = taigi_cand_open(NULL);
     ok(ret == -1, "taigi_cand_open() returns `%d' shall be `%d'", ret, -1);
 
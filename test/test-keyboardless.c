@@ -9,6 +9,7 @@
  */
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "testhelper.h"
 #include "taigi.h"
@@ -916,6 +917,105 @@ void test_clean_bopomofo()
     test_clean_bopomofo_during_cand_selecting();
 }
 
+void test_convert_bopomofo_normal()
+{
+    ChewingContext *ctx;
+    char buf[64];
+    int ret;
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_convert_bopomofo(ctx, "tong7 but8 hng5", buf, sizeof(buf));
+    ok(ret == 1, "taigi_convert_bopomofo() returns `%d' shall be `%d'", ret, 1);
+    ok(strcmp(buf, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ ) == 0,
+       "taigi_convert_bopomofo() shall set phrase_buf `%s' to `%s'", buf, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92");
+
+    ret = taigi_convert_bopomofo(ctx, "", buf, sizeof(buf));
+    ok(ret == 0, "taigi_convert_bopomofo() returns `%d' shall be `%d'", ret, 0);
+    ok(strcmp(buf, "") == 0, "taigi_convert_bopomofo() shall set phrase_buf `%s' to `%s'", buf, "");
+
+    taigi_delete(ctx);
+}
+
+void test_convert_bopomofo_keep_preedit()
+{
+    ChewingContext *ctx;
+    char buf[64];
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    type_keystroke_by_string(ctx, "tong7but8hng5");
+    ok_preedit_buffer(ctx, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ );
+
+    taigi_convert_bopomofo(ctx, "tsit8 e7", buf, sizeof(buf));
+
+    ok_preedit_buffer(ctx, "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ );
+    ok(taigi_commit_Check(ctx) == 0, "taigi_commit_Check() returns `%d' shall be `%d'", taigi_commit_Check(ctx), 0);
+
+    taigi_delete(ctx);
+}
+
+void test_convert_bopomofo_error()
+{
+    ChewingContext *ctx;
+    char buf[4];
+    int ret;
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_convert_bopomofo(ctx, "tong7 xyz", buf, sizeof(buf));
+    ok(ret == -1, "taigi_convert_bopomofo() returns `%d' shall be `%d'", ret, -1);
+
+    ret = taigi_convert_bopomofo(ctx, "tong7 but8 hng5", buf, sizeof(buf));
+    ok(ret == -1, "taigi_convert_bopomofo() returns `%d' shall be `%d'", ret, -1);
+
+    taigi_delete(ctx);
+}
+
+void test_convert_bopomofo_batch()
+{
+    static const char *const BOPOMOFO[] = {
+        "tong7 but8 hng5",
+        "tong7 xyz",
+        "tsit8-e7 png7 si5 kut4",
+    };
+    static const char *const PHRASE[] = {
+        "\xE5\x8B\x95\xE7\x89\xA9\xE5\x9C\x92" /* 動物園 */ ,
+        "",
+        "\xE4\xB8\x80\xE4\xB8\x8B \xE9\xA3\xAF\xE5\x8C\x99\xE9\xAA\xA8" /* 一下 飯匙骨 */ ,
+    };
+    ChewingContext *ctx;
+    char buf[ARRAY_SIZE(BOPOMOFO)][64];
+    size_t i;
+    int ret;
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_convert_bopomofo_batch(ctx, BOPOMOFO, ARRAY_SIZE(BOPOMOFO), buf[0], sizeof(buf[0]), 2);
+    ok(ret == 2, "taigi_convert_bopomofo_batch() returns `%d' shall be `%d'", ret, 2);
+    for (i = 0; i < ARRAY_SIZE(BOPOMOFO); ++i) {
+        ok(strcmp(buf[i], PHRASE[i]) == 0, "taigi_convert_bopomofo_batch() shall set entry %d `%s' to `%s'",
+           (int) i, buf[i], PHRASE[i]);
+    }
+
+    ret = taigi_convert_bopomofo_batch(ctx, BOPOMOFO, 0, buf[0], sizeof(buf[0]), 0);
+    ok(ret == 0, "taigi_convert_bopomofo_batch() returns `%d' shall be `%d'", ret, 0);
+
+    taigi_delete(ctx);
+}
+
+void test_convert_bopomofo()
+{
+    test_convert_bopomofo_normal();
+    test_convert_bopomofo_keep_preedit();
+    test_convert_bopomofo_error();
+    test_convert_bopomofo_batch();
+}
+
 int main(int argc, char *argv[])
 {
     char *logname;
@@ -942,6 +1042,8 @@ int main(int argc, char *argv[])
 
     test_clean_bopomofo();
 
+    test_convert_bopomofo();
+
     fclose(fd);
 
     return exit_status();
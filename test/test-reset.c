@@ -41,6 +41,38 @@ void test_reset_shall_not_clean_static_data()
     taigi_delete(ctx);
 }
 
+void test_delete_shall_not_clean_shared_data()
+{
+    ChewingContext *ctx;
+    ChewingContext *ctx2;
+    int total;
+
+    ctx = taigi_new();
+    ctx2 = taigi_new();
+    start_testcase(ctx, fd);
+
+    type_keystroke_by_string(ctx, "`");
+    total = taigi_cand_TotalChoice(ctx);
+    ok(total > 0, "symbol categories shall be listed");
+
+    /* ctx2 still uses the symbol table loaded by ctx */
+    taigi_delete(ctx);
+
+    type_keystroke_by_string(ctx2, "`");
+    ok(taigi_cand_TotalChoice(ctx2) == total, "shared symbol table shall be kept");
+
+    taigi_delete(ctx2);
+
+    /* the symbol table is loaded again after the last context is deleted */
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    type_keystroke_by_string(ctx, "`");
+    ok(taigi_cand_TotalChoice(ctx) == total, "symbol table shall be reloaded");
+
+    taigi_delete(ctx);
+}
+
 int main(int argc, char *argv[])
 {
     char *logname;
@@ -57,6 +89,7 @@ int main(int argc, char *argv[])
     free(logname);
 
     test_reset_shall_not_clean_static_data();
+    test_delete_shall_not_clean_shared_data();
 
     fclose(fd);
 
@@ -16,11 +16,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "taigi.h"
 #include "plat_types.h"
+#include "key2pho-private.h"
+#include "taigi-private.h"
+#include "userphrase-private.h"
 #include "testhelper.h"
 
+#if WITH_SQLITE3
+#    include "sqlite3.h"
+#    include "taigi-sql.h"
+#else
+#    include "hash-private.h"
+#endif
+
 FILE *fd;
 
 void test_ShiftLeft_not_entering_chewing()
@@ -724,6 +736,637 @@ void test_userphrase_lookup()
     taigi_delete(ctx);
 }
 
+/* write the two characters from U+4E00 + i as the phrase */
+static void make_phrase(char *phrase, int i)
+{
+    int j;
+
+    for (j = 0; j < 2; ++j) {
+        unsigned int code = 0x4E00 + i + j;
+
+        phrase[j * 3] = 0xE0 | (code >> 12);
+        phrase[j * 3 + 1] = 0x80 | ((code >> 6) & 0x3F);
+        phrase[j * 3 + 2] = 0x80 | (code & 0x3F);
+    }
+    phrase[6] = 0;
+}
+
+#if WITH_SQLITE3
+void test_userphrase_migrate_v1()
+{
+    ChewingContext *ctx;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    uint32_t phone[MAX_PHRASE_LEN + 1] = { 0 };
+    uint32_t migrated[MAX_PHRASE_LEN + 1] = { 0 };
+    int i;
+    int ret;
+
+    const char phrase[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    char *phrase_buf;
+    unsigned int phrase_len;
+
+    const char bopomofo[] = "hak8 sing1";
+    char *bopomofo_buf;
+    unsigned int bopomofo_len;
+
+    clean_userphrase();
+
+    ret = UintArrayFromBopomofo(phone, ARRAY_SIZE(phone), bopomofo);
+    assert(ret == 2);
+
+    /* a database written before the phone BLOB key */
+    ret = sqlite3_open(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &db);
+    assert(ret == SQLITE_OK);
+    ret = sqlite3_exec(db,
+                       "CREATE TABLE userphrase_v1 (time INTEGER, user_freq INTEGER, max_freq INTEGER, "
+                       "orig_freq INTEGER, length INTEGER, phone_0 INTEGER, phone_1 INTEGER, phone_2 INTEGER, "
+                       "phone_3 INTEGER, phone_4 INTEGER, phone_5 INTEGER, phone_6 INTEGER, phone_7 INTEGER, "
+                       "phone_8 INTEGER, phone_9 INTEGER, phone_10 INTEGER, phrase TEXT, type INTEGER, "
+                       "PRIMARY KEY (phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, phone_6, phone_7, "
+                       "phone_8, phone_9, phone_10, phrase))", NULL, NULL, NULL);
+    assert(ret == SQLITE_OK);
+    ret = sqlite3_prepare_v2(db,
+                             "INSERT INTO userphrase_v1 (time, user_freq, max_freq, orig_freq, length, "
+                             "phone_0, phone_1, phone_2, phone_3, phone_4, phone_5, phone_6, phone_7, phone_8, "
+                             "phone_9, phone_10, phrase, type) "
+                             "VALUES (0, 1, 1, 1, 2, ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, 0)",
+                             -1, &stmt, NULL);
+    assert(ret == SQLITE_OK);
+    for (i = 0; i < MAX_PHRASE_LEN; ++i)
+        sqlite3_bind_int(stmt, i + 1, phone[i]);
+    sqlite3_bind_text(stmt, MAX_PHRASE_LEN + 1, phrase, -1, SQLITE_STATIC);
+    ret = sqlite3_step(stmt);
+    assert(ret == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    ret = taigi_userphrase_enumerate(ctx);
+    ok(ret == 0, "taigi_userphrase_enumerate() return value `%d' shall be `%d'", ret, 0);
+    ret = taigi_userphrase_has_next(ctx, &phrase_len, &bopomofo_len);
+    ok(ret == 1, "taigi_userphrase_has_next() return value `%d' shall be `%d'", ret, 1);
+    phrase_buf = malloc(phrase_len);
+    assert(phrase_buf);
+    bopomofo_buf = malloc(bopomofo_len);
+    assert(bopomofo_buf);
+    ret = taigi_userphrase_get(ctx, phrase_buf, phrase_len, bopomofo_buf, bopomofo_len);
+    ok(ret == 0, "taigi_userphrase_get() return value `%d' shall be `%d'", ret, 0);
+    ok(strcmp(phrase_buf, phrase) == 0, "taigi_userphrase_get() shall set phrase_buf `%s' to `%s'", phrase_buf,
+       phrase);
+    /* compare the phones, since the text of a phone may differ in the tone */
+    ret = UintArrayFromBopomofo(migrated, ARRAY_SIZE(migrated), bopomofo_buf);
+    ok(ret == 2 && memcmp(migrated, phone, sizeof(phone)) == 0,
+       "taigi_userphrase_get() shall set bopomofo_buf to the phones of `%s'", bopomofo);
+    free(bopomofo_buf);
+    free(phrase_buf);
+
+    taigi_delete(ctx);
+
+    ret = sqlite3_open(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &db);
+    assert(ret == SQLITE_OK);
+    ret = sqlite3_prepare_v2(db, "SELECT * FROM userphrase_v1", -1, &stmt, NULL);
+    ok(ret != SQLITE_OK, "userphrase_v1 shall be dropped after migration");
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+void test_userphrase_max_freq()
+{
+    ChewingContext *ctx;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    uint32_t phone[MAX_PHRASE_LEN + 1] = { 0 };
+    unsigned char blob[MAX_PHRASE_LEN * PHONE_BLOB_UNIT];
+    int max_freq;
+    int ret;
+
+    const char frequent[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    const char phrase[] = "\xE5\xAD\xB8\xE8\x81\xB2" /* 學聲 */ ;
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ret = UintArrayFromBopomofo(phone, ARRAY_SIZE(phone), bopomofo);
+    assert(ret == 2);
+
+    /* create the tables */
+    ctx = taigi_new();
+    taigi_delete(ctx);
+
+    ret = sqlite3_open(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &db);
+    assert(ret == SQLITE_OK);
+    ret = sqlite3_prepare_v2(db,
+                             "INSERT INTO userphrase_v2 (time, user_freq, max_freq, orig_freq, length, phone, phrase, type) "
+                             "VALUES (0, 5000, 5000, 1, 2, ?1, ?2, 0)", -1, &stmt, NULL);
+    assert(ret == SQLITE_OK);
+    sqlite3_bind_blob(stmt, 1, blob, PackPhoneBlob(blob, phone, 2), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, frequent, -1, SQLITE_STATIC);
+    ret = sqlite3_step(stmt);
+    assert(ret == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_add(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+
+    /* the phrase just learned shall be looked up without reloading */
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(ctx);
+
+    ret = sqlite3_open(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &db);
+    assert(ret == SQLITE_OK);
+    ret = sqlite3_prepare_v2(db, "SELECT max_freq FROM userphrase_v2 WHERE phrase = ?1", -1, &stmt, NULL);
+    assert(ret == SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, phrase, -1, SQLITE_STATIC);
+    ret = sqlite3_step(stmt);
+    max_freq = (ret == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+    ok(max_freq == 5000, "max_freq `%d' shall be the user_freq `%d' of the same phone", max_freq, 5000);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+void test_userphrase_shared_database()
+{
+    ChewingContext *ctx;
+    ChewingContext *other;
+    int ret;
+
+    const char phrase[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+    other = taigi_new();
+
+    /* cache the lookup in ctx */
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 0, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 0);
+
+    /* the changes of another context shall not be hidden by the cache */
+    ret = taigi_userphrase_add(other, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    ret = taigi_userphrase_remove(other, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_remove() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 0, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 0);
+
+    taigi_delete(other);
+    taigi_delete(ctx);
+}
+
+void test_userphrase_shared_database_learn()
+{
+    ChewingContext *ctx;
+    ChewingContext *other;
+    int ret;
+
+    const char learned[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    const char phrase[] = "\xE5\xAD\xB8\xE8\x81\xB2" /* 學聲 */ ;
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+    other = taigi_new();
+
+    /* the phrases learned by ctx are seen by ctx at once */
+    type_keystroke_by_string(ctx, "hak8sing1kong2ue7<E>");
+    ret = taigi_userphrase_lookup(ctx, learned, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    /* and the database is not locked by ctx after learning */
+    ret = taigi_userphrase_add(other, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, learned, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    /* the learned phrases are written at last */
+    taigi_delete(ctx);
+    ret = taigi_userphrase_lookup(other, learned, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(other);
+}
+
+void test_userphrase_shared_database_locked()
+{
+    ChewingContext *ctx;
+    ChewingContext *other;
+    sqlite3 *db;
+    char phrase[7];
+    time_t start;
+    int elapsed;
+    int count;
+    int ret;
+    int i;
+
+    const int total = 1100;     /* more than the rows kept in memory */
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = sqlite3_open(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &db);
+    assert(SQLITE_OK == ret);
+    ret = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    assert(SQLITE_OK == ret);
+
+    /* while another connection writes, the flush is not tried on each phrase */
+    start = time(NULL);
+    count = 0;
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        count += taigi_userphrase_add(ctx, phrase, bopomofo);
+    }
+    elapsed = time(NULL) - start;
+    ok(elapsed < 60, "taigi_userphrase_add() shall take `%d' seconds less than `%d'", elapsed, 60);
+
+    /* and the rows kept are bounded */
+    ok(count > 0 && count < total, "taigi_userphrase_add() count `%d' shall be less than `%d'", count, total);
+    make_phrase(phrase, 0);
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    ret = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    assert(SQLITE_OK == ret);
+    sqlite3_close(db);
+
+    /* the rows are written once the database is free */
+    ret = taigi_userphrase_enumerate(ctx);
+    ok(ret == 0, "taigi_userphrase_enumerate() return value `%d' shall be `%d'", ret, 0);
+    other = taigi_new();
+    ret = taigi_userphrase_lookup(other, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(other);
+    taigi_delete(ctx);
+}
+#else
+static long get_userphrase_size()
+{
+    struct stat st;
+
+    if (stat(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, &st))
+        return -1;
+    return st.st_size;
+}
+
+void test_userphrase_hash_log()
+{
+    ChewingContext *ctx;
+    FILE *file;
+    long size;
+    long torn_size;
+    int ret;
+
+    const char phrase[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    const char removed[] = "\xE5\xAD\xB8\xE8\x81\xB2" /* 學聲 */ ;
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_add(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_add(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_remove(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_remove() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(ctx);
+
+    /* a record torn by a crash at the end of the log */
+    size = get_userphrase_size();
+    file = fopen(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, "ab");
+    assert(file);
+    fwrite("\x01\x02\x03", 1, 3, file);
+    fclose(file);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    /* is cut at once */
+    torn_size = get_userphrase_size();
+    ok(torn_size == size, "userphrase size `%ld' shall be `%ld'", torn_size, size);
+
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, removed, bopomofo);
+    ok(ret == 0, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 0);
+    ret = taigi_userphrase_add(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(ctx);
+
+    /* the record appended after the torn one was dropped */
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_lookup(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    /* a log that cannot be cut is not appended, but compacted at last */
+    ctx->data->static_data.hash_table->readonly = 1;
+    size = get_userphrase_size();
+    ret = taigi_userphrase_remove(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_remove() return value `%d' shall be `%d'", ret, 1);
+    torn_size = get_userphrase_size();
+    ok(torn_size == size, "userphrase size `%ld' shall be `%ld'", torn_size, size);
+
+    taigi_delete(ctx);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_lookup(ctx, removed, bopomofo);
+    ok(ret == 0, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 0);
+    ret = taigi_userphrase_add(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(ctx);
+
+    /* a compacted log is recovered if a crash left only it */
+    ret = rename(TEST_HASH_DIR PLAT_SEPARATOR DB_NAME, TEST_HASH_DIR PLAT_SEPARATOR DB_NAME ".tmp");
+    assert(ret == 0);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, removed, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+
+    taigi_delete(ctx);
+}
+
+void test_userphrase_hash_batch()
+{
+    ChewingContext *ctx;
+    uint32_t phone[MAX_PHRASE_LEN + 1] = { 0 };
+    long size;
+    long batch_size;
+    int ret;
+
+    const char phrase[] = "\xE5\xAD\xB8\xE7\x94\x9F" /* 學生 */ ;
+    const char other[] = "\xE5\xAD\xB8\xE8\x81\xB2" /* 學聲 */ ;
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ret = UintArrayFromBopomofo(phone, ARRAY_SIZE(phone), bopomofo);
+    assert(ret == 2);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    /* the records of a batch are appended at its end */
+    size = get_userphrase_size();
+    UserUpdatePhraseBegin(ctx->data);
+    ret = UserUpdatePhrase(ctx->data, phone, phrase, 0);
+    ok(ret == USER_UPDATE_INSERT, "UserUpdatePhrase() return value `%d' shall be `%d'", ret, USER_UPDATE_INSERT);
+    ret = UserUpdatePhrase(ctx->data, phone, other, 0);
+    ok(ret == USER_UPDATE_INSERT, "UserUpdatePhrase() return value `%d' shall be `%d'", ret, USER_UPDATE_INSERT);
+    ret = UserUpdatePhrase(ctx->data, phone, phrase, 0);
+    ok(ret == USER_UPDATE_MODIFY, "UserUpdatePhrase() return value `%d' shall be `%d'", ret, USER_UPDATE_MODIFY);
+    batch_size = get_userphrase_size();
+    ok(batch_size == size, "userphrase size `%ld' shall be `%ld' in the batch", batch_size, size);
+    UserUpdatePhraseEnd(ctx->data);
+
+    /* one record for each phrase */
+    batch_size = get_userphrase_size();
+    ok(batch_size > size, "userphrase size `%ld' shall be larger than `%ld'", batch_size, size);
+
+    /* outside of a batch, the record is appended at once */
+    ret = taigi_userphrase_remove(ctx, other, bopomofo);
+    ok(ret == 1, "taigi_userphrase_remove() return value `%d' shall be `%d'", ret, 1);
+    size = get_userphrase_size();
+    ok(size > batch_size, "userphrase size `%ld' shall be larger than `%ld'", size, batch_size);
+
+    taigi_delete(ctx);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 1);
+    ret = taigi_userphrase_lookup(ctx, other, bopomofo);
+    ok(ret == 0, "taigi_userphrase_lookup() return value `%d' shall be `%d'", ret, 0);
+
+    taigi_delete(ctx);
+}
+
+void test_userphrase_hash_table()
+{
+    ChewingContext *ctx;
+    char phrase[7];
+    unsigned int phrase_len;
+    unsigned int bopomofo_len;
+    int count;
+    int ret;
+    int i;
+
+    const int total = 300;      /* enough to grow the table a few times */
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    /* all of the phrases share the phones, and so the cluster */
+    count = 0;
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        count += taigi_userphrase_add(ctx, phrase, bopomofo);
+    }
+    ok(count == total, "taigi_userphrase_add() count `%d' shall be `%d'", count, total);
+
+    count = 0;
+    for (i = 0; i < total; i += 2) {
+        make_phrase(phrase, i);
+        count += taigi_userphrase_remove(ctx, phrase, bopomofo);
+    }
+    ok(count == total / 2, "taigi_userphrase_remove() count `%d' shall be `%d'", count, total / 2);
+
+    count = 0;
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+        count += ret == i % 2;
+    }
+    ok(count == total, "taigi_userphrase_lookup() shall find the `%d' phrases left", total / 2);
+
+    /* the enumeration follows the insertion order */
+    ret = taigi_userphrase_enumerate(ctx);
+    ok(ret == 0, "taigi_userphrase_enumerate() return value `%d' shall be `%d'", ret, 0);
+    count = 0;
+    for (i = 1; taigi_userphrase_has_next(ctx, &phrase_len, &bopomofo_len); i += 2) {
+        char phrase_buf[50];
+        char bopomofo_buf[50];
+
+        make_phrase(phrase, i);
+        taigi_userphrase_get(ctx, phrase_buf, sizeof(phrase_buf), bopomofo_buf, sizeof(bopomofo_buf));
+        count += strcmp(phrase_buf, phrase) == 0;
+    }
+    ok(count == total / 2, "taigi_userphrase_get() count in order `%d' shall be `%d'", count, total / 2);
+
+    taigi_delete(ctx);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    count = 0;
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+        count += ret == i % 2;
+    }
+    ok(count == total, "taigi_userphrase_lookup() shall find the `%d' phrases left after reload", total / 2);
+
+    taigi_delete(ctx);
+}
+#endif
+
+/* count the phrases enumerated in the order of make_phrase() from, step and to, then extra if not negative */
+static int count_enumerated(ChewingContext *ctx, int from, int step, int to, int extra)
+{
+    char phrase[7];
+    char phrase_buf[50];
+    char bopomofo_buf[50];
+    unsigned int phrase_len;
+    unsigned int bopomofo_len;
+    int count = 0;
+    int i = from;
+
+    if (taigi_userphrase_enumerate(ctx) != 0)
+        return -1;
+    while (taigi_userphrase_has_next(ctx, &phrase_len, &bopomofo_len)) {
+        make_phrase(phrase, i <= to ? i : extra);
+        taigi_userphrase_get(ctx, phrase_buf, sizeof(phrase_buf), bopomofo_buf, sizeof(bopomofo_buf));
+        count += strcmp(phrase_buf, phrase) == 0;
+        i += step;
+    }
+    return count;
+}
+
+void test_userphrase_hash_checkpoint()
+{
+    ChewingContext *ctx;
+    char phrase[7];
+    long size;
+    long compacted_size;
+    int count;
+    int ret;
+    int i;
+
+    const int total = 300;
+    const int updates = 600;    /* enough to outnumber the phrases */
+    const char bopomofo[] = "hak8 sing1";
+
+    clean_userphrase();
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        taigi_userphrase_add(ctx, phrase, bopomofo);
+    }
+    for (i = 0; i < total; i += 2) {
+        make_phrase(phrase, i);
+        taigi_userphrase_remove(ctx, phrase, bopomofo);
+    }
+
+    /*
+     * The log is compacted in the background once the updates outnumber the
+     * phrases, and the updates after that are kept in the log.
+     */
+    make_phrase(phrase, 1);
+    for (i = 0; i < updates; ++i)
+        taigi_userphrase_add(ctx, phrase, bopomofo);
+    ok(ctx->data->static_data.hash_table->compaction != NULL, "the compaction shall be started");
+
+    size = get_userphrase_size();
+    taigi_delete(ctx);
+    compacted_size = get_userphrase_size();
+    ok(compacted_size < size, "userphrase size `%ld' shall be less than `%ld'", compacted_size, size);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    /* only the records after the checkpoint are read at startup */
+    count = ctx->data->static_data.hash_table->item_count;
+    ok(count < total / 2, "items read at startup `%d' shall be less than `%d'", count, total / 2);
+
+    count = 0;
+    for (i = 0; i < total; ++i) {
+        make_phrase(phrase, i);
+        ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+        count += ret == i % 2;
+    }
+    ok(count == total, "taigi_userphrase_lookup() shall find the `%d' phrases in the checkpoint", total / 2);
+
+    count = count_enumerated(ctx, 1, 2, total, -1);
+    ok(count == total / 2, "taigi_userphrase_get() count in order `%d' shall be `%d'", count, total / 2);
+
+    /* the next checkpoint drops a removed phrase of the last one, and keeps its order */
+    make_phrase(phrase, 1);
+    ret = taigi_userphrase_remove(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_remove() return value `%d' shall be `%d'", ret, 1);
+    make_phrase(phrase, total);
+    ret = taigi_userphrase_add(ctx, phrase, bopomofo);
+    ok(ret == 1, "taigi_userphrase_add() return value `%d' shall be `%d'", ret, 1);
+    make_phrase(phrase, 3);
+    for (i = 0; i < updates; ++i)
+        taigi_userphrase_add(ctx, phrase, bopomofo);
+    ok(ctx->data->static_data.hash_table->compaction != NULL, "the compaction shall be started");
+
+    size = get_userphrase_size();
+    taigi_delete(ctx);
+    compacted_size = get_userphrase_size();
+    ok(compacted_size < size, "userphrase size `%ld' shall be less than `%ld'", compacted_size, size);
+
+    ctx = taigi_new();
+    start_testcase(ctx, fd);
+
+    count = 0;
+    for (i = 0; i <= total; ++i) {
+        make_phrase(phrase, i);
+        ret = taigi_userphrase_lookup(ctx, phrase, bopomofo);
+        count += ret == (i % 2 && i != 1) || i == total;
+    }
+    ok(count == total + 1, "taigi_userphrase_lookup() shall find the `%d' phrases after compaction", total / 2);
+
+    count = count_enumerated(ctx, 3, 2, total - 1, total);
+    ok(count == total / 2, "taigi_userphrase_get() count in order `%d' shall be `%d'", count, total / 2);
+
+    taigi_delete(ctx);
+}
+
 int main(int argc, char *argv[])
 {
     char *logname;
@@ -746,6 +1389,18 @@ int main(int argc, char *argv[])
     test_userphrase_enumerate();
     test_userphrase_manipulate();
     test_userphrase_lookup();
+#if WITH_SQLITE3
+    test_userphrase_migrate_v1();
+    test_userphrase_max_freq();
+    test_userphrase_shared_database();
+    test_userphrase_shared_database_learn();
+    test_userphrase_shared_database_locked();
+#else
+    test_userphrase_hash_log();
+    test_userphrase_hash_table();
+    test_userphrase_hash_checkpoint();
+    test_userphrase_hash_batch();
+#endif
 
     fclose(fd);
 